@@ -0,0 +1,259 @@
+/*
+ * Single writer front-end to an extent map.
+ * See actor.h for the overview.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<limits.h>
+#include<errno.h>
+#include<sched.h>
+#include"actor.h"
+
+static void mpsc_push(struct actor *a, struct actor_cmd *c)
+{
+	struct actor_cmd *prev;
+
+	__atomic_store_n(&c->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&a->head, c, __ATOMIC_SEQ_CST);
+	/* Until this store the list is cut after 'prev'; the owner waits */
+	__atomic_store_n(&prev->next, c, __ATOMIC_RELEASE);
+}
+
+/* NULL if empty, or if a push is halfway through */
+static struct actor_cmd *mpsc_pop(struct actor *a)
+{
+	struct actor_cmd *tail = a->tail;
+	struct actor_cmd *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &a->stub) {
+		if (!next)
+			return NULL;
+		a->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		a->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&a->head, __ATOMIC_SEQ_CST))
+		return NULL;
+	/* 'tail' is the last one: put the stub behind it to take it */
+	mpsc_push(a, &a->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		a->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static inline int mpsc_empty(struct actor *a)
+{
+	return a->tail == &a->stub &&
+	       !__atomic_load_n(&a->stub.next, __ATOMIC_ACQUIRE) &&
+	       __atomic_load_n(&a->head, __ATOMIC_SEQ_CST) == &a->stub;
+}
+
+static int cmd_cmp(const void *x, const void *y)
+{
+	const struct actor_cmd *a = *(struct actor_cmd * const *)x;
+	const struct actor_cmd *b = *(struct actor_cmd * const *)y;
+
+	if (a->lba != b->lba)
+		return a->lba < b->lba ? -1 : 1;
+	return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static int cmd_cmp_seq(const void *x, const void *y)
+{
+	const struct actor_cmd *a = *(struct actor_cmd * const *)x;
+	const struct actor_cmd *b = *(struct actor_cmd * const *)y;
+
+	return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/*
+ * Sorted by LBA, two overlapping updates must still be in arrival order
+ * or the older one would win. Conservatively: no update may overlap the
+ * updates sorted before it unless it also arrived after all of them.
+ */
+static int batch_ordered(struct actor_cmd **batch, int n)
+{
+	sector_t max_end = INT_MIN;
+	unsigned long max_seq = 0;
+	struct actor_cmd *c;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		c = batch[i];
+		if (c->op != ACTOR_UPDATE)
+			continue;
+		if (c->lba < max_end && c->seq < max_seq)
+			return 0;
+		if (c->lba + c->len > max_end)
+			max_end = c->lba + c->len;
+		if (c->seq > max_seq)
+			max_seq = c->seq;
+	}
+	return 1;
+}
+
+static void actor_lookup_one(struct actor *a, struct extent_finger *f, struct actor_cmd *c)
+{
+	struct extent *e = stl_rb_geq_finger(a->map, f, c->lba);
+
+	if (e && e->lba <= c->lba) {
+		c->pba = e->pba + (c->lba - e->lba);
+		c->len = e->lba + e->len - c->lba;
+	} else {
+		c->pba = -1;
+		c->len = (e ? e->lba : INT_MAX) - c->lba;
+	}
+	c->ret = 0;
+}
+
+static void actor_apply(struct actor *a, int n)
+{
+	struct extent_finger f;
+	struct actor_cmd *c;
+	int i;
+
+	qsort(a->batch, n, sizeof(*a->batch), cmd_cmp);
+	if (!batch_ordered(a->batch, n)) {
+		qsort(a->batch, n, sizeof(*a->batch), cmd_cmp_seq);
+		a->nr_unsorted++;
+	}
+	extent_finger_init(&f);
+	for (i = 0; i < n; i++) {
+		c = a->batch[i];
+		if (c->op == ACTOR_UPDATE)
+			c->ret = lsdm_update_range_finger(a->map, &f, c->lba, c->pba, c->len);
+	}
+	for (i = 0; i < n; i++) {
+		c = a->batch[i];
+		if (c->op == ACTOR_LOOKUP)
+			actor_lookup_one(a, &f, c);
+		else if (c->op != ACTOR_UPDATE)
+			c->ret = -EINVAL;
+		__atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+	}
+	a->nr_cmds += n;
+	a->nr_batches++;
+	if (n > a->biggest_batch)
+		a->biggest_batch = n;
+}
+
+static void *actor_main(void *arg)
+{
+	struct actor *a = arg;
+	struct actor_cmd *c;
+	int n;
+
+	for (;;) {
+		n = 0;
+		while (n < a->max_batch && (c = mpsc_pop(a))) {
+			c->seq = n;
+			a->batch[n++] = c;
+		}
+		if (n) {
+			actor_apply(a, n);
+			continue;
+		}
+		if (!mpsc_empty(a)) {
+			/* A push is halfway through */
+			sched_yield();
+			continue;
+		}
+
+		pthread_mutex_lock(&a->lock);
+		__atomic_store_n(&a->sleeping, 1, __ATOMIC_SEQ_CST);
+		while (mpsc_empty(a) && !a->stop)
+			pthread_cond_wait(&a->wake, &a->lock);
+		__atomic_store_n(&a->sleeping, 0, __ATOMIC_SEQ_CST);
+		if (mpsc_empty(a) && a->stop) {
+			pthread_mutex_unlock(&a->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&a->lock);
+	}
+}
+
+/* Start the owner thread of 'map'; nobody else may touch the map until actor_stop() */
+int actor_start(struct actor *a, struct extent_map *map, int max_batch)
+{
+	a->map = map;
+	a->max_batch = max_batch > 0 ? max_batch : ACTOR_BATCH_DEFAULT;
+	a->batch = malloc(a->max_batch * sizeof(*a->batch));
+	if (!a->batch)
+		return -ENOMEM;
+	a->stub.next = NULL;
+	a->head = a->tail = &a->stub;
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->wake, NULL);
+	a->sleeping = 0;
+	a->stop = 0;
+	a->nr_cmds = a->nr_batches = a->nr_unsorted = 0;
+	a->biggest_batch = 0;
+	if (pthread_create(&a->thread, NULL, actor_main, a)) {
+		free(a->batch);
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+/* Let the owner finish what was submitted, then stop it */
+void actor_stop(struct actor *a)
+{
+	pthread_mutex_lock(&a->lock);
+	a->stop = 1;
+	pthread_cond_signal(&a->wake);
+	pthread_mutex_unlock(&a->lock);
+	pthread_join(a->thread, NULL);
+	pthread_mutex_destroy(&a->lock);
+	pthread_cond_destroy(&a->wake);
+	free(a->batch);
+}
+
+/* Queue 'c' without waiting for it; it must stay put until actor_wait() */
+void actor_submit(struct actor *a, struct actor_cmd *c)
+{
+	c->done = 0;
+	mpsc_push(a, c);
+	if (__atomic_load_n(&a->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&a->lock);
+		pthread_cond_signal(&a->wake);
+		pthread_mutex_unlock(&a->lock);
+	}
+}
+
+/* Wait for 'c' to be applied; returns what the map returned */
+int actor_wait(struct actor_cmd *c)
+{
+	while (!__atomic_load_n(&c->done, __ATOMIC_ACQUIRE))
+		sched_yield();
+	return c->ret;
+}
+
+int actor_update_range(struct actor *a, sector_t lba, sector_t pba, int len)
+{
+	struct actor_cmd c;
+
+	actor_cmd_update(&c, lba, pba, len);
+	actor_submit(a, &c);
+	return actor_wait(&c);
+}
+
+/* Like update_buf_lookup(): the PBA or -1, and how far the answer holds */
+sector_t actor_lookup(struct actor *a, sector_t lba, int *len)
+{
+	struct actor_cmd c;
+
+	actor_cmd_lookup(&c, lba);
+	actor_submit(a, &c);
+	actor_wait(&c);
+	if (len)
+		*len = c.len;
+	return c.pba;
+}
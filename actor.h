@@ -0,0 +1,85 @@
+/*
+ * Single writer front-end to an extent map.
+ *
+ * One thread owns the map; everyone else sends it commands through a
+ * lock-free multi-producer queue (an intrusive Vyukov MPSC list: a push
+ * is one atomic exchange). The owner drains up to max_batch commands at
+ * a time, sorts them by LBA, applies the updates through a finger and
+ * then answers the lookups, so every lookup in a batch sees every update
+ * in it. A batch in which sorting would reorder overlapping updates is
+ * applied in arrival order instead. Each
+ * command is its own future: the owner sets 'done' once it has been
+ * applied and the submitter waits on that.
+ *
+ * The owner sleeps on a condition variable when the queue is empty;
+ * producers only touch the mutex when it is asleep.
+ */
+
+#ifndef _ACTOR_H
+#define _ACTOR_H
+
+#include<pthread.h>
+#include"extent.h"
+
+#define ACTOR_BATCH_DEFAULT	256
+
+enum actor_op {
+	ACTOR_UPDATE,
+	ACTOR_LOOKUP,
+};
+
+struct actor_cmd {
+	struct actor_cmd *next;
+	enum actor_op op;
+	sector_t lba;
+	sector_t pba;		/* in for updates, out for lookups (-1: unmapped) */
+	int len;		/* in for updates, out for lookups */
+	unsigned long seq;	/* arrival order within a batch */
+	int ret;
+	int done;
+};
+
+struct actor {
+	struct extent_map *map;
+	pthread_t thread;
+	struct actor_cmd *head;		/* producers push here */
+	struct actor_cmd *tail;		/* the owner pops here */
+	struct actor_cmd stub;
+	struct actor_cmd **batch;
+	int max_batch;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int sleeping;
+	int stop;
+
+	unsigned long nr_cmds;
+	unsigned long nr_batches;
+	unsigned long nr_unsorted;	/* batches applied in arrival order */
+	int biggest_batch;
+};
+
+int actor_start(struct actor *a, struct extent_map *map, int max_batch);
+void actor_stop(struct actor *a);
+
+void actor_submit(struct actor *a, struct actor_cmd *c);
+int actor_wait(struct actor_cmd *c);
+
+int actor_update_range(struct actor *a, sector_t lba, sector_t pba, int len);
+sector_t actor_lookup(struct actor *a, sector_t lba, int *len);
+
+static inline void actor_cmd_update(struct actor_cmd *c, sector_t lba, sector_t pba, int len)
+{
+	c->op = ACTOR_UPDATE;
+	c->lba = lba;
+	c->pba = pba;
+	c->len = len;
+}
+
+static inline void actor_cmd_lookup(struct actor_cmd *c, sector_t lba)
+{
+	c->op = ACTOR_LOOKUP;
+	c->lba = lba;
+}
+
+#endif /* _ACTOR_H */
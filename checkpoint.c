@@ -0,0 +1,524 @@
+/*
+ * Checkpoints of the extent map.
+ * See checkpoint.h for the format.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<limits.h>
+#include<libgen.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<pthread.h>
+#include"checkpoint.h"
+#include"segment.h"
+#include"dirty.h"
+
+static inline unsigned char *put_varint(unsigned char *p, __u32 v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* NULL if the varint runs past 'end' or is too long */
+static inline const unsigned char *get_varint(const unsigned char *p,
+					      const unsigned char *end, __u32 *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; p < end && shift < 35; shift += 7) {
+		*v |= (__u32)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+static inline __u32 zigzag(__s32 v)
+{
+	return ((__u32)v << 1) ^ (__u32)(v >> 31);
+}
+
+static inline __s32 unzigzag(__u32 v)
+{
+	return (__s32)(v >> 1) ^ -(__s32)(v & 1);
+}
+
+struct ckpt_writer {
+	FILE *f;
+	unsigned char *buf, *p;
+	struct ckpt_chunk *index;
+	unsigned long nr_chunks, c;
+	long off;
+	int nr;
+	sector_t end, pba_end;
+};
+
+static int ckpt_flush_chunk(struct ckpt_writer *w)
+{
+	long bytes = w->p - w->buf;
+
+	if (w->c == w->nr_chunks || fwrite(w->buf, bytes, 1, w->f) != 1)
+		return -EIO;
+	w->index[w->c].off = w->off;
+	w->index[w->c].bytes = bytes;
+	w->index[w->c].nr = w->nr;
+	w->c++;
+	w->off += bytes;
+	w->p = w->buf;
+	w->nr = 0;
+	w->end = w->pba_end = 0;
+	return 0;
+}
+
+/*
+ * Checkpoints are written next to 'path' and renamed over it once they
+ * are on disk, so a crash leaves either the old one or the new one.
+ */
+static FILE *ckpt_create(const char *path, char *tmp)
+{
+	if (snprintf(tmp, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	return fopen(tmp, "w");
+}
+
+static int ckpt_sync_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	int fd, ret = 0;
+
+	strncpy(dir, path, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = 0;
+	fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -errno;
+	if (fsync(fd) < 0)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+/* Close 'f', and with 'ret' still 0 make it durable as 'path' */
+static int ckpt_install(FILE *f, const char *tmp, const char *path, int ret)
+{
+	if (!ret && (fflush(f) || fsync(fileno(f)) < 0))
+		ret = -errno;
+	if (fclose(f) && !ret)
+		ret = -EIO;
+	if (!ret && rename(tmp, path) < 0)
+		ret = -errno;
+	if (ret < 0) {
+		unlink(tmp);
+		return ret;
+	}
+	return ckpt_sync_dir(path);
+}
+
+/*
+ * Stream 'map' to 'path' in LBA order. Returns the size of the
+ * checkpoint in bytes, once it is durable.
+ */
+long checkpoint_write(struct extent_map *map, const char *path)
+{
+	struct ckpt_header hdr = { 0 };
+	struct ckpt_writer w = { 0 };
+	struct rb_iter it;
+	struct extent *e;
+	char tmp[PATH_MAX];
+	int ret = -EIO;
+
+	w.nr_chunks = (map->n_extents + CKPT_CHUNK_EXTENTS - 1) / CKPT_CHUNK_EXTENTS;
+	/* Three varints of at most five bytes per extent */
+	w.buf = w.p = malloc(CKPT_CHUNK_EXTENTS * 15);
+	w.index = calloc(w.nr_chunks ? w.nr_chunks : 1, sizeof(*w.index));
+	if (!w.buf || !w.index) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	w.f = ckpt_create(path, tmp);
+	if (!w.f) {
+		ret = -errno;
+		goto out;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, w.f) != 1)
+		goto out;
+	w.off = sizeof(hdr);
+
+	for (e = extent_iter_first(map, &it); e; e = extent_iter_next(&it)) {
+		w.p = put_varint(w.p, e->lba - w.end);
+		w.p = put_varint(w.p, zigzag(e->pba - w.pba_end));
+		w.p = put_varint(w.p, e->len);
+		w.end = e->lba + e->len;
+		w.pba_end = e->pba + e->len;
+		if (++w.nr == CKPT_CHUNK_EXTENTS && ckpt_flush_chunk(&w) < 0)
+			goto out;
+	}
+	if ((w.nr && ckpt_flush_chunk(&w) < 0) || w.c != w.nr_chunks)
+		goto out;
+
+	hdr.magic = CKPT_MAGIC;
+	hdr.version = CKPT_VERSION;
+	hdr.chunk_extents = CKPT_CHUNK_EXTENTS;
+	hdr.nr_extents = map->n_extents;
+	hdr.nr_chunks = w.nr_chunks;
+	hdr.index_off = w.off;
+	if (w.nr_chunks && fwrite(w.index, sizeof(*w.index), w.nr_chunks, w.f) != w.nr_chunks)
+		goto out;
+	w.off += w.nr_chunks * sizeof(*w.index);
+	if (fseek(w.f, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, w.f) != 1)
+		goto out;
+	ret = 0;
+out:
+	if (w.f)
+		ret = ckpt_install(w.f, tmp, path, ret);
+	free(w.buf);
+	free(w.index);
+	if (ret < 0)
+		return ret;
+	/* Deltas start over from here */
+	if (map->dirty)
+		dirty_clear(map->dirty);
+	return w.off;
+}
+
+static int put_varints(FILE *f, __u32 a, __u32 b, __u32 c)
+{
+	unsigned char buf[15], *p = buf;
+
+	p = put_varint(p, a);
+	p = put_varint(p, b);
+	p = put_varint(p, c);
+	return fwrite(buf, p - buf, 1, f) == 1 ? p - buf : -EIO;
+}
+
+/*
+ * Write the ranges marked dirty since the last checkpoint, with the
+ * extents inside them, and clear the marks. Returns the size in bytes,
+ * once the delta is durable.
+ */
+long checkpoint_write_delta(struct extent_map *map, const char *path)
+{
+	struct ckpt_delta_header hdr = { 0 };
+	struct rb_iter it;
+	struct extent *e;
+	sector_t start, len, end, from = 0, cs, ce, prev_end, pba_end;
+	long off = sizeof(hdr);
+	unsigned nr;
+	char tmp[PATH_MAX];
+	int ret = -EIO, n;
+	FILE *f;
+
+	if (!map->dirty)
+		return -EINVAL;
+	f = ckpt_create(path, tmp);
+	if (!f)
+		return -errno;
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto out;
+
+	while (!dirty_next_range(map->dirty, from, &start, &len)) {
+		end = start + len;
+		from = end;
+		nr = 0;
+		for (e = extent_iter_seek(map, &it, start); e && e->lba < end;
+		     e = extent_iter_next(&it))
+			nr++;
+		n = put_varints(f, start, len, nr);
+		if (n < 0)
+			goto out;
+		off += n;
+
+		prev_end = start;
+		pba_end = 0;
+		for (e = extent_iter_seek(map, &it, start); e && e->lba < end;
+		     e = extent_iter_next(&it)) {
+			cs = e->lba > start ? e->lba : start;
+			ce = e->lba + e->len < end ? e->lba + e->len : end;
+			n = put_varints(f, cs - prev_end,
+					zigzag(e->pba + (cs - e->lba) - pba_end), ce - cs);
+			if (n < 0)
+				goto out;
+			off += n;
+			prev_end = ce;
+			pba_end = e->pba + (ce - e->lba);
+		}
+		hdr.nr_ranges++;
+		hdr.nr_extents += nr;
+	}
+
+	hdr.magic = CKPT_DELTA_MAGIC;
+	hdr.version = CKPT_VERSION;
+	if (fseek(f, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto out;
+	ret = 0;
+out:
+	ret = ckpt_install(f, tmp, path, ret);
+	if (ret < 0)
+		return ret;
+	dirty_clear(map->dirty);
+	return off;
+}
+
+/* Fold the delta at 'path' into 'map' */
+int checkpoint_apply_delta(struct extent_map *map, const char *path)
+{
+	struct ckpt_delta_header *hdr;
+	const unsigned char *p, *end;
+	unsigned char *file;
+	unsigned long r;
+	__u32 start, len, nr, gap, dpba, elen, i;
+	sector_t prev_end, pba_end;
+	long size;
+	int ret = -EINVAL;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < (long)sizeof(*hdr) ||
+	    fseek(f, 0, SEEK_SET) < 0) {
+		fclose(f);
+		return -EINVAL;
+	}
+	file = malloc(size);
+	if (!file || fread(file, size, 1, f) != 1) {
+		fclose(f);
+		free(file);
+		return file ? -EIO : -ENOMEM;
+	}
+	fclose(f);
+
+	hdr = (struct ckpt_delta_header *)file;
+	if (hdr->magic != CKPT_DELTA_MAGIC || hdr->version != CKPT_VERSION) {
+		printf("\n %s: %s is not a delta checkpoint", __func__, path);
+		goto out;
+	}
+	p = file + sizeof(*hdr);
+	end = file + size;
+	for (r = 0; r < hdr->nr_ranges; r++) {
+		p = get_varint(p, end, &start);
+		if (p)
+			p = get_varint(p, end, &len);
+		if (p)
+			p = get_varint(p, end, &nr);
+		if (!p || !len)
+			goto corrupt;
+		ret = lsdm_trim_range(map, start, len);
+		if (ret < 0)
+			goto out;
+		prev_end = start;
+		pba_end = 0;
+		for (i = 0; i < nr; i++) {
+			p = get_varint(p, end, &gap);
+			if (p)
+				p = get_varint(p, end, &dpba);
+			if (p)
+				p = get_varint(p, end, &elen);
+			if (!p || !elen || prev_end + gap + elen > start + len)
+				goto corrupt;
+			ret = lsdm_update_range(map, prev_end + gap,
+						pba_end + unzigzag(dpba), elen);
+			if (ret < 0)
+				goto out;
+			prev_end += gap + elen;
+			pba_end = pba_end + unzigzag(dpba) + elen;
+		}
+	}
+	ret = p == end ? 0 : -EINVAL;
+	goto out;
+corrupt:
+	printf("\n %s: %s is corrupt", __func__, path);
+	ret = -EINVAL;
+out:
+	free(file);
+	return ret;
+}
+
+struct ckpt_worker {
+	pthread_t thread;
+	const unsigned char *file;
+	const struct ckpt_header *hdr;
+	const struct ckpt_chunk *index;
+	struct rb_node **nodes;
+	unsigned long first, step;	/* chunks first, first + step, ... */
+	int started;
+	int ret;
+};
+
+static int decode_chunk(const unsigned char *p, const struct ckpt_chunk *c,
+			struct rb_node **nodes)
+{
+	const unsigned char *end = p + c->bytes;
+	sector_t lba_end = 0, pba_end = 0;
+	struct extent *e;
+	__u32 gap, dpba, len;
+	unsigned i;
+
+	for (i = 0; i < c->nr; i++) {
+		p = get_varint(p, end, &gap);
+		if (p)
+			p = get_varint(p, end, &dpba);
+		if (p)
+			p = get_varint(p, end, &len);
+		if (!p || !len)
+			return -EINVAL;
+		e = rb_entry(nodes[i], struct extent, rb);
+		e->lba = lba_end + gap;
+		e->pba = pba_end + unzigzag(dpba);
+		e->len = len;
+		lba_end = e->lba + len;
+		pba_end = e->pba + len;
+	}
+	return p == end ? 0 : -EINVAL;
+}
+
+static void *ckpt_decode(void *arg)
+{
+	struct ckpt_worker *w = arg;
+	unsigned long c;
+
+	w->ret = 0;
+	for (c = w->first; c < w->hdr->nr_chunks && !w->ret; c += w->step)
+		w->ret = decode_chunk(w->file + w->index[c].off, &w->index[c],
+				      w->nodes + c * w->hdr->chunk_extents);
+	return NULL;
+}
+
+static int ckpt_valid(const struct ckpt_header *hdr, const struct ckpt_chunk *index, long size)
+{
+	unsigned long c, nr = 0;
+
+	if (hdr->magic != CKPT_MAGIC || hdr->version != CKPT_VERSION || !hdr->chunk_extents ||
+	    hdr->index_off > size ||
+	    hdr->nr_chunks > (size - hdr->index_off) / sizeof(*index))
+		return 0;
+	for (c = 0; c < hdr->nr_chunks; c++) {
+		if (index[c].off < sizeof(*hdr) || index[c].off + index[c].bytes > hdr->index_off)
+			return 0;
+		/* Only the last chunk may be short */
+		if (index[c].nr != (c == hdr->nr_chunks - 1 ?
+				    hdr->nr_extents - nr : hdr->chunk_extents))
+			return 0;
+		nr += index[c].nr;
+	}
+	return nr == hdr->nr_extents;
+}
+
+/*
+ * Load the checkpoint at 'path' into the empty 'map'. Extents are
+ * allocated up front, 'nr_threads' workers decode the chunks straight
+ * into them, and the tree is then linked in one O(n) pass.
+ */
+int checkpoint_load(struct extent_map *map, const char *path, int nr_threads)
+{
+	struct ckpt_worker *workers = NULL;
+	struct ckpt_header *hdr;
+	struct ckpt_chunk *index;
+	struct rb_node **nodes = NULL;
+	struct extent *e, *prev = NULL;
+	unsigned char *file = NULL;
+	unsigned long i, nr = 0;
+	long size;
+	int t, ret = -EINVAL;
+	FILE *f;
+
+	if (map->n_extents)
+		return -EINVAL;
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < (long)sizeof(*hdr) ||
+	    fseek(f, 0, SEEK_SET) < 0) {
+		fclose(f);
+		return -EINVAL;
+	}
+	file = malloc(size);
+	if (!file || fread(file, size, 1, f) != 1) {
+		ret = file ? -EIO : -ENOMEM;
+		fclose(f);
+		goto out;
+	}
+	fclose(f);
+
+	hdr = (struct ckpt_header *)file;
+	index = (struct ckpt_chunk *)(file + hdr->index_off);
+	if (!ckpt_valid(hdr, index, size)) {
+		printf("\n %s: %s is not a valid checkpoint", __func__, path);
+		goto out;
+	}
+
+	ret = -ENOMEM;
+	nodes = malloc(sizeof(*nodes) * (hdr->nr_extents ? hdr->nr_extents : 1));
+	if (nr_threads < 1)
+		nr_threads = 1;
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!nodes || !workers)
+		goto out;
+	for (nr = 0; nr < hdr->nr_extents; nr++) {
+		e = extent_alloc(map);
+		if (!e)
+			goto out;
+		nodes[nr] = &e->rb;
+	}
+
+	for (t = 0; t < nr_threads; t++) {
+		workers[t].file = file;
+		workers[t].hdr = hdr;
+		workers[t].index = index;
+		workers[t].nodes = nodes;
+		workers[t].first = t;
+		workers[t].step = nr_threads;
+		workers[t].started = t &&
+			!pthread_create(&workers[t].thread, NULL, ckpt_decode, &workers[t]);
+	}
+	/* Whatever did not get a thread is decoded right here */
+	for (t = 0; t < nr_threads; t++)
+		if (!workers[t].started)
+			ckpt_decode(&workers[t]);
+	ret = 0;
+	for (t = 0; t < nr_threads; t++) {
+		if (workers[t].started)
+			pthread_join(workers[t].thread, NULL);
+		if (workers[t].ret)
+			ret = workers[t].ret;
+	}
+	if (ret)
+		goto out;
+
+	/* Chunks are decoded on their own: check that they line up */
+	for (i = 0; i < nr; i++) {
+		e = rb_entry(nodes[i], struct extent, rb);
+		if (prev && prev->lba + prev->len > e->lba) {
+			printf("\n %s: %s: extents out of order at lba %d", __func__, path, e->lba);
+			ret = -EINVAL;
+			goto out;
+		}
+		prev = e;
+	}
+	for (i = 0; map->sit && i < nr; i++) {
+		e = rb_entry(nodes[i], struct extent, rb);
+		seg_add_valid(map->sit, e->pba, e->len);
+	}
+	rb_build_sorted(nodes, nr, &map->extent_tbl_root);
+	map->n_extents = nr;
+	map->gen++;
+	nr = 0;
+	ret = 0;
+out:
+	/* On failure, give back whatever was allocated */
+	for (i = 0; i < nr; i++)
+		extent_free(map, rb_entry(nodes[i], struct extent, rb));
+	free(workers);
+	free(nodes);
+	free(file);
+	return ret;
+}
@@ -0,0 +1,65 @@
+/*
+ * Checkpoints of the extent map.
+ *
+ * A checkpoint is the map in LBA order, cut into chunks of
+ * CKPT_CHUNK_EXTENTS. Within a chunk every extent is stored as three
+ * varints: the gap from the end of the previous extent, the (zigzag
+ * encoded) PBA distance from the end of the previous extent, and the
+ * length. Log structured writes make both distances small, so most
+ * extents take a few bytes. Chunks start from zero and are listed in an
+ * index at the end of the file, so they can be decoded in parallel. The
+ * loader then links the extents with rb_build_sorted() in O(n).
+ *
+ *	header | chunk 0 | chunk 1 | ... | index
+ *
+ * A delta checkpoint holds only the LBA ranges marked in map->dirty
+ * since the last checkpoint: for each range its bounds, then the extents
+ * inside it (clipped to it) in the same varint encoding. Applying a delta
+ * unmaps each range and maps its extents back, so deltas fold into a
+ * base in order and the cost scales with what was written, not with the
+ * size of the map.
+ *
+ *	delta header | range 0 | range 1 | ...
+ */
+
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include<linux/types.h>
+#include"extent.h"
+
+#define CKPT_MAGIC		0x54504b434d44534cULL	/* "LSDMCKPT" */
+#define CKPT_VERSION		1
+#define CKPT_CHUNK_EXTENTS	65536
+
+struct ckpt_header {
+	__u64 magic;
+	__u32 version;
+	__u32 chunk_extents;
+	__u64 nr_extents;
+	__u64 nr_chunks;
+	__u64 index_off;	/* offset of nr_chunks struct ckpt_chunk */
+};
+
+struct ckpt_chunk {
+	__u64 off;
+	__u32 bytes;
+	__u32 nr;		/* extents in this chunk */
+};
+
+#define CKPT_DELTA_MAGIC	0x41544c444d44534cULL	/* "LSDMDLTA" */
+
+struct ckpt_delta_header {
+	__u64 magic;
+	__u32 version;
+	__u32 pad;
+	__u64 nr_ranges;
+	__u64 nr_extents;
+};
+
+long checkpoint_write(struct extent_map *map, const char *path);
+long checkpoint_write_delta(struct extent_map *map, const char *path);
+int checkpoint_apply_delta(struct extent_map *map, const char *path);
+int checkpoint_load(struct extent_map *map, const char *path, int nr_threads);
+
+#endif /* _CHECKPOINT_H */
@@ -0,0 +1,57 @@
+/*
+ * Fold delta checkpoints into a base checkpoint.
+ *
+ *	./ckpt_merge base delta... out
+ *
+ * The deltas are applied in the order given, oldest first, and the result
+ * is written out as a new full checkpoint.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include"extent.h"
+#include"checkpoint.h"
+
+#define MERGE_THREADS	4
+
+int main(int argc, char **argv)
+{
+	struct extent_map map;
+	struct extent_pool pool;
+	long bytes;
+	int i, ret;
+
+	if (argc < 4) {
+		printf("usage: %s base delta... out\n", argv[0]);
+		return 1;
+	}
+
+	extent_map_init(&map);
+	extent_pool_init(&pool);
+	map.pool = &pool;
+	ret = checkpoint_load(&map, argv[1], MERGE_THREADS);
+	if (ret < 0) {
+		printf("%s: cannot load %s: %d\n", argv[0], argv[1], ret);
+		return 1;
+	}
+	printf("%s: %d extents\n", argv[1], map.n_extents);
+
+	for (i = 2; i < argc - 1; i++) {
+		ret = checkpoint_apply_delta(&map, argv[i]);
+		if (ret < 0) {
+			printf("%s: cannot apply %s: %d\n", argv[0], argv[i], ret);
+			return 1;
+		}
+		printf("%s: applied, %d extents\n", argv[i], map.n_extents);
+	}
+
+	bytes = checkpoint_write(&map, argv[argc - 1]);
+	if (bytes < 0) {
+		printf("%s: cannot write %s: %ld\n", argv[0], argv[argc - 1], bytes);
+		return 1;
+	}
+	printf("%s: %d extents in %ld bytes\n", argv[argc - 1], map.n_extents, bytes);
+	extent_map_destroy(&map);
+	extent_pool_exit(&pool);
+	return 0;
+}
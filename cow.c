@@ -0,0 +1,735 @@
+/*
+ * Persistent (copy-on-write) extent map.
+ * See cow.h for the overview.
+ *
+ * Every function below takes over the references it is passed and
+ * returns one, so a tree handed to split() or join() must not be used
+ * again by the caller. A node that the caller holds the only reference
+ * to is taken apart in place; any other is copied.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<limits.h>
+#include<string.h>
+#include<errno.h>
+#include"cow.h"
+
+struct cow_key {
+	sector_t lba;
+	sector_t pba;
+	__u32 len;
+};
+
+static inline int is_red(struct cow_node *n)
+{
+	return n && !n->black;
+}
+
+static inline int bh(struct cow_node *n)
+{
+	return n ? n->bh : 0;
+}
+
+static inline unsigned long size(struct cow_node *n)
+{
+	return n ? n->size : 0;
+}
+
+static inline struct cow_node *get(struct cow_node *n)
+{
+	if (n)
+		__atomic_fetch_add(&n->ref, 1, __ATOMIC_RELAXED);
+	return n;
+}
+
+/* May be called from any thread holding a reference */
+static void put(struct cow_node *n)
+{
+	while (n && __atomic_sub_fetch(&n->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct cow_node *right = n->right;
+
+		put(n->left);
+		free(n);
+		n = right;
+	}
+}
+
+/*
+ * Enough spare nodes for one update to never fail halfway: two splits,
+ * up to three split_last()/split_first() and three joins each copy at
+ * most a few nodes per level, and the tree is at most 2 log2(n + 1)
+ * levels deep.
+ */
+#define COW_NODES_PER_LEVEL	32
+
+static int cow_fill_reserve(struct cow_map *m)
+{
+	unsigned long n = size(m->root) + 1, need = COW_NODES_PER_LEVEL * 2;
+	struct cow_node *node;
+
+	while (n) {
+		need += COW_NODES_PER_LEVEL * 2;
+		n >>= 1;
+	}
+	while (m->nr_reserve < need) {
+		node = malloc(sizeof(*node));
+		if (!node)
+			return -ENOMEM;
+		node->left = m->reserve;
+		m->reserve = node;
+		m->nr_reserve++;
+	}
+	return 0;
+}
+
+static struct cow_node *mk(struct cow_map *m, struct cow_node *l,
+			   const struct cow_key *k, struct cow_node *r, int black)
+{
+	struct cow_node *n = m->reserve;
+
+	if (!n) {
+		printf("\n %s: node reserve exhausted", __func__);
+		abort();
+	}
+	m->reserve = n->left;
+	m->nr_reserve--;
+	n->left = l;
+	n->right = r;
+	n->lba = k->lba;
+	n->pba = k->pba;
+	n->len = k->len;
+	n->black = black;
+	n->bh = bh(l) + black;
+	n->ref = 1;
+	n->size = size(l) + size(r) + 1;
+	return n;
+}
+
+static inline void update(struct cow_node *n)
+{
+	n->bh = bh(n->left) + n->black;
+	n->size = size(n->left) + size(n->right) + 1;
+}
+
+/* Take 'n' apart into its children and key */
+static void expose(struct cow_map *m, struct cow_node *n, struct cow_node **l,
+		   struct cow_key *k, struct cow_node **r, int *black)
+{
+	k->lba = n->lba;
+	k->pba = n->pba;
+	k->len = n->len;
+	*black = n->black;
+	if (__atomic_load_n(&n->ref, __ATOMIC_ACQUIRE) == 1) {
+		*l = n->left;
+		*r = n->right;
+		n->left = m->reserve;
+		m->reserve = n;
+		m->nr_reserve++;
+		return;
+	}
+	*l = get(n->left);
+	*r = get(n->right);
+	put(n);
+}
+
+/* Nodes built by mk() during this update are not shared yet */
+static struct cow_node *rotate_left(struct cow_node *n)
+{
+	struct cow_node *x = n->right;
+
+	n->right = x->left;
+	x->left = n;
+	update(n);
+	update(x);
+	return x;
+}
+
+static struct cow_node *rotate_right(struct cow_node *n)
+{
+	struct cow_node *x = n->left;
+
+	n->left = x->right;
+	x->right = n;
+	update(n);
+	update(x);
+	return x;
+}
+
+/* A black copy of 'n', which may be shared */
+static struct cow_node *blacken(struct cow_map *m, struct cow_node *n)
+{
+	struct cow_node *l, *r;
+	struct cow_key k;
+	int black;
+
+	expose(m, n, &l, &k, &r, &black);
+	return mk(m, l, &k, r, 1);
+}
+
+/* bh(tl) >= bh(tr): hang 'k' and 'tr' off the right spine of 'tl' */
+static struct cow_node *join_right(struct cow_map *m, struct cow_node *tl,
+				   const struct cow_key *k, struct cow_node *tr)
+{
+	struct cow_node *l, *r, *t;
+	struct cow_key k2;
+	int black;
+
+	if (!is_red(tl) && bh(tl) == bh(tr))
+		return mk(m, tl, k, tr, 0);
+	expose(m, tl, &l, &k2, &r, &black);
+	t = mk(m, l, &k2, join_right(m, r, k, tr), black);
+	if (black && is_red(t->right) && is_red(t->right->right)) {
+		t->right->right = blacken(m, t->right->right);
+		t = rotate_left(t);
+	}
+	return t;
+}
+
+static struct cow_node *join_left(struct cow_map *m, struct cow_node *tl,
+				  const struct cow_key *k, struct cow_node *tr)
+{
+	struct cow_node *l, *r, *t;
+	struct cow_key k2;
+	int black;
+
+	if (!is_red(tr) && bh(tr) == bh(tl))
+		return mk(m, tl, k, tr, 0);
+	expose(m, tr, &l, &k2, &r, &black);
+	t = mk(m, join_left(m, tl, k, l), &k2, r, black);
+	if (black && is_red(t->left) && is_red(t->left->left)) {
+		t->left->left = blacken(m, t->left->left);
+		t = rotate_right(t);
+	}
+	return t;
+}
+
+/* Every key of 'tl' sorts before 'k', every key of 'tr' after it */
+static struct cow_node *join(struct cow_map *m, struct cow_node *tl,
+			     const struct cow_key *k, struct cow_node *tr)
+{
+	struct cow_node *t;
+
+	if (bh(tl) > bh(tr)) {
+		t = join_right(m, tl, k, tr);
+		if (is_red(t) && is_red(t->right)) {
+			t->black = 1;
+			update(t);
+		}
+		return t;
+	}
+	if (bh(tl) < bh(tr)) {
+		t = join_left(m, tl, k, tr);
+		if (is_red(t) && is_red(t->left)) {
+			t->black = 1;
+			update(t);
+		}
+		return t;
+	}
+	return mk(m, tl, k, tr, !is_red(tl) && !is_red(tr) ? 0 : 1);
+}
+
+/* Extents starting below 'lba' go to 'lo', the rest to 'hi' */
+static void split(struct cow_map *m, struct cow_node *t, sector_t lba,
+		  struct cow_node **lo, struct cow_node **hi)
+{
+	struct cow_node *l, *r, *x;
+	struct cow_key k;
+	int black;
+
+	if (!t) {
+		*lo = *hi = NULL;
+		return;
+	}
+	expose(m, t, &l, &k, &r, &black);
+	if (lba <= k.lba) {
+		split(m, l, lba, lo, &x);
+		*hi = join(m, x, &k, r);
+	} else {
+		split(m, r, lba, &x, hi);
+		*lo = join(m, l, &k, x);
+	}
+}
+
+/* Remove the last extent of 't' into 'k' */
+static struct cow_node *split_last(struct cow_map *m, struct cow_node *t,
+				   struct cow_key *k)
+{
+	struct cow_node *l, *r;
+	struct cow_key k2;
+	int black;
+
+	expose(m, t, &l, &k2, &r, &black);
+	if (!r) {
+		*k = k2;
+		return l;
+	}
+	r = split_last(m, r, k);
+	return join(m, l, &k2, r);
+}
+
+static struct cow_node *split_first(struct cow_map *m, struct cow_node *t,
+				    struct cow_key *k)
+{
+	struct cow_node *l, *r;
+	struct cow_key k2;
+	int black;
+
+	expose(m, t, &l, &k2, &r, &black);
+	if (!l) {
+		*k = k2;
+		return r;
+	}
+	l = split_first(m, l, k);
+	return join(m, l, &k2, r);
+}
+
+static inline struct cow_node *cow_last(struct cow_node *t)
+{
+	while (t && t->right)
+		t = t->right;
+	return t;
+}
+
+static inline struct cow_node *cow_first(struct cow_node *t)
+{
+	while (t && t->left)
+		t = t->left;
+	return t;
+}
+
+static inline int contiguous(const struct cow_key *a, sector_t lba, sector_t pba)
+{
+	return a->lba + a->len == lba && a->pba + a->len == pba;
+}
+
+/*
+ * Replace whatever maps [lba, lba + len) with 'new', or with nothing if
+ * 'new' is NULL. The pieces are:
+ *
+ *	lo | prev | new | tail | hi
+ *
+ * where prev is the last extent starting below lba, clipped to it, and
+ * tail what an overwritten extent had beyond the range.
+ */
+static int cow_change(struct cow_map *m, sector_t lba, int len,
+		      const struct cow_key *new)
+{
+	struct cow_node *lo, *mid, *hi, *t, *n;
+	struct cow_key prev, tail, k, x;
+	sector_t end = lba + len;
+	int have_prev = 0, have_tail = 0;
+
+	if (len <= 0)
+		return -EINVAL;
+	if (cow_fill_reserve(m) < 0)
+		return -ENOMEM;
+
+	split(m, m->root, lba, &lo, &hi);
+	split(m, hi, end, &mid, &hi);
+
+	n = cow_last(lo);
+	if (n && (n->lba + n->len > lba ||
+		  (new && n->lba + n->len == lba && n->pba + n->len == new->pba))) {
+		lo = split_last(m, lo, &prev);
+		have_prev = 1;
+		if (prev.lba + prev.len > end) {
+			tail.lba = end;
+			tail.pba = prev.pba + (end - prev.lba);
+			tail.len = prev.lba + prev.len - end;
+			have_tail = 1;
+		}
+		if (prev.lba + prev.len > lba)
+			prev.len = lba - prev.lba;
+	}
+	if (mid) {
+		mid = split_last(m, mid, &x);
+		if (x.lba + x.len > end) {
+			tail.lba = end;
+			tail.pba = x.pba + (end - x.lba);
+			tail.len = x.lba + x.len - end;
+			have_tail = 1;
+		}
+		put(mid);
+	}
+
+	t = hi;
+	if (new) {
+		k = *new;
+		if (have_prev && contiguous(&prev, k.lba, k.pba)) {
+			prev.len += k.len;
+			k = prev;
+			have_prev = 0;
+		}
+		if (have_tail) {
+			if (contiguous(&k, tail.lba, tail.pba)) {
+				k.len += tail.len;
+				have_tail = 0;
+			}
+		} else {
+			n = cow_first(hi);
+			if (n && contiguous(&k, n->lba, n->pba)) {
+				t = split_first(m, hi, &x);
+				k.len += x.len;
+			}
+		}
+	}
+	if (have_tail)
+		t = join(m, NULL, &tail, t);
+	if (new)
+		t = join(m, NULL, &k, t);
+	if (have_prev) {
+		t = join(m, lo, &prev, t);
+	} else if (lo) {
+		lo = split_last(m, lo, &x);
+		t = join(m, lo, &x, t);
+	}
+	m->root = t;
+	return 0;
+}
+
+int cow_update_range(struct cow_map *m, sector_t lba, sector_t pba, int len)
+{
+	struct cow_key k = { lba, pba, len };
+
+	return cow_change(m, lba, len, &k);
+}
+
+int cow_trim_range(struct cow_map *m, sector_t lba, int len)
+{
+	return cow_change(m, lba, len, NULL);
+}
+
+void cow_map_init(struct cow_map *m)
+{
+	m->root = NULL;
+	m->reserve = NULL;
+	m->nr_reserve = 0;
+}
+
+/* Drops this version; nodes shared with snapshots stay theirs */
+void cow_map_destroy(struct cow_map *m)
+{
+	struct cow_node *n;
+
+	put(m->root);
+	m->root = NULL;
+	while ((n = m->reserve)) {
+		m->reserve = n->left;
+		free(n);
+	}
+	m->nr_reserve = 0;
+}
+
+/*
+ * Make 'snap' a version of its own holding what 'src' holds now. Either
+ * may be updated afterwards without the other seeing it; a snapshot that
+ * is only read needs no lock, on any thread.
+ */
+void cow_snapshot(struct cow_map *src, struct cow_map *snap)
+{
+	cow_map_init(snap);
+	snap->root = get(src->root);
+}
+
+/*
+ * PBA that 'lba' maps to, or -1 if it is unmapped. If 'len' is given it
+ * is set to the number of sectors from 'lba' on for which the answer
+ * stays contiguous (or unmapped).
+ */
+sector_t cow_lookup(struct cow_map *m, sector_t lba, int *len)
+{
+	struct cow_node *n = m->root, *higher = NULL;
+
+	while (n) {
+		if (lba < n->lba) {
+			higher = n;
+			n = n->left;
+		} else if (lba - n->lba >= n->len) {
+			n = n->right;
+		} else {
+			if (len)
+				*len = n->lba + n->len - lba;
+			return n->pba + (lba - n->lba);
+		}
+	}
+	if (len)
+		*len = higher ? higher->lba - lba : INT_MAX;
+	return -1;
+}
+
+/* Black height of 'n', or -1 if it breaks a red-black or extent rule */
+static int cow_check_node(struct cow_node *n, sector_t lo, sector_t hi,
+			  struct cow_key *last)
+{
+	int l, r, ref;
+
+	if (!n)
+		return 0;
+	/* Other versions may be taking and dropping references meanwhile */
+	ref = __atomic_load_n(&n->ref, __ATOMIC_RELAXED);
+	if (ref <= 0 || n->len == 0 || n->lba < lo || n->lba + n->len > hi) {
+		printf("\n %s: bad extent %d %d %d ref %d", __func__,
+		       n->lba, n->pba, n->len, ref);
+		return -1;
+	}
+	if (!n->black && (is_red(n->left) || is_red(n->right))) {
+		printf("\n %s: red %d has a red child", __func__, n->lba);
+		return -1;
+	}
+	l = cow_check_node(n->left, lo, n->lba, last);
+	if (l < 0)
+		return -1;
+	if (last->len && contiguous(last, n->lba, n->pba)) {
+		printf("\n %s: %d and %d should have been merged", __func__,
+		       last->lba, n->lba);
+		return -1;
+	}
+	last->lba = n->lba;
+	last->pba = n->pba;
+	last->len = n->len;
+	r = cow_check_node(n->right, n->lba + n->len, hi, last);
+	if (r < 0)
+		return -1;
+	if (l != r || n->bh != l + n->black ||
+	    n->size != size(n->left) + size(n->right) + 1) {
+		printf("\n %s: %d is out of balance", __func__, n->lba);
+		return -1;
+	}
+	return l + n->black;
+}
+
+int cow_check(struct cow_map *m)
+{
+	struct cow_key last = { 0, 0, 0 };
+
+	return cow_check_node(m->root, 0, INT_MAX, &last) < 0 ? -1 : 0;
+}
+
+/*
+ * In-order walk of one version for cow_diff(). Each stack entry is a
+ * subtree still to be walked whole, or a node whose left subtree is
+ * done and whose own extent comes next.
+ */
+struct cow_walk_ent {
+	struct cow_node *n;
+	int whole;
+	sector_t start;		/* first LBA covered, -1 until needed */
+};
+
+#define COW_WALK_DEPTH	(3 * 64)
+
+struct cow_walk {
+	struct cow_walk_ent s[COW_WALK_DEPTH];
+	int top;
+};
+
+static inline void walk_push(struct cow_walk *w, struct cow_node *n, int whole,
+			     sector_t start)
+{
+	if (n) {
+		w->s[w->top].n = n;
+		w->s[w->top].whole = whole;
+		w->s[w->top].start = start;
+		w->top++;
+	}
+}
+
+static inline struct cow_walk_ent *walk_top(struct cow_walk *w)
+{
+	return w->top ? &w->s[w->top - 1] : NULL;
+}
+
+/* LBA the walk continues at, INT_MAX at the end */
+static sector_t walk_pos(struct cow_walk *w)
+{
+	struct cow_walk_ent *t = walk_top(w);
+
+	if (!t)
+		return INT_MAX;
+	if (!t->whole)
+		return t->n->lba;
+	if (t->start < 0)
+		t->start = cow_first(t->n)->lba;
+	return t->start;
+}
+
+/* Replace the whole subtree on top by its left subtree, itself and its right */
+static void walk_expand(struct cow_walk *w)
+{
+	struct cow_walk_ent t = w->s[--w->top];
+
+	walk_push(w, t.n->right, 1, -1);
+	walk_push(w, t.n, 0, t.n->lba);
+	walk_push(w, t.n->left, 1, t.start);
+}
+
+/* Pop the node on top as the extent the walk is in */
+static void walk_load(struct cow_walk *w, struct cow_key *k)
+{
+	struct cow_node *n = w->s[--w->top].n;
+
+	k->lba = n->lba;
+	k->pba = n->pba;
+	k->len = n->len;
+}
+
+/* Step the walk: open up a whole subtree on top, or load the next extent */
+static void walk_next(struct cow_walk *w, struct cow_key *k)
+{
+	if (walk_top(w)->whole)
+		walk_expand(w);
+	else
+		walk_load(w, k);
+}
+
+static inline void key_cut(struct cow_key *k, __u32 l)
+{
+	k->lba += l;
+	k->pba += l;
+	k->len -= l;
+}
+
+struct cow_diff_state {
+	struct cow_diff pending;
+	cow_diff_fn fn;
+	void *arg;
+	long nr;
+	int stop;
+};
+
+static void diff_flush(struct cow_diff_state *d)
+{
+	if (d->pending.len && !d->stop) {
+		d->nr++;
+		d->stop = d->fn(&d->pending, d->arg);
+	}
+	d->pending.len = 0;
+}
+
+/* Queue a record, growing the last one if this continues it */
+static void diff_emit(struct cow_diff_state *d, int type, sector_t lba, __u32 len,
+		      sector_t old_pba, sector_t new_pba)
+{
+	struct cow_diff *p = &d->pending;
+
+	if (p->len && p->type == type && p->lba + p->len == lba &&
+	    (type == COW_DIFF_ADDED || p->old_pba + p->len == old_pba) &&
+	    (type == COW_DIFF_REMOVED || p->new_pba + p->len == new_pba)) {
+		p->len += len;
+		return;
+	}
+	diff_flush(d);
+	p->type = type;
+	p->lba = lba;
+	p->len = len;
+	p->old_pba = type == COW_DIFF_ADDED ? -1 : old_pba;
+	p->new_pba = type == COW_DIFF_REMOVED ? -1 : new_pba;
+}
+
+/*
+ * Call 'fn' with what turns 'a' into 'b', in LBA order: ranges only 'b'
+ * maps (added), ranges only 'a' maps (removed) and ranges both map to
+ * different places (remapped). Adjacent records of one kind that could
+ * be one are. A subtree that both versions share is skipped without
+ * being walked, so for two snapshots of one map the cost follows what
+ * was written between them, not the size of the map.
+ *
+ * 'fn' returning non-zero stops the diff. Returns the number of records
+ * passed to 'fn'. Neither version may be updated meanwhile.
+ */
+long cow_diff(struct cow_map *a, struct cow_map *b, cow_diff_fn fn, void *arg)
+{
+	struct cow_walk *wa, *wb;
+	struct cow_walk_ent *ta, *tb;
+	struct cow_diff_state d;
+	struct cow_key pa = { 0 }, pb = { 0 };	/* extents being compared, len 0: none */
+	sector_t posa, posb, end;
+	__u32 l;
+
+	wa = malloc(2 * sizeof(*wa));
+	if (!wa)
+		return -ENOMEM;
+	wb = wa + 1;
+	wa->top = wb->top = 0;
+	walk_push(wa, a->root, 1, -1);
+	walk_push(wb, b->root, 1, -1);
+	memset(&d, 0, sizeof(d));
+	d.fn = fn;
+	d.arg = arg;
+	pa.len = pb.len = 0;
+
+	while (!d.stop) {
+		if (pa.len && pb.len) {
+			if (pa.lba < pb.lba) {
+				end = pa.lba + pa.len < pb.lba ? pa.lba + pa.len : pb.lba;
+				l = end - pa.lba;
+				diff_emit(&d, COW_DIFF_REMOVED, pa.lba, l, pa.pba, 0);
+				key_cut(&pa, l);
+			} else if (pb.lba < pa.lba) {
+				end = pb.lba + pb.len < pa.lba ? pb.lba + pb.len : pa.lba;
+				l = end - pb.lba;
+				diff_emit(&d, COW_DIFF_ADDED, pb.lba, l, 0, pb.pba);
+				key_cut(&pb, l);
+			} else {
+				l = pa.len < pb.len ? pa.len : pb.len;
+				if (pa.pba != pb.pba)
+					diff_emit(&d, COW_DIFF_REMAPPED, pa.lba, l,
+						  pa.pba, pb.pba);
+				key_cut(&pa, l);
+				key_cut(&pb, l);
+			}
+			continue;
+		}
+
+		posa = pa.len ? pa.lba : walk_pos(wa);
+		posb = pb.len ? pb.lba : walk_pos(wb);
+		if (pa.len) {
+			if (posb >= pa.lba + pa.len) {
+				diff_emit(&d, COW_DIFF_REMOVED, pa.lba, pa.len, pa.pba, 0);
+				pa.len = 0;
+			} else {
+				walk_next(wb, &pb);
+			}
+			continue;
+		}
+		if (pb.len) {
+			if (posa >= pb.lba + pb.len) {
+				diff_emit(&d, COW_DIFF_ADDED, pb.lba, pb.len, 0, pb.pba);
+				pb.len = 0;
+			} else {
+				walk_next(wa, &pa);
+			}
+			continue;
+		}
+
+		if (posa == INT_MAX && posb == INT_MAX)
+			break;
+		if (posa != posb) {
+			if (posa < posb)
+				walk_next(wa, &pa);
+			else
+				walk_next(wb, &pb);
+			continue;
+		}
+		ta = walk_top(wa);
+		tb = walk_top(wb);
+		if (ta->whole && tb->whole) {
+			if (ta->n == tb->n) {
+				/* Shared, so identical: nothing to report */
+				wa->top--;
+				wb->top--;
+			} else if (ta->n->size >= tb->n->size) {
+				walk_expand(wa);
+			} else {
+				walk_expand(wb);
+			}
+			continue;
+		}
+		walk_next(wa, &pa);
+		walk_next(wb, &pb);
+	}
+	diff_flush(&d);
+	free(wa);
+	return d.nr;
+}
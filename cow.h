@@ -0,0 +1,85 @@
+/*
+ * Persistent (copy-on-write) extent map.
+ *
+ * A red-black tree of extents whose nodes are never changed once they
+ * can be reached from more than one version: an update copies the path
+ * it changes and shares every other subtree, counting references to
+ * nodes instead of owning them. A snapshot is then one reference to the
+ * root, taken in O(1), and reading a snapshot needs no lock however the
+ * live map changes afterwards.
+ *
+ * Updates are built from split and join (Blelloch et al., "Just Join for
+ * Parallel Ordered Sets"): the range is cut out of the tree with two
+ * splits, the extent clipped at either end, and the pieces joined back
+ * around the new extent. Each step is O(log n) and copies O(log n)
+ * nodes. The result follows lsdm_update_range() and lsdm_trim_range():
+ * overwritten extents are split or dropped and physically contiguous
+ * neighbours are merged. There is no segment accounting.
+ *
+ * Only one thread may update a given map; snapshots may be read and
+ * released from any thread.
+ *
+ * cow_diff() reports what changed between two versions as a stream of
+ * range records, for incremental replication between snapshots.
+ */
+
+#ifndef _COW_H
+#define _COW_H
+
+#include<linux/types.h>
+#include"extent.h"
+
+struct cow_node {
+	struct cow_node *left, *right;
+	sector_t lba;
+	sector_t pba;
+	__u32 len;
+	unsigned char black;
+	unsigned char bh;		/* black height of this subtree */
+	int ref;
+	unsigned long size;		/* extents in this subtree */
+};
+
+struct cow_map {
+	struct cow_node *root;
+	struct cow_node *reserve;	/* spare nodes, linked through 'left' */
+	unsigned long nr_reserve;
+};
+
+void cow_map_init(struct cow_map *m);
+void cow_map_destroy(struct cow_map *m);
+void cow_snapshot(struct cow_map *src, struct cow_map *snap);
+
+int cow_update_range(struct cow_map *m, sector_t lba, sector_t pba, int len);
+int cow_trim_range(struct cow_map *m, sector_t lba, int len);
+sector_t cow_lookup(struct cow_map *m, sector_t lba, int *len);
+int cow_check(struct cow_map *m);
+
+/*
+ * One record of cow_diff(): [lba, lba + len) was mapped to old_pba on
+ * and is now mapped to new_pba on; -1 for the side that has nothing.
+ */
+enum {
+	COW_DIFF_ADDED,
+	COW_DIFF_REMOVED,
+	COW_DIFF_REMAPPED,
+};
+
+struct cow_diff {
+	int type;
+	sector_t lba;
+	__u32 len;
+	sector_t old_pba;
+	sector_t new_pba;
+};
+
+typedef int (*cow_diff_fn)(const struct cow_diff *d, void *arg);
+
+long cow_diff(struct cow_map *a, struct cow_map *b, cow_diff_fn fn, void *arg);
+
+static inline unsigned long cow_nr_extents(struct cow_map *m)
+{
+	return m->root ? m->root->size : 0;
+}
+
+#endif /* _COW_H */
@@ -0,0 +1,85 @@
+/*
+ * Dirty range tracking for delta checkpoints.
+ * See dirty.h for the overview.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include"dirty.h"
+
+int dirty_map_init(struct dirty_map *d, sector_t nr_sectors, unsigned shift)
+{
+	d->shift = shift;
+	d->nr_bits = ((unsigned long)nr_sectors + (1UL << shift) - 1) >> shift;
+	d->bits = calloc((d->nr_bits + BITS_PER_LONG - 1) / BITS_PER_LONG,
+			 sizeof(unsigned long));
+	if (!d->bits)
+		return -ENOMEM;
+	d->nr_dirty = 0;
+	return 0;
+}
+
+void dirty_map_exit(struct dirty_map *d)
+{
+	free(d->bits);
+	d->bits = NULL;
+	d->nr_bits = 0;
+	d->nr_dirty = 0;
+}
+
+void dirty_mark(struct dirty_map *d, sector_t lba, sector_t len)
+{
+	unsigned long bit, last;
+
+	if (len <= 0)
+		return;
+	bit = (unsigned long)lba >> d->shift;
+	last = (unsigned long)(lba + len - 1) >> d->shift;
+	if (last >= d->nr_bits) {
+		printf("\n %s: lba %d len %d is beyond the dirty map", __func__, lba, len);
+		last = d->nr_bits - 1;
+	}
+	for (; bit <= last; bit++) {
+		if (d->bits[bit / BITS_PER_LONG] & (1UL << (bit % BITS_PER_LONG)))
+			continue;
+		d->bits[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
+		d->nr_dirty++;
+	}
+}
+
+void dirty_clear(struct dirty_map *d)
+{
+	memset(d->bits, 0, (d->nr_bits + BITS_PER_LONG - 1) / BITS_PER_LONG *
+	       sizeof(unsigned long));
+	d->nr_dirty = 0;
+}
+
+static inline int dirty_test(struct dirty_map *d, unsigned long bit)
+{
+	return !!(d->bits[bit / BITS_PER_LONG] & (1UL << (bit % BITS_PER_LONG)));
+}
+
+/*
+ * First run of dirty granules at or after sector 'from', returned in
+ * sectors. Clean words are skipped whole. -ENOENT when there is none.
+ */
+int dirty_next_range(struct dirty_map *d, sector_t from, sector_t *start, sector_t *len)
+{
+	unsigned long bit = (unsigned long)from >> d->shift, end;
+
+	while (bit < d->nr_bits && !dirty_test(d, bit)) {
+		if (!(bit % BITS_PER_LONG) && !d->bits[bit / BITS_PER_LONG])
+			bit += BITS_PER_LONG;
+		else
+			bit++;
+	}
+	if (bit >= d->nr_bits)
+		return -ENOENT;
+	for (end = bit + 1; end < d->nr_bits && dirty_test(d, end); end++)
+		;
+	*start = bit << d->shift;
+	*len = (end - bit) << d->shift;
+	return 0;
+}
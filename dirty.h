@@ -0,0 +1,32 @@
+/*
+ * Dirty range tracking for delta checkpoints.
+ *
+ * The LBA space is cut into granules of (1 << shift) sectors with one bit
+ * each. lsdm_update_range() and lsdm_trim_range() set the bits of every
+ * granule they touch, and a checkpoint clears them all, so the set bits
+ * are what a delta checkpoint has to write out. The cost is one bit per
+ * granule and a few instructions per update, whatever the map size.
+ */
+
+#ifndef _DIRTY_H
+#define _DIRTY_H
+
+#include"extent.h"
+
+#define DIRTY_SHIFT_DEFAULT	11	/* 2048 sectors: 1MB granules */
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
+
+struct dirty_map {
+	unsigned long *bits;
+	unsigned long nr_bits;
+	unsigned shift;
+	unsigned long nr_dirty;		/* bits set */
+};
+
+int dirty_map_init(struct dirty_map *d, sector_t nr_sectors, unsigned shift);
+void dirty_map_exit(struct dirty_map *d);
+void dirty_mark(struct dirty_map *d, sector_t lba, sector_t len);
+void dirty_clear(struct dirty_map *d);
+int dirty_next_range(struct dirty_map *d, sector_t from, sector_t *start, sector_t *len);
+
+#endif /* _DIRTY_H */
@@ -0,0 +1,1024 @@
+/*
+ * Extent map management, moved out of rbtree_test.c so that other
+ * components (segment accounting, allocators, checkpoints) can share it.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<errno.h>
+#include<assert.h>
+#include<string.h>
+#include<time.h>
+#include"extent.h"
+#include"segment.h"
+#include"dirty.h"
+#include"rbstats.h"
+#include"rbprobe.h"
+
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+
+/*
+ * Overwrites covering at least this many extents detach them with
+ * rb_erase_range() instead of one rb_erase() each.
+ */
+#define ERASE_RANGE_MIN	32
+
+int _stl_verbose;
+
+void extent_init(struct extent *e, sector_t lba, sector_t pba, unsigned len)
+{
+        memset(e, 0, sizeof(*e));
+        e->lba = lba;
+        e->pba = pba;
+        e->len = len;
+}
+
+void extent_map_init(struct extent_map *map)
+{
+	map->extent_tbl_root = RB_ROOT;
+	map->n_extents = 0;
+	map->gen = 0;
+	map->sit = NULL;
+	map->pool = NULL;
+	map->dirty = NULL;
+}
+
+void extent_pool_init(struct extent_pool *pool)
+{
+	pool->chunks = NULL;
+	pool->cur = NULL;
+	pool->used = 0;
+	pool->free_list = NULL;
+	pool->nr_chunks = 0;
+}
+
+/* Take back every extent at once; the chunks stay around for reuse */
+void extent_pool_reset(struct extent_pool *pool)
+{
+	pool->cur = pool->chunks;
+	pool->used = 0;
+	pool->free_list = NULL;
+}
+
+void extent_pool_exit(struct extent_pool *pool)
+{
+	struct extent_chunk *c, *next;
+
+	for (c = pool->chunks; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	extent_pool_init(pool);
+}
+
+static struct extent *extent_pool_alloc(struct extent_pool *pool)
+{
+	struct extent *e = pool->free_list;
+	struct extent_chunk *c;
+
+	if (e) {
+		pool->free_list = rb_entry_safe(e->rb.rb_right, struct extent, rb);
+		return e;
+	}
+	if (!pool->cur || pool->used == EXTENT_POOL_CHUNK) {
+		c = pool->cur ? pool->cur->next : pool->chunks;
+		if (!c) {
+			c = malloc(sizeof(*c));
+			if (unlikely(!c))
+				return NULL;
+			c->next = NULL;
+			if (pool->cur)
+				pool->cur->next = c;
+			else
+				pool->chunks = c;
+			pool->nr_chunks++;
+		}
+		pool->cur = c;
+		pool->used = 0;
+	}
+	return &pool->cur->extents[pool->used++];
+}
+
+static inline void extent_pool_free(struct extent_pool *pool, struct extent *e)
+{
+	e->rb.rb_right = pool->free_list ? &pool->free_list->rb : NULL;
+	pool->free_list = e;
+}
+
+struct extent *extent_alloc(struct extent_map *map)
+{
+	if (map->pool)
+		return extent_pool_alloc(map->pool);
+	return malloc(sizeof(struct extent));
+}
+
+void extent_free(struct extent_map *map, struct extent *e)
+{
+	map->gen++;
+	if (map->pool)
+		extent_pool_free(map->pool, e);
+	else
+		free(e);
+}
+
+static void extent_release(struct rb_node *node, void *arg)
+{
+	free(rb_entry(node, struct extent, rb));
+}
+
+/*
+ * Drop every extent of the map without rebalancing. A pooled map gets its
+ * pool rewound in O(1), so the pool must not be shared with another map;
+ * otherwise the extents are freed in one postorder pass.
+ */
+void extent_map_destroy(struct extent_map *map)
+{
+	if (map->pool) {
+		extent_pool_reset(map->pool);
+		map->extent_tbl_root = RB_ROOT;
+	} else {
+		rb_destroy(&map->extent_tbl_root, extent_release, NULL);
+	}
+	map->n_extents = 0;
+	map->gen++;
+}
+
+/* The sectors [pba, pba + len) no longer hold live data */
+static inline void extent_inval(struct extent_map *map, sector_t pba, __u32 len)
+{
+	if (map->sit)
+		seg_inval(map->sit, pba, len);
+}
+
+/* find a map entry containing 'lba' or the next higher entry.
+ * see Documentation/rbtree.txt
+ */
+static struct extent *_stl_rb_geq(struct rb_root *root, off_t lba)
+{
+	struct rb_node *node = root->rb_node;  /* top of the tree */
+	struct extent *higher = NULL;
+	struct extent *e = NULL;
+	unsigned long visited = 0;
+
+	rb_stat_inc(lookups);
+	while (node) {
+		visited++;
+		rb_stat_inc(lookup_nodes);
+		rb_stat_max(max_lookup_nodes, visited);
+		e = container_of(node, struct extent, rb);
+		if (e->lba >= lba && (!higher || e->lba < higher->lba)) {
+			higher = e;
+		}
+		if (lba < e->lba) {
+			node = node->rb_left;
+		} else {
+			if (lba >= e->lba + e->len) {
+				node = node->rb_right;
+			} else {
+				/* lba falls within "e"
+				 * (lba >= e->lba) && (lba < (e->lba + e->len)) */
+				return e;
+			}
+		}
+	}
+	return higher;
+}
+
+/* find the last map entry that starts below 'lba' */
+static struct extent *_stl_rb_below(struct rb_root *root, off_t lba)
+{
+	struct rb_node *node = root->rb_node;
+	struct extent *lower = NULL;
+	struct extent *e;
+
+	while (node) {
+		e = rb_entry(node, struct extent, rb);
+		if (e->lba < lba) {
+			lower = e;
+			node = node->rb_right;
+		} else {
+			node = node->rb_left;
+		}
+	}
+	return lower;
+}
+
+struct extent *lsdm_rb_next(struct extent *e)
+{
+	struct rb_node *node = rb_next(&e->rb);
+	return (node == NULL) ? NULL : container_of(node, struct extent, rb);
+}
+
+struct extent *lsdm_rb_prev(struct extent *e)
+{
+        struct rb_node *node = rb_prev(&e->rb);
+        return (node == NULL) ? NULL : container_of(node, struct extent, rb);
+}
+
+
+/* Same order as _stl_rb_geq(): the first extent that ends above 'lba' */
+static int extent_cmp_lba(const void *key, const struct rb_node *node)
+{
+	const struct extent *e = rb_entry(node, struct extent, rb);
+	off_t lba = *(const off_t *)key;
+
+	if (lba < e->lba)
+		return -1;
+	return lba >= e->lba + e->len;
+}
+
+/* Position 'it' on the extent holding 'lba' or the next higher one */
+struct extent *extent_iter_seek(struct extent_map *map, struct rb_iter *it, off_t lba)
+{
+	return rb_entry_safe(rb_iter_seek(it, &map->extent_tbl_root, &lba,
+					  extent_cmp_lba), struct extent, rb);
+}
+
+struct extent *stl_rb_geq(struct extent_map *map, off_t lba)
+{
+	struct extent *e = NULL;
+
+	rb_probe1(lsdm, lookup_entry, lba);
+	e = _stl_rb_geq(&map->extent_tbl_root, lba);
+	rb_probe2(lsdm, lookup_return, lba, e ? (long)e->lba : -1L);
+	return e;
+}
+
+/*
+ * Answer _stl_rb_geq() from the finger and its immediate neighbours.
+ * Returns 1 and sets *res (possibly to NULL: nothing at or above lba)
+ * when that was enough, 0 when the caller has to descend from the root.
+ */
+static int finger_geq(struct extent_map *map, struct extent_finger *f,
+		      off_t lba, struct extent **res)
+{
+	struct extent *e = f->e, *n;
+
+	if (!e || f->gen != map->gen)
+		return 0;
+
+	if (lba >= e->lba) {
+		if (lba < e->lba + e->len) {
+			f->hits++;
+			*res = e;
+			return 1;
+		}
+		n = lsdm_rb_next(e);
+		if (!n || lba < n->lba + n->len) {
+			f->near_hits++;
+			*res = n;
+			return 1;
+		}
+		return 0;
+	}
+	n = lsdm_rb_prev(e);
+	if (!n || lba >= n->lba + n->len) {
+		/* lba sits in the hole just below e */
+		f->near_hits++;
+		*res = e;
+		return 1;
+	}
+	if (lba >= n->lba) {
+		f->near_hits++;
+		*res = n;
+		return 1;
+	}
+	return 0;
+}
+
+static inline void finger_set(struct extent_map *map, struct extent_finger *f,
+			      struct extent *e)
+{
+	if (!f)
+		return;
+	f->e = e;
+	f->gen = map->gen;
+}
+
+struct extent *stl_rb_geq_finger(struct extent_map *map, struct extent_finger *f, off_t lba)
+{
+	struct extent *e;
+
+	if (!finger_geq(map, f, lba, &e)) {
+		f->misses++;
+		e = _stl_rb_geq(&map->extent_tbl_root, lba);
+	}
+	/* Keep pointing at something when we run off the end of the map */
+	if (e)
+		finger_set(map, f, e);
+	return e;
+}
+
+
+static int check_node_contents(struct rb_node *node)
+{
+	int ret = 0;
+	struct extent *e, *next, *prev;
+
+	if (!node)
+		return -1;
+
+	e = rb_entry(node, struct extent, rb);
+
+	if (e->lba < 0) {
+		printf("\n LBA is <=0, tree corrupt!! \n");
+		return -1;
+	}
+	if (e->pba < 0) {
+		printf("\n PBA is <=0, tree corrupt!! \n");
+		return -1;
+	}
+	if (e->len <= 0) {
+		printf("\n len is <=0, tree corrupt!! \n");
+		return -1;
+	}
+
+	next = lsdm_rb_next(e);
+	prev = lsdm_rb_prev(e);
+
+	if (next  && next->lba == e->lba) {
+		printf("\n LBA corruption (next) ! lba: %d is present in two nodes!", next->lba);
+		printf("\n next->lba: %d next->pba: %d next->len: %d", next->lba, next->pba, next->len);
+		return -1;
+	}
+
+	if (next && e->lba + e->len == next->lba) {
+		if (e->pba + e->len == next->pba) {
+			printf("\n Nodes not merged! ");
+			printf("\n e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
+			printf("\n next->lba: %d next->pba: %d next->len: %d", next->lba, next->pba, next->len);
+			return -1;
+		}
+	}
+
+	if (prev && prev->lba == e->lba) {
+		printf("\n LBA corruption (prev)! lba: %d is present in two nodes!", prev->lba);
+		return -1;
+	}
+
+	if (prev && prev->lba + prev->len == e->lba) {
+		if (prev->pba + prev->len == e->pba) {
+			printf("\n Nodes not merged! ");
+			printf("\n e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
+			printf("\n prev->lba: %d prev->pba: %d prev->len: %d", prev->lba, prev->pba, prev->len);
+			return -1;
+
+		}
+	}
+
+	if(node->rb_left)
+		ret = check_node_contents(node->rb_left);
+
+	if (ret < 0)
+		return ret;
+
+	if (node->rb_right)
+		ret = check_node_contents(node->rb_right);
+
+	return ret;
+
+}
+
+int lsdm_tree_check(struct extent_map *map)
+{
+	struct rb_node *node = map->extent_tbl_root.rb_node;
+	int ret = 0;
+
+	ret = check_node_contents(node);
+	printf("\n");
+	return ret;
+
+}
+
+
+static void lsdm_rb_remove(struct extent_map *map, struct extent *e)
+{
+	struct rb_root *root = &map->extent_tbl_root;
+	rb_erase(&e->rb, root);
+	map->n_extents--;
+}
+
+/*
+ * Drop every extent from 'first' to 'last' with one split and join of the
+ * tree, then invalidate and free them.
+ */
+static void lsdm_rb_erase_range(struct extent_map *map, struct extent *first,
+				struct extent *last)
+{
+	struct rb_root detached;
+	struct extent *e, *n;
+
+	rb_erase_range(&first->rb, &last->rb, &map->extent_tbl_root, &detached);
+	rbtree_postorder_for_each_entry_safe(e, n, &detached, rb) {
+		stl_dbg("\n case3 ! e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
+		extent_inval(map, e->pba, e->len);
+		map->n_extents--;
+		extent_free(map, e);
+	}
+}
+
+/* Check if we can be merged with the left or the right node */
+static struct extent *merge(struct extent_map *map, struct extent *e)
+{
+	struct extent *prev, *next;
+
+	rb_probe2(lsdm, merge_entry, e->lba, e->len);
+	prev = lsdm_rb_prev(e);
+	next = lsdm_rb_next(e);
+	if (prev) {
+		if(prev->lba + prev->len == e->lba) {
+			if (prev->pba + prev->len == e->pba) {
+				prev->len += e->len;
+				lsdm_rb_remove(map, e);
+				extent_free(map, e);
+				e = prev;
+			}
+		}
+
+	}
+	if (next) {
+		if (next->lba == e->lba + e->len) {
+			if (next->pba == e->pba + e->len) {
+				e->len += next->len;
+				lsdm_rb_remove(map, next);
+				extent_free(map, next);
+			}
+		}
+	}
+	rb_probe2(lsdm, merge_return, e->lba, e->len);
+	return e;
+}
+
+
+static int check_no_overlap(struct extent_map *map, struct extent * new)
+{
+	struct rb_node *node = map->extent_tbl_root.rb_node;  /* top of the tree */
+	struct extent *e = NULL, *next;
+	struct rb_iter it;
+
+	if (!node)
+		return 0;
+
+	/* Start from the smallest node that overlaps*/
+	for (node = rb_iter_first(&it, &map->extent_tbl_root); node; node = rb_iter_next(&it)) {
+		next = rb_entry(node, struct extent, rb);
+		printf("\n lba: %d pba: %d len: %d ", next->lba, next->pba, next->len);
+		if (next->lba >= (new->lba + new->len))
+			break;
+		e = next;
+	}
+	if (!e)
+		return 0;
+
+	if((e->lba + e->len) <= new->lba)
+		/* does not overlap */
+		return 0;
+	else
+		return -1;
+}
+
+
+/*
+ * Link 'new' and merge it with its neighbours. If 'res' is given it is
+ * set to the extent that 'new' ended up in.
+ */
+static int lsdm_rb_insert(struct extent_map *map, struct extent *new,
+			  struct extent **res)
+{
+	struct rb_root *root = &map->extent_tbl_root;
+	struct rb_node **link = &root->rb_node, *parent = NULL;
+	struct extent *e = NULL;
+	unsigned long depth = 0;
+	int ret = 0;
+
+	rb_probe3(lsdm, insert_entry, new->lba, new->len, 0);
+	RB_CLEAR_NODE(&new->rb);
+
+	if (_stl_verbose) {
+		ret = check_no_overlap(map, new);
+		if (ret < 0)
+			return ret;
+
+		printf("\n checked okay!");
+	}
+
+
+	/* Go to the bottom of the tree */
+	while (*link) {
+		depth++;
+		parent = *link;
+		e = rb_entry(parent, struct extent, rb);
+		if ((new->lba + new->len) <= e->lba) {
+			link = &(*link)->rb_left;
+		} else if (new->lba >= (e->lba + e->len)){
+			link = &(*link)->rb_right;
+		} else {
+			/* overlapping indicates (new->lba >= e->lba)
+			 */
+				printf("\n Overlapping node found 2!");
+				printf("\n e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
+				printf("\n new->lba: %d new->pba: %d new->len: %d \n", new->lba, new->pba, new->len);
+				exit(-1);
+		}
+	}
+	rb_stat_inc(inserts);
+	rb_stat_add(insert_depth, depth);
+	rb_stat_max(max_insert_depth, depth);
+	/* Put the new node there */
+	rb_link_node(&new->rb, parent, link);
+	rb_insert_color(&new->rb, root);
+	map->n_extents++;
+	e = merge(map, new);
+	if (res)
+		*res = e;
+	rb_probe3(lsdm, insert_return, e->lba, e->len, depth);
+	if (_stl_verbose) {
+		ret = lsdm_tree_check(map);
+		if (ret < 0) {
+			printf("\n !!!! Corruption while Inserting: lba: %d pba: %d len: %d", new->lba, new->pba, new->len);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * lsdm_rb_insert() for callers that know where 'new' goes: 'next' is the
+ * first extent above it, or NULL when 'new' goes after 'prev', the last
+ * extent of the map. No descent from the root is needed.
+ */
+static int lsdm_rb_insert_hint(struct extent_map *map, struct extent *new,
+			       struct extent *prev, struct extent *next,
+			       struct extent **res)
+{
+	struct rb_root *root = &map->extent_tbl_root;
+	struct extent *e;
+	int ret;
+
+	rb_probe3(lsdm, insert_entry, new->lba, new->len, 1);
+	RB_CLEAR_NODE(&new->rb);
+
+	if (_stl_verbose) {
+		ret = check_no_overlap(map, new);
+		if (ret < 0)
+			return ret;
+
+		printf("\n checked okay!");
+	}
+
+	if (next)
+		rb_insert_before(&new->rb, &next->rb, root);
+	else
+		rb_insert_after(&new->rb, prev ? &prev->rb : NULL, root);
+	map->n_extents++;
+	e = merge(map, new);
+	if (res)
+		*res = e;
+	rb_probe3(lsdm, insert_return, e->lba, e->len, 0);
+	if (_stl_verbose) {
+		ret = lsdm_tree_check(map);
+		if (ret < 0) {
+			printf("\n !!!! Corruption while Inserting: lba: %d pba: %d len: %d", new->lba, new->pba, new->len);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Update mapping. Removes any total overlaps, edits any partial
+ * overlaps, adds new extent to map.
+ */
+int lsdm_update_range(struct extent_map *map, sector_t lba, sector_t pba, int len)
+{
+	return lsdm_update_range_finger(map, NULL, lba, pba, len);
+}
+
+/*
+ * The body of lsdm_update_range_finger(). The overwrite cases it went
+ * through are or'ed into '*cases' as 1 << case, for the return probe.
+ */
+static int __lsdm_update_range_finger(struct extent_map *map, struct extent_finger *f,
+				      sector_t lba, sector_t pba, int len, int *cases)
+{
+	struct extent *e = NULL, *new = NULL, *split = NULL, *next=NULL, *prev=NULL;
+	struct extent *tmp = NULL, *ins = NULL, *hint_prev = NULL, *last = NULL;
+	struct rb_node *node = map->extent_tbl_root.rb_node;  /* top of the tree */
+	int diff = 0;
+	int i=0;
+	int ret=0;
+	int flag = 0;
+	int hinted = 0;
+	unsigned long visited = 0;
+	struct extent olde;
+
+	assert(len != 0);
+
+	//printf("\n %s lba: %d, pba: %d, len:%ld ", __func__, lba, pba, len);
+	stl_dbg("\n ---------------------\n");
+	new = extent_alloc(map);
+	if (unlikely(!new)) {
+		return -ENOMEM;
+	}
+	extent_init(new, lba, pba, len);
+	/* The new sectors are valid before the ones they replace go */
+	if (map->sit)
+		seg_add_valid(map->sit, pba, len);
+	if (map->dirty)
+		dirty_mark(map->dirty, lba, len);
+	if (f && finger_geq(map, f, lba, &e)) {
+		/* e is the lowest extent that could overlap */
+		hinted = 1;
+		hint_prev = e ? NULL : f->e;
+		node = (e && e->lba < lba + len) ? &e->rb : NULL;
+	} else if (f) {
+		f->misses++;
+	}
+	if (!hinted)
+		rb_stat_inc(lookups);
+	while (node) {
+		if (!hinted) {
+			visited++;
+			rb_stat_inc(lookup_nodes);
+			rb_stat_max(max_lookup_nodes, visited);
+		}
+		e = rb_entry(node, struct extent, rb);
+		/* No overlap */
+		if ((lba + len) <= e->lba) {
+			node = node->rb_left;
+			continue;
+		}
+		if (lba >= (e->lba + e->len)) {
+			node = node->rb_right;
+			continue;
+		}
+		break;
+	}
+	/* There is no node with which this lba overlaps with */
+	if (!node) {
+		rb_stat_inc(update_case[0]);
+		*cases |= 1 << 0;
+		/* new node has to be added */
+		stl_dbg( "\n %s flag: %d Inserting (lba: %u pba: %u len: %d) ", __func__, flag, new->lba, new->pba, new->len);
+		stl_dbg("\n----------------- \n");
+		if (hinted)
+			/* e is the next extent above us, if any */
+			ret = lsdm_rb_insert_hint(map, new, hint_prev, e, &ins);
+		else
+			ret = lsdm_rb_insert(map, new, &ins);
+		if (ret < 0) {
+			printf("\n Corruption in case 8!! ");
+			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
+			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
+			printf("\n");
+			exit(-1);
+		}
+		finger_set(map, f, ins);
+		return(0);
+	}
+	/* We have found a "node"  that overlaps with our lba, pba,
+	 * len trio
+	 */
+
+	 /*
+	 * Case 1: overwrite a part of the existing extent
+	 * 	++++++++++
+	 * -----------------------
+	 *
+	 *  No end matches!!
+	 */
+
+	if ((lba > e->lba)  && (lba + len < e->lba + e->len)) {
+		stl_dbg("\n case1 ! e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
+		rb_stat_inc(update_case[1]);
+		*cases |= 1 << 1;
+		split = extent_alloc(map);
+		if (!split) {
+			/* Nothing maps the new sectors after all */
+			extent_inval(map, pba, len);
+			extent_free(map, new);
+			return -ENOMEM;
+		}
+		diff =  lba - e->lba;
+		/* Initialize split before e->len changes!! */
+		extent_init(split, lba + len, e->pba + (diff + len), e->len - (diff + len));
+		/* new should be physically discontiguous
+		 */
+		//assert(e->pba + diff !=  pba);
+		extent_inval(map, e->pba + diff, len);
+		e->len = diff;
+		ret = lsdm_rb_insert(map, new, &ins);
+		if (ret < 0) {
+			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
+			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
+			printf("\n");
+			exit(-1);
+		}
+		ret = lsdm_rb_insert(map, split, NULL);
+		if (ret < 0) {
+			printf("\n Corruption in case 1!! ");
+			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
+			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
+			printf ("\n split->lba: %d split->pba: %d split->len: %d ", split->lba, split->pba, split->len);
+			printf("\n");
+			exit(-1);
+		}
+		finger_set(map, f, ins);
+		return 0;
+	}
+
+	stl_dbg ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
+	/* Start from the smallest node that overlaps*/
+	while(1) {
+		prev = lsdm_rb_prev(e);
+		if (!prev)
+			break;
+		if (prev->lba + prev->len <= lba)
+			break;
+		e = prev;
+	}
+	stl_dbg ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
+
+	/* Now we consider the overlapping "e's" in an order of
+	 * increasing LBA
+	 */
+
+	/*
+	 * Case 2: Overwrites an existing extent partially;
+	 * covers only the right portion of an existing extent (e)
+	 * 	++++++++
+	 * -----------
+	 *  e
+	 *
+	 *
+	 * 	++++++++
+	 * -------------
+	 *
+	 * (Right end of e1 and + could match!)
+	 *
+	 */
+	if ((lba > e->lba) && ((lba + len) >= (e->lba + e->len)) && (lba < (e->lba + e->len))) {
+		extent_inval(map, e->pba + (lba - e->lba), e->lba + e->len - lba);
+		e->len = lba - e->lba;
+		e = lsdm_rb_next(e);
+		flag = 1;
+		rb_stat_inc(update_case[2]);
+		*cases |= 1 << 2;
+		/*
+		 *  process the next overlapping segments!
+		 *  Fall through to the next case.
+		 */
+	}
+
+	/*
+	 * Case 3: Overwrite many extents completely
+	 *	++++++++++++++++++++
+	 *	  ----- ------  --------
+	 *
+	 * Could also be exact same:
+	 * 	+++++
+	 * 	-----
+	 * We need to remove all such e
+	 *
+	 * here we compare left ends and right ends of
+	 * new and existing node e
+	 */
+	if ((e!=NULL) && (lba <= e->lba) && ((lba + len) >= (e->lba + e->len))) {
+		rb_stat_inc(update_case[3]);
+		*cases |= 1 << 3;
+		/* The covered extents run from e up to the last one that
+		 * starts below our end and does not stick out of it
+		 */
+		last = _stl_rb_below(&map->extent_tbl_root, lba + len);
+		if (last->lba + last->len > lba + len)
+			last = lsdm_rb_prev(last);
+		/* A handful of extents are cheaper to erase one by one */
+		for (tmp = e, i = 0; tmp != last && i < ERASE_RANGE_MIN; i++)
+			tmp = lsdm_rb_next(tmp);
+		if (tmp != last) {
+			tmp = lsdm_rb_next(last);
+			lsdm_rb_erase_range(map, e, last);
+			e = tmp;
+		}
+	}
+	while ((e!=NULL) && (lba <= e->lba) && ((lba + len) >= (e->lba + e->len))) {
+		stl_dbg("\n case3 ! e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
+		tmp = lsdm_rb_next(e);
+		extent_inval(map, e->pba, e->len);
+		lsdm_rb_remove(map, e);
+		extent_free(map, e);
+		e = tmp;
+	}
+	if (!e || (e->lba >= (lba + len)))  {
+		/* No overlap with any more e */
+		if (e)
+			ret = lsdm_rb_insert_hint(map, new, NULL, e, &ins);
+		else
+			ret = lsdm_rb_insert(map, new, &ins);
+		if (ret < 0) {
+			printf("\n Corruption in case 3!! ");
+			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
+			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
+			printf("\n");
+			exit(-1);
+		}
+		finger_set(map, f, ins);
+		return 0;
+	}
+	/* else fall down to the next case for the last
+	 * component that overwrites an extent partially
+	 */
+
+	/*
+	 * Case 4:
+	 * Partially overwrite an extent
+	 * ++++++++++
+	 * 	-------------- OR
+	 *
+	 * Left end of + and - matches!
+	 * +++++++
+	 * --------------
+	 *
+	 */
+	if ((lba <= e->lba) && (lba + len > e->lba) && (lba + len < e->lba + e->len))  {
+		stl_dbg("\n case4 ! e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
+		rb_stat_inc(update_case[4]);
+		*cases |= 1 << 4;
+		diff = lba + len - e->lba;
+		lsdm_rb_remove(map, e);
+		extent_inval(map, e->pba, diff);
+		e->lba = e->lba + diff;
+		e->len = e->len - diff;
+		e->pba = e->pba + diff;
+		stl_dbg("\n e snipped! e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
+		ret = lsdm_rb_insert(map, new, &ins);
+		if (ret < 0) {
+			printf("\n Corruption in case 4!! ");
+			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
+			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
+			printf("\n");
+			exit(-1);
+		}
+		ret = lsdm_rb_insert(map, e, NULL);
+		if (ret < 0) {
+			printf("\n Corruption in case 4!! ");
+			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
+			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
+			printf("\n");
+			exit(-1);
+		}
+		finger_set(map, f, ins);
+		return(0);
+	}
+
+	/* If you are here then you haven't covered some
+	 * case!
+	 */
+	printf("\n why are you here ? flag: %d", flag);
+	printf("\n %s lba: %d, pba: %d, len:%d ", __func__, lba, pba, len);
+	if (flag)
+		printf("\n %s olde.lba: %d, olde.pba: %d, olde.len:%d ", __func__, olde.lba, olde.pba, olde.len);
+	printf("\n %s e->lba: %d, e->pba: %d, e->len:%d ", __func__, e->lba, e->pba, e->len);
+	printf("\n");
+	exit(-1);
+
+	return 0;
+}
+
+/*
+ * lsdm_update_range() that looks for the overlapping extents around the
+ * finger first, and leaves the finger on the extent holding 'lba'.
+ */
+int lsdm_update_range_finger(struct extent_map *map, struct extent_finger *f,
+			     sector_t lba, sector_t pba, int len)
+{
+	int cases = 0, ret;
+
+	rb_probe3(lsdm, update_entry, lba, pba, len);
+	ret = __lsdm_update_range_finger(map, f, lba, pba, len, &cases);
+	rb_probe3(lsdm, update_return, lba, cases, ret);
+	return ret;
+}
+
+/*
+ * Unmap [lba, lba + len): extents inside the range go, extents that
+ * straddle one of its ends are trimmed, and one that covers the whole
+ * range is split in two around it.
+ */
+int lsdm_trim_range(struct extent_map *map, sector_t lba, int len)
+{
+	struct extent *e, *next, *split;
+	sector_t end = lba + len, d;
+
+	if (len <= 0)
+		return -EINVAL;
+	if (map->dirty)
+		dirty_mark(map->dirty, lba, len);
+
+	e = _stl_rb_geq(&map->extent_tbl_root, lba);
+	for (; e && e->lba < end; e = next) {
+		next = lsdm_rb_next(e);
+		if (e->lba < lba) {
+			if (e->lba + e->len > end) {
+				split = extent_alloc(map);
+				if (unlikely(!split))
+					return -ENOMEM;
+				d = end - e->lba;
+				extent_init(split, end, e->pba + d, e->len - d);
+				rb_insert_after(&split->rb, &e->rb, &map->extent_tbl_root);
+				map->n_extents++;
+				extent_inval(map, e->pba + (lba - e->lba), len);
+				e->len = lba - e->lba;
+				break;
+			}
+			extent_inval(map, e->pba + (lba - e->lba), e->lba + e->len - lba);
+			e->len = lba - e->lba;
+		} else if (e->lba + e->len > end) {
+			d = end - e->lba;
+			extent_inval(map, e->pba, d);
+			e->lba = end;
+			e->pba += d;
+			e->len -= d;
+			break;
+		} else {
+			extent_inval(map, e->pba, e->len);
+			lsdm_rb_remove(map, e);
+			extent_free(map, e);
+		}
+	}
+	return 0;
+}
+
+static inline unsigned long long coalesce_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Fold 'n' into 'e' if it continues it both in LBA and in PBA */
+static int coalesce_pair(struct extent_map *map, struct extent *e, struct extent *n)
+{
+	if (e->lba + e->len != n->lba || e->pba + e->len != n->pba)
+		return 0;
+	e->len += n->len;
+	lsdm_rb_remove(map, n);
+	extent_free(map, n);
+	return 1;
+}
+
+/*
+ * One slice of the background coalescing pass: starting at c->next_lba,
+ * fold every extent that continues its predecessor both in LBA and in PBA
+ * into that predecessor. The slice stops after 'max_steps' extents or
+ * once 'budget_ns' has gone by (0: no limit), leaving c->next_lba on the
+ * first extent not yet compared with its successor, where the next slice
+ * picks up; the map may change freely in between. At the
+ * end of the map the cursor wraps to 0 and c->passes is bumped.
+ *
+ * Segment accounting is untouched: merged extents cover the same sectors.
+ * Returns the number of extents freed in this slice.
+ */
+int lsdm_coalesce(struct extent_map *map, struct extent_coalesce *c,
+		  int max_steps, unsigned long long budget_ns)
+{
+	unsigned long long deadline = 0;
+	struct extent *e, *n, *p;
+	int steps = 0, merged = 0;
+
+	if (budget_ns)
+		deadline = coalesce_now_ns() + budget_ns;
+
+	e = _stl_rb_geq(&map->extent_tbl_root, c->next_lba);
+	/* An update since the last slice may have made e continue its predecessor */
+	p = e ? lsdm_rb_prev(e) : NULL;
+	if (p && coalesce_pair(map, p, e)) {
+		e = p;
+		merged++;
+		steps++;
+	}
+
+	while (e && steps < max_steps) {
+		n = lsdm_rb_next(e);
+		if (!n)
+			break;
+		if (coalesce_pair(map, e, n))
+			merged++;
+		else
+			e = n;
+		/* Reading the clock costs more than a step, so not every time */
+		if (!(++steps & 15) && deadline && coalesce_now_ns() >= deadline)
+			break;
+	}
+
+	c->merged += merged;
+	if (e && lsdm_rb_next(e)) {
+		c->next_lba = e->lba;
+	} else {
+		c->next_lba = 0;
+		c->passes++;
+	}
+	return merged;
+}
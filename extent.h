@@ -0,0 +1,143 @@
+/*
+ * In-memory LBA -> PBA extent map of the log structured device mapper.
+ *
+ * Extents are kept in an rbtree sorted by LBA. Physically contiguous
+ * neighbours are merged on insert, so the map never holds two extents
+ * that could be described by one.
+ */
+
+#ifndef _EXTENT_H
+#define _EXTENT_H
+
+#include<sys/types.h>
+#include<linux/types.h>
+#include"rbtree.h"
+
+typedef int sector_t;
+
+struct seg_tbl;
+struct dirty_map;
+
+/* total size = xx bytes (64b). fits in 1 cache line
+   for 32b is xx bytes, fits in ARM cache line */
+struct extent {
+        struct rb_node rb;      /* 20 bytes */
+        sector_t lba;           /* 512B LBA */
+        sector_t pba;
+        __u32      len;
+}; /* xx bytes including padding after 'rb', xx on 32-bit */
+
+#define EXTENT_POOL_CHUNK	4096	/* extents per pool chunk */
+
+struct extent_chunk {
+	struct extent_chunk *next;
+	struct extent extents[EXTENT_POOL_CHUNK];
+};
+
+/*
+ * Slab of extents for one map. Chunks are carved in list order and freed
+ * extents are kept on a list threaded through rb.rb_right. Emptying the
+ * pool only rewinds it to the first chunk, so it costs O(1) however many
+ * extents it handed out.
+ */
+struct extent_pool {
+	struct extent_chunk *chunks;
+	struct extent_chunk *cur;	/* chunk being carved */
+	unsigned used;			/* extents carved from 'cur' */
+	struct extent *free_list;
+	unsigned long nr_chunks;
+};
+
+struct extent_map {
+	struct rb_root extent_tbl_root;
+	int n_extents;
+	unsigned long gen;	/* bumped whenever an extent is freed */
+	struct seg_tbl *sit;	/* optional valid-block accounting */
+	struct extent_pool *pool;	/* optional, else malloc/free */
+	struct dirty_map *dirty;	/* optional, for delta checkpoints */
+};
+
+/*
+ * Per caller cache of the last extent touched. Sequential I/O lands in
+ * that extent or one of its neighbours, which saves the root descent.
+ * The finger goes stale as soon as any extent of the map is freed.
+ */
+struct extent_finger {
+	struct extent *e;
+	unsigned long gen;		/* map->gen when 'e' was recorded */
+	unsigned long hits;		/* answered by 'e' itself */
+	unsigned long near_hits;	/* answered by rb_next/rb_prev of 'e' */
+	unsigned long misses;		/* descended from the root */
+};
+
+/* Where an incremental lsdm_coalesce() pass resumes */
+struct extent_coalesce {
+	sector_t next_lba;
+	unsigned long merged;		/* extents freed so far */
+	unsigned long passes;		/* times the whole map was covered */
+};
+
+static inline void extent_coalesce_init(struct extent_coalesce *c)
+{
+	c->next_lba = 0;
+	c->merged = 0;
+	c->passes = 0;
+}
+
+/* Non zero: trace every update and check the whole tree after each insert */
+extern int _stl_verbose;
+
+#define stl_dbg(...) do {			\
+	if (_stl_verbose)			\
+		printf(__VA_ARGS__);		\
+} while (0)
+
+void extent_init(struct extent *e, sector_t lba, sector_t pba, unsigned len);
+void extent_map_init(struct extent_map *map);
+void extent_map_destroy(struct extent_map *map);
+
+void extent_pool_init(struct extent_pool *pool);
+void extent_pool_reset(struct extent_pool *pool);
+void extent_pool_exit(struct extent_pool *pool);
+struct extent *extent_alloc(struct extent_map *map);
+void extent_free(struct extent_map *map, struct extent *e);
+
+static inline void extent_finger_init(struct extent_finger *f)
+{
+	f->e = NULL;
+	f->gen = 0;
+	f->hits = f->near_hits = f->misses = 0;
+}
+
+struct extent *stl_rb_geq(struct extent_map *map, off_t lba);
+struct extent *stl_rb_geq_finger(struct extent_map *map, struct extent_finger *f, off_t lba);
+struct extent *lsdm_rb_next(struct extent *e);
+struct extent *lsdm_rb_prev(struct extent *e);
+
+/* In-order scans without parent pointer walks, see struct rb_iter */
+struct extent *extent_iter_seek(struct extent_map *map, struct rb_iter *it, off_t lba);
+
+static inline struct extent *extent_iter_first(struct extent_map *map, struct rb_iter *it)
+{
+	return rb_entry_safe(rb_iter_first(it, &map->extent_tbl_root), struct extent, rb);
+}
+
+static inline struct extent *extent_iter_next(struct rb_iter *it)
+{
+	return rb_entry_safe(rb_iter_next(it), struct extent, rb);
+}
+
+static inline struct extent *extent_iter_prev(struct rb_iter *it)
+{
+	return rb_entry_safe(rb_iter_prev(it), struct extent, rb);
+}
+
+int lsdm_update_range(struct extent_map *map, sector_t lba, sector_t pba, int len);
+int lsdm_update_range_finger(struct extent_map *map, struct extent_finger *f,
+			     sector_t lba, sector_t pba, int len);
+int lsdm_trim_range(struct extent_map *map, sector_t lba, int len);
+int lsdm_tree_check(struct extent_map *map);
+int lsdm_coalesce(struct extent_map *map, struct extent_coalesce *c,
+		  int max_steps, unsigned long long budget_ns);
+
+#endif /* _EXTENT_H */
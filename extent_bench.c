@@ -0,0 +1,1744 @@
+/*
+ * Micro benchmarks for the extent map, replaying the traces from
+ * rbtree_array.h.
+ *
+ *	./extent_bench [test] [rounds]
+ *
+ * With no arguments every test is run.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<unistd.h>
+#include"rbtree.h"
+#include"rbtree_array.h"
+#include"extent.h"
+#include"update_buf.h"
+#include"pmap.h"
+#include"checkpoint.h"
+#include"dirty.h"
+#include"wal.h"
+#include"paged.h"
+#include"shard.h"
+#include"rangelock.h"
+#include"actor.h"
+#include"seqmap.h"
+#include"cow.h"
+#include"union.h"
+#include"rbstats.h"
+
+#define NR_TRIO		(sizeof(trio) / sizeof(trio[0]))
+#define COPIES		16
+#define COPY_LBA_SPAN	40000000	/* above the highest LBA in trio[] */
+#define COPY_PBA_SPAN	2000000
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A trio[] entry is sequential if it starts where the previous one ended */
+static int trio_sequential(int i)
+{
+	return i && trio[i][0] == trio[i - 1][0] + trio[i - 1][2];
+}
+
+struct split_time {
+	unsigned long long seq_ns, rand_ns;
+	unsigned long seq_ops, rand_ops;
+};
+
+static inline void split_add(struct split_time *t, int seq, unsigned long long ns)
+{
+	if (seq) {
+		t->seq_ns += ns;
+		t->seq_ops++;
+	} else {
+		t->rand_ns += ns;
+		t->rand_ops++;
+	}
+}
+
+static void split_print(const char *what, struct split_time *t)
+{
+	printf("  %-28s seq: %7.1f ns/op  random: %7.1f ns/op\n", what,
+	       t->seq_ops ? (double)t->seq_ns / t->seq_ops : 0.0,
+	       t->rand_ops ? (double)t->rand_ns / t->rand_ops : 0.0);
+}
+
+static void replay_trio(struct extent_map *map, struct extent_finger *f,
+			struct split_time *t)
+{
+	unsigned long long start;
+	int c, i;
+
+	for (c = 0; c < COPIES; c++) {
+		for (i = 0; i < NR_TRIO; i++) {
+			sector_t lba = trio[i][0] + c * COPY_LBA_SPAN;
+			sector_t pba = trio[i][1] + c * COPY_PBA_SPAN;
+
+			start = now_ns();
+			if (f)
+				lsdm_update_range_finger(map, f, lba, pba, trio[i][2]);
+			else
+				lsdm_update_range(map, lba, pba, trio[i][2]);
+			split_add(t, trio_sequential(i), now_ns() - start);
+		}
+	}
+}
+
+/* Read every 4K block of every trio[] extent, in trace order */
+static unsigned long scan_trio(struct extent_map *map, struct extent_finger *f,
+			       struct split_time *t)
+{
+	unsigned long long start;
+	unsigned long sum = 0;
+	struct extent *e;
+	sector_t lba;
+	int c, i;
+
+	for (c = 0; c < COPIES; c++) {
+		for (i = 0; i < NR_TRIO; i++) {
+			sector_t base = trio[i][0] + c * COPY_LBA_SPAN;
+
+			for (lba = base; lba < base + trio[i][2]; lba += 8) {
+				start = now_ns();
+				if (f)
+					e = stl_rb_geq_finger(map, f, lba);
+				else
+					e = stl_rb_geq(map, lba);
+				split_add(t, lba != base || trio_sequential(i), now_ns() - start);
+				if (e)
+					sum += e->pba;
+			}
+		}
+	}
+	return sum;
+}
+
+static void bench_finger(int rounds)
+{
+	struct extent_map map;
+	struct extent_finger f;
+	struct split_time upd_root = {0}, upd_finger = {0};
+	struct split_time rd_root = {0}, rd_finger = {0};
+	unsigned long sum_root = 0, sum_finger = 0;
+	unsigned long hits = 0, near_hits = 0, misses = 0;
+	int r;
+
+	extent_map_init(&map);
+	for (r = 0; r < rounds; r++) {
+		replay_trio(&map, NULL, &upd_root);
+		sum_root += scan_trio(&map, NULL, &rd_root);
+		extent_map_destroy(&map);
+
+		extent_finger_init(&f);
+		replay_trio(&map, &f, &upd_finger);
+		extent_finger_init(&f);
+		sum_finger += scan_trio(&map, &f, &rd_finger);
+		hits += f.hits;
+		near_hits += f.near_hits;
+		misses += f.misses;
+		extent_map_destroy(&map);
+	}
+
+	printf("finger: trio[] x %d copies, %d rounds, %lu%% of updates sequential\n",
+	       COPIES, rounds, upd_root.seq_ops * 100 / (upd_root.seq_ops + upd_root.rand_ops));
+	split_print("lsdm_update_range", &upd_root);
+	split_print("lsdm_update_range_finger", &upd_finger);
+	split_print("stl_rb_geq", &rd_root);
+	split_print("stl_rb_geq_finger", &rd_finger);
+	printf("  lookup finger: %lu hits, %lu neighbour hits, %lu misses (%.1f%% hit rate)\n",
+	       hits, near_hits, misses,
+	       100.0 * (hits + near_hits) / (hits + near_hits + misses));
+	if (sum_root != sum_finger)
+		printf("  !!! finger lookups returned different extents\n");
+}
+
+#define NR_APPENDS	200000
+
+/*
+ * Log structured appends: every write lands just past the last one. The
+ * PBAs leave a gap so that nothing merges and the map keeps growing.
+ */
+static void bench_append(int rounds)
+{
+	struct extent_map map;
+	struct extent_finger f;
+	unsigned long long start, root_ns = 0, hint_ns = 0;
+	int r, i;
+
+	extent_map_init(&map);
+	for (r = 0; r < rounds; r++) {
+		start = now_ns();
+		for (i = 0; i < NR_APPENDS; i++)
+			lsdm_update_range(&map, i * 8, i * 16, 8);
+		root_ns += now_ns() - start;
+		extent_map_destroy(&map);
+
+		extent_finger_init(&f);
+		start = now_ns();
+		for (i = 0; i < NR_APPENDS; i++)
+			lsdm_update_range_finger(&map, &f, i * 8, i * 16, 8);
+		hint_ns += now_ns() - start;
+		extent_map_destroy(&map);
+	}
+	printf("append: %d extents, %d rounds\n", NR_APPENDS, rounds);
+	printf("  %-28s %7.1f ns/op\n", "lsdm_update_range",
+	       (double)root_ns / rounds / NR_APPENDS);
+	printf("  %-28s %7.1f ns/op\n", "finger + rb_insert_after",
+	       (double)hint_ns / rounds / NR_APPENDS);
+}
+
+#define ERASE_EXTENTS	(1 << 20)
+
+/*
+ * Cut k consecutive extents out of a map of ERASE_EXTENTS, as case 3 of
+ * lsdm_update_range does for a large overwrite: one rb_erase per extent
+ * against a single rb_erase_range. The extents are put back, untimed,
+ * after every cut.
+ */
+static void bench_erase(int rounds)
+{
+	static const int ks[] = { 2, 16, 256, 4096, 65536 };
+	struct extent_map map;
+	struct extent **cut, *e;
+	struct rb_root detached;
+	unsigned long long start, loop_ns, range_ns;
+	int i, j, r, k, first;
+
+	extent_map_init(&map);
+	for (i = 0; i < ERASE_EXTENTS; i++)
+		lsdm_update_range(&map, i * 8, i * 16, 8);
+	cut = malloc(sizeof(*cut) * ks[sizeof(ks) / sizeof(ks[0]) - 1]);
+
+	printf("erase: k consecutive extents out of %d\n", ERASE_EXTENTS);
+	srand(30);
+	for (j = 0; j < sizeof(ks) / sizeof(ks[0]); j++) {
+		k = ks[j];
+		loop_ns = range_ns = 0;
+		for (r = 0; r < rounds; r++) {
+			first = rand() % (ERASE_EXTENTS - k);
+			for (e = stl_rb_geq(&map, first * 8), i = 0; i < k; i++, e = lsdm_rb_next(e))
+				cut[i] = e;
+
+			start = now_ns();
+			for (i = 0; i < k; i++)
+				rb_erase(&cut[i]->rb, &map.extent_tbl_root);
+			loop_ns += now_ns() - start;
+			e = stl_rb_geq(&map, first * 8);
+			for (i = k - 1; i >= 0; i--) {
+				rb_insert_before(&cut[i]->rb, e ? &e->rb : NULL, &map.extent_tbl_root);
+				e = cut[i];
+			}
+
+			start = now_ns();
+			rb_erase_range(&cut[0]->rb, &cut[k - 1]->rb, &map.extent_tbl_root, &detached);
+			range_ns += now_ns() - start;
+			e = stl_rb_geq(&map, first * 8);
+			for (i = k - 1; i >= 0; i--) {
+				rb_insert_before(&cut[i]->rb, e ? &e->rb : NULL, &map.extent_tbl_root);
+				e = cut[i];
+			}
+		}
+		printf("  k = %-6d rb_erase loop: %10.0f ns  rb_erase_range: %7.0f ns\n",
+		       k, (double)loop_ns / rounds, (double)range_ns / rounds);
+	}
+	free(cut);
+	extent_map_destroy(&map);
+}
+
+#define TEARDOWN_EXTENTS	(1 << 20)
+
+static void fill_map(struct extent_map *map, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		lsdm_update_range(map, i * 8, i * 16, 8);
+}
+
+/*
+ * Throw away a map of TEARDOWN_EXTENTS: rb_erase + free per extent (what a
+ * naive teardown does), one postorder pass with rb_destroy, and rewinding
+ * the extent pool the map was built from.
+ */
+static void bench_teardown(int rounds)
+{
+	struct extent_map map;
+	struct extent_pool pool;
+	struct rb_node *node;
+	unsigned long long start, erase_ns = 0, destroy_ns = 0, reset_ns = 0;
+	unsigned long long fill_ns = 0, pool_fill_ns = 0;
+	int r;
+
+	extent_map_init(&map);
+	extent_pool_init(&pool);
+	for (r = 0; r < rounds; r++) {
+		start = now_ns();
+		fill_map(&map, TEARDOWN_EXTENTS);
+		fill_ns += now_ns() - start;
+		start = now_ns();
+		while ((node = map.extent_tbl_root.rb_node)) {
+			rb_erase(node, &map.extent_tbl_root);
+			free(rb_entry(node, struct extent, rb));
+		}
+		erase_ns += now_ns() - start;
+		extent_map_init(&map);
+
+		fill_map(&map, TEARDOWN_EXTENTS);
+		start = now_ns();
+		extent_map_destroy(&map);
+		destroy_ns += now_ns() - start;
+
+		map.pool = &pool;
+		start = now_ns();
+		fill_map(&map, TEARDOWN_EXTENTS);
+		pool_fill_ns += now_ns() - start;
+		start = now_ns();
+		extent_map_destroy(&map);
+		reset_ns += now_ns() - start;
+		map.pool = NULL;
+	}
+	extent_pool_exit(&pool);
+
+	printf("teardown: %d extents, %d rounds\n", TEARDOWN_EXTENTS, rounds);
+	printf("  %-28s %12.0f ns\n", "rb_erase + free", (double)erase_ns / rounds);
+	printf("  %-28s %12.0f ns\n", "rb_destroy", (double)destroy_ns / rounds);
+	printf("  %-28s %12.0f ns\n", "extent_pool_reset", (double)reset_ns / rounds);
+	printf("  build with malloc: %.1f ns/extent, from the pool: %.1f ns/extent\n",
+	       (double)fill_ns / rounds / TEARDOWN_EXTENTS,
+	       (double)pool_fill_ns / rounds / TEARDOWN_EXTENTS);
+}
+
+#define SCAN_EXTENTS	(1 << 20)
+#define SCAN_RANGES	100000
+#define SCAN_RANGE_LEN	64
+
+/*
+ * Whole-map scans, forward and backward, and short range scans starting
+ * at a random LBA: rb_next/rb_prev, as check_no_overlap() used to do,
+ * against the stack cursor.
+ */
+static void bench_scan(int rounds)
+{
+	struct extent_map map;
+	struct rb_iter it;
+	struct rb_node *node;
+	struct extent *e;
+	unsigned long long start, fwd_ns[2] = {0}, rev_ns[2] = {0}, range_ns[2] = {0};
+	unsigned long sum[2] = {0};
+	sector_t *lbas;
+	int r, i, j;
+
+	extent_map_init(&map);
+	fill_map(&map, SCAN_EXTENTS);
+	lbas = malloc(sizeof(*lbas) * SCAN_RANGES);
+	srand(32);
+	for (i = 0; i < SCAN_RANGES; i++)
+		lbas[i] = rand() % (SCAN_EXTENTS * 8);
+
+	for (r = 0; r < rounds; r++) {
+		start = now_ns();
+		for (node = rb_first(&map.extent_tbl_root); node; node = rb_next(node))
+			sum[0] += rb_entry(node, struct extent, rb)->pba;
+		fwd_ns[0] += now_ns() - start;
+		start = now_ns();
+		for (node = rb_iter_first(&it, &map.extent_tbl_root); node; node = rb_iter_next(&it))
+			sum[1] += rb_entry(node, struct extent, rb)->pba;
+		fwd_ns[1] += now_ns() - start;
+
+		start = now_ns();
+		for (node = rb_last(&map.extent_tbl_root); node; node = rb_prev(node))
+			sum[0] += rb_entry(node, struct extent, rb)->pba;
+		rev_ns[0] += now_ns() - start;
+		start = now_ns();
+		for (node = rb_iter_last(&it, &map.extent_tbl_root); node; node = rb_iter_prev(&it))
+			sum[1] += rb_entry(node, struct extent, rb)->pba;
+		rev_ns[1] += now_ns() - start;
+
+		start = now_ns();
+		for (i = 0; i < SCAN_RANGES; i++)
+			for (e = stl_rb_geq(&map, lbas[i]), j = 0; e && j < SCAN_RANGE_LEN;
+			     e = lsdm_rb_next(e), j++)
+				sum[0] += e->pba;
+		range_ns[0] += now_ns() - start;
+		start = now_ns();
+		for (i = 0; i < SCAN_RANGES; i++)
+			for (e = extent_iter_seek(&map, &it, lbas[i]), j = 0; e && j < SCAN_RANGE_LEN;
+			     e = extent_iter_next(&it), j++)
+				sum[1] += e->pba;
+		range_ns[1] += now_ns() - start;
+	}
+
+	printf("scan: %d extents, %d rounds\n", SCAN_EXTENTS, rounds);
+	printf("  %-28s rb_next: %6.2f ns/extent  rb_iter: %6.2f ns/extent\n", "full scan",
+	       (double)fwd_ns[0] / rounds / SCAN_EXTENTS, (double)fwd_ns[1] / rounds / SCAN_EXTENTS);
+	printf("  %-28s rb_prev: %6.2f ns/extent  rb_iter: %6.2f ns/extent\n", "reverse scan",
+	       (double)rev_ns[0] / rounds / SCAN_EXTENTS, (double)rev_ns[1] / rounds / SCAN_EXTENTS);
+	printf("  %-28s rb_next: %6.0f ns/range   rb_iter: %6.0f ns/range\n", "seek + 64 extents",
+	       (double)range_ns[0] / rounds / SCAN_RANGES, (double)range_ns[1] / rounds / SCAN_RANGES);
+	if (sum[0] != sum[1])
+		printf("  !!! the cursor visited different extents\n");
+	free(lbas);
+	extent_map_destroy(&map);
+}
+
+/* An extent on a threaded tree, for comparison with struct extent */
+struct lextent {
+	struct rb_lnode ln;
+	sector_t lba, pba;
+	__u32 len;
+};
+
+static struct lextent *lextent_geq(struct rb_root_linked *root, sector_t lba)
+{
+	struct rb_node *node = root->rb_root.rb_node;
+	struct lextent *e, *higher = NULL;
+
+	while (node) {
+		e = rb_entry(node, struct lextent, ln.rb);
+		if (lba < e->lba) {
+			higher = e;
+			node = node->rb_left;
+		} else if (lba >= e->lba + e->len) {
+			node = node->rb_right;
+		} else {
+			return e;
+		}
+	}
+	return higher;
+}
+
+/*
+ * The scans of bench_scan over a threaded copy of the map, where every
+ * step is a load of ->next, plus what the threads cost on insert.
+ */
+static void bench_threaded(int rounds)
+{
+	struct extent_map map;
+	struct rb_root_linked root = RB_ROOT_LINKED;
+	struct lextent *le, *pool;
+	struct rb_lnode *ln;
+	struct rb_node *node;
+	struct extent *e, *plain;
+	unsigned long long start, scan_ns[2] = {0}, range_ns[2] = {0}, build_ns[2] = {0};
+	unsigned long sum[2] = {0};
+	sector_t *lbas;
+	int r, i, j;
+
+	/* Both trees come from an array, so they share the memory layout */
+	plain = malloc(sizeof(*plain) * SCAN_EXTENTS);
+	pool = malloc(sizeof(*pool) * SCAN_EXTENTS);
+	lbas = malloc(sizeof(*lbas) * SCAN_RANGES);
+	srand(33);
+	for (i = 0; i < SCAN_RANGES; i++)
+		lbas[i] = rand() % (SCAN_EXTENTS * 8);
+	extent_map_init(&map);
+
+	for (r = 0; r < rounds; r++) {
+		start = now_ns();
+		for (i = 0; i < SCAN_EXTENTS; i++) {
+			e = &plain[i];
+			extent_init(e, i * 8, i * 16, 8);
+			rb_insert_after(&e->rb, rb_last(&map.extent_tbl_root), &map.extent_tbl_root);
+		}
+		build_ns[0] += now_ns() - start;
+		start = now_ns();
+		for (i = 0; i < SCAN_EXTENTS; i++) {
+			le = &pool[i];
+			le->lba = i * 8;
+			le->pba = i * 16;
+			le->len = 8;
+			rb_insert_linked_after(&le->ln, root.last, &root);
+		}
+		build_ns[1] += now_ns() - start;
+
+		start = now_ns();
+		for (node = rb_first(&map.extent_tbl_root); node; node = rb_next(node))
+			sum[0] += rb_entry(node, struct extent, rb)->pba;
+		scan_ns[0] += now_ns() - start;
+		start = now_ns();
+		for (ln = root.first; ln; ln = ln->next)
+			sum[1] += rb_entry(ln, struct lextent, ln)->pba;
+		scan_ns[1] += now_ns() - start;
+
+		start = now_ns();
+		for (i = 0; i < SCAN_RANGES; i++)
+			for (e = stl_rb_geq(&map, lbas[i]), j = 0; e && j < SCAN_RANGE_LEN;
+			     e = lsdm_rb_next(e), j++)
+				sum[0] += e->pba;
+		range_ns[0] += now_ns() - start;
+		start = now_ns();
+		for (i = 0; i < SCAN_RANGES; i++)
+			for (le = lextent_geq(&root, lbas[i]), j = 0; le && j < SCAN_RANGE_LEN;
+			     le = rb_entry_safe(le->ln.next, struct lextent, ln), j++)
+				sum[1] += le->pba;
+		range_ns[1] += now_ns() - start;
+
+		extent_map_init(&map);
+		root = RB_ROOT_LINKED;
+	}
+
+	printf("threaded: %d extents, %d rounds\n", SCAN_EXTENTS, rounds);
+	printf("  %-28s rb_next: %6.2f ns/extent  ->next: %6.2f ns/extent\n", "full scan",
+	       (double)scan_ns[0] / rounds / SCAN_EXTENTS, (double)scan_ns[1] / rounds / SCAN_EXTENTS);
+	printf("  %-28s rb_next: %6.0f ns/range   ->next: %6.0f ns/range\n", "seek + 64 extents",
+	       (double)range_ns[0] / rounds / SCAN_RANGES, (double)range_ns[1] / rounds / SCAN_RANGES);
+	printf("  %-28s plain:   %6.1f ns/extent  threaded: %6.1f ns/extent\n", "append",
+	       (double)build_ns[0] / rounds / SCAN_EXTENTS, (double)build_ns[1] / rounds / SCAN_EXTENTS);
+	if (sum[0] != sum[1])
+		printf("  !!! the threaded scan visited different extents\n");
+	free(lbas);
+	free(pool);
+	free(plain);
+}
+
+#define WC_UPDATES	(1 << 20)
+#define WC_HOT_SLOTS	1024
+#define WC_COLD_SPAN	(1 << 24)
+
+static unsigned long map_sum(struct extent_map *map)
+{
+	struct rb_iter it;
+	struct extent *e;
+	unsigned long sum = 0;
+
+	for (e = extent_iter_first(map, &it); e; e = extent_iter_next(&it))
+		sum = sum * 31 + e->lba * 7 + e->pba * 3 + e->len;
+	return sum;
+}
+
+/*
+ * Small writes, 90% of them to a hot set of WC_HOT_SLOTS 4K blocks, with
+ * PBAs handed out log structured. Every update straight into the map
+ * against the same updates through an update buffer.
+ */
+static void bench_wcbuf(int rounds)
+{
+	static const int maxes[] = { 256, 4096, 65536 };
+	struct extent_map map;
+	struct update_buf b;
+	sector_t (*ops)[2];
+	unsigned long long start, direct_ns = 0, buf_ns;
+	unsigned long sum;
+	int r, i, j, n_extents;
+
+	ops = malloc(sizeof(*ops) * WC_UPDATES);
+	srand(34);
+	for (i = 0; i < WC_UPDATES; i++) {
+		if (rand() % 10)
+			ops[i][0] = (rand() % WC_HOT_SLOTS) * 8;
+		else
+			ops[i][0] = (rand() % (WC_COLD_SPAN / 8)) * 8;
+		ops[i][1] = i * 8;
+	}
+
+	extent_map_init(&map);
+	for (r = 0; r < rounds; r++) {
+		start = now_ns();
+		for (i = 0; i < WC_UPDATES; i++)
+			lsdm_update_range(&map, ops[i][0], ops[i][1], 8);
+		direct_ns += now_ns() - start;
+		if (r < rounds - 1)
+			extent_map_destroy(&map);
+	}
+	sum = map_sum(&map);
+	n_extents = map.n_extents;
+	extent_map_destroy(&map);
+
+	printf("wcbuf: %d 4K writes, %d%% to %d hot blocks, %d rounds\n",
+	       WC_UPDATES, 90, WC_HOT_SLOTS, rounds);
+	printf("  %-28s %7.1f ns/update\n", "lsdm_update_range",
+	       (double)direct_ns / rounds / WC_UPDATES);
+	for (j = 0; j < sizeof(maxes) / sizeof(maxes[0]); j++) {
+		buf_ns = 0;
+		for (r = 0; r < rounds; r++) {
+			update_buf_init(&b, &map, maxes[j]);
+			start = now_ns();
+			for (i = 0; i < WC_UPDATES; i++)
+				update_buf_add(&b, ops[i][0], ops[i][1], 8);
+			update_buf_flush(&b);
+			buf_ns += now_ns() - start;
+			update_buf_exit(&b);
+			if (r < rounds - 1)
+				extent_map_destroy(&map);
+		}
+		printf("  buffer of %-6d extents      %7.1f ns/update, %.0f tree updates saved per flush (%.0f%%)\n",
+		       maxes[j], (double)buf_ns / rounds / WC_UPDATES,
+		       (double)(b.nr_updates - b.nr_applied) / b.nr_flushes,
+		       100.0 * (b.nr_updates - b.nr_applied) / b.nr_updates);
+		if (map.n_extents != n_extents || map_sum(&map) != sum)
+			printf("  !!! buffered updates built a different map\n");
+		extent_map_destroy(&map);
+	}
+	free(ops);
+}
+
+#define COALESCE_EXTENTS	(1 << 20)
+#define COALESCE_SLICE_NS	50000
+#define COALESCE_LOOKUPS	1000000
+
+static double lookup_ns(struct extent_map *map, sector_t span)
+{
+	unsigned long long start, t;
+	unsigned long sum = 0;
+	struct extent *e;
+	int i;
+
+	srand(35);
+	start = now_ns();
+	for (i = 0; i < COALESCE_LOOKUPS; i++) {
+		e = stl_rb_geq(map, rand() % span);
+		if (e)
+			sum += e->pba;
+	}
+	t = now_ns() - start;
+	if (!sum)
+		printf("  !!! lookups found nothing\n");
+	return (double)t / COALESCE_LOOKUPS;
+}
+
+/*
+ * A map of COALESCE_EXTENTS where runs of four contiguous extents were
+ * never merged, coalesced in slices of at most COALESCE_SLICE_NS.
+ */
+static void bench_coalesce(int rounds)
+{
+	struct extent_map map;
+	struct extent_pool pool;
+	struct extent_coalesce c;
+	struct extent *e;
+	unsigned long long start, t, total_ns = 0, max_ns = 0, slices = 0;
+	double before = 0, after = 0;
+	int r, i, n_before = 0;
+
+	extent_map_init(&map);
+	extent_pool_init(&pool);
+	map.pool = &pool;
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < COALESCE_EXTENTS; i++) {
+			e = extent_alloc(&map);
+			/* A gap in the PBAs after every fourth extent */
+			extent_init(e, i * 8, i * 8 + (i / 4) * 64, 8);
+			rb_insert_after(&e->rb, rb_last(&map.extent_tbl_root), &map.extent_tbl_root);
+		}
+		map.n_extents = n_before = COALESCE_EXTENTS;
+		before += lookup_ns(&map, COALESCE_EXTENTS * 8);
+
+		extent_coalesce_init(&c);
+		while (!c.passes) {
+			start = now_ns();
+			lsdm_coalesce(&map, &c, COALESCE_EXTENTS, COALESCE_SLICE_NS);
+			t = now_ns() - start;
+			total_ns += t;
+			if (t > max_ns)
+				max_ns = t;
+			slices++;
+		}
+		after += lookup_ns(&map, COALESCE_EXTENTS * 8);
+		if (r < rounds - 1)
+			extent_map_destroy(&map);
+	}
+
+	printf("coalesce: %d extents in runs of 4, %d rounds\n", COALESCE_EXTENTS, rounds);
+	printf("  %d -> %d extents, %.1f ms per pass in %llu slices\n",
+	       n_before, map.n_extents, (double)total_ns / rounds / 1000000, slices / rounds);
+	printf("  slice budget %d us: %.1f us on average, %.1f us at most\n",
+	       COALESCE_SLICE_NS / 1000, (double)total_ns / slices / 1000, (double)max_ns / 1000);
+	printf("  stl_rb_geq: %.1f ns before, %.1f ns after\n", before / rounds, after / rounds);
+	extent_map_destroy(&map);
+	extent_pool_exit(&pool);
+}
+
+#define PMAP_EXTENTS	(1 << 20)
+#define PMAP_BENCH_FILE	"/tmp/extent_bench.pmap"
+
+/*
+ * Volume start-up: rebuilding a map of PMAP_EXTENTS by replaying its
+ * updates, against opening a persistent map that already holds it.
+ */
+static void bench_pmap(int rounds)
+{
+	struct extent_map map;
+	struct pmap pm;
+	struct pmap_node *pn;
+	struct extent *e;
+	unsigned long long start, replay_ns = 0, open_ns = 0, build_ns, mem_ns = 0, pm_ns = 0;
+	unsigned long sum[2] = {0};
+	int r, i, ret;
+
+	extent_map_init(&map);
+	fill_map(&map, PMAP_EXTENTS);
+	ret = pmap_create(&pm, PMAP_BENCH_FILE, 1024);
+	if (ret < 0) {
+		printf("pmap: cannot create %s: %d\n", PMAP_BENCH_FILE, ret);
+		return;
+	}
+	start = now_ns();
+	pmap_from_map(&pm, &map);
+	build_ns = now_ns() - start;
+	pmap_close(&pm);
+	extent_map_destroy(&map);
+
+	for (r = 0; r < rounds; r++) {
+		start = now_ns();
+		fill_map(&map, PMAP_EXTENTS);
+		replay_ns += now_ns() - start;
+
+		start = now_ns();
+		ret = pmap_open(&pm, PMAP_BENCH_FILE);
+		open_ns += now_ns() - start;
+		if (ret < 0) {
+			printf("pmap: cannot open %s: %d\n", PMAP_BENCH_FILE, ret);
+			break;
+		}
+
+		srand(36);
+		start = now_ns();
+		for (i = 0; i < PMAP_EXTENTS; i++) {
+			e = stl_rb_geq(&map, rand() % (PMAP_EXTENTS * 8));
+			sum[0] += e ? e->pba : 0;
+		}
+		mem_ns += now_ns() - start;
+		srand(36);
+		start = now_ns();
+		for (i = 0; i < PMAP_EXTENTS; i++) {
+			pn = pmap_geq(&pm, rand() % (PMAP_EXTENTS * 8));
+			sum[1] += pn ? pn->pba : 0;
+		}
+		pm_ns += now_ns() - start;
+
+		pmap_close(&pm);
+		extent_map_destroy(&map);
+	}
+	unlink(PMAP_BENCH_FILE);
+
+	printf("pmap: %d extents, %d rounds, copied into the file in %.1f ms\n",
+	       PMAP_EXTENTS, rounds, (double)build_ns / 1000000);
+	printf("  %-28s %10.3f ms\n", "replay into extent_map", (double)replay_ns / rounds / 1000000);
+	printf("  %-28s %10.3f ms\n", "pmap_open", (double)open_ns / rounds / 1000000);
+	printf("  lookups: %.1f ns in memory, %.1f ns through the file mapping\n",
+	       (double)mem_ns / rounds / PMAP_EXTENTS, (double)pm_ns / rounds / PMAP_EXTENTS);
+	if (sum[0] != sum[1])
+		printf("  !!! the persistent map answered differently\n");
+}
+
+#define CKPT_EXTENTS	(1 << 20)
+#define CKPT_BENCH_FILE	"/tmp/extent_bench.ckpt"
+
+/*
+ * Random 4K-32K writes appended to the log until the map holds
+ * CKPT_EXTENTS, then: checkpoint size and write time, loading it with
+ * 1-8 decoder threads, and rebuilding the same map by inserting its
+ * extents one by one, in LBA and in random order.
+ */
+static void bench_ckpt(int rounds)
+{
+	static const int threads[] = { 1, 2, 4, 8 };
+	struct extent_map map, l;
+	struct extent *e, **all;
+	struct rb_iter it;
+	unsigned long long start, write_ns = 0, load_ns, seq_ns = 0, rand_ns = 0;
+	sector_t pba = 0;
+	long bytes = 0;
+	int r, i, j, len, n;
+
+	extent_map_init(&map);
+	extent_map_init(&l);
+	srand(37);
+	while (map.n_extents < CKPT_EXTENTS) {
+		len = 8 * (1 + rand() % 4);
+		lsdm_update_range(&map, (rand() % (1 << 22)) * 8, pba, len);
+		pba += len;
+	}
+	n = map.n_extents;
+	all = malloc(sizeof(*all) * n);
+	for (e = extent_iter_first(&map, &it), i = 0; e; e = extent_iter_next(&it))
+		all[i++] = e;
+
+	for (r = 0; r < rounds; r++) {
+		start = now_ns();
+		bytes = checkpoint_write(&map, CKPT_BENCH_FILE);
+		write_ns += now_ns() - start;
+	}
+	if (bytes < 0) {
+		printf("ckpt: cannot write %s: %ld\n", CKPT_BENCH_FILE, bytes);
+		goto out;
+	}
+	printf("ckpt: %d extents, %d rounds\n", n, rounds);
+	printf("  checkpoint: %.2f MB per million extents (%.1f bytes/extent), written in %.1f ms\n",
+	       (double)bytes * 1000000 / n / (1 << 20), (double)bytes / n,
+	       (double)write_ns / rounds / 1000000);
+
+	for (r = 0; r < rounds; r++) {
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			lsdm_update_range(&l, all[i]->lba, all[i]->pba, all[i]->len);
+		seq_ns += now_ns() - start;
+		extent_map_destroy(&l);
+
+		/* Same extents, shuffled */
+		for (i = n - 1; i > 0; i--) {
+			j = rand() % (i + 1);
+			e = all[i];
+			all[i] = all[j];
+			all[j] = e;
+		}
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			lsdm_update_range(&l, all[i]->lba, all[i]->pba, all[i]->len);
+		rand_ns += now_ns() - start;
+		extent_map_destroy(&l);
+	}
+	printf("  %-28s %8.1f ms\n", "insert in LBA order", (double)seq_ns / rounds / 1000000);
+	printf("  %-28s %8.1f ms\n", "insert in random order", (double)rand_ns / rounds / 1000000);
+
+	for (j = 0; j < sizeof(threads) / sizeof(threads[0]); j++) {
+		load_ns = 0;
+		for (r = 0; r < rounds; r++) {
+			start = now_ns();
+			if (checkpoint_load(&l, CKPT_BENCH_FILE, threads[j]) < 0)
+				printf("  !!! checkpoint did not load\n");
+			load_ns += now_ns() - start;
+			if (l.n_extents != n || map_sum(&l) != map_sum(&map))
+				printf("  !!! checkpoint loaded a different map\n");
+			extent_map_destroy(&l);
+		}
+		printf("  checkpoint_load, %d thread%s  %8.1f ms\n", threads[j],
+		       threads[j] > 1 ? "s" : " ", (double)load_ns / rounds / 1000000);
+	}
+out:
+	unlink(CKPT_BENCH_FILE);
+	free(all);
+	extent_map_destroy(&map);
+}
+
+#define DELTA_EXTENTS	(1 << 20)
+#define DELTA_BENCH_FILE	"/tmp/extent_bench.delta"
+
+/*
+ * A map of DELTA_EXTENTS that takes k random 4K writes after a full
+ * checkpoint: the delta checkpoint of those writes against writing the
+ * whole map again, with coarse and fine dirty granules.
+ */
+static void bench_delta(int rounds)
+{
+	static const int ks[] = { 100, 1000, 10000, 100000 };
+	static const int shifts[] = { DIRTY_SHIFT_DEFAULT, 6 };
+	struct extent_map map;
+	struct dirty_map dirty;
+	unsigned long long start, full_ns = 0, delta_ns;
+	sector_t pba = DELTA_EXTENTS * 16;
+	long full = 0, delta = 0;
+	int r, i, j, s;
+
+	extent_map_init(&map);
+	fill_map(&map, DELTA_EXTENTS);
+	for (r = 0; r < rounds; r++) {
+		start = now_ns();
+		full = checkpoint_write(&map, CKPT_BENCH_FILE);
+		full_ns += now_ns() - start;
+	}
+	printf("delta: %d extents, %d rounds\n", DELTA_EXTENTS, rounds);
+	printf("  %-34s %10ld bytes %8.2f ms\n", "full checkpoint", full,
+	       (double)full_ns / rounds / 1000000);
+
+	srand(38);
+	for (s = 0; s < sizeof(shifts) / sizeof(shifts[0]); s++) {
+		if (dirty_map_init(&dirty, DELTA_EXTENTS * 8, shifts[s]) < 0)
+			break;
+		map.dirty = &dirty;
+		for (j = 0; j < sizeof(ks) / sizeof(ks[0]); j++) {
+			delta_ns = 0;
+			for (r = 0; r < rounds; r++) {
+				for (i = 0; i < ks[j]; i++) {
+					lsdm_update_range(&map, (rand() % DELTA_EXTENTS) * 8, pba, 8);
+					pba += 8;
+				}
+				start = now_ns();
+				delta = checkpoint_write_delta(&map, DELTA_BENCH_FILE);
+				delta_ns += now_ns() - start;
+			}
+			printf("  %5dKB granules, %6d writes   %10ld bytes %8.2f ms\n",
+			       (1 << shifts[s]) / 2, ks[j], delta, (double)delta_ns / rounds / 1000000);
+		}
+		map.dirty = NULL;
+		dirty_map_exit(&dirty);
+	}
+	unlink(CKPT_BENCH_FILE);
+	unlink(DELTA_BENCH_FILE);
+	extent_map_destroy(&map);
+}
+
+#define WAL_BENCH_FILE	"extent_bench.wal"	/* local disk, not /tmp */
+#define WAL_LBA_SPAN	(1 << 23)
+
+/*
+ * Logged 4K random writes: updates per second with every update made
+ * durable in commit groups of 'batch', against applying them to the map
+ * alone. The last line commits on a 1ms timer instead of a group size.
+ */
+static void bench_wal(int rounds)
+{
+	static const struct { int batch; unsigned interval_us; } cfgs[] = {
+		{ 1, 0 }, { 8, 0 }, { 64, 0 }, { 512, 0 }, { 4096, 0 }, { 65536, 1000 },
+	};
+	struct extent_map map;
+	struct wal w;
+	unsigned long long start, ns;
+	unsigned long commits;
+	long n, i;
+	int r, c;
+
+	printf("wal: random 4K writes, %d rounds\n", rounds);
+	n = 200000;
+	ns = 0;
+	for (r = 0; r < rounds; r++) {
+		extent_map_init(&map);
+		srand(39);
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			lsdm_update_range(&map, (rand() % (WAL_LBA_SPAN / 8)) * 8, i * 8, 8);
+		ns += now_ns() - start;
+		extent_map_destroy(&map);
+	}
+	printf("  %-26s %10.0f updates/s\n", "map only",
+	       (double)n * rounds * 1000000000 / ns);
+
+	for (c = 0; c < sizeof(cfgs) / sizeof(cfgs[0]); c++) {
+		/* Enough updates for a few hundred commits, within reason */
+		n = cfgs[c].batch * 256L;
+		n = n < 2000 ? 2000 : n > 200000 ? 200000 : n;
+		ns = 0;
+		commits = 0;
+		for (r = 0; r < rounds; r++) {
+			unlink(WAL_BENCH_FILE);
+			extent_map_init(&map);
+			if (wal_open(&w, WAL_BENCH_FILE, cfgs[c].batch, cfgs[c].interval_us) < 0) {
+				printf("  cannot open %s\n", WAL_BENCH_FILE);
+				return;
+			}
+			srand(39);
+			start = now_ns();
+			for (i = 0; i < n; i++)
+				wal_update_range(&w, &map, (rand() % (WAL_LBA_SPAN / 8)) * 8, i * 8, 8);
+			wal_commit(&w);
+			ns += now_ns() - start;
+			commits += w.nr_commits;
+			wal_close(&w);
+			extent_map_destroy(&map);
+		}
+		if (cfgs[c].interval_us)
+			printf("  commit every %4ums       ", cfgs[c].interval_us / 1000);
+		else
+			printf("  commit groups of %-8d", cfgs[c].batch);
+		printf(" %10.0f updates/s %8.1f us/group %8.0f updates/group\n",
+		       (double)n * rounds * 1000000000 / ns, (double)ns / commits / 1000,
+		       (double)n * rounds / commits);
+	}
+	unlink(WAL_BENCH_FILE);
+}
+
+#define PAGED_EXTENTS		(1 << 20)
+#define PAGED_BENCH_FILE	"extent_bench.paged"
+
+/* 9 in 10 accesses go to a hot tenth of the extents */
+static inline sector_t paged_key(void)
+{
+	if (rand() % 10)
+		return (rand() % (PAGED_EXTENTS / 10)) * 8;
+	return (rand() % PAGED_EXTENTS) * 8;
+}
+
+/*
+ * Skewed 4K lookups and writes over PAGED_EXTENTS, with the map fully
+ * resident against a paged map whose cache holds a fraction of its
+ * leaves. Resident memory counts the extent pool the cached leaves are
+ * carved from and the top index; the fully resident map is n_extents
+ * struct extent.
+ */
+static void bench_paged(int rounds)
+{
+	static const unsigned long cache[] = { 64, 256, 512, 2048 };
+	struct extent_map map;
+	struct paged_map pm;
+	unsigned long long start, look_ns, upd_ns;
+	unsigned long loads, nr_ops = 20000;
+	long i;
+	int r, c, len;
+
+	extent_map_init(&map);
+	fill_map(&map, PAGED_EXTENTS);
+	printf("paged: %d extents, %lu lookups + %lu writes, %d rounds\n",
+	       PAGED_EXTENTS, nr_ops, nr_ops, rounds);
+
+	look_ns = upd_ns = 0;
+	for (r = 0; r < rounds; r++) {
+		srand(40);
+		start = now_ns();
+		for (i = 0; i < nr_ops; i++)
+			stl_rb_geq(&map, paged_key());
+		look_ns += now_ns() - start;
+	}
+	printf("  %-22s %8.1f MB  lookup %7.0f ns\n", "all resident",
+	       (double)map.n_extents * sizeof(struct extent) / (1 << 20),
+	       (double)look_ns / rounds / nr_ops);
+
+	for (c = 0; c < sizeof(cache) / sizeof(cache[0]); c++) {
+		look_ns = upd_ns = 0;
+		loads = 0;
+		for (r = 0; r < rounds; r++) {
+			if (paged_create(&pm, PAGED_BENCH_FILE, cache[c]) < 0 ||
+			    paged_from_map(&pm, &map) < 0) {
+				printf("  cannot build %s\n", PAGED_BENCH_FILE);
+				return;
+			}
+			srand(40);
+			start = now_ns();
+			for (i = 0; i < nr_ops; i++)
+				paged_lookup(&pm, paged_key(), &len);
+			look_ns += now_ns() - start;
+			start = now_ns();
+			for (i = 0; i < nr_ops; i++)
+				paged_update_range(&pm, paged_key() + 2,
+						   PAGED_EXTENTS * 16 + i * 4, 4);
+			upd_ns += now_ns() - start;
+			loads += pm.nr_loads;
+			if (r == rounds - 1)
+				printf("  cache of %-5lu leaves  %8.1f MB  lookup %7.0f ns  write %7.0f ns"
+				       "  %4.0f%% misses  %lu leaves\n", cache[c],
+				       (double)(pm.pool.nr_chunks * sizeof(struct extent_chunk) +
+						pm.max_ranges * sizeof(struct paged_range)) / (1 << 20),
+				       (double)look_ns / rounds / nr_ops, (double)upd_ns / rounds / nr_ops,
+				       100.0 * loads / rounds / (2 * nr_ops), pm.nr_ranges);
+			paged_close(&pm);
+		}
+	}
+	unlink(PAGED_BENCH_FILE);
+	extent_map_destroy(&map);
+}
+
+#define SHARD_OPS	(1 << 17)	/* updates per run, split over the threads */
+#define SHARD_LBA_SPAN	(1 << 23)
+
+struct shard_thread {
+	pthread_t thread;
+	struct shard_map *sm;
+	unsigned long nr;
+	unsigned seed;
+	int started;
+};
+
+static void *shard_thread(void *arg)
+{
+	struct shard_thread *t = arg;
+	unsigned long i;
+	sector_t lba;
+
+	for (i = 0; i < t->nr; i++) {
+		lba = (rand_r(&t->seed) % (SHARD_LBA_SPAN / 8)) * 8;
+		/* One in eight spans two stripes */
+		if (!(i & 7))
+			lba = (lba | ((1 << t->sm->stripe_shift) - 1)) - 3;
+		shard_update_range(t->sm, lba, lba + 8 * t->seed, 8);
+	}
+	return NULL;
+}
+
+/*
+ * SHARD_OPS random 4K updates from 1 to 64 threads, against one shard
+ * (a single global lock) and against more shards. Threads beyond the
+ * number of CPUs only add contention.
+ */
+static void bench_shard(int rounds)
+{
+	static const int shards[] = { 1, 8, 64 };
+	struct shard_thread t[64];
+	struct shard_map sm;
+	unsigned long long start, ns;
+	int nr_threads, s, r, i;
+
+	printf("shard: %d random 4K updates, %ld CPUs, %d rounds, Mupdates/s\n",
+	       SHARD_OPS, sysconf(_SC_NPROCESSORS_ONLN), rounds);
+	printf("  %-10s", "threads");
+	for (nr_threads = 1; nr_threads <= 64; nr_threads *= 2)
+		printf(" %6d", nr_threads);
+	printf("\n");
+
+	for (s = 0; s < sizeof(shards) / sizeof(shards[0]); s++) {
+		printf("  %2d shard%s ", shards[s], shards[s] > 1 ? "s" : " ");
+		for (nr_threads = 1; nr_threads <= 64; nr_threads *= 2) {
+			ns = 0;
+			for (r = 0; r < rounds; r++) {
+				if (shard_map_init(&sm, shards[s], SHARD_STRIPE_DEFAULT) < 0)
+					return;
+				start = now_ns();
+				for (i = 0; i < nr_threads; i++) {
+					t[i].sm = &sm;
+					t[i].nr = SHARD_OPS / nr_threads;
+					t[i].seed = 41 + i;
+					t[i].started = !pthread_create(&t[i].thread, NULL,
+								       shard_thread, &t[i]);
+					if (!t[i].started)
+						shard_thread(&t[i]);
+				}
+				for (i = 0; i < nr_threads; i++)
+					if (t[i].started)
+						pthread_join(t[i].thread, NULL);
+				ns += now_ns() - start;
+				shard_map_exit(&sm);
+			}
+			printf(" %6.2f", (double)SHARD_OPS * rounds * 1000 / ns);
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+}
+
+#define RL_OPS		4000	/* updates per run, split over the threads */
+#define RL_IO_NS	50000	/* the write the lock covers, slept */
+
+struct rl_thread {
+	pthread_t thread;
+	struct range_lock_tree *tree;	/* NULL: take 'global' for the whole write */
+	pthread_mutex_t *global, *map_lock;
+	struct extent_map *map;
+	unsigned long nr;
+	unsigned seed;
+	int started;
+};
+
+static void *rl_thread(void *arg)
+{
+	struct rl_thread *t = arg;
+	struct timespec io = { 0, RL_IO_NS };
+	struct range_lock rl;
+	unsigned long i;
+	sector_t lba;
+
+	for (i = 0; i < t->nr; i++) {
+		lba = (rand_r(&t->seed) % (1 << 20)) * 8;
+		if (t->tree) {
+			range_lock_init(&rl, lba, 8);
+			range_write_lock(t->tree, &rl);
+		} else {
+			pthread_mutex_lock(t->global);
+		}
+		nanosleep(&io, NULL);
+		pthread_mutex_lock(t->map_lock);
+		lsdm_update_range(t->map, lba, lba + 8 * t->seed, 8);
+		pthread_mutex_unlock(t->map_lock);
+		if (t->tree) {
+			range_unlock(t->tree, &rl);
+			range_lock_exit(&rl);
+		} else {
+			pthread_mutex_unlock(t->global);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Uncontended write_lock + unlock with k other locks held, against a
+ * bare mutex; then writers that hold their lock over a slept write of
+ * RL_IO_NS and a map update, under range locks or one global lock.
+ */
+static void bench_rangelock(int rounds)
+{
+	static const int held[] = { 0, 16, 1024, 65536 };
+	static const int threads[] = { 1, 2, 4, 8, 16 };
+	struct range_lock_tree tree;
+	struct range_lock *locks, rl;
+	struct rl_thread t[16];
+	pthread_mutex_t global = PTHREAD_MUTEX_INITIALIZER, map_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct extent_map map;
+	unsigned long long start, ns;
+	int h, i, r, n, use_tree;
+
+	printf("rangelock: %d rounds\n", rounds);
+	ns = 0;
+	for (r = 0; r < rounds; r++) {
+		start = now_ns();
+		for (i = 0; i < 100000; i++) {
+			pthread_mutex_lock(&global);
+			pthread_mutex_unlock(&global);
+		}
+		ns += now_ns() - start;
+	}
+	printf("  %-28s %7.1f ns\n", "mutex lock + unlock", (double)ns / rounds / 100000);
+
+	locks = malloc(65536 * sizeof(*locks));
+	if (!locks)
+		return;
+	for (h = 0; h < sizeof(held) / sizeof(held[0]); h++) {
+		range_lock_tree_init(&tree);
+		for (i = 0; i < held[h]; i++) {
+			range_lock_init(&locks[i], i * 16, 8);
+			range_write_lock(&tree, &locks[i]);
+		}
+		ns = 0;
+		for (r = 0; r < rounds; r++) {
+			start = now_ns();
+			for (i = 0; i < 100000; i++) {
+				range_lock_init(&rl, (i % 65536) * 16 + 8, 8);
+				range_write_lock(&tree, &rl);
+				range_unlock(&tree, &rl);
+			}
+			ns += now_ns() - start;
+		}
+		printf("  range lock + unlock, %5d held %7.1f ns\n", held[h],
+		       (double)ns / rounds / 100000);
+		for (i = 0; i < held[h]; i++) {
+			range_unlock(&tree, &locks[i]);
+			range_lock_exit(&locks[i]);
+		}
+		range_lock_tree_exit(&tree);
+	}
+	free(locks);
+
+	printf("  %-16s", "writes/s, threads");
+	for (n = 0; n < sizeof(threads) / sizeof(threads[0]); n++)
+		printf(" %7d", threads[n]);
+	printf("\n");
+	for (use_tree = 0; use_tree < 2; use_tree++) {
+		printf("  %-17s", use_tree ? "range locks" : "global lock");
+		for (n = 0; n < sizeof(threads) / sizeof(threads[0]); n++) {
+			range_lock_tree_init(&tree);
+			extent_map_init(&map);
+			start = now_ns();
+			for (i = 0; i < threads[n]; i++) {
+				t[i].tree = use_tree ? &tree : NULL;
+				t[i].global = &global;
+				t[i].map_lock = &map_lock;
+				t[i].map = &map;
+				t[i].nr = RL_OPS / threads[n];
+				t[i].seed = 42 + i;
+				t[i].started = !pthread_create(&t[i].thread, NULL, rl_thread, &t[i]);
+				if (!t[i].started)
+					rl_thread(&t[i]);
+			}
+			for (i = 0; i < threads[n]; i++)
+				if (t[i].started)
+					pthread_join(t[i].thread, NULL);
+			ns = now_ns() - start;
+			printf(" %7.0f", (double)RL_OPS * 1000000000 / ns);
+			fflush(stdout);
+			extent_map_destroy(&map);
+			range_lock_tree_exit(&tree);
+		}
+		printf("\n");
+	}
+}
+
+#define ACTOR_OPS	(1 << 16)	/* updates per run, split over the producers */
+#define ACTOR_INFLIGHT	32
+
+struct actor_thread {
+	pthread_t thread;
+	struct actor *a;		/* NULL: lock 'lock' around the update */
+	pthread_mutex_t *lock;
+	struct extent_map *map;
+	int window;			/* updates in flight */
+	unsigned long nr;
+	unsigned long long *lat;	/* ns from submit to completion */
+	unsigned seed;
+	int started;
+};
+
+static void *actor_thread(void *arg)
+{
+	struct actor_thread *t = arg;
+	struct actor_cmd c[ACTOR_INFLIGHT];
+	unsigned long long sub[ACTOR_INFLIGHT];
+	unsigned long i;
+	sector_t lba;
+	int k;
+
+	for (i = 0; i < t->nr; i += t->window) {
+		for (k = 0; k < t->window; k++) {
+			lba = (rand_r(&t->seed) % (1 << 20)) * 8;
+			sub[k] = now_ns();
+			if (t->a) {
+				actor_cmd_update(&c[k], lba, lba + 8 * t->seed, 8);
+				actor_submit(t->a, &c[k]);
+			} else {
+				pthread_mutex_lock(t->lock);
+				lsdm_update_range(t->map, lba, lba + 8 * t->seed, 8);
+				pthread_mutex_unlock(t->lock);
+				t->lat[i + k] = now_ns() - sub[k];
+			}
+		}
+		for (k = 0; t->a && k < t->window; k++) {
+			actor_wait(&c[k]);
+			t->lat[i + k] = now_ns() - sub[k];
+		}
+	}
+	return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Random 4K updates from 1 to 16 producers: under a mutex, through the
+ * single writer one at a time, and through it with ACTOR_INFLIGHT
+ * updates in flight per producer. Throughput, then latency percentiles
+ * from submission to completion.
+ */
+static void bench_actor(int rounds)
+{
+	static const int producers[] = { 1, 2, 4, 8, 16 };
+	static const char *modes[] = { "mutex", "single writer", "single writer, 32 in flight" };
+	struct actor_thread t[16];
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	struct extent_map map;
+	struct actor a;
+	unsigned long long start, ns, *lat;
+	unsigned long per;
+	int m, n, i;
+
+	lat = malloc(ACTOR_OPS * sizeof(*lat));
+	if (!lat)
+		return;
+	printf("actor: %d random 4K updates, %ld CPUs\n", ACTOR_OPS,
+	       sysconf(_SC_NPROCESSORS_ONLN));
+	for (m = 0; m < 3; m++) {
+		printf("  %s\n", modes[m]);
+		for (n = 0; n < sizeof(producers) / sizeof(producers[0]); n++) {
+			extent_map_init(&map);
+			if (m && actor_start(&a, &map, ACTOR_BATCH_DEFAULT) < 0)
+				return;
+			per = ACTOR_OPS / producers[n];
+			start = now_ns();
+			for (i = 0; i < producers[n]; i++) {
+				t[i].a = m ? &a : NULL;
+				t[i].lock = &lock;
+				t[i].map = &map;
+				t[i].window = m == 2 ? ACTOR_INFLIGHT : 1;
+				t[i].nr = per;
+				t[i].lat = lat + i * per;
+				t[i].seed = 43 + i;
+				t[i].started = !pthread_create(&t[i].thread, NULL, actor_thread, &t[i]);
+				if (!t[i].started)
+					actor_thread(&t[i]);
+			}
+			for (i = 0; i < producers[n]; i++)
+				if (t[i].started)
+					pthread_join(t[i].thread, NULL);
+			ns = now_ns() - start;
+			if (m)
+				actor_stop(&a);
+			qsort(lat, per * producers[n], sizeof(*lat), cmp_ull);
+			printf("    %2d producers %8.0f Kupdates/s  p50 %8.1f us  p99 %8.1f us"
+			       "  p99.9 %8.1f us", producers[n],
+			       (double)per * producers[n] * 1000000 / ns,
+			       lat[per * producers[n] / 2] / 1000.0,
+			       lat[per * producers[n] * 99 / 100] / 1000.0,
+			       lat[per * producers[n] * 999 / 1000] / 1000.0);
+			if (m)
+				printf("  batch %5.1f", (double)a.nr_cmds / a.nr_batches);
+			printf("\n");
+			extent_map_destroy(&map);
+		}
+	}
+	free(lat);
+}
+
+#define SEQ_EXTENTS	(1 << 18)
+#define SEQ_OPS		(1 << 18)	/* per run, split over the threads */
+#define SEQ_WRITE_EVERY	51		/* 50 lookups per update */
+
+struct seq_thread {
+	pthread_t thread;
+	struct seq_map *sm;		/* NULL: the map under 'rw' */
+	pthread_rwlock_t *rw;
+	struct extent_map *map;
+	unsigned long nr;
+	unsigned seed;
+	int started;
+};
+
+static void *seq_thread(void *arg)
+{
+	struct seq_thread *t = arg;
+	struct extent *e;
+	unsigned long i;
+	sector_t lba;
+	int len;
+
+	for (i = 0; i < t->nr; i++) {
+		lba = (rand_r(&t->seed) % SEQ_EXTENTS) * 8;
+		if (i % SEQ_WRITE_EVERY == 0) {
+			if (t->sm) {
+				seq_map_update_range(t->sm, lba, lba * 2 + t->seed, 8);
+			} else {
+				pthread_rwlock_wrlock(t->rw);
+				lsdm_update_range(t->map, lba, lba * 2 + t->seed, 8);
+				pthread_rwlock_unlock(t->rw);
+			}
+		} else if (t->sm) {
+			seq_map_lookup(t->sm, lba, &len);
+		} else {
+			pthread_rwlock_rdlock(t->rw);
+			e = stl_rb_geq(t->map, lba);
+			len = e ? e->len : 0;
+			pthread_rwlock_unlock(t->rw);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * 50 lookups per update over SEQ_EXTENTS from 1 to 8 threads, readers
+ * under a pthread rwlock against optimistic seqlock lookups.
+ */
+static void bench_seqlock(int rounds)
+{
+	static const int threads[] = { 1, 2, 4, 8 };
+	struct seq_thread t[8];
+	pthread_rwlock_t rw;
+	struct extent_map map;
+	struct seq_map sm;
+	unsigned long long start, ns;
+	int m, n, r, i;
+
+	printf("seqlock: %d extents, %d ops, 1 update per %d, %ld CPUs, Mops/s\n",
+	       SEQ_EXTENTS, SEQ_OPS, SEQ_WRITE_EVERY, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("  %-10s", "threads");
+	for (n = 0; n < sizeof(threads) / sizeof(threads[0]); n++)
+		printf(" %6d", threads[n]);
+	printf("\n");
+	for (m = 0; m < 2; m++) {
+		printf("  %-10s", m ? "seqlock" : "rwlock");
+		for (n = 0; n < sizeof(threads) / sizeof(threads[0]); n++) {
+			ns = 0;
+			for (r = 0; r < rounds; r++) {
+				pthread_rwlock_init(&rw, NULL);
+				extent_map_init(&map);
+				seq_map_init(&sm);
+				if (m) {
+					for (i = 0; i < SEQ_EXTENTS; i++)
+						seq_map_update_range(&sm, i * 8, i * 16, 8);
+				} else {
+					fill_map(&map, SEQ_EXTENTS);
+				}
+				start = now_ns();
+				for (i = 0; i < threads[n]; i++) {
+					t[i].sm = m ? &sm : NULL;
+					t[i].rw = &rw;
+					t[i].map = &map;
+					t[i].nr = SEQ_OPS / threads[n];
+					t[i].seed = 44 + i;
+					t[i].started = !pthread_create(&t[i].thread, NULL,
+								       seq_thread, &t[i]);
+					if (!t[i].started)
+						seq_thread(&t[i]);
+				}
+				for (i = 0; i < threads[n]; i++)
+					if (t[i].started)
+						pthread_join(t[i].thread, NULL);
+				ns += now_ns() - start;
+				seq_map_exit(&sm);
+				extent_map_destroy(&map);
+				pthread_rwlock_destroy(&rw);
+			}
+			printf(" %6.2f", (double)SEQ_OPS * rounds * 1000 / ns);
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+}
+
+#define COW_EXTENTS	(1 << 18)
+#define COW_OPS		(1 << 17)
+#define COW_SNAP_EVERY	64
+
+static void cow_fill(struct cow_map *m, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		cow_update_range(m, i * 8, i * 16, 8);
+}
+
+/*
+ * Random overwrites of COW_EXTENTS: extent_map against the persistent
+ * map, with no snapshot and with one taken every COW_SNAP_EVERY updates,
+ * so the next update copies its whole path. Then what a consistent copy
+ * costs either way, and lookups.
+ */
+static void bench_cow(int rounds)
+{
+	struct extent_pool pool;
+	struct extent_map map, copy;
+	struct cow_map m, snap;
+	struct extent *e;
+	unsigned long long start, upd_ns = 0, cow_ns = 0, snap_upd_ns = 0;
+	unsigned long long copy_ns = 0, snap_ns = 0, geq_ns = 0, look_ns = 0;
+	unsigned seed;
+	int r, i, s;
+
+	extent_pool_init(&pool);
+	for (r = 0; r < rounds; r++) {
+		extent_map_init(&map);
+		map.pool = &pool;
+		fill_map(&map, COW_EXTENTS);
+		seed = r;
+		start = now_ns();
+		for (i = 0; i < COW_OPS; i++)
+			lsdm_update_range(&map, rand_r(&seed) % (COW_EXTENTS * 8),
+					  COW_EXTENTS * 16 + i * 16, 1 + i % 16);
+		upd_ns += now_ns() - start;
+
+		start = now_ns();
+		for (i = 0; i < COW_OPS; i++)
+			stl_rb_geq(&map, rand_r(&seed) % (COW_EXTENTS * 8));
+		geq_ns += now_ns() - start;
+
+		/* An in-order rebuild is the cheapest copy an extent_map has */
+		extent_map_init(&copy);
+		copy.pool = &pool;
+		start = now_ns();
+		for (e = stl_rb_geq(&map, 0); e; e = lsdm_rb_next(e))
+			lsdm_update_range(&copy, e->lba, e->pba, e->len);
+		copy_ns += now_ns() - start;
+		extent_map_destroy(&copy);
+		extent_map_destroy(&map);
+
+		for (s = 0; s < 2; s++) {
+			cow_map_init(&m);
+			cow_fill(&m, COW_EXTENTS);
+			cow_map_init(&snap);
+			seed = r;
+			start = now_ns();
+			for (i = 0; i < COW_OPS; i++) {
+				if (s && i % COW_SNAP_EVERY == 0) {
+					cow_map_destroy(&snap);
+					cow_snapshot(&m, &snap);
+				}
+				cow_update_range(&m, rand_r(&seed) % (COW_EXTENTS * 8),
+						 COW_EXTENTS * 16 + i * 16, 1 + i % 16);
+			}
+			if (s)
+				snap_upd_ns += now_ns() - start;
+			else
+				cow_ns += now_ns() - start;
+			cow_map_destroy(&snap);
+		}
+
+		start = now_ns();
+		for (i = 0; i < COW_OPS; i++)
+			cow_lookup(&m, rand_r(&seed) % (COW_EXTENTS * 8), NULL);
+		look_ns += now_ns() - start;
+
+		start = now_ns();
+		for (i = 0; i < COW_OPS; i++) {
+			cow_snapshot(&m, &snap);
+			cow_map_destroy(&snap);
+		}
+		snap_ns += now_ns() - start;
+		cow_map_destroy(&m);
+	}
+	extent_pool_exit(&pool);
+
+	printf("cow: %d extents, %d random overwrites, %d rounds, ns/op\n",
+	       COW_EXTENTS, COW_OPS, rounds);
+	printf("  %-36s %10.1f\n", "lsdm_update_range",
+	       (double)upd_ns / rounds / COW_OPS);
+	printf("  %-36s %10.1f\n", "cow_update_range",
+	       (double)cow_ns / rounds / COW_OPS);
+	printf("  %-36s %10.1f\n", "cow_update_range, snapshot every 64",
+	       (double)snap_upd_ns / rounds / COW_OPS);
+	printf("  %-36s %10.1f\n", "stl_rb_geq", (double)geq_ns / rounds / COW_OPS);
+	printf("  %-36s %10.1f\n", "cow_lookup", (double)look_ns / rounds / COW_OPS);
+	printf("  %-36s %10.1f\n", "extent_map copy", (double)copy_ns / rounds);
+	printf("  %-36s %10.1f\n", "cow_snapshot + drop",
+	       (double)snap_ns / rounds / COW_OPS);
+}
+
+#define DIFF_EXTENTS	(1 << 18)
+
+static int diff_count(const struct cow_diff *d, void *arg)
+{
+	(*(long *)arg)++;
+	return 0;
+}
+
+/*
+ * Diff a snapshot of DIFF_EXTENTS against the map after 10 to 10000
+ * random writes, and, as the cost of a walk that cannot skip anything,
+ * against an identical map built separately.
+ */
+static void bench_diff(int rounds)
+{
+	static const int writes[] = { 10, 100, 1000, 10000 };
+	struct cow_map m, snap, other;
+	unsigned long long start, ns;
+	unsigned seed = 46;
+	long nr;
+	int w, r, done = 0;
+
+	cow_map_init(&m);
+	cow_map_init(&other);
+	cow_fill(&m, DIFF_EXTENTS);
+	cow_fill(&other, DIFF_EXTENTS);
+	printf("diff: snapshot of %d extents against the map after n writes, %d rounds\n",
+	       DIFF_EXTENTS, rounds);
+	cow_snapshot(&m, &snap);
+	for (w = 0; w < sizeof(writes) / sizeof(writes[0]); w++) {
+		for (; done < writes[w]; done++)
+			cow_update_range(&m, rand_r(&seed) % (DIFF_EXTENTS * 8),
+					 DIFF_EXTENTS * 16 + done * 16, 1 + done % 16);
+		ns = 0;
+		for (r = 0; r < rounds; r++) {
+			nr = 0;
+			start = now_ns();
+			cow_diff(&snap, &m, diff_count, &nr);
+			ns += now_ns() - start;
+		}
+		printf("  %6d writes: %6ld records in %10.0f ns\n", writes[w], nr,
+		       (double)ns / rounds);
+	}
+	ns = 0;
+	for (r = 0; r < rounds; r++) {
+		nr = 0;
+		start = now_ns();
+		cow_diff(&snap, &other, diff_count, &nr);
+		ns += now_ns() - start;
+	}
+	printf("  nothing shared: %ld records in %.0f ns\n", nr, (double)ns / rounds);
+	cow_map_destroy(&snap);
+	cow_map_destroy(&other);
+	cow_map_destroy(&m);
+}
+
+#define UNION_PARENT	(1 << 20)
+#define UNION_CHILD	(1 << 18)
+
+/* The child overwrote one 8 sector extent in four of the parent, moved */
+static void union_fill_child(struct extent_map *child)
+{
+	int i;
+
+	for (i = 0; i < UNION_CHILD; i++)
+		lsdm_update_range(child, i * 32 + 4, UNION_PARENT * 16 + i * 16, 8);
+}
+
+/*
+ * Fold a parent of UNION_PARENT extents into a child of UNION_CHILD:
+ * lsdm_update_range() for every extent of both into a new map, against
+ * lsdm_map_union() on 1 to 8 threads.
+ */
+static void bench_union(int rounds)
+{
+	static const int threads[] = { 1, 2, 4, 8 };
+	struct extent_pool ppool, cpool;
+	struct extent_map parent, child, map;
+	struct extent *e;
+	unsigned long long start, serial_ns = 0, ns;
+	int n, r;
+
+	extent_pool_init(&ppool);
+	extent_pool_init(&cpool);
+	extent_map_init(&parent);
+	parent.pool = &ppool;
+	fill_map(&parent, UNION_PARENT);
+	extent_map_init(&child);
+	child.pool = &cpool;
+	printf("union: parent %d extents, child %d, %d rounds, %ld CPUs\n",
+	       UNION_PARENT, UNION_CHILD, rounds, sysconf(_SC_NPROCESSORS_ONLN));
+	for (r = 0; r < rounds; r++) {
+		union_fill_child(&child);
+		extent_map_init(&map);
+		start = now_ns();
+		for (e = stl_rb_geq(&parent, 0); e; e = lsdm_rb_next(e))
+			lsdm_update_range(&map, e->lba, e->pba, e->len);
+		for (e = stl_rb_geq(&child, 0); e; e = lsdm_rb_next(e))
+			lsdm_update_range(&map, e->lba, e->pba, e->len);
+		serial_ns += now_ns() - start;
+		extent_map_destroy(&map);
+		extent_map_destroy(&child);
+	}
+	printf("  %-24s %8.1f ms\n", "lsdm_update_range", (double)serial_ns / rounds / 1000000);
+	for (n = 0; n < sizeof(threads) / sizeof(threads[0]); n++) {
+		ns = 0;
+		for (r = 0; r < rounds; r++) {
+			union_fill_child(&child);
+			start = now_ns();
+			lsdm_map_union(&child, &parent, threads[n]);
+			ns += now_ns() - start;
+			extent_map_destroy(&child);
+		}
+		printf("  lsdm_map_union, %d thread%s %8.1f ms, %.1fx\n", threads[n],
+		       threads[n] > 1 ? "s" : " ", (double)ns / rounds / 1000000,
+		       (double)serial_ns / ns);
+	}
+	extent_map_destroy(&parent);
+	extent_pool_exit(&ppool);
+	extent_pool_exit(&cpool);
+}
+
+struct bench {
+	const char *name;
+	void (*fn)(int rounds);
+};
+
+static struct bench benches[] = {
+	{ "finger", bench_finger },
+	{ "append", bench_append },
+	{ "erase", bench_erase },
+	{ "teardown", bench_teardown },
+	{ "scan", bench_scan },
+	{ "threaded", bench_threaded },
+	{ "wcbuf", bench_wcbuf },
+	{ "coalesce", bench_coalesce },
+	{ "pmap", bench_pmap },
+	{ "ckpt", bench_ckpt },
+	{ "delta", bench_delta },
+	{ "wal", bench_wal },
+	{ "paged", bench_paged },
+	{ "shard", bench_shard },
+	{ "rangelock", bench_rangelock },
+	{ "actor", bench_actor },
+	{ "seqlock", bench_seqlock },
+	{ "cow", bench_cow },
+	{ "diff", bench_diff },
+	{ "union", bench_union },
+};
+
+int main(int argc, char **argv)
+{
+	int rounds = 20, i, ran = 0;
+
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if (argc > 1 && strcmp(argv[1], benches[i].name))
+			continue;
+		rb_stats_reset();
+		benches[i].fn(rounds);
+#ifdef CONFIG_RB_STATS
+		rb_stats_dump();
+#endif
+		ran++;
+	}
+	if (!ran) {
+		printf("usage: %s [test] [rounds]\n tests:", argv[0]);
+		for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+			printf(" %s", benches[i].name);
+		printf("\n");
+		return 1;
+	}
+	return 0;
+}
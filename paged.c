@@ -0,0 +1,640 @@
+/*
+ * Demand paged extent map.
+ * See paged.h for the overview.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<limits.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include"paged.h"
+
+/* Extents per leaf when packing a whole map, leaving room to grow */
+#define PAGED_FILL	(PAGED_PAGE_EXTENTS * 3 / 4)
+
+static int paged_rw(int fd, void *buf, size_t bytes, off_t off, int write)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (bytes) {
+		n = write ? pwrite(fd, p, bytes, off) : pread(fd, p, bytes, off);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return n < 0 ? -errno : -EIO;
+		}
+		p += n;
+		off += n;
+		bytes -= n;
+	}
+	return 0;
+}
+
+static inline off_t page_off(unsigned long page)
+{
+	return (off_t)page * PAGED_PAGE_SIZE;
+}
+
+/* End of range 'i', exclusive */
+static inline sector_t range_end(struct paged_map *pm, unsigned long i)
+{
+	return i + 1 < pm->nr_ranges ? pm->ranges[i + 1].start : INT_MAX;
+}
+
+/* The range holding 'lba': the last one starting at or below it */
+static unsigned long range_find(struct paged_map *pm, sector_t lba)
+{
+	unsigned long lo = 0, hi = pm->nr_ranges;
+
+	while (hi - lo > 1) {
+		unsigned long mid = lo + (hi - lo) / 2;
+
+		if (pm->ranges[mid].start <= lba)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Make room for range 'i' in the top index, shifting the ones above */
+static int range_insert(struct paged_map *pm, unsigned long i)
+{
+	struct paged_range *r;
+
+	if (pm->nr_ranges == pm->max_ranges) {
+		r = realloc(pm->ranges, 2 * pm->max_ranges * sizeof(*r));
+		if (!r)
+			return -ENOMEM;
+		pm->ranges = r;
+		pm->max_ranges *= 2;
+	}
+	memmove(&pm->ranges[i + 1], &pm->ranges[i],
+		(pm->nr_ranges - i) * sizeof(*pm->ranges));
+	pm->nr_ranges++;
+	return 0;
+}
+
+static void lru_unlink(struct paged_map *pm, struct paged_page *p)
+{
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		pm->hot = p->next;
+	if (p->next)
+		p->next->prev = p->prev;
+	else
+		pm->cold = p->prev;
+}
+
+static void lru_push(struct paged_map *pm, struct paged_page *p)
+{
+	p->prev = NULL;
+	p->next = pm->hot;
+	if (pm->hot)
+		pm->hot->prev = p;
+	else
+		pm->cold = p;
+	pm->hot = p;
+}
+
+static int leaf_write(struct paged_map *pm, struct paged_range *r)
+{
+	struct paged_page *p = r->res;
+	struct paged_leaf *leaf;
+	struct rb_iter it;
+	struct extent *e;
+	int ret, n = 0;
+
+	if (p->map.n_extents > PAGED_PAGE_EXTENTS)
+		return -EFBIG;
+	leaf = calloc(1, PAGED_PAGE_SIZE);
+	if (!leaf)
+		return -ENOMEM;
+	for (e = extent_iter_first(&p->map, &it); e; e = extent_iter_next(&it)) {
+		leaf->ext[n].lba = e->lba;
+		leaf->ext[n].pba = e->pba;
+		leaf->ext[n].len = e->len;
+		n++;
+	}
+	leaf->nr = n;
+	if (!r->page)
+		r->page = ++pm->nr_pages;
+	ret = paged_rw(pm->fd, leaf, PAGED_PAGE_SIZE, page_off(r->page), 1);
+	free(leaf);
+	if (ret < 0)
+		return ret;
+	p->dirty = 0;
+	pm->nr_writebacks++;
+	return 0;
+}
+
+static void paged_release(struct rb_node *node, void *arg)
+{
+	extent_free(arg, rb_entry(node, struct extent, rb));
+}
+
+/* Write the coldest leaf back if needed and drop it */
+static int paged_evict(struct paged_map *pm)
+{
+	struct paged_page *p = pm->cold;
+	struct paged_range *r = &pm->ranges[range_find(pm, p->start)];
+	int ret;
+
+	if (p->dirty) {
+		ret = leaf_write(pm, r);
+		if (ret < 0)
+			return ret;
+	}
+	lru_unlink(pm, p);
+	r->res = NULL;
+	/* The pool is shared, so give the extents back one by one */
+	rb_destroy(&p->map.extent_tbl_root, paged_release, &p->map);
+	free(p);
+	pm->nr_resident--;
+	pm->nr_evictions++;
+	return 0;
+}
+
+static int paged_shrink(struct paged_map *pm, unsigned long max)
+{
+	int ret;
+
+	while (pm->nr_resident > max) {
+		ret = paged_evict(pm);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int leaf_read(struct paged_map *pm, struct paged_range *r, sector_t end,
+		     struct extent_map *map)
+{
+	struct paged_leaf *leaf;
+	struct rb_node **nodes = NULL;
+	struct extent *e;
+	sector_t prev_end = r->start;
+	int ret, i, n = 0;
+
+	leaf = malloc(PAGED_PAGE_SIZE);
+	if (!leaf)
+		return -ENOMEM;
+	ret = paged_rw(pm->fd, leaf, PAGED_PAGE_SIZE, page_off(r->page), 0);
+	if (ret < 0)
+		goto out;
+	ret = -EINVAL;
+	if (leaf->nr > PAGED_PAGE_EXTENTS)
+		goto corrupt;
+	nodes = malloc(leaf->nr * sizeof(*nodes) + 1);
+	if (!nodes) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (n = 0; n < leaf->nr; n++) {
+		struct paged_rec *x = &leaf->ext[n];
+
+		if (x->lba < prev_end || !x->len || x->len > end - x->lba)
+			goto corrupt;
+		prev_end = x->lba + x->len;
+		e = extent_alloc(map);
+		if (!e) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		extent_init(e, x->lba, x->pba, x->len);
+		nodes[n] = &e->rb;
+	}
+	rb_build_sorted(nodes, n, &map->extent_tbl_root);
+	map->n_extents = n;
+	n = 0;
+	ret = 0;
+	goto out;
+corrupt:
+	printf("\n %s: leaf %u of range at lba %d is corrupt", __func__, r->page, r->start);
+out:
+	for (i = 0; i < n; i++)
+		extent_free(map, rb_entry(nodes[i], struct extent, rb));
+	free(nodes);
+	free(leaf);
+	return ret;
+}
+
+/* The decoded leaf of range 'i', loading it on a miss */
+static struct paged_page *paged_get(struct paged_map *pm, unsigned long i, int *err)
+{
+	struct paged_range *r = &pm->ranges[i];
+	struct paged_page *p = r->res;
+	int ret;
+
+	if (p) {
+		if (pm->hot != p) {
+			lru_unlink(pm, p);
+			lru_push(pm, p);
+		}
+		return p;
+	}
+
+	ret = paged_shrink(pm, pm->max_resident - 1);
+	if (ret < 0)
+		goto fail;
+	r = &pm->ranges[i];
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	extent_map_init(&p->map);
+	p->map.pool = &pm->pool;
+	p->start = r->start;
+	if (r->page) {
+		ret = leaf_read(pm, r, range_end(pm, i), &p->map);
+		if (ret < 0) {
+			free(p);
+			goto fail;
+		}
+		pm->nr_loads++;
+	}
+	/* Loaded extents were accounted for when they were written */
+	p->map.sit = pm->sit;
+	r->res = p;
+	lru_push(pm, p);
+	pm->nr_resident++;
+	return p;
+fail:
+	*err = ret;
+	return NULL;
+}
+
+/*
+ * Move the upper half of the leaf of range 'i' into a new range after
+ * it. The leaf map is cut with rb_erase_range(), so the split costs a
+ * walk to the median and O(log n) relinking.
+ */
+static int paged_split(struct paged_map *pm, unsigned long i)
+{
+	struct paged_page *p = pm->ranges[i].res, *q;
+	struct rb_iter it;
+	struct extent *e;
+	int k, ret;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return -ENOMEM;
+	ret = range_insert(pm, i + 1);
+	if (ret < 0) {
+		free(q);
+		return ret;
+	}
+	e = extent_iter_first(&p->map, &it);
+	for (k = 0; k < p->map.n_extents / 2; k++)
+		e = extent_iter_next(&it);
+
+	extent_map_init(&q->map);
+	q->map.pool = &pm->pool;
+	rb_erase_range(&e->rb, rb_last(&p->map.extent_tbl_root),
+		       &p->map.extent_tbl_root, &q->map.extent_tbl_root);
+	q->map.n_extents = p->map.n_extents - k;
+	q->map.sit = pm->sit;
+	p->map.n_extents = k;
+	p->map.gen++;
+	q->start = e->lba;
+	q->dirty = p->dirty = 1;
+
+	pm->ranges[i + 1].start = q->start;
+	pm->ranges[i + 1].page = 0;
+	pm->ranges[i + 1].res = q;
+	lru_push(pm, q);
+	pm->nr_resident++;
+	pm->nr_splits++;
+	stl_dbg("\n %s: range at %d split at %d", __func__, p->start, q->start);
+	return 0;
+}
+
+/*
+ * Map [lba, lba + len) to [pba, pba + len) with the semantics of
+ * lsdm_update_range(), one range at a time.
+ */
+int paged_update_range(struct paged_map *pm, sector_t lba, sector_t pba, int len)
+{
+	struct paged_page *p;
+	unsigned long i;
+	sector_t n;
+	int before, ret = 0;
+
+	if (lba < 0 || len <= 0 || len > INT_MAX - lba)
+		return -EINVAL;
+	while (len) {
+		i = range_find(pm, lba);
+		p = paged_get(pm, i, &ret);
+		if (!p)
+			return ret;
+		n = range_end(pm, i) - lba;
+		if (n > len)
+			n = len;
+		before = p->map.n_extents;
+		ret = lsdm_update_range(&p->map, lba, pba, n);
+		if (ret < 0)
+			return ret;
+		p->dirty = 1;
+		pm->nr_extents += p->map.n_extents - before;
+		if (p->map.n_extents > PAGED_PAGE_EXTENTS) {
+			ret = paged_split(pm, i);
+			if (ret < 0)
+				return ret;
+		}
+		lba += n;
+		pba += n;
+		len -= n;
+	}
+	return paged_shrink(pm, pm->max_resident);
+}
+
+/*
+ * PBA that 'lba' maps to, or -1 if it is unmapped or the leaf cannot be
+ * read. If 'len' is given it is set to the number of sectors from 'lba'
+ * on for which the answer stays contiguous (or unmapped), up to the end
+ * of the range.
+ */
+sector_t paged_lookup(struct paged_map *pm, sector_t lba, int *len)
+{
+	struct paged_page *p;
+	struct extent *e;
+	unsigned long i;
+	sector_t end;
+	int err;
+
+	i = range_find(pm, lba);
+	end = range_end(pm, i);
+	p = paged_get(pm, i, &err);
+	if (!p) {
+		if (len)
+			*len = 0;
+		return -1;
+	}
+	e = stl_rb_geq(&p->map, lba);
+	if (e && e->lba <= lba) {
+		if (len)
+			*len = e->lba + e->len - lba;
+		return e->pba + (lba - e->lba);
+	}
+	if (len)
+		*len = (e ? e->lba : end) - lba;
+	return -1;
+}
+
+static int paged_write_header(struct paged_map *pm, unsigned long index_page, int clean)
+{
+	struct paged_header *hdr;
+	int ret;
+
+	hdr = calloc(1, PAGED_PAGE_SIZE);
+	if (!hdr)
+		return -ENOMEM;
+	hdr->magic = PAGED_MAGIC;
+	hdr->version = PAGED_VERSION;
+	hdr->page_size = PAGED_PAGE_SIZE;
+	hdr->nr_pages = pm->nr_pages;
+	hdr->nr_ranges = pm->nr_ranges;
+	hdr->nr_extents = pm->nr_extents;
+	hdr->index_page = index_page;
+	hdr->clean = clean;
+	ret = paged_rw(pm->fd, hdr, PAGED_PAGE_SIZE, 0, 1);
+	free(hdr);
+	if (!ret && fdatasync(pm->fd) < 0)
+		ret = -errno;
+	return ret;
+}
+
+/* Write back every dirty leaf, then the top index after the last leaf */
+static int paged_flush(struct paged_map *pm, int clean)
+{
+	struct paged_index *index;
+	struct paged_page *p;
+	unsigned long i;
+	int ret;
+
+	for (p = pm->hot; p; p = p->next) {
+		if (!p->dirty)
+			continue;
+		ret = leaf_write(pm, &pm->ranges[range_find(pm, p->start)]);
+		if (ret < 0)
+			return ret;
+	}
+	index = malloc(pm->nr_ranges * sizeof(*index));
+	if (!index)
+		return -ENOMEM;
+	for (i = 0; i < pm->nr_ranges; i++) {
+		index[i].start = pm->ranges[i].start;
+		index[i].page = pm->ranges[i].page;
+	}
+	ret = paged_rw(pm->fd, index, pm->nr_ranges * sizeof(*index),
+		       page_off(pm->nr_pages + 1), 1);
+	free(index);
+	if (!ret && fdatasync(pm->fd) < 0)
+		ret = -errno;
+	if (!ret)
+		ret = paged_write_header(pm, pm->nr_pages + 1, clean);
+	return ret;
+}
+
+int paged_sync(struct paged_map *pm)
+{
+	return paged_flush(pm, 0);
+}
+
+static int paged_init(struct paged_map *pm, unsigned long nr_ranges,
+		      unsigned long max_resident)
+{
+	memset(pm, 0, sizeof(*pm));
+	pm->max_resident = max_resident ? max_resident : PAGED_RESIDENT_DEFAULT;
+	pm->max_ranges = nr_ranges > 16 ? nr_ranges : 16;
+	pm->ranges = calloc(pm->max_ranges, sizeof(*pm->ranges));
+	extent_pool_init(&pm->pool);
+	return pm->ranges ? 0 : -ENOMEM;
+}
+
+/* A new, empty map at 'path': one range covering every LBA, no leaf yet */
+int paged_create(struct paged_map *pm, const char *path, unsigned long max_resident)
+{
+	int ret;
+
+	ret = paged_init(pm, 1, max_resident);
+	if (ret < 0)
+		return ret;
+	pm->nr_ranges = 1;
+	pm->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (pm->fd < 0) {
+		ret = -errno;
+		free(pm->ranges);
+		return ret;
+	}
+	return 0;
+}
+
+int paged_open(struct paged_map *pm, const char *path, unsigned long max_resident)
+{
+	struct paged_header hdr;
+	struct paged_index *index = NULL;
+	unsigned long i;
+	int fd, ret;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return -errno;
+	ret = paged_rw(fd, &hdr, sizeof(hdr), 0, 0);
+	if (ret < 0)
+		goto fail;
+	if (hdr.magic != PAGED_MAGIC || hdr.version != PAGED_VERSION ||
+	    hdr.page_size != PAGED_PAGE_SIZE || !hdr.nr_ranges ||
+	    hdr.index_page != hdr.nr_pages + 1) {
+		printf("\n %s: %s is not a paged extent map", __func__, path);
+		ret = -EINVAL;
+		goto fail;
+	}
+	if (!hdr.clean) {
+		printf("\n %s: %s was not closed cleanly", __func__, path);
+		ret = -EUCLEAN;
+		goto fail;
+	}
+	ret = paged_init(pm, hdr.nr_ranges, max_resident);
+	if (ret < 0)
+		goto fail;
+	pm->fd = fd;
+	index = malloc(hdr.nr_ranges * sizeof(*index));
+	ret = index ? paged_rw(fd, index, hdr.nr_ranges * sizeof(*index),
+			       page_off(hdr.index_page), 0) : -ENOMEM;
+	if (ret < 0)
+		goto fail_free;
+	for (i = 0; i < hdr.nr_ranges; i++) {
+		if (index[i].page > hdr.nr_pages || (i ? index[i].start <= index[i - 1].start :
+						      index[i].start != 0)) {
+			printf("\n %s: %s: bad top index entry %lu", __func__, path, i);
+			ret = -EINVAL;
+			goto fail_free;
+		}
+		pm->ranges[i].start = index[i].start;
+		pm->ranges[i].page = index[i].page;
+	}
+	pm->nr_ranges = hdr.nr_ranges;
+	pm->nr_pages = hdr.nr_pages;
+	pm->nr_extents = hdr.nr_extents;
+	free(index);
+	/* Leaves may overwrite the index from here on */
+	ret = paged_write_header(pm, hdr.index_page, 0);
+	if (ret < 0)
+		goto fail_ranges;
+	return 0;
+
+fail_free:
+	free(index);
+fail_ranges:
+	free(pm->ranges);
+fail:
+	close(fd);
+	return ret;
+}
+
+/* Write everything back and drop every leaf */
+void paged_close(struct paged_map *pm)
+{
+	int ret;
+
+	ret = paged_flush(pm, 1);
+	if (ret < 0)
+		printf("\n %s: cannot write the map back: %d", __func__, ret);
+	while (pm->cold) {
+		pm->cold->dirty = 0;
+		paged_evict(pm);
+	}
+	extent_pool_exit(&pm->pool);
+	free(pm->ranges);
+	close(pm->fd);
+}
+
+/*
+ * Pack 'map' into the leaves of a map fresh from paged_create(), filled
+ * to PAGED_FILL extents so that updates do not split them right away.
+ * Nothing is made resident.
+ */
+int paged_from_map(struct paged_map *pm, struct extent_map *map)
+{
+	struct paged_leaf *leaf;
+	struct rb_iter it;
+	struct extent *e;
+	unsigned long nr = (map->n_extents + PAGED_FILL - 1) / PAGED_FILL, i = 0;
+	int ret = 0;
+
+	if (pm->nr_pages || pm->nr_resident)
+		return -EBUSY;
+	if (nr > pm->max_ranges) {
+		struct paged_range *r = realloc(pm->ranges, nr * sizeof(*r));
+
+		if (!r)
+			return -ENOMEM;
+		pm->ranges = r;
+		pm->max_ranges = nr;
+	}
+	leaf = calloc(1, PAGED_PAGE_SIZE);
+	if (!leaf)
+		return -ENOMEM;
+
+	for (e = extent_iter_first(map, &it); e; e = extent_iter_next(&it)) {
+		leaf->ext[leaf->nr].lba = e->lba;
+		leaf->ext[leaf->nr].pba = e->pba;
+		leaf->ext[leaf->nr].len = e->len;
+		if (++leaf->nr < PAGED_FILL && map->n_extents - pm->nr_extents > leaf->nr)
+			continue;
+		pm->ranges[i].start = i ? leaf->ext[0].lba : 0;
+		pm->ranges[i].page = ++pm->nr_pages;
+		pm->ranges[i].res = NULL;
+		ret = paged_rw(pm->fd, leaf, PAGED_PAGE_SIZE, page_off(pm->nr_pages), 1);
+		if (ret < 0)
+			break;
+		pm->nr_extents += leaf->nr;
+		memset(leaf, 0, PAGED_PAGE_SIZE);
+		i++;
+	}
+	free(leaf);
+	if (i)
+		pm->nr_ranges = i;
+	return ret;
+}
+
+/*
+ * Check every leaf, loading each in turn through the cache: extents in
+ * order, merged, inside their range. Returns the number of extents.
+ */
+long paged_check(struct paged_map *pm)
+{
+	struct paged_page *p;
+	struct extent *first, *last;
+	unsigned long i;
+	long total = 0;
+	int ret;
+
+	for (i = 0; i < pm->nr_ranges; i++) {
+		p = paged_get(pm, i, &ret);
+		if (!p)
+			return ret;
+		if (lsdm_tree_check(&p->map) < 0)
+			return -EINVAL;
+		first = rb_entry_safe(rb_first(&p->map.extent_tbl_root), struct extent, rb);
+		last = rb_entry_safe(rb_last(&p->map.extent_tbl_root), struct extent, rb);
+		if (first && (first->lba < pm->ranges[i].start ||
+			      last->lba + last->len > range_end(pm, i))) {
+			printf("\n %s: range %lu holds extents outside it", __func__, i);
+			return -EINVAL;
+		}
+		total += p->map.n_extents;
+	}
+	if (total != pm->nr_extents) {
+		printf("\n %s: %ld extents, %lu expected", __func__, total, pm->nr_extents);
+		return -EINVAL;
+	}
+	return total;
+}
@@ -0,0 +1,110 @@
+/*
+ * Demand paged extent map.
+ *
+ * For volumes with more extents than can stay resident. The LBA space is
+ * cut into ranges by a small in-memory top index; each range keeps its
+ * extents, sorted, in one fixed size leaf page of a file. A leaf is
+ * decoded into an extent_map of its own the first time it is touched and
+ * sits in an LRU cache of at most 'max_resident' pages; the coldest one
+ * is written back if dirty and dropped to make room. Updates go through
+ * lsdm_update_range() on the leaf maps, clipped at range boundaries, and
+ * a leaf that outgrows its page is split in two, adding a range.
+ *
+ * Resident memory is the top index (one struct paged_range per leaf)
+ * plus at most max_resident leaves of PAGED_PAGE_EXTENTS extents, all
+ * carved from one extent pool that evicted leaves give back to.
+ *
+ *	header page | leaf 1 | leaf 2 | ... | top index
+ *
+ * Like pmap, there is no journaling: the top index and the leaves are
+ * only consistent after paged_sync(), and a file that was not closed
+ * with paged_close() is refused on open.
+ */
+
+#ifndef _PAGED_H
+#define _PAGED_H
+
+#include<linux/types.h>
+#include"extent.h"
+
+#define PAGED_MAGIC		0x454741504d44534cULL	/* "LSDMPAGE" */
+#define PAGED_VERSION		1
+#define PAGED_PAGE_SIZE		4096
+#define PAGED_RESIDENT_DEFAULT	256
+
+struct paged_header {
+	__u64 magic;
+	__u32 version;
+	__u32 page_size;
+	__u64 nr_pages;		/* leaves, numbered from 1 */
+	__u64 nr_ranges;
+	__u64 nr_extents;
+	__u64 index_page;	/* first page of the top index */
+	__u32 clean;		/* set by paged_close(), cleared while open */
+	__u32 pad;
+};
+
+struct paged_rec {
+	sector_t lba;
+	sector_t pba;
+	__u32 len;
+};
+
+struct paged_leaf {
+	__u32 nr;
+	__u32 pad;
+	struct paged_rec ext[];
+};
+
+#define PAGED_PAGE_EXTENTS \
+	((PAGED_PAGE_SIZE - sizeof(struct paged_leaf)) / sizeof(struct paged_rec))
+
+/* Top index entry on disk */
+struct paged_index {
+	sector_t start;
+	__u32 page;
+};
+
+/* A decoded leaf */
+struct paged_page {
+	struct extent_map map;
+	sector_t start;			/* of its range */
+	int dirty;
+	struct paged_page *prev, *next;	/* LRU, hottest first */
+};
+
+/* Top index entry: covers [start, start of the next range) */
+struct paged_range {
+	sector_t start;
+	__u32 page;			/* leaf in the file, 0: none yet */
+	struct paged_page *res;		/* decoded leaf if resident */
+};
+
+struct paged_map {
+	int fd;
+	struct paged_range *ranges;
+	unsigned long nr_ranges, max_ranges;
+	unsigned long nr_pages;		/* leaves in the file */
+	unsigned long nr_extents;
+	struct paged_page *hot, *cold;	/* LRU list ends */
+	struct extent_pool pool;	/* extents of every resident leaf */
+	unsigned long nr_resident, max_resident;
+	struct seg_tbl *sit;		/* optional, sees updates only */
+
+	unsigned long nr_loads;
+	unsigned long nr_evictions;
+	unsigned long nr_writebacks;
+	unsigned long nr_splits;
+};
+
+int paged_create(struct paged_map *pm, const char *path, unsigned long max_resident);
+int paged_open(struct paged_map *pm, const char *path, unsigned long max_resident);
+int paged_sync(struct paged_map *pm);
+void paged_close(struct paged_map *pm);
+
+int paged_update_range(struct paged_map *pm, sector_t lba, sector_t pba, int len);
+sector_t paged_lookup(struct paged_map *pm, sector_t lba, int *len);
+int paged_from_map(struct paged_map *pm, struct extent_map *map);
+long paged_check(struct paged_map *pm);
+
+#endif /* _PAGED_H */
@@ -0,0 +1,222 @@
+/*
+ * Free space allocator for physical sectors.
+ * See pba_alloc.h for the overview.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<errno.h>
+#include"rbtree_augmented.h"
+#include"pba_alloc.h"
+
+static inline sector_t free_extent_compute_max(struct free_extent *fe)
+{
+	sector_t max = fe->len;
+	struct free_extent *child;
+
+	if (fe->rb.rb_left) {
+		child = rb_entry(fe->rb.rb_left, struct free_extent, rb);
+		if (child->max_len > max)
+			max = child->max_len;
+	}
+	if (fe->rb.rb_right) {
+		child = rb_entry(fe->rb.rb_right, struct free_extent, rb);
+		if (child->max_len > max)
+			max = child->max_len;
+	}
+	return max;
+}
+
+RB_DECLARE_CALLBACKS(static, pba_augment_cb, struct free_extent, rb,
+		     sector_t, max_len, free_extent_compute_max)
+
+void pba_allocator_init(struct pba_allocator *a)
+{
+	a->free_root = RB_ROOT;
+	a->nr_free = 0;
+	a->nr_runs = 0;
+	a->next_pba = 0;
+}
+
+static void free_extent_release(struct rb_node *node, void *arg)
+{
+	free(rb_entry(node, struct free_extent, rb));
+}
+
+void pba_allocator_exit(struct pba_allocator *a)
+{
+	rb_destroy(&a->free_root, free_extent_release, NULL);
+	pba_allocator_init(a);
+}
+
+static void pba_remove(struct pba_allocator *a, struct free_extent *fe)
+{
+	rb_erase_augmented(&fe->rb, &a->free_root, &pba_augment_cb);
+	a->nr_runs--;
+	free(fe);
+}
+
+/*
+ * Return sectors to the free pool. The range must not overlap free
+ * space already in the tree.
+ */
+int pba_free(struct pba_allocator *a, sector_t pba, sector_t len)
+{
+	struct rb_node **link = &a->free_root.rb_node, *parent = NULL, *node;
+	struct free_extent *fe, *prev = NULL, *next = NULL, *new;
+
+	if (len <= 0)
+		return -EINVAL;
+
+	/* Find the runs on either side of the freed range */
+	while (*link) {
+		parent = *link;
+		fe = rb_entry(parent, struct free_extent, rb);
+		if (pba + len <= fe->pba) {
+			next = fe;
+			link = &parent->rb_left;
+		} else if (pba >= fe->pba + fe->len) {
+			prev = fe;
+			link = &parent->rb_right;
+		} else {
+			printf("\n %s: pba: %d len: %d is already free (run pba: %d len: %d)",
+			       __func__, pba, len, fe->pba, fe->len);
+			return -EINVAL;
+		}
+	}
+
+	a->nr_free += len;
+	if (prev && prev->pba + prev->len == pba) {
+		prev->len += len;
+		if (next && next->pba == pba + len) {
+			prev->len += next->len;
+			pba_remove(a, next);
+		}
+		pba_augment_cb_propagate(&prev->rb, NULL);
+		return 0;
+	}
+	if (next && next->pba == pba + len) {
+		/* Growing 'next' downwards keeps it in the same place */
+		next->pba = pba;
+		next->len += len;
+		pba_augment_cb_propagate(&next->rb, NULL);
+		return 0;
+	}
+
+	new = malloc(sizeof(*new));
+	if (!new) {
+		a->nr_free -= len;
+		return -ENOMEM;
+	}
+	new->pba = pba;
+	new->len = len;
+	new->max_len = len;
+
+	/* The path to 'link' is unchanged; fix the maxima along it */
+	for (node = parent; node; node = rb_parent(node)) {
+		fe = rb_entry(node, struct free_extent, rb);
+		if (fe->max_len >= len)
+			break;
+		fe->max_len = len;
+	}
+	rb_link_node(&new->rb, parent, link);
+	rb_insert_augmented(&new->rb, &a->free_root, &pba_augment_cb);
+	a->nr_runs++;
+	return 0;
+}
+
+/*
+ * Lowest run starting at or after 'goal' that holds 'len' sectors.
+ * Subtrees whose longest run is too short are never entered.
+ */
+static struct free_extent *pba_first_fit(struct rb_node *node, sector_t goal, sector_t len)
+{
+	struct free_extent *fe, *found;
+
+	while (node) {
+		fe = rb_entry(node, struct free_extent, rb);
+		if (fe->max_len < len)
+			return NULL;
+		if (fe->pba >= goal) {
+			found = pba_first_fit(node->rb_left, goal, len);
+			if (found)
+				return found;
+			if (fe->len >= len)
+				return fe;
+		}
+		node = node->rb_right;
+	}
+	return NULL;
+}
+
+static sector_t pba_take(struct pba_allocator *a, struct free_extent *fe, sector_t len)
+{
+	sector_t pba = fe->pba;
+
+	a->nr_free -= len;
+	if (fe->len == len) {
+		pba_remove(a, fe);
+	} else {
+		fe->pba += len;
+		fe->len -= len;
+		pba_augment_cb_propagate(&fe->rb, NULL);
+	}
+	a->next_pba = pba + len;
+	return pba;
+}
+
+/* First fit: the lowest free run that holds 'len' sectors */
+int pba_alloc(struct pba_allocator *a, sector_t len, sector_t *pba)
+{
+	return pba_alloc_after(a, 0, len, pba);
+}
+
+/*
+ * Next fit: the lowest run at or after 'goal', wrapping around to the
+ * start of the device when nothing past 'goal' is long enough.
+ */
+int pba_alloc_after(struct pba_allocator *a, sector_t goal, sector_t len, sector_t *pba)
+{
+	struct free_extent *fe;
+
+	if (len <= 0)
+		return -EINVAL;
+
+	fe = pba_first_fit(a->free_root.rb_node, goal, len);
+	if (!fe && goal)
+		fe = pba_first_fit(a->free_root.rb_node, 0, len);
+	if (!fe)
+		return -ENOSPC;
+
+	*pba = pba_take(a, fe, len);
+	return 0;
+}
+
+/*
+ * Write 'len' sectors at 'lba': allocate physical space next fit from the
+ * write pointer and record the mapping. A write that does not fit in one
+ * free run is spread over as many runs as it takes, longest first.
+ */
+int pba_map_write(struct pba_allocator *a, struct extent_map *map, sector_t lba, int len)
+{
+	sector_t pba, chunk;
+	int ret;
+
+	if (len > a->nr_free)
+		return -ENOSPC;
+
+	while (len) {
+		chunk = pba_max_run(a);
+		if (chunk > len)
+			chunk = len;
+		ret = pba_alloc_after(a, a->next_pba, chunk, &pba);
+		if (ret < 0)
+			return ret;
+		ret = lsdm_update_range(map, lba, pba, chunk);
+		if (ret < 0)
+			return ret;
+		lba += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
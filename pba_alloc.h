@@ -0,0 +1,48 @@
+/*
+ * Free space allocator for physical sectors.
+ *
+ * Free runs are kept in an rbtree ordered by PBA. Every node is augmented
+ * with the longest free run found in its subtree, so "lowest run of at
+ * least len sectors" is answered in O(log n) by pruning subtrees whose
+ * longest run is too short. Freed ranges are coalesced with their
+ * neighbours, so the tree never holds two adjacent runs.
+ */
+
+#ifndef _PBA_ALLOC_H
+#define _PBA_ALLOC_H
+
+#include"rbtree.h"
+#include"extent.h"
+
+struct free_extent {
+	struct rb_node rb;
+	sector_t pba;
+	sector_t len;
+	sector_t max_len;	/* longest run in this subtree */
+};
+
+struct pba_allocator {
+	struct rb_root free_root;
+	sector_t nr_free;	/* free sectors */
+	unsigned nr_runs;	/* nodes in free_root */
+	sector_t next_pba;	/* write pointer for next-fit */
+};
+
+void pba_allocator_init(struct pba_allocator *a);
+void pba_allocator_exit(struct pba_allocator *a);
+
+int pba_free(struct pba_allocator *a, sector_t pba, sector_t len);
+int pba_alloc(struct pba_allocator *a, sector_t len, sector_t *pba);
+int pba_alloc_after(struct pba_allocator *a, sector_t goal, sector_t len, sector_t *pba);
+
+int pba_map_write(struct pba_allocator *a, struct extent_map *map, sector_t lba, int len);
+
+/* Longest free run on the device */
+static inline sector_t pba_max_run(struct pba_allocator *a)
+{
+	struct rb_node *node = a->free_root.rb_node;
+
+	return node ? rb_entry(node, struct free_extent, rb)->max_len : 0;
+}
+
+#endif /* _PBA_ALLOC_H */
@@ -0,0 +1,592 @@
+/*
+ * Persistent extent map.
+ * See pmap.h for the overview.
+ *
+ * The red-black tree below is the textbook one (as in rbtree.c, but with
+ * offsets for links). Every link is an offset from pm->base, so growing
+ * the file with mremap() may move the mapping without touching a node.
+ */
+
+#define _GNU_SOURCE	/* mremap() */
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include"pmap.h"
+
+#define PMAP_RED	0
+#define PMAP_BLACK	1
+
+/* Nodes start on the first cache line after the header */
+#define PMAP_NODES_START	64
+
+static inline struct pmap_node *pnode(struct pmap *pm, __u64 off)
+{
+	return off ? (struct pmap_node *)(pm->base + off) : NULL;
+}
+
+static inline __u64 poff(struct pmap *pm, struct pmap_node *n)
+{
+	return n ? (char *)n - pm->base : 0;
+}
+
+static inline struct pmap_node *pm_parent(struct pmap *pm, struct pmap_node *n)
+{
+	return pnode(pm, n->parent_color & ~3ULL);
+}
+
+static inline struct pmap_node *pm_left(struct pmap *pm, struct pmap_node *n)
+{
+	return pnode(pm, n->left);
+}
+
+static inline struct pmap_node *pm_right(struct pmap *pm, struct pmap_node *n)
+{
+	return pnode(pm, n->right);
+}
+
+static inline int pm_is_black(struct pmap_node *n)
+{
+	return !n || (n->parent_color & 1);
+}
+
+static inline void pm_set_color(struct pmap_node *n, int color)
+{
+	n->parent_color = (n->parent_color & ~1ULL) | color;
+}
+
+static inline void pm_set_parent(struct pmap *pm, struct pmap_node *n, struct pmap_node *p)
+{
+	n->parent_color = poff(pm, p) | (n->parent_color & 1);
+}
+
+/* Point whatever linked to 'old' (parent or root) at 'new' */
+static void pm_change_child(struct pmap *pm, struct pmap_node *old,
+			    struct pmap_node *new, struct pmap_node *parent)
+{
+	if (!parent)
+		pm->hdr->root = poff(pm, new);
+	else if (parent->left == poff(pm, old))
+		parent->left = poff(pm, new);
+	else
+		parent->right = poff(pm, new);
+}
+
+static void pm_rotate_left(struct pmap *pm, struct pmap_node *x)
+{
+	struct pmap_node *y = pm_right(pm, x), *p = pm_parent(pm, x);
+
+	x->right = y->left;
+	if (y->left)
+		pm_set_parent(pm, pm_left(pm, y), x);
+	pm_set_parent(pm, y, p);
+	pm_change_child(pm, x, y, p);
+	y->left = poff(pm, x);
+	pm_set_parent(pm, x, y);
+}
+
+static void pm_rotate_right(struct pmap *pm, struct pmap_node *x)
+{
+	struct pmap_node *y = pm_left(pm, x), *p = pm_parent(pm, x);
+
+	x->left = y->right;
+	if (y->right)
+		pm_set_parent(pm, pm_right(pm, y), x);
+	pm_set_parent(pm, y, p);
+	pm_change_child(pm, x, y, p);
+	y->right = poff(pm, x);
+	pm_set_parent(pm, x, y);
+}
+
+static void pm_insert_color(struct pmap *pm, struct pmap_node *n)
+{
+	struct pmap_node *p, *g, *u;
+
+	while ((p = pm_parent(pm, n)) && !pm_is_black(p)) {
+		g = pm_parent(pm, p);
+		if (p == pm_left(pm, g)) {
+			u = pm_right(pm, g);
+			if (!pm_is_black(u)) {
+				pm_set_color(p, PMAP_BLACK);
+				pm_set_color(u, PMAP_BLACK);
+				pm_set_color(g, PMAP_RED);
+				n = g;
+				continue;
+			}
+			if (n == pm_right(pm, p)) {
+				pm_rotate_left(pm, p);
+				n = p;
+				p = pm_parent(pm, n);
+			}
+			pm_set_color(p, PMAP_BLACK);
+			pm_set_color(g, PMAP_RED);
+			pm_rotate_right(pm, g);
+		} else {
+			u = pm_left(pm, g);
+			if (!pm_is_black(u)) {
+				pm_set_color(p, PMAP_BLACK);
+				pm_set_color(u, PMAP_BLACK);
+				pm_set_color(g, PMAP_RED);
+				n = g;
+				continue;
+			}
+			if (n == pm_left(pm, p)) {
+				pm_rotate_right(pm, p);
+				n = p;
+				p = pm_parent(pm, n);
+			}
+			pm_set_color(p, PMAP_BLACK);
+			pm_set_color(g, PMAP_RED);
+			pm_rotate_left(pm, g);
+		}
+	}
+	pm_set_color(pnode(pm, pm->hdr->root), PMAP_BLACK);
+}
+
+static void pm_erase_color(struct pmap *pm, struct pmap_node *x, struct pmap_node *xp)
+{
+	struct pmap_node *w;
+
+	while (x != pnode(pm, pm->hdr->root) && pm_is_black(x)) {
+		if (x == pm_left(pm, xp)) {
+			w = pm_right(pm, xp);
+			if (!pm_is_black(w)) {
+				pm_set_color(w, PMAP_BLACK);
+				pm_set_color(xp, PMAP_RED);
+				pm_rotate_left(pm, xp);
+				w = pm_right(pm, xp);
+			}
+			if (pm_is_black(pm_left(pm, w)) && pm_is_black(pm_right(pm, w))) {
+				pm_set_color(w, PMAP_RED);
+				x = xp;
+				xp = pm_parent(pm, x);
+				continue;
+			}
+			if (pm_is_black(pm_right(pm, w))) {
+				pm_set_color(pm_left(pm, w), PMAP_BLACK);
+				pm_set_color(w, PMAP_RED);
+				pm_rotate_right(pm, w);
+				w = pm_right(pm, xp);
+			}
+			pm_set_color(w, xp->parent_color & 1);
+			pm_set_color(xp, PMAP_BLACK);
+			pm_set_color(pm_right(pm, w), PMAP_BLACK);
+			pm_rotate_left(pm, xp);
+		} else {
+			w = pm_left(pm, xp);
+			if (!pm_is_black(w)) {
+				pm_set_color(w, PMAP_BLACK);
+				pm_set_color(xp, PMAP_RED);
+				pm_rotate_right(pm, xp);
+				w = pm_left(pm, xp);
+			}
+			if (pm_is_black(pm_left(pm, w)) && pm_is_black(pm_right(pm, w))) {
+				pm_set_color(w, PMAP_RED);
+				x = xp;
+				xp = pm_parent(pm, x);
+				continue;
+			}
+			if (pm_is_black(pm_left(pm, w))) {
+				pm_set_color(pm_right(pm, w), PMAP_BLACK);
+				pm_set_color(w, PMAP_RED);
+				pm_rotate_left(pm, w);
+				w = pm_left(pm, xp);
+			}
+			pm_set_color(w, xp->parent_color & 1);
+			pm_set_color(xp, PMAP_BLACK);
+			pm_set_color(pm_left(pm, w), PMAP_BLACK);
+			pm_rotate_right(pm, xp);
+		}
+		x = pnode(pm, pm->hdr->root);
+		break;
+	}
+	if (x)
+		pm_set_color(x, PMAP_BLACK);
+}
+
+/* Unlink 'z' and put it on the free list */
+static void pm_erase(struct pmap *pm, struct pmap_node *z)
+{
+	struct pmap_node *y = z, *x, *xp;
+	int black;
+
+	if (z->left && z->right) {
+		y = pm_right(pm, z);
+		while (y->left)
+			y = pm_left(pm, y);
+	}
+	x = y->left ? pm_left(pm, y) : pm_right(pm, y);
+	xp = pm_parent(pm, y);
+	black = pm_is_black(y);
+	if (x)
+		pm_set_parent(pm, x, xp);
+	pm_change_child(pm, y, x, xp);
+
+	if (y != z) {
+		/* The successor takes over z's place and color */
+		if (xp == z)
+			xp = y;
+		y->parent_color = z->parent_color;
+		y->left = z->left;
+		y->right = z->right;
+		if (y->left)
+			pm_set_parent(pm, pm_left(pm, y), y);
+		if (y->right)
+			pm_set_parent(pm, pm_right(pm, y), y);
+		pm_change_child(pm, z, y, pm_parent(pm, z));
+	}
+	if (black)
+		pm_erase_color(pm, x, xp);
+
+	z->left = pm->hdr->free_list;
+	pm->hdr->free_list = poff(pm, z);
+	pm->hdr->nr_extents--;
+}
+
+static int pmap_map(struct pmap *pm, size_t size)
+{
+	pm->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pm->fd, 0);
+	if (pm->base == MAP_FAILED)
+		return -errno;
+	pm->size = size;
+	pm->hdr = (struct pmap_header *)pm->base;
+	return 0;
+}
+
+/* Double the file; the mapping may move but no offset changes */
+static int pmap_grow(struct pmap *pm)
+{
+	size_t size = pm->size * 2;
+	void *base;
+
+	if (ftruncate(pm->fd, size) < 0)
+		return -errno;
+	base = mremap(pm->base, pm->size, size, MREMAP_MAYMOVE);
+	if (base == MAP_FAILED)
+		return -errno;
+	pm->base = base;
+	pm->size = size;
+	pm->hdr = (struct pmap_header *)pm->base;
+	pm->hdr->file_size = size;
+	return 0;
+}
+
+/* Make sure 'nr' nodes can be allocated without moving the mapping */
+static int pmap_reserve(struct pmap *pm, int nr)
+{
+	__u64 need = pm->hdr->next_free + nr * sizeof(struct pmap_node);
+	int ret;
+
+	while (need > pm->size) {
+		ret = pmap_grow(pm);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static struct pmap_node *pmap_alloc(struct pmap *pm)
+{
+	struct pmap_node *n;
+
+	if (pm->hdr->free_list) {
+		n = pnode(pm, pm->hdr->free_list);
+		pm->hdr->free_list = n->left;
+	} else {
+		n = pnode(pm, pm->hdr->next_free);
+		pm->hdr->next_free += sizeof(*n);
+	}
+	memset(n, 0, sizeof(*n));
+	return n;
+}
+
+int pmap_create(struct pmap *pm, const char *path, unsigned long nr_nodes)
+{
+	size_t size = PMAP_NODES_START + nr_nodes * sizeof(struct pmap_node);
+	int ret;
+
+	pm->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (pm->fd < 0)
+		return -errno;
+	if (ftruncate(pm->fd, size) < 0) {
+		ret = -errno;
+		close(pm->fd);
+		return ret;
+	}
+	ret = pmap_map(pm, size);
+	if (ret < 0) {
+		close(pm->fd);
+		return ret;
+	}
+	memset(pm->hdr, 0, sizeof(*pm->hdr));
+	pm->hdr->magic = PMAP_MAGIC;
+	pm->hdr->version = PMAP_VERSION;
+	pm->hdr->node_size = sizeof(struct pmap_node);
+	pm->hdr->file_size = size;
+	pm->hdr->next_free = PMAP_NODES_START;
+	return 0;
+}
+
+static int pmap_offset_ok(struct pmap *pm, __u64 off)
+{
+	return !off || (off >= PMAP_NODES_START && off < pm->hdr->next_free &&
+			!((off - PMAP_NODES_START) % sizeof(struct pmap_node)));
+}
+
+/* mmap an existing map; only the header is looked at */
+int pmap_open(struct pmap *pm, const char *path)
+{
+	struct pmap_header *h;
+	struct stat st;
+	int ret = -EINVAL;
+
+	pm->fd = open(path, O_RDWR);
+	if (pm->fd < 0)
+		return -errno;
+	if (fstat(pm->fd, &st) < 0 || st.st_size < PMAP_NODES_START) {
+		close(pm->fd);
+		return -EINVAL;
+	}
+	ret = pmap_map(pm, st.st_size);
+	if (ret < 0) {
+		close(pm->fd);
+		return ret;
+	}
+
+	h = pm->hdr;
+	ret = -EINVAL;
+	if (h->magic != PMAP_MAGIC || h->version != PMAP_VERSION ||
+	    h->node_size != sizeof(struct pmap_node) || h->file_size != st.st_size ||
+	    h->next_free > h->file_size || !pmap_offset_ok(pm, h->root) ||
+	    !pmap_offset_ok(pm, h->free_list)) {
+		printf("\n %s: %s is not a valid extent map", __func__, path);
+		goto fail;
+	}
+	if (!h->clean) {
+		printf("\n %s: %s was not closed cleanly", __func__, path);
+		ret = -EUCLEAN;
+		goto fail;
+	}
+	h->clean = 0;
+	return 0;
+fail:
+	munmap(pm->base, pm->size);
+	close(pm->fd);
+	return ret;
+}
+
+int pmap_sync(struct pmap *pm)
+{
+	return msync(pm->base, pm->size, MS_SYNC) < 0 ? -errno : 0;
+}
+
+void pmap_close(struct pmap *pm)
+{
+	pmap_sync(pm);
+	pm->hdr->clean = 1;
+	pmap_sync(pm);
+	munmap(pm->base, pm->size);
+	close(pm->fd);
+}
+
+struct pmap_node *pmap_geq(struct pmap *pm, sector_t lba)
+{
+	struct pmap_node *n = pnode(pm, pm->hdr->root), *higher = NULL;
+
+	while (n) {
+		if (lba < n->lba) {
+			higher = n;
+			n = pm_left(pm, n);
+		} else if (lba >= n->lba + n->len) {
+			n = pm_right(pm, n);
+		} else {
+			return n;
+		}
+	}
+	return higher;
+}
+
+struct pmap_node *pmap_first(struct pmap *pm)
+{
+	struct pmap_node *n = pnode(pm, pm->hdr->root);
+
+	while (n && n->left)
+		n = pm_left(pm, n);
+	return n;
+}
+
+struct pmap_node *pmap_next(struct pmap *pm, struct pmap_node *n)
+{
+	struct pmap_node *p;
+
+	if (n->right) {
+		n = pm_right(pm, n);
+		while (n->left)
+			n = pm_left(pm, n);
+		return n;
+	}
+	while ((p = pm_parent(pm, n)) && n == pm_right(pm, p))
+		n = p;
+	return p;
+}
+
+static struct pmap_node *pmap_prev(struct pmap *pm, struct pmap_node *n)
+{
+	struct pmap_node *p;
+
+	if (n->left) {
+		n = pm_left(pm, n);
+		while (n->right)
+			n = pm_right(pm, n);
+		return n;
+	}
+	while ((p = pm_parent(pm, n)) && n == pm_left(pm, p))
+		n = p;
+	return p;
+}
+
+/* Link a new extent that overlaps nothing in the map */
+static struct pmap_node *pmap_insert(struct pmap *pm, sector_t lba, sector_t pba, __u32 len)
+{
+	struct pmap_node *n, *parent = NULL, *cur = pnode(pm, pm->hdr->root);
+	int left = 0;
+
+	n = pmap_alloc(pm);
+	n->lba = lba;
+	n->pba = pba;
+	n->len = len;
+	while (cur) {
+		parent = cur;
+		left = lba < cur->lba;
+		cur = left ? pm_left(pm, cur) : pm_right(pm, cur);
+	}
+	n->parent_color = poff(pm, parent);	/* red */
+	if (!parent)
+		pm->hdr->root = poff(pm, n);
+	else if (left)
+		parent->left = poff(pm, n);
+	else
+		parent->right = poff(pm, n);
+	pm_insert_color(pm, n);
+	pm->hdr->nr_extents++;
+	return n;
+}
+
+/*
+ * Map [lba, lba + len) to [pba, pba + len), with the same semantics as
+ * lsdm_update_range(): whatever the range overlapped is trimmed, split
+ * or dropped, and the new extent is merged with contiguous neighbours.
+ */
+int pmap_update_range(struct pmap *pm, sector_t lba, sector_t pba, int len)
+{
+	struct pmap_node *e, *next, *n;
+	sector_t end = lba + len, d;
+	int ret;
+
+	if (len <= 0)
+		return -EINVAL;
+	/* At most a split and the new extent; no node may move after this */
+	ret = pmap_reserve(pm, 2);
+	if (ret < 0)
+		return ret;
+
+	for (e = pmap_geq(pm, lba); e && e->lba < end; e = next) {
+		next = pmap_next(pm, e);
+		if (e->lba < lba) {
+			if (e->lba + e->len > end) {
+				/* Punching a hole: keep both sides */
+				d = end - e->lba;
+				pmap_insert(pm, end, e->pba + d, e->len - d);
+				e->len = lba - e->lba;
+				break;
+			}
+			e->len = lba - e->lba;
+		} else if (e->lba + e->len > end) {
+			d = end - e->lba;
+			e->lba = end;
+			e->pba += d;
+			e->len -= d;
+			break;
+		} else {
+			pm_erase(pm, e);
+		}
+	}
+
+	n = pmap_insert(pm, lba, pba, len);
+	e = pmap_prev(pm, n);
+	if (e && e->lba + e->len == lba && e->pba + e->len == pba) {
+		e->len += n->len;
+		pm_erase(pm, n);
+		n = e;
+	}
+	e = pmap_next(pm, n);
+	if (e && n->lba + n->len == e->lba && n->pba + n->len == e->pba) {
+		n->len += e->len;
+		pm_erase(pm, e);
+	}
+	return 0;
+}
+
+/* Copy an in-memory map into an empty persistent one */
+int pmap_from_map(struct pmap *pm, struct extent_map *map)
+{
+	struct rb_iter it;
+	struct extent *e;
+	int ret;
+
+	for (e = extent_iter_first(map, &it); e; e = extent_iter_next(&it)) {
+		ret = pmap_reserve(pm, 1);
+		if (ret < 0)
+			return ret;
+		pmap_insert(pm, e->lba, e->pba, e->len);
+	}
+	return 0;
+}
+
+static int pmap_check_node(struct pmap *pm, struct pmap_node *n, unsigned long *count)
+{
+	struct pmap_node *l, *r;
+	int lh, rh;
+
+	if (!n)
+		return 1;
+	(*count)++;
+	l = pm_left(pm, n);
+	r = pm_right(pm, n);
+	if ((l && pm_parent(pm, l) != n) || (r && pm_parent(pm, r) != n))
+		return -1;
+	if (!pm_is_black(n) && (!pm_is_black(l) || !pm_is_black(r)))
+		return -1;
+	if ((l && l->lba + l->len > n->lba) || (r && n->lba + n->len > r->lba))
+		return -1;
+	lh = pmap_check_node(pm, l, count);
+	rh = pmap_check_node(pm, r, count);
+	if (lh < 0 || rh < 0 || lh != rh)
+		return -1;
+	return lh + pm_is_black(n);
+}
+
+/* Red-black properties, order of neighbours and the extent count */
+int pmap_check(struct pmap *pm)
+{
+	struct pmap_node *e, *next;
+	unsigned long count = 0;
+
+	if (pmap_check_node(pm, pnode(pm, pm->hdr->root), &count) < 0 ||
+	    count != pm->hdr->nr_extents) {
+		printf("\n %s: the tree is corrupt", __func__);
+		return -1;
+	}
+	for (e = pmap_first(pm); e && (next = pmap_next(pm, e)); e = next) {
+		if (e->lba + e->len > next->lba) {
+			printf("\n %s: lba %d len %d overlaps lba %d", __func__,
+			       e->lba, e->len, next->lba);
+			return -1;
+		}
+	}
+	return 0;
+}
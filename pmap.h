@@ -0,0 +1,72 @@
+/*
+ * Persistent extent map.
+ *
+ * The extents live in a file that is mmap'd as a whole. Nodes are linked
+ * by their offset in the file instead of by pointer, with the color in
+ * the low bit of the parent offset just like __rb_parent_color, so the
+ * tree is valid wherever the file gets mapped. Opening a volume is an
+ * mmap and a check of the header; nothing is rebuilt.
+ *
+ * There is no journaling: a file that was not closed with pmap_close()
+ * is refused on open.
+ */
+
+#ifndef _PMAP_H
+#define _PMAP_H
+
+#include<stddef.h>
+#include<linux/types.h>
+#include"extent.h"
+
+#define PMAP_MAGIC	0x50414d504d44534cULL	/* "LSDMPMAP" */
+#define PMAP_VERSION	1
+
+struct pmap_header {
+	__u64 magic;
+	__u32 version;
+	__u32 node_size;	/* sizeof(struct pmap_node) when created */
+	__u64 file_size;
+	__u64 root;		/* offset of the root node, 0: empty */
+	__u64 free_list;	/* freed nodes, linked through 'left' */
+	__u64 next_free;	/* first node never handed out */
+	__u64 nr_extents;
+	__u32 clean;		/* set by pmap_close(), cleared while open */
+	__u32 pad;
+};
+
+/* Offset 0 is the header, so it doubles as the NULL link */
+struct pmap_node {
+	__u64 parent_color;
+	__u64 left, right;
+	sector_t lba;
+	sector_t pba;
+	__u32 len;
+	__u32 pad;
+};
+
+struct pmap {
+	int fd;
+	char *base;
+	size_t size;
+	struct pmap_header *hdr;
+};
+
+int pmap_create(struct pmap *pm, const char *path, unsigned long nr_nodes);
+int pmap_open(struct pmap *pm, const char *path);
+int pmap_sync(struct pmap *pm);
+void pmap_close(struct pmap *pm);
+
+int pmap_update_range(struct pmap *pm, sector_t lba, sector_t pba, int len);
+/* The extent holding 'lba' or the next higher one, NULL if none */
+struct pmap_node *pmap_geq(struct pmap *pm, sector_t lba);
+struct pmap_node *pmap_next(struct pmap *pm, struct pmap_node *node);
+struct pmap_node *pmap_first(struct pmap *pm);
+int pmap_from_map(struct pmap *pm, struct extent_map *map);
+int pmap_check(struct pmap *pm);
+
+static inline unsigned long pmap_nr_extents(struct pmap *pm)
+{
+	return pm->hdr->nr_extents;
+}
+
+#endif /* _PMAP_H */
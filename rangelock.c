@@ -0,0 +1,223 @@
+/*
+ * Range locks over the LBA space.
+ * See rangelock.h for the overview.
+ */
+
+#include<stdio.h>
+#include<errno.h>
+#include"rbtree_augmented.h"
+#include"rangelock.h"
+
+static inline sector_t range_lock_compute_last(struct range_lock *rl)
+{
+	sector_t last = rl->last;
+	struct range_lock *child;
+
+	if (rl->rb.rb_left) {
+		child = rb_entry(rl->rb.rb_left, struct range_lock, rb);
+		if (child->subtree_last > last)
+			last = child->subtree_last;
+	}
+	if (rl->rb.rb_right) {
+		child = rb_entry(rl->rb.rb_right, struct range_lock, rb);
+		if (child->subtree_last > last)
+			last = child->subtree_last;
+	}
+	return last;
+}
+
+RB_DECLARE_CALLBACKS(static, range_lock_augment_cb, struct range_lock, rb,
+		     sector_t, subtree_last, range_lock_compute_last)
+
+void range_lock_tree_init(struct range_lock_tree *tree)
+{
+	pthread_mutex_init(&tree->lock, NULL);
+	tree->root = RB_ROOT;
+	tree->nr_locks = 0;
+	tree->nr_contended = 0;
+}
+
+/* Every lock must have been released */
+void range_lock_tree_exit(struct range_lock_tree *tree)
+{
+	pthread_mutex_destroy(&tree->lock);
+}
+
+void range_lock_init(struct range_lock *rl, sector_t lba, int len)
+{
+	RB_CLEAR_NODE(&rl->rb);
+	rl->start = lba;
+	rl->last = lba + len - 1;
+	rl->subtree_last = rl->last;
+	rl->exclusive = 0;
+	rl->blocking = 0;
+	pthread_cond_init(&rl->wait, NULL);
+}
+
+void range_lock_exit(struct range_lock *rl)
+{
+	pthread_cond_destroy(&rl->wait);
+}
+
+static inline int range_conflict(struct range_lock *a, struct range_lock *b)
+{
+	return a->exclusive || b->exclusive;
+}
+
+/*
+ * Call fn() on every lock in the subtree of 'node' that overlaps
+ * [start, last]. Subtrees that end below 'start' are never entered, and
+ * neither are right subtrees of locks starting above 'last'.
+ */
+static void range_for_each(struct rb_node *node, sector_t start, sector_t last,
+			   void (*fn)(struct range_lock *, void *), void *arg)
+{
+	struct range_lock *rl;
+
+	while (node) {
+		rl = rb_entry(node, struct range_lock, rb);
+		if (rl->subtree_last < start)
+			return;
+		range_for_each(node->rb_left, start, last, fn, arg);
+		if (rl->start > last)
+			return;
+		if (rl->last >= start)
+			fn(rl, arg);
+		node = node->rb_right;
+	}
+}
+
+static void range_count_blocker(struct range_lock *other, void *arg)
+{
+	struct range_lock *rl = arg;
+
+	if (range_conflict(rl, other))
+		rl->blocking++;
+}
+
+static void range_insert(struct range_lock_tree *tree, struct range_lock *rl)
+{
+	struct rb_node **link = &tree->root.rb_node, *parent = NULL;
+	struct range_lock *p;
+
+	while (*link) {
+		parent = *link;
+		p = rb_entry(parent, struct range_lock, rb);
+		if (p->subtree_last < rl->last)
+			p->subtree_last = rl->last;
+		if (rl->start < p->start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rl->subtree_last = rl->last;
+	rb_link_node(&rl->rb, parent, link);
+	rb_insert_augmented(&rl->rb, &tree->root, &range_lock_augment_cb);
+	tree->nr_locks++;
+}
+
+static void range_erase(struct range_lock_tree *tree, struct range_lock *rl)
+{
+	rb_erase_augmented(&rl->rb, &tree->root, &range_lock_augment_cb);
+	RB_CLEAR_NODE(&rl->rb);
+	tree->nr_locks--;
+}
+
+static void range_lock_common(struct range_lock_tree *tree, struct range_lock *rl,
+			      int exclusive)
+{
+	rl->exclusive = exclusive;
+	rl->blocking = 0;
+	pthread_mutex_lock(&tree->lock);
+	range_for_each(tree->root.rb_node, rl->start, rl->last, range_count_blocker, rl);
+	range_insert(tree, rl);
+	if (rl->blocking) {
+		tree->nr_contended++;
+		while (rl->blocking)
+			pthread_cond_wait(&rl->wait, &tree->lock);
+	}
+	pthread_mutex_unlock(&tree->lock);
+}
+
+void range_read_lock(struct range_lock_tree *tree, struct range_lock *rl)
+{
+	range_lock_common(tree, rl, 0);
+}
+
+void range_write_lock(struct range_lock_tree *tree, struct range_lock *rl)
+{
+	range_lock_common(tree, rl, 1);
+}
+
+/* Non zero if the lock was taken; never waits */
+static int range_trylock_common(struct range_lock_tree *tree, struct range_lock *rl,
+				int exclusive)
+{
+	rl->exclusive = exclusive;
+	rl->blocking = 0;
+	pthread_mutex_lock(&tree->lock);
+	range_for_each(tree->root.rb_node, rl->start, rl->last, range_count_blocker, rl);
+	if (!rl->blocking)
+		range_insert(tree, rl);
+	pthread_mutex_unlock(&tree->lock);
+	return !rl->blocking;
+}
+
+int range_read_trylock(struct range_lock_tree *tree, struct range_lock *rl)
+{
+	return range_trylock_common(tree, rl, 0);
+}
+
+int range_write_trylock(struct range_lock_tree *tree, struct range_lock *rl)
+{
+	return range_trylock_common(tree, rl, 1);
+}
+
+static void range_wake_blocked(struct range_lock *other, void *arg)
+{
+	struct range_lock *rl = arg;
+
+	/* Conflicting locks still in the tree all queued up behind 'rl' */
+	if (other != rl && range_conflict(rl, other) && !--other->blocking)
+		pthread_cond_signal(&other->wait);
+}
+
+void range_unlock(struct range_lock_tree *tree, struct range_lock *rl)
+{
+	pthread_mutex_lock(&tree->lock);
+	range_erase(tree, rl);
+	range_for_each(tree->root.rb_node, rl->start, rl->last, range_wake_blocked, rl);
+	pthread_mutex_unlock(&tree->lock);
+}
+
+static int range_check_node(struct rb_node *node, unsigned long *nr)
+{
+	struct range_lock *rl;
+
+	if (!node)
+		return 0;
+	rl = rb_entry(node, struct range_lock, rb);
+	if (rl->subtree_last != range_lock_compute_last(rl) || rl->last < rl->start) {
+		printf("\n %s: lock [%d, %d] has subtree_last %d", __func__,
+		       rl->start, rl->last, rl->subtree_last);
+		return -EINVAL;
+	}
+	(*nr)++;
+	if (range_check_node(node->rb_left, nr) < 0)
+		return -EINVAL;
+	return range_check_node(node->rb_right, nr);
+}
+
+/* The augmented ends are right and the tree holds nr_locks locks */
+int range_lock_tree_check(struct range_lock_tree *tree)
+{
+	unsigned long nr = 0;
+	int ret;
+
+	pthread_mutex_lock(&tree->lock);
+	ret = range_check_node(tree->root.rb_node, &nr);
+	if (!ret && nr != tree->nr_locks)
+		ret = -EINVAL;
+	pthread_mutex_unlock(&tree->lock);
+	return ret;
+}
@@ -0,0 +1,55 @@
+/*
+ * Range locks over the LBA space.
+ *
+ * Every lock, held or waiting, sits in an interval tree: an rbtree
+ * ordered by start and augmented with the highest end in each subtree,
+ * so the locks overlapping a range are found without visiting the rest.
+ * Shared locks only conflict with exclusive ones. A new lock counts the
+ * conflicting locks already in the tree and waits until all of them are
+ * released; releasing a lock decrements the count of every conflicting
+ * lock that came after it and wakes those that reach zero. Waiters are
+ * therefore served in arrival order and writers cannot starve.
+ *
+ * The tree itself is protected by a mutex held only while a lock is
+ * inserted or removed, never while it is waited on or held.
+ */
+
+#ifndef _RANGELOCK_H
+#define _RANGELOCK_H
+
+#include<pthread.h>
+#include"rbtree.h"
+#include"extent.h"
+
+struct range_lock {
+	struct rb_node rb;
+	sector_t start;
+	sector_t last;			/* inclusive */
+	sector_t subtree_last;
+	int exclusive;
+	unsigned long blocking;		/* conflicting locks ahead of this one */
+	pthread_cond_t wait;
+};
+
+struct range_lock_tree {
+	pthread_mutex_t lock;
+	struct rb_root root;
+	unsigned long nr_locks;		/* held and waiting */
+	unsigned long nr_contended;	/* locks that had to wait */
+};
+
+void range_lock_tree_init(struct range_lock_tree *tree);
+void range_lock_tree_exit(struct range_lock_tree *tree);
+
+void range_lock_init(struct range_lock *rl, sector_t lba, int len);
+void range_lock_exit(struct range_lock *rl);
+
+void range_read_lock(struct range_lock_tree *tree, struct range_lock *rl);
+void range_write_lock(struct range_lock_tree *tree, struct range_lock *rl);
+int range_read_trylock(struct range_lock_tree *tree, struct range_lock *rl);
+int range_write_trylock(struct range_lock_tree *tree, struct range_lock *rl);
+void range_unlock(struct range_lock_tree *tree, struct range_lock *rl);
+
+int range_lock_tree_check(struct range_lock_tree *tree);
+
+#endif /* _RANGELOCK_H */
@@ -0,0 +1,43 @@
+/*
+ * Optional USDT probes on the tree and extent map operations, for
+ * tracing a running process with perf or bpftrace (see probes/).
+ *
+ * They are only compiled in with CONFIG_RB_USDT (make USDT=1), which
+ * needs <sys/sdt.h> from systemtap-sdt-dev. A compiled in probe is a
+ * single nop until a tracer attaches to it, and its arguments are only
+ * evaluated into registers. Without CONFIG_RB_USDT every rb_probe*() is
+ * an empty statement.
+ *
+ * Probes in rbtree.c belong to the provider "urb" (liburb.so), those in
+ * extent.c to "lsdm" (the program linking it). Every operation has an
+ * <op>_entry and an <op>_return probe:
+ *
+ *   urb:insert	rb_insert_color(), rb_insert_after/before()	node, root
+ *   urb:erase	rb_erase()					node, root
+ *   lsdm:insert	entry: lba, len, hinted; return: lba, len, depth
+ *		of the extent it merged into
+ *   lsdm:merge	lba, len; on return those of the merged extent
+ *   lsdm:lookup	stl_rb_geq(): lba; on return also the lba found or -1
+ *   lsdm:update	lsdm_update_range(): entry lba, pba, len; return lba,
+ *		the cases taken as a mask of 1 << case (case 0 is no
+ *		overlap) and the return value
+ */
+
+#ifndef _RBPROBE_H
+#define _RBPROBE_H
+
+#ifdef CONFIG_RB_USDT
+#include <sys/sdt.h>
+
+#define rb_probe1(prov, name, a)		DTRACE_PROBE1(prov, name, a)
+#define rb_probe2(prov, name, a, b)		DTRACE_PROBE2(prov, name, a, b)
+#define rb_probe3(prov, name, a, b, c)		DTRACE_PROBE3(prov, name, a, b, c)
+#define rb_probe4(prov, name, a, b, c, d)	DTRACE_PROBE4(prov, name, a, b, c, d)
+#else
+#define rb_probe1(prov, name, a)		do { } while (0)
+#define rb_probe2(prov, name, a, b)		do { } while (0)
+#define rb_probe3(prov, name, a, b, c)		do { } while (0)
+#define rb_probe4(prov, name, a, b, c, d)	do { } while (0)
+#endif
+
+#endif /* _RBPROBE_H */
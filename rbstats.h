@@ -0,0 +1,60 @@
+/*
+ * Opt-in counters of what the tree and the extent map do under a load:
+ * rebalancing cases, rotations and color flips in rbtree.c, and descent
+ * lengths and overwrite cases in extent.c.
+ *
+ * They are only compiled in with CONFIG_RB_STATS (make STATS=1). Without
+ * it every rb_stat_*() is an empty statement and the hot paths build to
+ * the same code as before. The counters are plain increments, so with
+ * several threads updating maps at once they are approximate.
+ */
+
+#ifndef _RBSTATS_H
+#define _RBSTATS_H
+
+struct rb_stats {
+	unsigned long insert_fixups;	/* __rb_insert() runs */
+	unsigned long insert_case[3];	/* cases 1-3 of __rb_insert() */
+	unsigned long erase_fixups;	/* ____rb_erase_color() runs */
+	unsigned long erase_case[4];	/* cases 1-4 of ____rb_erase_color() */
+	unsigned long rotations;
+	unsigned long recolors;		/* flips not part of a rotation */
+
+	unsigned long inserts;		/* descents of lsdm_rb_insert() */
+	unsigned long insert_depth;	/* summed, for the average */
+	unsigned long max_insert_depth;
+	unsigned long lookups;		/* stl_rb_geq() and overlap searches */
+	unsigned long lookup_nodes;	/* nodes visited, summed */
+	unsigned long max_lookup_nodes;
+	unsigned long update_case[5];	/* lsdm_update_range(): 0 is no overlap */
+};
+
+#ifdef CONFIG_RB_STATS
+extern struct rb_stats rb_stats;
+
+#define rb_stat_inc(field)	(rb_stats.field++)
+#define rb_stat_add(field, n)	(rb_stats.field += (n))
+#define rb_stat_max(field, n)	do {				\
+	if ((n) > rb_stats.field)				\
+		rb_stats.field = (n);				\
+} while (0)
+#else
+#define rb_stat_inc(field)	do { } while (0)
+#define rb_stat_add(field, n)	do { } while (0)
+#define rb_stat_max(field, n)	do { } while (0)
+#endif
+
+#ifndef RB_HEADER_ONLY
+/* Both work without CONFIG_RB_STATS: there is just nothing to show */
+void rb_stats_reset(void);
+void rb_stats_dump(void);
+#else
+/* Every file has its own copy of the tree code, so no shared counters */
+#ifdef CONFIG_RB_STATS
+#error "CONFIG_RB_STATS does not work with RB_HEADER_ONLY"
+#endif
+static inline void rb_stats_reset(void) { }
+static inline void rb_stats_dump(void) { }
+#endif
+
+#endif /* _RBSTATS_H */
@@ -50,9 +50,16 @@
  * pointers.
  */
 
+/* rbtree.h includes this file in header-only mode */
+#ifndef _RBTREE_C
+#define _RBTREE_C
+
 #include<stdio.h>
+#include<string.h>
 #include "rbtree.h"
 #include "rbtree_augmented.h"
+#include "rbstats.h"
+#include "rbprobe.h"
 
 
 
@@ -81,12 +88,17 @@ __rb_rotate_set_parents(struct rb_node *old, struct rb_node *new,
 	__rb_change_child(old, new, parent, root);
 }
 
-static __always_inline void
+/*
+ * Returns 1 when the fixup ended by blackening a red root, i.e. when the
+ * black height of the tree grew by one, and 0 otherwise.
+ */
+static __always_inline int
 __rb_insert(struct rb_node *node, struct rb_root *root,
 	    void (*augment_rotate)(struct rb_node *old, struct rb_node *new))
 {
 	struct rb_node *parent = rb_red_parent(node), *gparent, *tmp;
 
+	rb_stat_inc(insert_fixups);
 	while (1) {
 		/*
 		 * Loop invariant: node is red
@@ -97,7 +109,7 @@ __rb_insert(struct rb_node *node, struct rb_root *root,
 		 */
 		if (!parent) {
 			rb_set_parent_color(node, NULL, RB_BLACK);
-			break;
+			return 1;
 		} else if (rb_is_black(parent))
 			break;
 
@@ -124,6 +136,8 @@ __rb_insert(struct rb_node *node, struct rb_root *root,
 				node = gparent;
 				parent = rb_parent(node);
 				rb_set_parent_color(node, parent, RB_RED);
+				rb_stat_inc(insert_case[0]);
+				rb_stat_add(recolors, 3);
 				continue;
 			}
 
@@ -149,6 +163,8 @@ __rb_insert(struct rb_node *node, struct rb_root *root,
 							    RB_BLACK);
 				rb_set_parent_color(parent, node, RB_RED);
 				augment_rotate(parent, node);
+				rb_stat_inc(insert_case[1]);
+				rb_stat_inc(rotations);
 				parent = node;
 				tmp = node->rb_right;
 			}
@@ -168,6 +184,8 @@ __rb_insert(struct rb_node *node, struct rb_root *root,
 				rb_set_parent_color(tmp, gparent, RB_BLACK);
 			__rb_rotate_set_parents(gparent, parent, root, RB_RED);
 			augment_rotate(gparent, parent);
+			rb_stat_inc(insert_case[2]);
+			rb_stat_inc(rotations);
 			break;
 		} else {
 			tmp = gparent->rb_left;
@@ -178,6 +196,8 @@ __rb_insert(struct rb_node *node, struct rb_root *root,
 				node = gparent;
 				parent = rb_parent(node);
 				rb_set_parent_color(node, parent, RB_RED);
+				rb_stat_inc(insert_case[0]);
+				rb_stat_add(recolors, 3);
 				continue;
 			}
 
@@ -192,6 +212,8 @@ __rb_insert(struct rb_node *node, struct rb_root *root,
 							    RB_BLACK);
 				rb_set_parent_color(parent, node, RB_RED);
 				augment_rotate(parent, node);
+				rb_stat_inc(insert_case[1]);
+				rb_stat_inc(rotations);
 				parent = node;
 				tmp = node->rb_left;
 			}
@@ -203,9 +225,12 @@ __rb_insert(struct rb_node *node, struct rb_root *root,
 				rb_set_parent_color(tmp, gparent, RB_BLACK);
 			__rb_rotate_set_parents(gparent, parent, root, RB_RED);
 			augment_rotate(gparent, parent);
+			rb_stat_inc(insert_case[2]);
+			rb_stat_inc(rotations);
 			break;
 		}
 	}
+	return 0;
 }
 
 /*
@@ -218,6 +243,7 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root,
 {
 	struct rb_node *node = NULL, *sibling, *tmp1, *tmp2;
 
+	rb_stat_inc(erase_fixups);
 	while (1) {
 		/*
 		 * Loop invariants:
@@ -245,6 +271,8 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root,
 				__rb_rotate_set_parents(parent, sibling, root,
 							RB_RED);
 				augment_rotate(parent, sibling);
+				rb_stat_inc(erase_case[0]);
+				rb_stat_inc(rotations);
 				sibling = tmp1;
 			}
 			tmp1 = sibling->rb_right;
@@ -268,9 +296,12 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root,
 					 */
 					rb_set_parent_color(sibling, parent,
 							    RB_RED);
-					if (rb_is_red(parent))
+					rb_stat_inc(erase_case[1]);
+					rb_stat_inc(recolors);
+					if (rb_is_red(parent)) {
 						rb_set_black(parent);
-					else {
+						rb_stat_inc(recolors);
+					} else {
 						node = parent;
 						parent = rb_parent(node);
 						if (parent)
@@ -298,6 +329,8 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root,
 					rb_set_parent_color(tmp1, sibling,
 							    RB_BLACK);
 				augment_rotate(sibling, tmp2);
+				rb_stat_inc(erase_case[2]);
+				rb_stat_inc(rotations);
 				tmp1 = sibling;
 				sibling = tmp2;
 			}
@@ -322,6 +355,8 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root,
 			__rb_rotate_set_parents(parent, sibling, root,
 						RB_BLACK);
 			augment_rotate(parent, sibling);
+			rb_stat_inc(erase_case[3]);
+			rb_stat_inc(rotations);
 			break;
 		} else {
 			sibling = parent->rb_left;
@@ -334,6 +369,8 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root,
 				__rb_rotate_set_parents(parent, sibling, root,
 							RB_RED);
 				augment_rotate(parent, sibling);
+				rb_stat_inc(erase_case[0]);
+				rb_stat_inc(rotations);
 				sibling = tmp1;
 			}
 			tmp1 = sibling->rb_left;
@@ -343,9 +380,12 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root,
 					/* Case 2 - sibling color flip */
 					rb_set_parent_color(sibling, parent,
 							    RB_RED);
-					if (rb_is_red(parent))
+					rb_stat_inc(erase_case[1]);
+					rb_stat_inc(recolors);
+					if (rb_is_red(parent)) {
 						rb_set_black(parent);
-					else {
+						rb_stat_inc(recolors);
+					} else {
 						node = parent;
 						parent = rb_parent(node);
 						if (parent)
@@ -362,6 +402,8 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root,
 					rb_set_parent_color(tmp1, sibling,
 							    RB_BLACK);
 				augment_rotate(sibling, tmp2);
+				rb_stat_inc(erase_case[2]);
+				rb_stat_inc(rotations);
 				tmp1 = sibling;
 				sibling = tmp2;
 			}
@@ -375,6 +417,8 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root,
 			__rb_rotate_set_parents(parent, sibling, root,
 						RB_BLACK);
 			augment_rotate(parent, sibling);
+			rb_stat_inc(erase_case[3]);
+			rb_stat_inc(rotations);
 			break;
 		}
 	}
@@ -404,15 +448,269 @@ static const struct rb_augment_callbacks dummy_callbacks = {
 
 void rb_insert_color(struct rb_node *node, struct rb_root *root)
 {
+	rb_probe2(urb, insert_entry, node, root);
 	__rb_insert(node, root, dummy_rotate);
+	rb_probe2(urb, insert_return, node, root);
 }
 
 void rb_erase(struct rb_node *node, struct rb_root *root)
 {
 	struct rb_node *rebalance;
+
+	rb_probe2(urb, erase_entry, node, root);
 	rebalance = __rb_erase_augmented(node, root, &dummy_callbacks);
 	if (rebalance)
 		____rb_erase_color(rebalance, root, dummy_rotate);
+	rb_probe2(urb, erase_return, node, root);
+}
+
+/*
+ * Insertion with a hint.
+ *
+ * The caller already knows where 'node' belongs in sort order: right after
+ * 'prev' (or right before 'next'). The free slot between two in-order
+ * neighbours is either the right child of the lower one or the left child
+ * of the higher one, so it is found without a descent from the root.
+ * Appending after rb_last() is O(1) before rebalancing, and rebalancing is
+ * amortized O(1).
+ *
+ * A NULL 'prev' inserts at the front of the tree, a NULL 'next' at the end.
+ */
+void rb_insert_after(struct rb_node *node, struct rb_node *prev,
+		     struct rb_root *root)
+{
+	struct rb_node *parent, **link;
+
+	if (!prev) {
+		parent = NULL;
+		link = &root->rb_node;
+		while (*link) {
+			parent = *link;
+			link = &parent->rb_left;
+		}
+	} else if (!prev->rb_right) {
+		parent = prev;
+		link = &prev->rb_right;
+	} else {
+		/* Our successor is leftmost under prev->rb_right */
+		parent = prev->rb_right;
+		while (parent->rb_left)
+			parent = parent->rb_left;
+		link = &parent->rb_left;
+	}
+	rb_link_node(node, parent, link);
+	rb_probe2(urb, insert_entry, node, root);
+	__rb_insert(node, root, dummy_rotate);
+	rb_probe2(urb, insert_return, node, root);
+}
+
+void rb_insert_before(struct rb_node *node, struct rb_node *next,
+		      struct rb_root *root)
+{
+	struct rb_node *parent, **link;
+
+	if (!next) {
+		parent = NULL;
+		link = &root->rb_node;
+		while (*link) {
+			parent = *link;
+			link = &parent->rb_right;
+		}
+	} else if (!next->rb_left) {
+		parent = next;
+		link = &next->rb_left;
+	} else {
+		/* Our predecessor is rightmost under next->rb_left */
+		parent = next->rb_left;
+		while (parent->rb_right)
+			parent = parent->rb_right;
+		link = &parent->rb_right;
+	}
+	rb_link_node(node, parent, link);
+	rb_probe2(urb, insert_entry, node, root);
+	__rb_insert(node, root, dummy_rotate);
+	rb_probe2(urb, insert_return, node, root);
+}
+
+/*
+ * Split and join.
+ *
+ * __rb_join() concatenates two trees around a middle node and
+ * __rb_split() cuts a tree in two at a node. Together they detach a whole
+ * in-order range with O(log n) pointer work, instead of one erase and
+ * rebalance per node. Black heights are tracked incrementally so that
+ * neither has to measure a tree more than once.
+ */
+
+/* Black height of the tree under 'node', counting 'node' itself */
+static int rb_black_height(const struct rb_node *node)
+{
+	int h = 0;
+
+	for (; node; node = node->rb_left)
+		h += rb_is_black(node);
+	return h;
+}
+
+/*
+ * Make the subtree under 'node', of black height 'h', a tree of its own.
+ * Roots are always black, so a red 'node' adds one to the height; the
+ * resulting height is returned.
+ */
+static int rb_make_root(struct rb_root *root, struct rb_node *node, int h)
+{
+	root->rb_node = node;
+	if (!node)
+		return 0;
+	if (rb_is_red(node))
+		h++;
+	rb_set_parent_color(node, NULL, RB_BLACK);
+	return h;
+}
+
+/*
+ * Build 'out' from 'l', the node 'k' and 'r', where everything in 'l'
+ * sorts before 'k' and everything in 'r' after it. 'hl' and 'hr' are the
+ * black heights of the two trees; the black height of the result is
+ * returned. 'out' may be the same as 'l' or 'r'.
+ *
+ * The shorter tree hangs off a red 'k' on the spine of the taller one, at
+ * the first black node of the same black height, and the usual insert
+ * fixup repairs any red-red violation above it. This costs
+ * O(|hl - hr| + 1).
+ */
+static int __rb_join(struct rb_root *l, int hl, struct rb_node *k,
+		     struct rb_root *r, int hr, struct rb_root *out)
+{
+	struct rb_node *lroot = l->rb_node, *rroot = r->rb_node;
+	struct rb_node *parent = NULL, *c;
+	int h;
+
+	if (hl == hr) {
+		k->rb_left = lroot;
+		k->rb_right = rroot;
+		if (lroot)
+			rb_set_parent(lroot, k);
+		if (rroot)
+			rb_set_parent(rroot, k);
+		rb_set_parent_color(k, NULL, RB_BLACK);
+		out->rb_node = k;
+		return hl + 1;
+	}
+
+	if (hl > hr) {
+		/* Walk down the right spine of l */
+		for (c = lroot, h = hl; c && (h > hr || rb_is_red(c)); c = c->rb_right) {
+			h -= rb_is_black(c);
+			parent = c;
+		}
+		k->rb_left = c;
+		k->rb_right = rroot;
+		parent->rb_right = k;
+		out->rb_node = lroot;
+		h = hl;
+	} else {
+		/* Walk down the left spine of r */
+		for (c = rroot, h = hr; c && (h > hl || rb_is_red(c)); c = c->rb_left) {
+			h -= rb_is_black(c);
+			parent = c;
+		}
+		k->rb_left = lroot;
+		k->rb_right = c;
+		parent->rb_left = k;
+		out->rb_node = rroot;
+		h = hr;
+	}
+	if (k->rb_left)
+		rb_set_parent(k->rb_left, k);
+	if (k->rb_right)
+		rb_set_parent(k->rb_right, k);
+	rb_set_parent_color(k, parent, RB_RED);
+	return h + __rb_insert(k, out, dummy_rotate);
+}
+
+/*
+ * Cut the tree containing 'node' in two: everything before 'node' goes to
+ * 'l', everything after it to 'r', and 'node' itself is left out. The
+ * black heights of the two halves are returned in 'hl' and 'hr'.
+ *
+ * Walking up from 'node', every ancestor and its subtree on the far side
+ * is joined onto the half they belong to. The subtrees grow in height on
+ * the way up, so the cost of the joins telescopes to O(log n).
+ */
+static void __rb_split(struct rb_node *node, struct rb_root *l, int *hl,
+		       struct rb_root *r, int *hr)
+{
+	struct rb_node *cur = node, *parent, *gparent;
+	struct rb_root sub;
+	int h, hsub, cur_black = rb_is_black(node);
+
+	/* Black height of the subtrees hanging off 'cur' */
+	h = rb_black_height(node) - cur_black;
+
+	parent = rb_parent(node);
+	*hl = rb_make_root(l, node->rb_left, h);
+	*hr = rb_make_root(r, node->rb_right, h);
+
+	while (parent) {
+		gparent = rb_parent(parent);
+		h += cur_black;
+		cur_black = rb_is_black(parent);
+		if (parent->rb_left == cur) {
+			/* parent and its right subtree come after us */
+			hsub = rb_make_root(&sub, parent->rb_right, h);
+			*hr = __rb_join(r, *hr, parent, &sub, hsub, r);
+		} else {
+			hsub = rb_make_root(&sub, parent->rb_left, h);
+			*hl = __rb_join(&sub, hsub, parent, l, *hl, l);
+		}
+		cur = parent;
+		parent = gparent;
+	}
+}
+
+/*
+ * Remove every node from 'first' to 'last' (inclusive, in sort order)
+ * from 'root' with two splits and a join, rebalancing once instead of
+ * once per node: O(log n) whatever the size of the range.
+ *
+ * The removed nodes are handed back in 'detached' as a valid tree of
+ * their own, typically to be released with
+ * rbtree_postorder_for_each_entry_safe(). Not for augmented trees.
+ */
+void rb_erase_range(struct rb_node *first, struct rb_node *last,
+		    struct rb_root *root, struct rb_root *detached)
+{
+	struct rb_root l, r, mid, tail, empty = RB_ROOT;
+	struct rb_node *k;
+	int hl, hr, hmid, htail, h;
+
+	__rb_split(first, &l, &hl, &r, &hr);
+	if (last == first) {
+		mid = empty;
+		hmid = 0;
+		tail = r;
+		htail = hr;
+	} else {
+		__rb_split(last, &mid, &hmid, &tail, &htail);
+	}
+
+	/* first + mid + last */
+	h = __rb_join(&empty, 0, first, &mid, hmid, detached);
+	if (last != first)
+		__rb_join(detached, h, last, &empty, 0, detached);
+
+	/* l + tail, with the leftmost node of tail as the join key */
+	if (!tail.rb_node) {
+		*root = l;
+	} else if (!l.rb_node) {
+		*root = tail;
+	} else {
+		k = rb_first(&tail);
+		rb_erase(k, &tail);
+		htail = rb_black_height(tail.rb_node);
+		__rb_join(&l, hl, k, &tail, htail, root);
+	}
 }
 
 /*
@@ -567,3 +865,294 @@ struct rb_node *rb_first_postorder(const struct rb_root *root)
 
 	return rb_left_deepest_node(root->rb_node);
 }
+
+/*
+ * Tear down a whole tree: every node is handed to 'release' after its
+ * children, so 'release' may free it. Nothing is unlinked or recolored on
+ * the way, which makes this O(n) with no rebalancing at all, against
+ * O(n log n) for erasing the nodes one by one. 'root' is left empty.
+ */
+void rb_destroy(struct rb_root *root,
+		void (*release)(struct rb_node *, void *), void *arg)
+{
+	struct rb_node *node, *next;
+
+	for (node = rb_first_postorder(root); node; node = next) {
+		next = rb_next_postorder(node);
+		release(node, arg);
+	}
+	*root = RB_ROOT;
+}
+
+/*
+ * Stack based in-order cursor. stack[0..depth-1] is the path from the
+ * root to the current node; bit 0 of an entry is set when that node is
+ * the right child of the entry below it. Stepping up is then a matter of
+ * popping entries, with no node loads and no __rb_parent_color decoding.
+ */
+#define RB_ITER_RIGHT	1UL
+
+/* Push 'node' and then its leftmost (or rightmost) descendants */
+static inline struct rb_node *rb_iter_descend(struct rb_iter *it, struct rb_node *node,
+					      unsigned long tag, int left)
+{
+	unsigned long *sp = it->stack + it->depth;
+	struct rb_node *next;
+
+	*sp++ = (unsigned long)node | tag;
+	if (left) {
+		while ((next = node->rb_left)) {
+			node = next;
+			*sp++ = (unsigned long)node;
+		}
+	} else {
+		while ((next = node->rb_right)) {
+			node = next;
+			*sp++ = (unsigned long)node | RB_ITER_RIGHT;
+		}
+	}
+	it->depth = sp - it->stack;
+	return node;
+}
+
+struct rb_node *rb_iter_first(struct rb_iter *it, const struct rb_root *root)
+{
+	it->depth = 0;
+	if (!root->rb_node)
+		return NULL;
+	return rb_iter_descend(it, root->rb_node, 0, 1);
+}
+
+struct rb_node *rb_iter_last(struct rb_iter *it, const struct rb_root *root)
+{
+	it->depth = 0;
+	if (!root->rb_node)
+		return NULL;
+	return rb_iter_descend(it, root->rb_node, 0, 0);
+}
+
+struct rb_node *rb_iter_seek(struct rb_iter *it, const struct rb_root *root,
+			     const void *key,
+			     int (*cmp)(const void *key, const struct rb_node *))
+{
+	struct rb_node *node = root->rb_node;
+	unsigned long tag = 0;
+	int found = 0, c;
+
+	it->depth = 0;
+	while (node) {
+		it->stack[it->depth++] = (unsigned long)node | tag;
+		c = cmp(key, node);
+		if (c <= 0) {
+			found = it->depth;
+			if (!c)
+				break;
+			node = node->rb_left;
+			tag = 0;
+		} else {
+			node = node->rb_right;
+			tag = RB_ITER_RIGHT;
+		}
+	}
+	/* The path to the lower bound is a prefix of the path walked */
+	it->depth = found;
+	return rb_iter_cur(it);
+}
+
+struct rb_node *rb_iter_next(struct rb_iter *it)
+{
+	struct rb_node *node = rb_iter_cur(it);
+	int depth = it->depth;
+
+	if (!node)
+		return NULL;
+	if (node->rb_right)
+		return rb_iter_descend(it, node->rb_right, RB_ITER_RIGHT, 1);
+
+	/* Pop right children, then the left child whose parent is next */
+	while (--depth && (it->stack[depth] & RB_ITER_RIGHT))
+		;
+	it->depth = depth;
+	return rb_iter_cur(it);
+}
+
+struct rb_node *rb_iter_prev(struct rb_iter *it)
+{
+	struct rb_node *node = rb_iter_cur(it);
+	int depth = it->depth;
+
+	if (!node)
+		return NULL;
+	if (node->rb_left)
+		return rb_iter_descend(it, node->rb_left, 0, 0);
+
+	while (--depth && !(it->stack[depth] & RB_ITER_RIGHT))
+		;
+	it->depth = depth;
+	return rb_iter_cur(it);
+}
+
+/*
+ * Threaded trees. The list is kept in step with the tree: a node linked
+ * as the left child of 'parent' comes right before it, one linked as the
+ * right child right after it, so no update needs an extra search.
+ */
+static void rb_lnode_splice(struct rb_lnode *node, struct rb_lnode *prev,
+			    struct rb_lnode *next, struct rb_root_linked *root)
+{
+	node->prev = prev;
+	node->next = next;
+	if (prev)
+		prev->next = node;
+	else
+		root->first = node;
+	if (next)
+		next->prev = node;
+	else
+		root->last = node;
+}
+
+void rb_insert_linked(struct rb_lnode *node, struct rb_node *parent,
+		      struct rb_node **link, struct rb_root_linked *root)
+{
+	struct rb_lnode *p = rb_entry_safe(parent, struct rb_lnode, rb);
+
+	if (!p)
+		rb_lnode_splice(node, NULL, NULL, root);
+	else if (link == &parent->rb_left)
+		rb_lnode_splice(node, p->prev, p, root);
+	else
+		rb_lnode_splice(node, p, p->next, root);
+	rb_link_node(&node->rb, parent, link);
+	rb_insert_color(&node->rb, &root->rb_root);
+}
+
+void rb_insert_linked_after(struct rb_lnode *node, struct rb_lnode *prev,
+			    struct rb_root_linked *root)
+{
+	if (prev) {
+		rb_insert_after(&node->rb, &prev->rb, &root->rb_root);
+		rb_lnode_splice(node, prev, prev->next, root);
+	} else {
+		rb_insert_before(&node->rb, root->first ? &root->first->rb : NULL,
+				 &root->rb_root);
+		rb_lnode_splice(node, NULL, root->first, root);
+	}
+}
+
+void rb_erase_linked(struct rb_lnode *node, struct rb_root_linked *root)
+{
+	if (node->prev)
+		node->prev->next = node->next;
+	else
+		root->first = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
+	else
+		root->last = node->prev;
+	rb_erase(&node->rb, &root->rb_root);
+}
+
+void rb_replace_linked(struct rb_lnode *victim, struct rb_lnode *new,
+		       struct rb_root_linked *root)
+{
+	rb_replace_node(&victim->rb, &new->rb, &root->rb_root);
+	rb_lnode_splice(new, victim->prev, victim->next, root);
+}
+
+/* rb_erase_range() for threaded trees; the list is cut in O(1) as well */
+void rb_erase_range_linked(struct rb_lnode *first, struct rb_lnode *last,
+			   struct rb_root_linked *root,
+			   struct rb_root_linked *detached)
+{
+	struct rb_lnode *prev = first->prev, *next = last->next;
+
+	rb_erase_range(&first->rb, &last->rb, &root->rb_root, &detached->rb_root);
+	if (prev)
+		prev->next = next;
+	else
+		root->first = next;
+	if (next)
+		next->prev = prev;
+	else
+		root->last = prev;
+	first->prev = last->next = NULL;
+	detached->first = first;
+	detached->last = last;
+}
+
+static struct rb_node *__rb_build(struct rb_node **nodes, unsigned long nr,
+				  struct rb_node *parent, int depth, int red_depth)
+{
+	unsigned long mid = nr / 2;
+	struct rb_node *node;
+
+	if (!nr)
+		return NULL;
+	node = nodes[mid];
+	rb_set_parent_color(node, parent, depth == red_depth ? RB_RED : RB_BLACK);
+	node->rb_left = __rb_build(nodes, mid, node, depth + 1, red_depth);
+	node->rb_right = __rb_build(nodes + mid + 1, nr - mid - 1, node,
+				    depth + 1, red_depth);
+	return node;
+}
+
+/*
+ * Bulk load: link 'nodes', which must be in sort order, into a balanced
+ * tree under an empty 'root' without a single comparison or rotation.
+ * Splitting at the median keeps every NULL link within one level of the
+ * deepest node, so making the deepest level red and everything else
+ * black gives all paths the same black height.
+ */
+void rb_build_sorted(struct rb_node **nodes, unsigned long nr,
+		     struct rb_root *root)
+{
+	int red_depth = -1;
+	unsigned long n;
+
+	for (n = nr; n; n >>= 1)
+		red_depth++;
+	root->rb_node = __rb_build(nodes, nr, NULL, 0, red_depth);
+	if (root->rb_node)
+		rb_set_black(root->rb_node);
+}
+
+#ifndef RB_HEADER_ONLY
+#ifdef CONFIG_RB_STATS
+struct rb_stats rb_stats;
+#endif
+
+void rb_stats_reset(void)
+{
+#ifdef CONFIG_RB_STATS
+	memset(&rb_stats, 0, sizeof(rb_stats));
+#endif
+}
+
+void rb_stats_dump(void)
+{
+#ifdef CONFIG_RB_STATS
+	struct rb_stats *s = &rb_stats;
+
+	printf("\n rb stats:");
+	printf("\n  insert fixups %lu, cases 1-3: %lu %lu %lu", s->insert_fixups,
+	       s->insert_case[0], s->insert_case[1], s->insert_case[2]);
+	printf("\n  erase fixups %lu, cases 1-4: %lu %lu %lu %lu", s->erase_fixups,
+	       s->erase_case[0], s->erase_case[1], s->erase_case[2], s->erase_case[3]);
+	printf("\n  rotations %lu, recolors %lu", s->rotations, s->recolors);
+	printf("\n  insert depth: avg %.1f, max %lu over %lu inserts",
+	       s->inserts ? (double)s->insert_depth / s->inserts : 0.0,
+	       s->max_insert_depth, s->inserts);
+	printf("\n  nodes per lookup: avg %.1f, max %lu over %lu lookups",
+	       s->lookups ? (double)s->lookup_nodes / s->lookups : 0.0,
+	       s->max_lookup_nodes, s->lookups);
+	printf("\n  lsdm_update_range cases 0-4: %lu %lu %lu %lu %lu\n",
+	       s->update_case[0], s->update_case[1], s->update_case[2],
+	       s->update_case[3], s->update_case[4]);
+#else
+	printf("\n rb stats: built without CONFIG_RB_STATS\n");
+#endif
+}
+#endif /* RB_HEADER_ONLY */
+
+#endif /* _RBTREE_C */
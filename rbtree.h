@@ -31,6 +31,19 @@
 
 #include<stdio.h>
 #include<stddef.h>
+
+/*
+ * Header-only mode: built with RB_HEADER_ONLY, the routines of rbtree.c
+ * are static inline in every file that includes this header, and are
+ * compiled in from there, so that they inline into their callers. Such
+ * a program does not link liburb.
+ */
+#ifdef RB_HEADER_ONLY
+#define RB_API	static inline
+#else
+#define RB_API	extern
+#endif
+
 struct rb_node {
 	unsigned long  __rb_parent_color;
 	struct rb_node *rb_right;
@@ -69,22 +82,98 @@ struct rb_root {
 	((node)->__rb_parent_color = (unsigned long)(node))
 
 
-extern void rb_insert_color(struct rb_node *, struct rb_root *);
-extern void rb_erase(struct rb_node *, struct rb_root *);
+RB_API void rb_insert_color(struct rb_node *, struct rb_root *);
+RB_API void rb_erase(struct rb_node *, struct rb_root *);
+
+/* Insert next to a node known to be the in-order neighbour, no descent */
+RB_API void rb_insert_after(struct rb_node *node, struct rb_node *prev,
+			    struct rb_root *root);
+RB_API void rb_insert_before(struct rb_node *node, struct rb_node *next,
+			     struct rb_root *root);
+
+/* Detach the in-order range [first, last] as a tree of its own */
+RB_API void rb_erase_range(struct rb_node *first, struct rb_node *last,
+			   struct rb_root *root, struct rb_root *detached);
 
 
 /* Find logical next and previous nodes in a tree */
-extern struct rb_node *rb_next(const struct rb_node *);
-extern struct rb_node *rb_prev(const struct rb_node *);
-extern struct rb_node *rb_first(const struct rb_root *);
-extern struct rb_node *rb_last(const struct rb_root *);
+RB_API struct rb_node *rb_next(const struct rb_node *);
+RB_API struct rb_node *rb_prev(const struct rb_node *);
+RB_API struct rb_node *rb_first(const struct rb_root *);
+RB_API struct rb_node *rb_last(const struct rb_root *);
 
 /* Postorder iteration - always visit the parent after its children */
-extern struct rb_node *rb_first_postorder(const struct rb_root *);
-extern struct rb_node *rb_next_postorder(const struct rb_node *);
+RB_API struct rb_node *rb_first_postorder(const struct rb_root *);
+RB_API struct rb_node *rb_next_postorder(const struct rb_node *);
+
+/* Build a tree in O(n) from nodes already in sort order */
+RB_API void rb_build_sorted(struct rb_node **nodes, unsigned long nr,
+			    struct rb_root *root);
+
+/* Release every node without unlinking or recoloring, leaving 'root' empty */
+RB_API void rb_destroy(struct rb_root *root,
+		       void (*release)(struct rb_node *, void *), void *arg);
+
+/*
+ * In-order cursor that keeps the path from the root on a stack instead of
+ * following parent pointers. A red-black tree of n nodes is at most
+ * 2 * log2(n + 1) high, so 128 entries cover any tree that fits in a
+ * 64-bit address space. Any change to the tree invalidates the cursor.
+ */
+#define RB_ITER_MAX_DEPTH	128
+
+struct rb_iter {
+	int depth;
+	unsigned long stack[RB_ITER_MAX_DEPTH];	/* see rbtree.c */
+};
+
+RB_API struct rb_node *rb_iter_first(struct rb_iter *it, const struct rb_root *root);
+RB_API struct rb_node *rb_iter_last(struct rb_iter *it, const struct rb_root *root);
+/* First node for which cmp(key, node) <= 0 */
+RB_API struct rb_node *rb_iter_seek(struct rb_iter *it, const struct rb_root *root,
+				    const void *key,
+				    int (*cmp)(const void *key, const struct rb_node *));
+RB_API struct rb_node *rb_iter_next(struct rb_iter *it);
+RB_API struct rb_node *rb_iter_prev(struct rb_iter *it);
+
+static inline struct rb_node *rb_iter_cur(const struct rb_iter *it)
+{
+	return it->depth ? (struct rb_node *)(it->stack[it->depth - 1] & ~1UL) : NULL;
+}
+
+/*
+ * Threaded variant: the nodes also sit on a doubly linked list in sort
+ * order, so stepping to a neighbour is a single load. It costs two more
+ * pointers per node and O(1) extra work in every update. Trees of
+ * rb_lnode must only be changed through the _linked functions below.
+ */
+struct rb_lnode {
+	struct rb_node rb;
+	struct rb_lnode *prev, *next;
+};
+
+struct rb_root_linked {
+	struct rb_root rb_root;
+	struct rb_lnode *first, *last;
+};
+
+#define RB_ROOT_LINKED (struct rb_root_linked) { { NULL, }, NULL, NULL }
+
+/* Link 'node' at 'link' under 'parent', as found by a descent, and rebalance */
+RB_API void rb_insert_linked(struct rb_lnode *node, struct rb_node *parent,
+			     struct rb_node **link, struct rb_root_linked *root);
+/* Insert right after 'prev', or at the front if 'prev' is NULL */
+RB_API void rb_insert_linked_after(struct rb_lnode *node, struct rb_lnode *prev,
+				   struct rb_root_linked *root);
+RB_API void rb_erase_linked(struct rb_lnode *node, struct rb_root_linked *root);
+RB_API void rb_replace_linked(struct rb_lnode *victim, struct rb_lnode *new,
+			      struct rb_root_linked *root);
+RB_API void rb_erase_range_linked(struct rb_lnode *first, struct rb_lnode *last,
+				  struct rb_root_linked *root,
+				  struct rb_root_linked *detached);
 
 /* Fast replacement of a single node without remove/rebalance/add/rebalance */
-extern void rb_replace_node(struct rb_node *victim, struct rb_node *new,
+RB_API void rb_replace_node(struct rb_node *victim, struct rb_node *new,
 			    struct rb_root *root);
 
 static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
@@ -125,3 +214,8 @@ static inline void rb_link_node_rcu(struct rb_node *node, struct rb_node *parent
 	     pos = n)
 
 #endif	/* _LINUX_RBTREE_H */
+
+/* rbtree_augmented.h includes it itself, once it is complete */
+#if defined(RB_HEADER_ONLY) && !defined(_LINUX_RBTREE_AUGMENTED_H)
+#include "rbtree.c"
+#endif
@@ -39,7 +39,7 @@ struct rb_augment_callbacks {
 	void (*rotate)(struct rb_node *old, struct rb_node *new);
 };
 
-extern void __rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+RB_API void __rb_insert_augmented(struct rb_node *node, struct rb_root *root,
 	void (*augment_rotate)(struct rb_node *old, struct rb_node *new));
 /*
  * Fixup the rbtree and update the augmented information when rebalancing.
@@ -128,7 +128,7 @@ __rb_change_child(struct rb_node *old, struct rb_node *new,
 		root->rb_node = new;
 }
 
-extern void __rb_erase_color(struct rb_node *parent, struct rb_root *root,
+RB_API void __rb_erase_color(struct rb_node *parent, struct rb_root *root,
 	void (*augment_rotate)(struct rb_node *old, struct rb_node *new));
 
 static __always_inline struct rb_node *
@@ -245,3 +245,7 @@ rb_erase_augmented(struct rb_node *node, struct rb_root *root,
 }
 
 #endif	/* _LINUX_RBTREE_AUGMENTED_H */
+
+#ifdef RB_HEADER_ONLY
+#include "rbtree.c"
+#endif
@@ -13,621 +13,2282 @@
 #include<errno.h>
 #include<assert.h>
 #include<string.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sched.h>
 #include "rbtree_array.h"
+#include "extent.h"
+#include "segment.h"
+#include "pba_alloc.h"
+#include "update_buf.h"
+#include "pmap.h"
+#include "checkpoint.h"
+#include "dirty.h"
+#include "wal.h"
+#include "paged.h"
+#include "shard.h"
+#include "rangelock.h"
+#include "actor.h"
+#include "seqmap.h"
+#include "cow.h"
+#include "union.h"
+#include "rbstats.h"
 
 
 #define NODES       2000
 #define PERF_LOOPS  100
 #define CHECK_LOOPS 10
+#define NR_SECTORS  (1 << 26)	/* covers every PBA in rbtree_array.h */
 
-#define likely(x)       __builtin_expect(!!(x), 1)
-#define unlikely(x)     __builtin_expect(!!(x), 0)
+static struct extent_map map;
+static struct seg_tbl sit;
+static struct extent nodes[NODES];
 
+static void print_tree_contents(struct rb_node *node)
+{
 
-/* total size = xx bytes (64b). fits in 1 cache line
-   for 32b is xx bytes, fits in ARM cache line */
-struct extent {
-        struct rb_node rb;      /* 20 bytes */
-        sector_t lba;           /* 512B LBA */
-        sector_t pba;
-        __u32      len;
-}; /* xx bytes including padding after 'rb', xx on 32-bit */
+	if (!node)
+		return;
 
-static struct rb_root extent_tbl_root = RB_ROOT;
-static struct extent nodes[NODES];
-static int n_extents = 0;
+	struct extent *e = rb_entry(node, struct extent, rb);
 
+	printf("\n %d %d %d", e->lba, e->pba, e->len);
 
-/************** Extent map management *****************/
+	if(node->rb_left)
+		print_tree_contents(node->rb_left);
+	if (node->rb_right)
+		print_tree_contents(node->rb_right);
+}
 
-static void extent_init(struct extent *e, sector_t lba, sector_t pba, unsigned len)
+static void start_printing()
 {
-        memset(e, 0, sizeof(*e));
-        e->lba = lba;
-        e->pba = pba;
-        e->len = len;
+	struct rb_node *node = map.extent_tbl_root.rb_node;
+	print_tree_contents(node);
+	printf("\n");
 }
 
-/* find a map entry containing 'lba' or the next higher entry.
- * see Documentation/rbtree.txt
- */
-static struct extent *_stl_rb_geq(struct rb_root *root, off_t lba)
+
+
+static void init(void)
+{
+	int i;
+	unsigned int lba = 0, pba = 0, len=0;
+	for (i = 0; i < NODES; i++) {
+		extent_init(&nodes[i], lba, pba, len);
+		lba = lba + 20;
+		len = len + 20;
+		pba = pba + 20;
+	}
+}
+
+static int is_red(struct rb_node *rb)
+{
+	return !(rb->__rb_parent_color & 1);
+}
+
+static int black_path_count(struct rb_node *rb)
+{
+	int count;
+	for (count = 0; rb; rb = rb_parent(rb))
+		count += !is_red(rb);
+	return count;
+}
+
+/* Black height of the subtree, or -1 if a red-black property is broken */
+static int check_rb_props(struct rb_node *rb)
+{
+	int lh, rh;
+
+	if (!rb)
+		return 0;
+	if (is_red(rb) && ((rb->rb_left && is_red(rb->rb_left)) ||
+			   (rb->rb_right && is_red(rb->rb_right))))
+		return -1;
+	if ((rb->rb_left && rb_parent(rb->rb_left) != rb) ||
+	    (rb->rb_right && rb_parent(rb->rb_right) != rb))
+		return -1;
+	lh = check_rb_props(rb->rb_left);
+	rh = check_rb_props(rb->rb_right);
+	if (lh < 0 || rh < 0 || lh != rh)
+		return -1;
+	return lh + !is_red(rb);
+}
+
+/* nodes[] must be exactly the tree's contents, in lba order */
+static int check_sorted_nodes(struct rb_root *root, int nr)
 {
-	struct rb_node *node = root->rb_node;  /* top of the tree */
-	struct extent *higher = NULL;
-	struct extent *e = NULL;
+	struct rb_node *rb;
+	int count = 0;
 
-	while (node) {
-		e = container_of(node, struct extent, rb);
-		if (e->lba >= lba && (!higher || e->lba < higher->lba)) {
-			higher = e;
+	if (root->rb_node && (is_red(root->rb_node) || check_rb_props(root->rb_node) < 0)) {
+		printf("\n red-black properties broken");
+		return -1;
+	}
+	for (rb = rb_first(root); rb; rb = rb_next(rb), count++) {
+		if (count >= nr || rb != &nodes[count].rb) {
+			printf("\n node %d out of order", count);
+			return -1;
 		}
-		if (lba < e->lba) {
-			node = node->rb_left;
+	}
+	if (count != nr) {
+		printf("\n %d nodes in the tree, expected %d", count, nr);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Insert nodes[0..nr-1] in random order, each one linked next to an
+ * already inserted neighbour with rb_insert_after/before.
+ */
+static void insert_nodes_shuffled(struct rb_root *root, int nr)
+{
+	char inserted[NODES];
+	int order[NODES];
+	int i, j, k, tmp;
+
+	for (i = 0; i < nr; i++)
+		order[i] = i;
+	for (i = nr - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	memset(inserted, 0, sizeof(inserted));
+	*root = RB_ROOT;
+	for (i = 0; i < nr; i++) {
+		k = order[i];
+		if (rand() & 1) {
+			for (j = k - 1; j >= 0 && !inserted[j]; j--)
+				;
+			rb_insert_after(&nodes[k].rb, j >= 0 ? &nodes[j].rb : NULL, root);
 		} else {
-			if (lba >= e->lba + e->len) {
-				node = node->rb_right;
-			} else {
-				/* lba falls within "e"
-				 * (lba >= e->lba) && (lba < (e->lba + e->len)) */
-				return e;
-			}
+			for (j = k + 1; j < nr && !inserted[j]; j++)
+				;
+			rb_insert_before(&nodes[k].rb, j < nr ? &nodes[j].rb : NULL, root);
+		}
+		inserted[k] = 1;
+	}
+}
+
+/*
+ * Build trees out of nodes[] purely with rb_insert_after/before: once by
+ * appending, once by prepending and once in random order, each node being
+ * linked next to an already inserted neighbour.
+ */
+static int check_insert_hint(void)
+{
+	struct rb_root root = RB_ROOT;
+	int i;
+
+	init();
+	for (i = 0; i < NODES; i++)
+		rb_insert_after(&nodes[i].rb, rb_last(&root), &root);
+	if (check_sorted_nodes(&root, NODES) < 0)
+		return -1;
+
+	root = RB_ROOT;
+	for (i = NODES - 1; i >= 0; i--)
+		rb_insert_before(&nodes[i].rb, rb_first(&root), &root);
+	if (check_sorted_nodes(&root, NODES) < 0)
+		return -1;
+
+	srand(29);
+	insert_nodes_shuffled(&root, NODES);
+	if (check_sorted_nodes(&root, NODES) < 0)
+		return -1;
+	printf("\n insert with hint: ok\n");
+	return 0;
+}
+
+/* The tree must hold exactly nodes[lo..hi] minus nodes[cut_lo..cut_hi] */
+static int check_nodes_range(struct rb_root *root, int lo, int hi,
+			     int cut_lo, int cut_hi)
+{
+	struct rb_node *rb = rb_first(root);
+	int i;
+
+	if (root->rb_node && (is_red(root->rb_node) || check_rb_props(root->rb_node) < 0)) {
+		printf("\n red-black properties broken");
+		return -1;
+	}
+	for (i = lo; i <= hi; i++) {
+		if (i >= cut_lo && i <= cut_hi)
+			continue;
+		if (rb != &nodes[i].rb) {
+			printf("\n expected node %d", i);
+			return -1;
+		}
+		rb = rb_next(rb);
+	}
+	if (rb) {
+		printf("\n extra nodes in the tree");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Cut random ranges out of a tree of nodes[], including single nodes,
+ * both ends and the whole tree. Both the remainder and the detached part
+ * must be valid red-black trees holding the right nodes.
+ */
+static int check_erase_range(void)
+{
+	struct rb_root root, detached;
+	int loop, nr, first, last;
+
+	srand(30);
+	for (loop = 0; loop < 500; loop++) {
+		nr = 1 + rand() % NODES;
+		init();
+		/* Random insertion order gives varied shapes and colors */
+		insert_nodes_shuffled(&root, nr);
+		switch (loop % 5) {
+		case 0:
+			first = last = rand() % nr;
+			break;
+		case 1:
+			first = 0;
+			last = rand() % nr;
+			break;
+		case 2:
+			first = rand() % nr;
+			last = nr - 1;
+			break;
+		case 3:
+			first = 0;
+			last = nr - 1;
+			break;
+		default:
+			first = rand() % nr;
+			last = first + rand() % (nr - first);
+			break;
+		}
+		rb_erase_range(&nodes[first].rb, &nodes[last].rb, &root, &detached);
+		if (check_nodes_range(&root, 0, nr - 1, first, last) < 0 ||
+		    check_nodes_range(&detached, first, last, 1, 0) < 0) {
+			printf("\n erase range [%d, %d] of %d nodes failed", first, last, nr);
+			return -1;
 		}
 	}
-	return higher;
+	printf("\n erase range: ok\n");
+	return 0;
 }
 
-static struct extent *lsdm_rb_next(struct extent *e)
+static void check_postorder_foreach(int nr_nodes)
 {
-	struct rb_node *node = rb_next(&e->rb);
-	return (node == NULL) ? NULL : container_of(node, struct extent, rb);
+	struct extent *cur, *n;
+	int count = 0;
+	rbtree_postorder_for_each_entry_safe(cur, n, &map.extent_tbl_root, rb)
+		count++;
+
 }
 
-static struct extent *lsdm_rb_prev(struct extent *e)
+static void check_postorder(int nr_nodes)
 {
-        struct rb_node *node = rb_prev(&e->rb);
-        return (node == NULL) ? NULL : container_of(node, struct extent, rb);
+	struct rb_node *rb;
+	int count = 0;
+	for (rb = rb_first_postorder(&map.extent_tbl_root); rb; rb = rb_next_postorder(rb))
+		count++;
+
 }
 
+static void check(int nr_nodes)
+{
+	struct rb_node *rb;
+	int count = 0, blacks = 0;
+	uint32_t prev_key = 0;
 
+	for (rb = rb_first(&map.extent_tbl_root); rb; rb = rb_next(rb)) {
+		struct extent *node = rb_entry(rb, struct extent, rb);
+		if (!count)
+			blacks = black_path_count(rb);
+		else
+		prev_key = node->lba;
+		count++;
+	}
 
 
-static struct extent *stl_rb_geq(off_t lba)
+	check_postorder(nr_nodes);
+	check_postorder_foreach(nr_nodes);
+}
+
+static void check_augmented(int nr_nodes)
+{
+	struct rb_node *rb;
+
+	check(nr_nodes);
+	for (rb = rb_first(&map.extent_tbl_root); rb; rb = rb_next(rb)) {
+		struct extent *node = rb_entry(rb, struct extent, rb);
+	}
+}
+
+/*
+ * Recount the live sectors of every segment from the map and compare with
+ * the incrementally maintained table, then make sure the victim tree
+ * hands out the emptiest written segment.
+ */
+static int check_map_sit(struct extent_map *map, struct seg_tbl *sit)
 {
-	struct extent *e = NULL;
+	struct rb_node *rb;
+	__u32 *count;
+	unsigned segno, min_seg = 0;
+	__u32 min = ~0U;
+	int victim, ret = 0;
+
+	count = calloc(sit->nr_segs, sizeof(*count));
+	if (!count)
+		return -ENOMEM;
+
+	for (rb = rb_first(&map->extent_tbl_root); rb; rb = rb_next(rb)) {
+		struct extent *e = rb_entry(rb, struct extent, rb);
+		sector_t pba = e->pba, end = e->pba + e->len;
+
+		while (pba < end) {
+			sector_t seg_end = (pba | ((1 << sit->seg_shift) - 1)) + 1;
+			if (seg_end > end)
+				seg_end = end;
+			count[seg_nr(sit, pba)] += seg_end - pba;
+			pba = seg_end;
+		}
+	}
+
+	for (segno = 0; segno < sit->nr_segs; segno++) {
+		if (count[segno] != seg_vblocks(sit, segno)) {
+			printf("\n segment %u: %u valid sectors in the map, %u accounted",
+			       segno, count[segno], seg_vblocks(sit, segno));
+			ret = -1;
+		}
+		if (!RB_EMPTY_NODE(&sit->entries[segno].rb) && count[segno] < min) {
+			min = count[segno];
+			min_seg = segno;
+		}
+	}
 
-	e = _stl_rb_geq(&extent_tbl_root, lba);
-	return e;
+	victim = seg_pick_victim(sit);
+	if (victim != (sit->nr_victims ? (int)min_seg : -1)) {
+		printf("\n GC victim: %d expected: %u (%u valid sectors)", victim, min_seg, min);
+		ret = -1;
+	}
+	printf("\n %u segments written, GC victim: %d with %u valid sectors\n",
+	       sit->nr_victims, victim, victim < 0 ? 0 : seg_vblocks(sit, victim));
+	free(count);
+	return ret;
 }
 
+static int check_sit(void)
+{
+	return check_map_sit(&map, &sit);
+}
 
-static int check_node_contents(struct rb_node *node)
+static sector_t check_free_runs(struct rb_node *node, unsigned char *used, int *ret)
 {
-	int ret = 0;
-	struct extent *e, *next, *prev;
+	struct free_extent *fe, *next;
+	sector_t max, sub, i;
 
 	if (!node)
-		return -1;
+		return 0;
+	fe = rb_entry(node, struct free_extent, rb);
+	max = fe->len;
+	sub = check_free_runs(node->rb_left, used, ret);
+	if (sub > max)
+		max = sub;
+	sub = check_free_runs(node->rb_right, used, ret);
+	if (sub > max)
+		max = sub;
+	if (fe->max_len != max) {
+		printf("\n free run pba: %d len: %d max_len: %d expected: %d",
+		       fe->pba, fe->len, fe->max_len, max);
+		*ret = -1;
+	}
+	for (i = fe->pba; i < fe->pba + fe->len; i++)
+		if (used[i]) {
+			printf("\n sector %d is both free and allocated", i);
+			*ret = -1;
+			break;
+		}
+	if (rb_next(node)) {
+		next = rb_entry(rb_next(node), struct free_extent, rb);
+		if (fe->pba + fe->len >= next->pba) {
+			printf("\n free runs (%d, %d) and (%d, %d) not coalesced",
+			       fe->pba, fe->len, next->pba, next->len);
+			*ret = -1;
+		}
+	}
+	return max;
+}
 
-	e = rb_entry(node, struct extent, rb);
+#define ALLOC_SECTORS	(1 << 16)
+#define ALLOC_LOOPS	20000
 
-	if (e->lba < 0) {
-		printf("\n LBA is <=0, tree corrupt!! \n");
-		return -1;
+/*
+ * Random allocations and frees against a shadow map of the device;
+ * afterwards every free run must be free in the shadow, coalesced with
+ * its neighbours and carry the right subtree maximum.
+ */
+static int check_pba_alloc(void)
+{
+	struct pba_allocator a;
+	struct extent_map scratch;
+	unsigned char *used;
+	sector_t (*held)[2];
+	sector_t pba, i;
+	int nr_held = 0, loop, ret = 0, len, n_free = ALLOC_SECTORS;
+
+	used = calloc(ALLOC_SECTORS, 1);
+	held = calloc(ALLOC_LOOPS, sizeof(*held));
+	if (!used || !held)
+		return -ENOMEM;
+
+	srand(26);
+	pba_allocator_init(&a);
+	/* Free the device in pieces, out of order, to exercise coalescing */
+	for (i = 0; i < ALLOC_SECTORS; i += 2048)
+		if ((i / 2048) & 1)
+			pba_free(&a, i, 2048);
+	for (i = 0; i < ALLOC_SECTORS; i += 2048)
+		if (!((i / 2048) & 1))
+			pba_free(&a, i, 2048);
+	if (a.nr_runs != 1 || pba_max_run(&a) != ALLOC_SECTORS) {
+		printf("\n %d runs, longest %d after freeing the whole device", a.nr_runs, pba_max_run(&a));
+		ret = -1;
 	}
-	if (e->pba < 0) {
-		printf("\n PBA is <=0, tree corrupt!! \n");
-		return -1;
+
+	for (loop = 0; loop < ALLOC_LOOPS && !ret; loop++) {
+		if (nr_held && (rand() % 3 == 0 || !n_free)) {
+			int victim = rand() % nr_held;
+
+			pba_free(&a, held[victim][0], held[victim][1]);
+			for (i = held[victim][0]; i < held[victim][0] + held[victim][1]; i++)
+				used[i] = 0;
+			n_free += held[victim][1];
+			held[victim][0] = held[nr_held - 1][0];
+			held[victim][1] = held[nr_held - 1][1];
+			nr_held--;
+			continue;
+		}
+		len = 1 + rand() % 64;
+		if (pba_alloc_after(&a, rand() % ALLOC_SECTORS, len, &pba) < 0) {
+			if (len <= pba_max_run(&a)) {
+				printf("\n alloc of %d failed with a %d run free", len, pba_max_run(&a));
+				ret = -1;
+			}
+			continue;
+		}
+		for (i = pba; i < pba + len; i++) {
+			if (used[i]) {
+				printf("\n sector %d allocated twice", i);
+				ret = -1;
+			}
+			used[i] = 1;
+		}
+		n_free -= len;
+		held[nr_held][0] = pba;
+		held[nr_held][1] = len;
+		nr_held++;
 	}
-	if (e->len <= 0) {
-		printf("\n len is <=0, tree corrupt!! \n");
-		return -1;
+
+	check_free_runs(a.free_root.rb_node, used, &ret);
+	if (a.nr_free != n_free) {
+		printf("\n allocator has %d free sectors, expected %d", a.nr_free, n_free);
+		ret = -1;
 	}
 
-	next = lsdm_rb_next(e);
-	prev = lsdm_rb_prev(e);
+	/* Writes bigger than any free run get spread over several runs */
+	extent_map_init(&scratch);
+	len = pba_max_run(&a) + 100;
+	if (len <= a.nr_free) {
+		if (pba_map_write(&a, &scratch, 0, len) < 0) {
+			printf("\n pba_map_write of %d sectors failed", len);
+			ret = -1;
+		} else if (stl_rb_geq(&scratch, 0)->lba != 0 || scratch.n_extents < 2) {
+			printf("\n pba_map_write did not split the write");
+			ret = -1;
+		}
+	}
+
+	printf("\n pba allocator: %d runs, %d free sectors, longest run %d\n",
+	       a.nr_runs, a.nr_free, pba_max_run(&a));
+	pba_allocator_exit(&a);
+	free(held);
+	free(used);
+	return ret;
+}
 
-	if (next  && next->lba == e->lba) {
-		printf("\n LBA corruption (next) ! lba: %d is present in two nodes!", next->lba);
-		printf("\n next->lba: %d next->pba: %d next->len: %d", next->lba, next->pba, next->len);
+/*
+ * Replay new[] through the finger into a second map: it must come out
+ * identical to the map built by plain root descents, and finger lookups
+ * must agree with stl_rb_geq() everywhere.
+ */
+static int check_finger(int nr)
+{
+	struct extent_map fmap;
+	struct extent_finger f;
+	struct rb_node *a, *b;
+	int verbose = _stl_verbose, ret = 0, i;
+	sector_t lba;
+
+	_stl_verbose = 0;
+	extent_map_init(&fmap);
+	extent_finger_init(&f);
+	for (i = 0; i < nr; i++) {
+		ret = lsdm_update_range_finger(&fmap, &f, new[i][1], new[i][0], new[i][2]);
+		if (ret) {
+			printf("\n finger update %d failed: %d", i, ret);
+			goto out;
+		}
+	}
+
+	for (a = rb_first(&map.extent_tbl_root), b = rb_first(&fmap.extent_tbl_root);
+	     a && b; a = rb_next(a), b = rb_next(b)) {
+		struct extent *x = rb_entry(a, struct extent, rb);
+		struct extent *y = rb_entry(b, struct extent, rb);
+
+		if (x->lba != y->lba || x->pba != y->pba || x->len != y->len) {
+			printf("\n finger map differs: (%d %d %d) vs (%d %d %d)",
+			       x->lba, x->pba, x->len, y->lba, y->pba, y->len);
+			ret = -1;
+			break;
+		}
+	}
+	if (a || b) {
+		printf("\n finger map has a different number of extents");
+		ret = -1;
+	}
+
+	extent_finger_init(&f);
+	for (lba = 0; lba < 40000000 && !ret; lba += 1021) {
+		if (stl_rb_geq_finger(&fmap, &f, lba) != stl_rb_geq(&fmap, lba)) {
+			printf("\n finger lookup of lba %d went wrong", lba);
+			ret = -1;
+		}
+	}
+	printf("\n finger: %lu hits, %lu neighbour hits, %lu misses\n",
+	       f.hits, f.near_hits, f.misses);
+out:
+	extent_map_destroy(&fmap);
+	_stl_verbose = verbose;
+	return ret;
+}
+
+#define MODEL_SECTORS	(1 << 15)
+
+/* Check every sector of 'm' against 'model' (-1: unmapped) */
+static int check_against_model(struct extent_map *m, const sector_t *model, int nr)
+{
+	struct extent *e;
+	sector_t lba;
+	int count = 0;
+	struct rb_node *rb;
+
+	for (lba = 0; lba < nr; lba++) {
+		e = stl_rb_geq(m, lba);
+		if (e && e->lba <= lba) {
+			if (model[lba] != e->pba + (lba - e->lba)) {
+				printf("\n lba %d maps to %d, expected %d", lba,
+				       e->pba + (lba - e->lba), model[lba]);
+				return -1;
+			}
+		} else if (model[lba] != -1) {
+			printf("\n lba %d is unmapped, expected %d", lba, model[lba]);
+			return -1;
+		}
+	}
+	for (rb = rb_first(&m->extent_tbl_root); rb; rb = rb_next(rb))
+		count++;
+	if (count != m->n_extents) {
+		printf("\n map says %d extents, tree has %d", m->n_extents, count);
 		return -1;
 	}
+	return 0;
+}
 
-	if (next && e->lba + e->len == next->lba) {
-		if (e->pba + e->len == next->pba) {
-			printf("\n Nodes not merged! ");
-			printf("\n e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
-			printf("\n next->lba: %d next->pba: %d next->len: %d", next->lba, next->pba, next->len);
+/*
+ * Large overwrites that cover hundreds of extents and clip one at either
+ * end, so case 3 detaches them with rb_erase_range(). The map allocates
+ * from a pool, which is rewound and refilled once at the end.
+ */
+static int check_overwrite_range(void)
+{
+	struct extent_map m;
+	struct extent_pool pool;
+	unsigned long nr_chunks;
+	sector_t *model;
+	int verbose = _stl_verbose, ret = 0, loop, i, lba, len;
+
+	model = malloc(MODEL_SECTORS * sizeof(*model));
+	if (!model)
+		return -ENOMEM;
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+
+	_stl_verbose = 0;
+	extent_map_init(&m);
+	extent_pool_init(&pool);
+	m.pool = &pool;
+	/* 8 sector extents with 8 sector holes, nothing mergeable */
+	for (i = 0; i < MODEL_SECTORS / 16; i++) {
+		lsdm_update_range(&m, i * 16, 1000000 + i * 32, 8);
+		for (lba = i * 16; lba < i * 16 + 8; lba++)
+			model[lba] = 1000000 + i * 32 + (lba - i * 16);
+	}
+	srand(300);
+	for (loop = 0; loop < 50 && !ret; loop++) {
+		len = 512 + rand() % (MODEL_SECTORS / 4);
+		lba = rand() % (MODEL_SECTORS - len);
+		lsdm_update_range(&m, lba, 2000000 + loop * MODEL_SECTORS, len);
+		for (i = 0; i < len; i++)
+			model[lba + i] = 2000000 + loop * MODEL_SECTORS + i;
+		ret = check_against_model(&m, model, MODEL_SECTORS);
+		/* Punch small extents back in so the next pass has work */
+		for (i = 0; i < 200; i++) {
+			int l = rand() % (MODEL_SECTORS - 8), j;
+
+			lsdm_update_range(&m, l, 3000000 + loop * 4096 + i * 16, 4);
+			for (j = 0; j < 4; j++)
+				model[l + j] = 3000000 + loop * 4096 + i * 16 + j;
+		}
+	}
+	if (!ret)
+		ret = check_against_model(&m, model, MODEL_SECTORS);
+	if (!ret && lsdm_tree_check(&m) < 0)
+		ret = -1;
+	printf(" large overwrites: %s, %d extents left\n", ret ? "FAILED" : "ok", m.n_extents);
+
+	/* Refilling a rewound pool must not grow it */
+	nr_chunks = pool.nr_chunks;
+	extent_map_destroy(&m);
+	for (i = 0; i < MODEL_SECTORS / 16; i++)
+		lsdm_update_range(&m, i * 16, 1000000 + i * 32, 8);
+	if (!ret && (pool.nr_chunks != nr_chunks || lsdm_tree_check(&m) < 0)) {
+		printf("\n pool grew from %lu to %lu chunks after a reset",
+		       nr_chunks, pool.nr_chunks);
+		ret = -1;
+	}
+	extent_map_destroy(&m);
+	extent_pool_exit(&pool);
+	free(model);
+	_stl_verbose = verbose;
+	return ret;
+}
+
+/* Walk 'nr' sectors with update_buf_lookup(), one answered run at a time */
+static int check_buf_lookup(struct update_buf *b, const sector_t *model, int nr)
+{
+	sector_t lba, pba;
+	int len, i;
+
+	for (lba = 0; lba < nr; lba += len) {
+		pba = update_buf_lookup(b, lba, &len);
+		if (len <= 0) {
+			printf("\n lookup of lba %d returned an empty run", lba);
 			return -1;
 		}
+		for (i = 0; i < len && lba + i < nr; i++) {
+			if (model[lba + i] != (pba < 0 ? -1 : pba + i)) {
+				printf("\n buffered lba %d reads %d, expected %d", lba + i,
+				       pba < 0 ? -1 : pba + i, model[lba + i]);
+				return -1;
+			}
+		}
 	}
+	return 0;
+}
 
-	if (prev && prev->lba == e->lba) {
-		printf("\n LBA corruption (prev)! lba: %d is present in two nodes!", prev->lba);
-		return -1;
+/*
+ * Small overlapping writes to a hot region go through an update buffer
+ * that flushes every 64 staged extents. Reads must see the latest data
+ * at all times, and the map must match the model after the last flush.
+ */
+static int check_update_buf(void)
+{
+	struct extent_map m;
+	struct update_buf b;
+	sector_t *model;
+	int verbose = _stl_verbose, ret = 0, i, j, lba, len;
+
+	model = malloc(MODEL_SECTORS * sizeof(*model));
+	if (!model)
+		return -ENOMEM;
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+
+	_stl_verbose = 0;
+	extent_map_init(&m);
+	update_buf_init(&b, &m, 64);
+	srand(34);
+	for (i = 0; i < 20000 && !ret; i++) {
+		len = 1 + rand() % 16;
+		if (rand() % 4)
+			lba = rand() % 2048;
+		else
+			lba = rand() % (MODEL_SECTORS - len);
+		update_buf_add(&b, lba, 100000 + i * 16, len);
+		for (j = 0; j < len; j++)
+			model[lba + j] = 100000 + i * 16 + j;
+		if (!(i % 1000))
+			ret = check_buf_lookup(&b, model, MODEL_SECTORS);
+	}
+	if (!ret)
+		ret = check_buf_lookup(&b, model, MODEL_SECTORS);
+	if (!ret && update_buf_flush(&b) < 0)
+		ret = -1;
+	if (!ret)
+		ret = check_against_model(&m, model, MODEL_SECTORS);
+	if (!ret && lsdm_tree_check(&m) < 0)
+		ret = -1;
+	printf(" update buffer: %s, %lu updates applied as %lu extents in %lu flushes\n",
+	       ret ? "FAILED" : "ok", b.nr_updates, b.nr_applied, b.nr_flushes);
+
+	update_buf_exit(&b);
+	extent_map_destroy(&m);
+	free(model);
+	_stl_verbose = verbose;
+	return ret;
+}
+
+/* Number of neighbours in 'm' that could still be one extent */
+static int count_mergeable(struct extent_map *m)
+{
+	struct rb_iter it;
+	struct extent *e, *n;
+	int count = 0;
+
+	e = extent_iter_first(m, &it);
+	for (n = e ? extent_iter_next(&it) : NULL; n; e = n, n = extent_iter_next(&it))
+		if (e->lba + e->len == n->lba && e->pba + e->len == n->pba)
+			count++;
+	return count;
+}
+
+/*
+ * Build a map out of runs that are fragmented into pieces behind merge()'s
+ * back, then coalesce it in slices of 'steps' steps while updates keep
+ * landing in between. Two quiet passes later nothing may be left to merge.
+ */
+static int check_coalesce_steps(int steps)
+{
+	struct extent_map m;
+	struct extent_pool pool;
+	struct extent_coalesce c;
+	struct extent *e;
+	sector_t *model, lba = 0, pba = 500000;
+	int verbose = _stl_verbose, ret = 0, runs = 0, pieces, len, i, j, slices = 0;
+	unsigned long passes;
+
+	model = malloc(MODEL_SECTORS * sizeof(*model));
+	if (!model)
+		return -ENOMEM;
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+
+	_stl_verbose = 0;
+	extent_map_init(&m);
+	extent_pool_init(&pool);
+	m.pool = &pool;
+	srand(35);
+	while (lba < MODEL_SECTORS - 64) {
+		pieces = 1 + rand() % 5;
+		for (i = 0; i < pieces; i++) {
+			len = 1 + rand() % 8;
+			e = extent_alloc(&m);
+			extent_init(e, lba, pba, len);
+			rb_insert_after(&e->rb, rb_last(&m.extent_tbl_root), &m.extent_tbl_root);
+			m.n_extents++;
+			for (j = 0; j < len; j++)
+				model[lba + j] = pba + j;
+			lba += len;
+			pba += len;
+		}
+		runs++;
+		lba += rand() % 3;
+		pba += 1000;
 	}
 
-	if (prev && prev->lba + prev->len == e->lba) {
-		if (prev->pba + prev->len == e->pba) {
-			printf("\n Nodes not merged! ");
-			printf("\n e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
-			printf("\n prev->lba: %d prev->pba: %d prev->len: %d", prev->lba, prev->pba, prev->len);
+	extent_coalesce_init(&c);
+	/* Every slice takes a step, so a pass is bounded by the extents */
+	while (!c.passes && slices < 2 * MODEL_SECTORS) {
+		lsdm_coalesce(&m, &c, steps, 0);
+		slices++;
+		if (slices % 10)
+			continue;
+		/* The cursor has to survive the map changing under it */
+		lba = rand() % (MODEL_SECTORS - 16);
+		lsdm_update_range(&m, lba, 900000 + slices * 16, 16);
+		for (j = 0; j < 16; j++)
+			model[lba + j] = 900000 + slices * 16 + j;
+	}
+	if (!c.passes) {
+		printf("\n coalesce: %d step slices never finish a pass", steps);
+		ret = -1;
+	}
+	passes = c.passes;
+	while (!ret && c.passes < passes + 2)
+		lsdm_coalesce(&m, &c, steps, 0);
+
+	if (!ret)
+		ret = check_against_model(&m, model, MODEL_SECTORS);
+	if (!ret && (count_mergeable(&m) || lsdm_tree_check(&m) < 0))
+		ret = -1;
+	printf(" coalesce: %s, %d step slices, %d runs, %lu extents merged in %d slices\n",
+	       ret ? "FAILED" : "ok", steps, runs, c.merged, slices);
+
+	extent_map_destroy(&m);
+	extent_pool_exit(&pool);
+	free(model);
+	_stl_verbose = verbose;
+	return ret;
+}
+
+static int check_coalesce(void)
+{
+	int ret = check_coalesce_steps(7);
+
+	if (!ret)
+		ret = check_coalesce_steps(1);
+	return ret;
+}
+
+#define PMAP_TEST_FILE	"/tmp/rbtest.pmap"
+
+/* Every sector of the persistent map must read like the model */
+static int check_pmap_model(struct pmap *pm, const sector_t *model, int nr)
+{
+	struct pmap_node *e;
+	sector_t lba;
+
+	for (lba = 0; lba < nr; lba++) {
+		e = pmap_geq(pm, lba);
+		if (e && e->lba <= lba) {
+			if (model[lba] != e->pba + (lba - e->lba)) {
+				printf("\n pmap: lba %d maps to %d, expected %d", lba,
+				       e->pba + (lba - e->lba), model[lba]);
+				return -1;
+			}
+		} else if (model[lba] != -1) {
+			printf("\n pmap: lba %d is unmapped, expected %d", lba, model[lba]);
 			return -1;
+		}
+	}
+	return pmap_check(pm);
+}
 
+/*
+ * Random updates into a persistent map that starts too small and has to
+ * grow (and move), then a close and a reopen, which must find the same
+ * map without rebuilding anything. A torn header must be refused.
+ */
+static int check_pmap(void)
+{
+	struct pmap pm;
+	sector_t *model;
+	int ret, i, j, lba, len;
+	unsigned long nr;
+
+	model = malloc(MODEL_SECTORS * sizeof(*model));
+	if (!model)
+		return -ENOMEM;
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+
+	ret = pmap_create(&pm, PMAP_TEST_FILE, 16);
+	if (ret < 0) {
+		free(model);
+		return ret;
+	}
+	srand(36);
+	for (i = 0; i < 20000; i++) {
+		len = 1 + rand() % 64;
+		lba = rand() % (MODEL_SECTORS - len);
+		/* Every fourth write continues the previous one, to merge */
+		if (i % 4 == 3)
+			lba = (lba & ~63);
+		pmap_update_range(&pm, lba, 200000 + i * 64, len);
+		for (j = 0; j < len; j++)
+			model[lba + j] = 200000 + i * 64 + j;
+	}
+	ret = check_pmap_model(&pm, model, MODEL_SECTORS);
+	nr = pmap_nr_extents(&pm);
+	pmap_close(&pm);
+
+	if (!ret)
+		ret = pmap_open(&pm, PMAP_TEST_FILE);
+	if (!ret) {
+		ret = check_pmap_model(&pm, model, MODEL_SECTORS);
+		if (pmap_nr_extents(&pm) != nr)
+			ret = -1;
+		/* Not closed: the next open has to refuse it */
+		munmap(pm.base, pm.size);
+		close(pm.fd);
+		if (!ret && pmap_open(&pm, PMAP_TEST_FILE) != -EUCLEAN)
+			ret = -1;
+	}
+	printf("\n persistent map: %s, %lu extents\n", ret ? "FAILED" : "ok", nr);
+	unlink(PMAP_TEST_FILE);
+	free(model);
+	return ret;
+}
+
+#define CKPT_TEST_FILE	"/tmp/rbtest.ckpt"
+
+/* rb_build_sorted() must give a valid tree for every size */
+static int check_build_sorted(void)
+{
+	struct rb_node *ptrs[NODES];
+	struct rb_root root;
+	int nr, i;
+
+	for (i = 0; i < NODES; i++)
+		ptrs[i] = &nodes[i].rb;
+	for (nr = 0; nr <= NODES; nr += nr < 70 ? 1 : 97) {
+		rb_build_sorted(ptrs, nr, &root);
+		if (check_nodes_range(&root, 0, nr - 1, -1, -1) < 0) {
+			printf("\n bulk build of %d nodes is broken", nr);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A checkpoint of several chunks, loaded back with more workers than
+ * chunks, must give the same extents in a valid tree.
+ */
+static int check_checkpoint(void)
+{
+	struct extent_map m, l;
+	struct extent *a, *b;
+	struct rb_iter ia, ib;
+	int verbose = _stl_verbose, ret, i;
+	long bytes;
+
+	ret = check_build_sorted();
+	_stl_verbose = 0;
+	extent_map_init(&m);
+	extent_map_init(&l);
+	srand(37);
+	/* PBAs jump back and forth, so the deltas take both signs */
+	for (i = 0; i < 3 * CKPT_CHUNK_EXTENTS / 2 && !ret; i++)
+		lsdm_update_range(&m, rand() % (1 << 24),
+				  rand() % 2 ? i * 16 : (1 << 28) - i * 16, 1 + rand() % 16);
+
+	bytes = checkpoint_write(&m, CKPT_TEST_FILE);
+	if (!ret && bytes < 0)
+		ret = bytes;
+	if (!ret)
+		ret = checkpoint_load(&l, CKPT_TEST_FILE, 5);
+	if (!ret && (l.n_extents != m.n_extents || lsdm_tree_check(&l) < 0 ||
+		     check_rb_props(l.extent_tbl_root.rb_node) < 0))
+		ret = -1;
+	for (a = extent_iter_first(&m, &ia), b = extent_iter_first(&l, &ib); !ret && (a || b);
+	     a = extent_iter_next(&ia), b = extent_iter_next(&ib)) {
+		if (!a || !b || a->lba != b->lba || a->pba != b->pba || a->len != b->len)
+			ret = -1;
+	}
+	printf(" checkpoint: %s, %d extents in %ld bytes\n", ret ? "FAILED" : "ok",
+	       m.n_extents, bytes);
+
+	extent_map_destroy(&m);
+	extent_map_destroy(&l);
+	unlink(CKPT_TEST_FILE);
+	_stl_verbose = verbose;
+	return ret;
+}
+
+#define DELTA_TEST_FILE	"/tmp/rbtest.delta"
+
+/*
+ * A base checkpoint plus two deltas of writes and trims, folded back
+ * together, must read exactly like the live map. A delta must only cover
+ * the granules written since the previous checkpoint.
+ */
+static int check_delta(void)
+{
+	struct extent_map m, l;
+	struct dirty_map dirty;
+	sector_t *model;
+	int verbose = _stl_verbose, ret, i, j, lba, len, round;
+	long bytes[3];
+
+	model = malloc(MODEL_SECTORS * sizeof(*model));
+	if (!model || dirty_map_init(&dirty, MODEL_SECTORS, 8) < 0)
+		return -ENOMEM;
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+
+	_stl_verbose = 0;
+	extent_map_init(&m);
+	extent_map_init(&l);
+	m.dirty = &dirty;
+	srand(38);
+	for (i = 0; i < MODEL_SECTORS / 16; i++) {
+		lsdm_update_range(&m, i * 16, 600000 + i * 32, 12);
+		for (j = 0; j < 12; j++)
+			model[i * 16 + j] = 600000 + i * 32 + j;
+	}
+	bytes[0] = checkpoint_write(&m, CKPT_TEST_FILE);
+	ret = (bytes[0] < 0 || dirty.nr_dirty) ? -1 : 0;
+
+	for (round = 1; round <= 2 && !ret; round++) {
+		for (i = 0; i < 100; i++) {
+			len = 1 + rand() % 300;
+			lba = rand() % (MODEL_SECTORS - len);
+			if (rand() % 4) {
+				lsdm_update_range(&m, lba, 700000 * round + i * 512, len);
+				for (j = 0; j < len; j++)
+					model[lba + j] = 700000 * round + i * 512 + j;
+			} else {
+				lsdm_trim_range(&m, lba, len);
+				for (j = 0; j < len; j++)
+					model[lba + j] = -1;
+			}
+		}
+		bytes[round] = checkpoint_write_delta(&m, round == 1 ?
+						      DELTA_TEST_FILE : DELTA_TEST_FILE "2");
+		if (bytes[round] < 0 || dirty.nr_dirty)
+			ret = -1;
+	}
+	if (!ret)
+		ret = check_against_model(&m, model, MODEL_SECTORS);
+	if (!ret)
+		ret = checkpoint_load(&l, CKPT_TEST_FILE, 2);
+	if (!ret)
+		ret = checkpoint_apply_delta(&l, DELTA_TEST_FILE);
+	if (!ret)
+		ret = checkpoint_apply_delta(&l, DELTA_TEST_FILE "2");
+	if (!ret)
+		ret = check_against_model(&l, model, MODEL_SECTORS);
+	if (!ret && lsdm_tree_check(&l) < 0)
+		ret = -1;
+	printf(" delta checkpoint: %s, base %ld bytes, deltas %ld and %ld bytes\n",
+	       ret ? "FAILED" : "ok", bytes[0], bytes[1], bytes[2]);
+
+	extent_map_destroy(&m);
+	extent_map_destroy(&l);
+	dirty_map_exit(&dirty);
+	unlink(CKPT_TEST_FILE);
+	unlink(DELTA_TEST_FILE);
+	unlink(DELTA_TEST_FILE "2");
+	free(model);
+	_stl_verbose = verbose;
+	return ret;
+}
+
+#define WAL_TEST_FILE	"/tmp/rbtest.wal"
+
+static void wal_model_update(struct wal *w, struct extent_map *m, sector_t *model,
+			     sector_t lba, sector_t pba, int len)
+{
+	int j;
+
+	wal_update_range(w, m, lba, pba, len);
+	for (j = 0; j < len; j++)
+		model[lba + j] = pba + j;
+}
+
+/*
+ * Writes, a checkpoint that resets the log, more writes, then a crash
+ * that loses the last uncommitted group and tears the record being
+ * written. The checkpoint plus the replayed log must read exactly like
+ * the map as of the last commit, and reopening the log must pick up
+ * right after its last valid record.
+ */
+static int check_wal(void)
+{
+	struct extent_map m, l;
+	struct wal w;
+	sector_t *model;
+	long long last;
+	long replayed = 0;
+	int verbose = _stl_verbose, ret, i, len;
+	FILE *f;
+
+	model = malloc(MODEL_SECTORS * sizeof(*model));
+	if (!model)
+		return -ENOMEM;
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+
+	_stl_verbose = 0;
+	extent_map_init(&m);
+	extent_map_init(&l);
+	unlink(WAL_TEST_FILE);
+	ret = wal_open(&w, WAL_TEST_FILE, 16, 0);
+	if (ret < 0)
+		goto out;
+	srand(39);
+	for (i = 0; i < 500; i++) {
+		len = 1 + rand() % 64;
+		wal_model_update(&w, &m, model, rand() % (MODEL_SECTORS - len),
+				 800000 + i * 64, len);
+	}
+	/* The log may only go once the checkpoint is on disk */
+	ret = (checkpoint_write(&m, CKPT_TEST_FILE) < 0 || wal_reset(&w) < 0) ? -1 : 0;
+	for (i = 500; i < 1000 && !ret; i++) {
+		len = 1 + rand() % 64;
+		wal_model_update(&w, &m, model, rand() % (MODEL_SECTORS - len),
+				 800000 + i * 64, len);
+	}
+	if (!ret)
+		ret = wal_commit(&w);
+	last = w.seq;
+
+	/* Never committed: the crash loses these */
+	for (i = 0; i < 5 && !ret; i++)
+		wal_update_range(&w, &m, i * 100, 999000 + i * 100, 10);
+	close(w.fd);
+	free(w.buf);
+	f = fopen(WAL_TEST_FILE, "a");
+	if (!f || fwrite("torn recor", 10, 1, f) != 1)
+		ret = -1;
+	if (f)
+		fclose(f);
+
+	if (!ret)
+		ret = checkpoint_load(&l, CKPT_TEST_FILE, 2);
+	if (!ret) {
+		replayed = wal_replay(&l, WAL_TEST_FILE, 64);
+		ret = replayed != 500 ? -1 : 0;
+	}
+	if (!ret)
+		ret = check_against_model(&l, model, MODEL_SECTORS);
+	if (!ret && lsdm_tree_check(&l) < 0)
+		ret = -1;
+	if (!ret) {
+		if (wal_open(&w, WAL_TEST_FILE, 16, 0)) {
+			ret = -1;
+		} else {
+			if (w.seq != last || w.durable != last)
+				ret = -1;
+			wal_close(&w);
+		}
+	}
+	printf(" update log: %s, %ld records replayed\n", ret ? "FAILED" : "ok", replayed);
+
+out:
+	extent_map_destroy(&m);
+	extent_map_destroy(&l);
+	unlink(CKPT_TEST_FILE);
+	unlink(WAL_TEST_FILE);
+	free(model);
+	_stl_verbose = verbose;
+	return ret;
+}
+
+/*
+ * A lone append in interval mode: nothing more arrives to trigger the
+ * commit, so wal_poll() has to once the interval is up.
+ */
+static int check_wal_interval(void)
+{
+	struct wal w;
+	long long seq;
+	int ret, i;
+
+	unlink(WAL_TEST_FILE);
+	ret = wal_open(&w, WAL_TEST_FILE, 16, 1000);
+	if (ret < 0)
+		return ret;
+	seq = wal_append(&w, 100, 200, 8);
+	if (seq < 0)
+		ret = seq;
+	for (i = 0; !ret && !wal_durable(&w, seq) && i < 100; i++) {
+		usleep(500);
+		ret = wal_poll(&w);
+	}
+	if (!ret && !wal_durable(&w, seq))
+		ret = -1;
+	printf(" update log interval commit: %s, %lu commits\n",
+	       ret ? "FAILED" : "ok", w.nr_commits);
+	wal_close(&w);
+	unlink(WAL_TEST_FILE);
+	return ret;
+}
+
+#define PAGED_TEST_FILE	"/tmp/rbtest.paged"
+
+static int check_paged_model(struct paged_map *pm, const sector_t *model, int nr)
+{
+	sector_t lba, pba;
+	int len, j;
+
+	for (lba = 0; lba < nr; lba += len) {
+		pba = paged_lookup(pm, lba, &len);
+		if (len <= 0) {
+			printf("\n paged: lookup of lba %d failed", lba);
+			return -1;
+		}
+		for (j = 0; j < len && lba + j < nr; j++) {
+			if (model[lba + j] != (pba == -1 ? -1 : pba + j)) {
+				printf("\n paged: lba %d maps to %d, expected %d", lba + j,
+				       pba == -1 ? -1 : pba + j, model[lba + j]);
+				return -1;
+			}
+		}
+	}
+	if (pm->nr_resident > pm->max_resident)
+		return -1;
+	return paged_check(pm) < 0 ? -1 : 0;
+}
+
+/*
+ * A map packed into leaves, then random writes through a cache of four
+ * leaves, so that leaves keep getting evicted, reloaded and split. The
+ * result must read like the model, also after a close and a reopen.
+ */
+static int check_paged(void)
+{
+	struct extent_map m;
+	struct paged_map pm;
+	sector_t *model;
+	unsigned long splits = 0, loads = 0;
+	int verbose = _stl_verbose, ret, i, j, lba, len;
+
+	model = malloc(MODEL_SECTORS * sizeof(*model));
+	if (!model)
+		return -ENOMEM;
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+
+	_stl_verbose = 0;
+	extent_map_init(&m);
+	for (i = 0; i < MODEL_SECTORS / 16; i++) {
+		lsdm_update_range(&m, i * 16, 900000 + i * 32, 12);
+		for (j = 0; j < 12; j++)
+			model[i * 16 + j] = 900000 + i * 32 + j;
+	}
+	ret = paged_create(&pm, PAGED_TEST_FILE, 4);
+	if (ret < 0)
+		goto out;
+	ret = paged_from_map(&pm, &m);
+	srand(40);
+	for (i = 0; i < 5000 && !ret; i++) {
+		len = 1 + rand() % 8;
+		lba = rand() % (MODEL_SECTORS - len);
+		ret = paged_update_range(&pm, lba, 1000000 + i * 8, len);
+		for (j = 0; j < len; j++)
+			model[lba + j] = 1000000 + i * 8 + j;
+	}
+	if (!ret)
+		ret = check_paged_model(&pm, model, MODEL_SECTORS);
+	splits = pm.nr_splits;
+	loads = pm.nr_loads;
+	paged_close(&pm);
+
+	if (!ret)
+		ret = paged_open(&pm, PAGED_TEST_FILE, 2);
+	if (!ret) {
+		ret = check_paged_model(&pm, model, MODEL_SECTORS);
+		paged_close(&pm);
+	}
+	if (!ret && !splits)
+		ret = -1;
+	printf(" paged map: %s, %d leaf loads, %lu splits\n", ret ? "FAILED" : "ok",
+	       (int)loads, splits);
+out:
+	extent_map_destroy(&m);
+	unlink(PAGED_TEST_FILE);
+	free(model);
+	_stl_verbose = verbose;
+	return ret;
+}
+
+#define SHARD_THREADS	4
+
+struct shard_writer {
+	pthread_t thread;
+	struct shard_map *sm;
+	sector_t *model;
+	int first, nr;		/* LBAs this writer owns */
+	unsigned seed;
+	int started;
+};
+
+static void *shard_write(void *arg)
+{
+	struct shard_writer *w = arg;
+	int i, j, lba, len;
+
+	for (i = 0; i < 3000; i++) {
+		len = 1 + rand_r(&w->seed) % 200;
+		lba = w->first + rand_r(&w->seed) % (w->nr - len);
+		shard_update_range(w->sm, lba, 1100000 + w->first + i * 256, len);
+		for (j = 0; j < len; j++)
+			w->model[lba + j] = 1100000 + w->first + i * 256 + j;
+	}
+	return NULL;
+}
+
+/*
+ * Writers on disjoint quarters of the LBA space, with ranges spanning up
+ * to four 64 sector stripes, so every writer takes shards that the
+ * others take too. The shards must then read like the model.
+ */
+static int check_shard(void)
+{
+	struct shard_writer w[SHARD_THREADS];
+	struct shard_map sm;
+	sector_t *model, lba, pba;
+	int verbose = _stl_verbose, ret, i, j, len;
+
+	model = malloc(MODEL_SECTORS * sizeof(*model));
+	if (!model)
+		return -ENOMEM;
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+	ret = shard_map_init(&sm, 8, 6);
+	if (ret < 0) {
+		free(model);
+		return ret;
+	}
+
+	_stl_verbose = 0;
+	for (i = 0; i < SHARD_THREADS; i++) {
+		w[i].sm = &sm;
+		w[i].model = model;
+		w[i].nr = MODEL_SECTORS / SHARD_THREADS;
+		w[i].first = i * w[i].nr;
+		w[i].seed = 41 + i;
+		w[i].started = !pthread_create(&w[i].thread, NULL, shard_write, &w[i]);
+		if (!w[i].started)
+			shard_write(&w[i]);
+	}
+	for (i = 0; i < SHARD_THREADS; i++)
+		if (w[i].started)
+			pthread_join(w[i].thread, NULL);
+
+	for (lba = 0; lba < MODEL_SECTORS && !ret; lba += len) {
+		pba = shard_lookup(&sm, lba, &len);
+		for (j = 0; j < len && lba + j < MODEL_SECTORS; j++) {
+			if (model[lba + j] != (pba == -1 ? -1 : pba + j)) {
+				printf("\n shard: lba %d maps to %d, expected %d", lba + j,
+				       pba == -1 ? -1 : pba + j, model[lba + j]);
+				ret = -1;
+				break;
+			}
 		}
 	}
+	if (!ret)
+		ret = shard_check(&sm);
+	printf(" sharded map: %s, %lu extents in %d shards\n", ret ? "FAILED" : "ok",
+	       shard_nr_extents(&sm), sm.nr_shards);
+	shard_map_exit(&sm);
+	free(model);
+	_stl_verbose = verbose;
+	return ret;
+}
 
-	if(node->rb_left)
-		ret = check_node_contents(node->rb_left);
-
-	if (ret < 0)
-		return ret;
+#define RL_THREADS	4
+#define RL_SECTORS	4096
 
-	if (node->rb_right)
-		ret = check_node_contents(node->rb_right);
+struct rl_worker {
+	pthread_t thread;
+	struct range_lock_tree *tree;
+	int *readers, *writers;	/* holders of each sector */
+	unsigned seed;
+	int started;
+	int errors;
+};
 
-	return ret;
+/* Claim or release every sector of 'rl'; count what must not be there */
+static int rl_claim(struct rl_worker *w, struct range_lock *rl, int delta)
+{
+	int lba, bad = 0;
 
+	for (lba = rl->start; lba <= rl->last; lba++) {
+		if (rl->exclusive) {
+			bad += __atomic_add_fetch(&w->writers[lba], delta, __ATOMIC_SEQ_CST) > 1;
+			bad += __atomic_load_n(&w->readers[lba], __ATOMIC_SEQ_CST) != 0;
+		} else {
+			__atomic_add_fetch(&w->readers[lba], delta, __ATOMIC_SEQ_CST);
+			bad += __atomic_load_n(&w->writers[lba], __ATOMIC_SEQ_CST) != 0;
+		}
+	}
+	return delta > 0 ? bad : 0;
 }
 
-static int lsdm_tree_check()
+static void *rl_work(void *arg)
 {
-	struct rb_node *node = extent_tbl_root.rb_node;
-	int ret = 0;
-
-	ret = check_node_contents(node);
-	printf("\n");
-	return ret;
-
+	struct rl_worker *w = arg;
+	struct range_lock rl;
+	int i, len, locked;
+
+	for (i = 0; i < 2000; i++) {
+		len = 1 + rand_r(&w->seed) % 64;
+		range_lock_init(&rl, rand_r(&w->seed) % (RL_SECTORS - len), len);
+		if (i % 5 == 0) {
+			locked = rand_r(&w->seed) % 3 ? range_read_trylock(w->tree, &rl) :
+							range_write_trylock(w->tree, &rl);
+		} else {
+			if (rand_r(&w->seed) % 3)
+				range_read_lock(w->tree, &rl);
+			else
+				range_write_lock(w->tree, &rl);
+			locked = 1;
+		}
+		if (locked) {
+			w->errors += rl_claim(w, &rl, 1);
+			sched_yield();
+			rl_claim(w, &rl, -1);
+			range_unlock(w->tree, &rl);
+		}
+		range_lock_exit(&rl);
+	}
+	return NULL;
 }
 
-
-static void lsdm_rb_remove(struct extent *e)
+/*
+ * Threads taking random shared and exclusive range locks over a small
+ * LBA space, so that they keep colliding. While a lock is held, no
+ * conflicting holder may show up on any of its sectors, and everyone has
+ * to get through.
+ */
+static int check_rangelock(void)
 {
-	struct rb_root *root = &extent_tbl_root;
-	rb_erase(&e->rb, root);
-	n_extents--;
+	struct rl_worker w[RL_THREADS];
+	struct range_lock_tree tree;
+	int *readers, *writers, ret = 0, errors = 0, i;
+
+	readers = calloc(RL_SECTORS, sizeof(*readers));
+	writers = calloc(RL_SECTORS, sizeof(*writers));
+	if (!readers || !writers) {
+		free(readers);
+		free(writers);
+		return -ENOMEM;
+	}
+	range_lock_tree_init(&tree);
+	for (i = 0; i < RL_THREADS; i++) {
+		w[i].tree = &tree;
+		w[i].readers = readers;
+		w[i].writers = writers;
+		w[i].seed = 42 + i;
+		w[i].errors = 0;
+		w[i].started = !pthread_create(&w[i].thread, NULL, rl_work, &w[i]);
+		if (!w[i].started)
+			rl_work(&w[i]);
+	}
+	for (i = 0; i < RL_THREADS; i++) {
+		if (w[i].started)
+			pthread_join(w[i].thread, NULL);
+		errors += w[i].errors;
+	}
+	if (errors || tree.nr_locks || range_lock_tree_check(&tree) < 0)
+		ret = -1;
+	for (i = 0; i < RL_SECTORS && !ret; i++)
+		if (readers[i] || writers[i])
+			ret = -1;
+	printf(" range locks: %s, %lu of %d locks waited, %d conflicts\n",
+	       ret ? "FAILED" : "ok", tree.nr_contended, RL_THREADS * 2000, errors);
+	range_lock_tree_exit(&tree);
+	free(readers);
+	free(writers);
+	return ret;
 }
 
-/* Check if we can be merged with the left or the right node */
-static struct extent *merge(struct extent *e)
+#define ACTOR_THREADS	4
+#define ACTOR_WINDOW	16
+
+struct actor_producer {
+	pthread_t thread;
+	struct actor *a;
+	sector_t *model;
+	int first, nr;		/* LBAs this producer owns */
+	unsigned seed;
+	int started;
+	int errors;
+};
+
+/*
+ * Windows of asynchronous updates, some overlapping each other, then a
+ * lookup of one of them: it must see the last update submitted.
+ */
+static void *actor_produce(void *arg)
 {
-	struct extent *prev, *next;
-
-	prev = lsdm_rb_prev(e);
-	next = lsdm_rb_next(e);
-	if (prev) {
-		if(prev->lba + prev->len == e->lba) {
-			if (prev->pba + prev->len == e->pba) {
-				prev->len += e->len;
-				lsdm_rb_remove(e);
-				free(e);
-				e = prev;
-			}
+	struct actor_producer *p = arg;
+	struct actor_cmd c[ACTOR_WINDOW];
+	int i, k, j, lba, len;
+	sector_t pba;
+
+	for (i = 0; i < 300; i++) {
+		for (k = 0; k < ACTOR_WINDOW; k++) {
+			len = 1 + rand_r(&p->seed) % 100;
+			lba = p->first + rand_r(&p->seed) % (p->nr - len);
+			pba = 1200000 + p->first * 16 + (i * ACTOR_WINDOW + k) * 128;
+			actor_cmd_update(&c[k], lba, pba, len);
+			actor_submit(p->a, &c[k]);
+			for (j = 0; j < len; j++)
+				p->model[lba + j] = pba + j;
 		}
+		for (k = 0; k < ACTOR_WINDOW; k++)
+			p->errors += actor_wait(&c[k]) < 0;
+		lba = c[ACTOR_WINDOW - 1].lba;
+		if (actor_lookup(p->a, lba, NULL) != c[ACTOR_WINDOW - 1].pba)
+			p->errors++;
+	}
+	return NULL;
+}
 
+/*
+ * Producers on disjoint quarters of the LBA space feeding one owner
+ * thread. Afterwards the map, read through the owner, must match the
+ * model.
+ */
+static int check_actor(void)
+{
+	struct actor_producer p[ACTOR_THREADS];
+	struct extent_map m;
+	struct actor a;
+	sector_t *model, lba, pba;
+	int verbose = _stl_verbose, ret, i, j, len, errors = 0;
+
+	model = malloc(MODEL_SECTORS * sizeof(*model));
+	if (!model)
+		return -ENOMEM;
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+	_stl_verbose = 0;
+	extent_map_init(&m);
+	ret = actor_start(&a, &m, 64);
+	if (ret < 0)
+		goto out;
+
+	for (i = 0; i < ACTOR_THREADS; i++) {
+		p[i].a = &a;
+		p[i].model = model;
+		p[i].nr = MODEL_SECTORS / ACTOR_THREADS;
+		p[i].first = i * p[i].nr;
+		p[i].seed = 43 + i;
+		p[i].errors = 0;
+		p[i].started = !pthread_create(&p[i].thread, NULL, actor_produce, &p[i]);
+		if (!p[i].started)
+			actor_produce(&p[i]);
 	}
-	if (next) {
-		if (next->lba == e->lba + e->len) {
-			if (next->pba == e->pba + e->len) {
-				e->len += next->len;
-				lsdm_rb_remove(next);
-				free(next);
+	for (i = 0; i < ACTOR_THREADS; i++) {
+		if (p[i].started)
+			pthread_join(p[i].thread, NULL);
+		errors += p[i].errors;
+	}
+	ret = errors ? -1 : 0;
+
+	for (lba = 0; lba < MODEL_SECTORS && !ret; lba += len) {
+		pba = actor_lookup(&a, lba, &len);
+		for (j = 0; j < len && lba + j < MODEL_SECTORS; j++) {
+			if (model[lba + j] != (pba == -1 ? -1 : pba + j)) {
+				printf("\n actor: lba %d maps to %d, expected %d", lba + j,
+				       pba == -1 ? -1 : pba + j, model[lba + j]);
+				ret = -1;
+				break;
 			}
 		}
 	}
+	actor_stop(&a);
+	if (!ret && lsdm_tree_check(&m) < 0)
+		ret = -1;
+	printf(" single writer: %s, %lu commands in %lu batches (%lu unsorted), largest %d\n",
+	       ret ? "FAILED" : "ok", a.nr_cmds, a.nr_batches, a.nr_unsorted, a.biggest_batch);
+out:
+	extent_map_destroy(&m);
+	free(model);
+	_stl_verbose = verbose;
+	return ret;
 }
 
-
-int check_no_overlap(struct extent * new)
+#define SEQ_READERS	3
+#define SEQ_STABLE	3000000		/* pba - lba of extents nobody rewrites */
+#define SEQ_OFF_A	4000000		/* ... and of the two kinds of rewrites */
+#define SEQ_OFF_B	5000000
+
+struct seq_reader {
+	pthread_t thread;
+	struct seq_map *sm;
+	int *stop;
+	unsigned seed;
+	int started;
+	unsigned long lookups;
+	int errors;
+};
+
+/*
+ * The first 8 sectors of every 64 never change and must always read
+ * right. Anything else must read as unmapped or as one of the rewrites.
+ */
+static void *seq_read(void *arg)
 {
-	struct rb_node *node = extent_tbl_root.rb_node;  /* top of the tree */
-	struct extent *e = NULL, *next;
-
-	if (!node)
-		return 0;
+	struct seq_reader *r = arg;
+	sector_t lba, pba;
+	int len;
+
+	while (!__atomic_load_n(r->stop, __ATOMIC_ACQUIRE)) {
+		lba = rand_r(&r->seed) % MODEL_SECTORS;
+		pba = seq_map_lookup(r->sm, lba, &len);
+		if (len <= 0)
+			r->errors++;
+		else if (lba % 64 < 8)
+			r->errors += pba != lba + SEQ_STABLE || len > 8 - lba % 64;
+		else if (pba != -1)
+			r->errors += pba != lba + SEQ_OFF_A && pba != lba + SEQ_OFF_B;
+		r->lookups++;
+	}
+	return NULL;
+}
 
-	/* Start from the smallest node that overlaps*/
-	for (node = rb_first(&extent_tbl_root); node; node = rb_next(node)) {
-		next = rb_entry(node, struct extent, rb);
-		printf("\n lba: %d pba: %d len: %d ", next->lba, next->pba, next->len);
-		if (next->lba >= (new->lba + new->len))
-			break;
-		e = next;
+/*
+ * One writer rewriting and trimming everything but the stable extents,
+ * which makes the tree rotate and recycle extents under readers that
+ * never take a lock. No reader may see anything the map never held.
+ */
+static int check_seqmap(void)
+{
+	struct seq_reader r[SEQ_READERS];
+	struct seq_map sm;
+	unsigned long lookups = 0;
+	int stop = 0, errors = 0, verbose = _stl_verbose, i, lba, len, off;
+	unsigned seed = 44;
+
+	_stl_verbose = 0;
+	seq_map_init(&sm);
+	for (lba = 0; lba < MODEL_SECTORS; lba += 64)
+		seq_map_update_range(&sm, lba, lba + SEQ_STABLE, 8);
+	for (i = 0; i < SEQ_READERS; i++) {
+		r[i].sm = &sm;
+		r[i].stop = &stop;
+		r[i].seed = 44 + i;
+		r[i].lookups = 0;
+		r[i].errors = 0;
+		r[i].started = !pthread_create(&r[i].thread, NULL, seq_read, &r[i]);
 	}
-	if (!e)
-		return 0;
 
-	if((e->lba + e->len) <= new->lba) 
-		/* does not overlap */
-		return 0;
-	else
-		return -1;
+	for (i = 0; i < 20000; i++) {
+		lba = rand_r(&seed) % MODEL_SECTORS;
+		off = lba % 64;
+		if (off < 8) {
+			lba += 8 - off;
+			off = 8;
+		}
+		len = 1 + rand_r(&seed) % (64 - off);
+		if (i % 4 == 3)
+			seq_map_trim_range(&sm, lba, len);
+		else
+			seq_map_update_range(&sm, lba, lba + (i & 1 ? SEQ_OFF_A : SEQ_OFF_B), len);
+		if (i % 64 == 0)
+			sched_yield();
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < SEQ_READERS; i++) {
+		if (r[i].started)
+			pthread_join(r[i].thread, NULL);
+		errors += r[i].errors;
+		lookups += r[i].lookups;
+	}
+	if (lsdm_tree_check(&sm.map) < 0)
+		errors++;
+	printf(" optimistic lookups: %s, %lu lookups, %lu retries\n",
+	       errors ? "FAILED" : "ok", lookups, sm.nr_retries);
+	seq_map_exit(&sm);
+	_stl_verbose = verbose;
+	return errors ? -1 : 0;
 }
 
-
-int _stl_verbose;
-static int lsdm_rb_insert(struct extent *new)
+/* Check every sector of a persistent map against 'model' (-1: unmapped) */
+static int check_cow_model(struct cow_map *m, const sector_t *model, int nr)
 {
-	struct rb_root *root = &extent_tbl_root;
-	struct rb_node **link = &root->rb_node, *parent = NULL;
-	struct extent *e = NULL;
-	int ret = 0;
-
-	RB_CLEAR_NODE(&new->rb);
+	sector_t lba, pba;
+	int len, j;
+
+	for (lba = 0; lba < nr; lba += len) {
+		pba = cow_lookup(m, lba, &len);
+		if (len > nr - lba)
+			len = nr - lba;
+		for (j = 0; j < len; j++) {
+			if (model[lba + j] != (pba == -1 ? -1 : pba + j)) {
+				printf("\n cow: lba %d maps to %d, expected %d", lba + j,
+				       pba == -1 ? -1 : pba + j, model[lba + j]);
+				return -1;
+			}
+		}
+	}
+	return cow_check(m);
+}
 
-	ret = check_no_overlap(new);
-	if (ret < 0)
-		return ret;
+#define COW_SNAPS	4
 
-	printf("\n checked okay!");
+struct cow_reader {
+	pthread_t thread;
+	struct cow_map snap;
+	sector_t *model;	/* what the snapshot held when taken */
+	int started, errors;
+};
 
+/* Re-read a snapshot while the map moves on, then drop it */
+static void *cow_read(void *arg)
+{
+	struct cow_reader *r = arg;
+	int i;
 
-	/* Go to the bottom of the tree */
-	while (*link) {
-		parent = *link;
-		e = rb_entry(parent, struct extent, rb);
-		if ((new->lba + new->len) <= e->lba) {
-			link = &(*link)->rb_left;
-		} else if (new->lba >= (e->lba + e->len)){
-			link = &(*link)->rb_right;
-		} else {
-			/* overlapping indicates (new->lba >= e->lba)
-			 */
-				printf("\n Overlapping node found 2!");
-				printf("\n e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
-				printf("\n new->lba: %d new->pba: %d new->len: %d \n", new->lba, new->pba, new->len);
-				exit(-1);
-		}
-	}
-	/* Put the new node there */
-	rb_link_node(&new->rb, parent, link);
-	rb_insert_color(&new->rb, root);
-	merge(new);
-	ret = lsdm_tree_check();
-	if (ret < 0) {
-		printf("\n !!!! Corruption while Inserting: lba: %d pba: %d len: %d", new->lba, new->pba, new->len);
-		return -1;
+	for (i = 0; i < 4 && !r->errors; i++) {
+		if (check_cow_model(&r->snap, r->model, MODEL_SECTORS) < 0)
+			r->errors++;
+		sched_yield();
 	}
-	return 0;
+	cow_map_destroy(&r->snap);
+	return NULL;
 }
 
-
-/* Update mapping. Removes any total overlaps, edits any partial
- * overlaps, adds new extent to map.
+/*
+ * Random updates and trims on a persistent map must give the same
+ * sectors and the same number of extents as an extent_map fed the same
+ * calls, and snapshots taken on the way must keep what they saw while
+ * the map is overwritten under them, read and released on other threads.
  */
-static int lsdm_update_range(sector_t lba, sector_t pba, int len)
-{
-	struct extent *e = NULL, *new = NULL, *split = NULL, *next=NULL, *prev=NULL;
-	struct extent *tmp = NULL;
-	struct rb_node *node = extent_tbl_root.rb_node;  /* top of the tree */
-	struct rb_node *left;
-	struct extent *e_left;
-	int diff = 0;
-	int i=0;
-	int ret=0;
-	int flag = 0;
-	struct extent olde;
-
-	assert(len != 0);
-
-	//printf("\n %s lba: %d, pba: %d, len:%ld ", __func__, lba, pba, len);
-	printf("\n ---------------------\n");
-	new = malloc(sizeof(struct extent ));
-	if (unlikely(!new)) {
+static int check_cow(void)
+{
+	struct cow_reader r[COW_SNAPS];
+	struct extent_pool pool;
+	struct extent_map em;
+	struct cow_map m;
+	sector_t *model;
+	int verbose = _stl_verbose, ret = 0, i, lba, len, s = 0;
+	unsigned seed = 45;
+
+	model = malloc((COW_SNAPS + 1) * MODEL_SECTORS * sizeof(*model));
+	if (!model)
 		return -ENOMEM;
-	}
-	extent_init(new, lba, pba, len);
-	while (node) {
-		e = rb_entry(node, struct extent, rb);
-		/* No overlap */
-		if ((lba + len) <= e->lba) {
-			node = node->rb_left;
-			continue;
-		}
-		if (lba >= (e->lba + e->len)) {
-			node = node->rb_right;
-			continue;
-		}
-		break;
-	}
-	/* There is no node with which this lba overlaps with */
-	if (!node) {
-		/* new node has to be added */
-		printf( "\n %s flag: %d Inserting (lba: %u pba: %u len: %d) ", __func__, flag, new->lba, new->pba, new->len);
-		printf("\n----------------- \n");
-		ret = lsdm_rb_insert(new);
-		if (ret < 0) {
-			printf("\n Corruption in case 8!! ");
-			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
-			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
-			printf("\n");
-			exit(-1);
-		}
-		return(0);
-	}
-	/* We have found a "node"  that overlaps with our lba, pba,
-	 * len trio
-	 */
-
-	 /*
-	 * Case 1: overwrite a part of the existing extent
-	 * 	++++++++++
-	 * ----------------------- 
-	 *
-	 *  No end matches!!
-	 */
-
-	if ((lba > e->lba)  && (lba + len < e->lba + e->len)) {
-		printf("\n case1 ! e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
-		split = malloc(sizeof(struct extent));
-		if (!split) {
-			free(new);
-			return -ENOMEM;
-		}
-		diff =  lba - e->lba;
-		/* Initialize split before e->len changes!! */
-		extent_init(split, lba + len, e->pba + (diff + len), e->len - (diff + len));
-		/* new should be physically discontiguous
-		 */
-		//assert(e->pba + diff !=  pba);
-		e->len = diff;
-		ret = lsdm_rb_insert(new);
-		if (ret < 0) {
-			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
-			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
-			printf("\n");
-			exit(-1);
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+
+	_stl_verbose = 0;
+	cow_map_init(&m);
+	extent_map_init(&em);
+	extent_pool_init(&pool);
+	em.pool = &pool;
+	for (i = 0; i < 40000 && !ret; i++) {
+		len = 1 + rand_r(&seed) % (i % 16 ? 64 : 2048);
+		lba = rand_r(&seed) % (MODEL_SECTORS - len);
+		if (i % 5 == 4) {
+			ret = cow_trim_range(&m, lba, len);
+			lsdm_trim_range(&em, lba, len);
+			for (s = 0; s < len; s++)
+				model[lba + s] = -1;
+		} else {
+			/* Often continuing the extent before it, to be merged */
+			sector_t pba = i % 3 ? 100000 + i * 64 : model[lba ? lba - 1 : 0] + 1;
+
+			if (pba <= 0)
+				pba = 100000 + i * 64;
+			ret = cow_update_range(&m, lba, pba, len);
+			lsdm_update_range(&em, lba, pba, len);
+			for (s = 0; s < len; s++)
+				model[lba + s] = pba + s;
 		}
-		ret = lsdm_rb_insert(split);
-		if (ret < 0) {
-			printf("\n Corruption in case 1!! ");
-			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
-			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
-			printf ("\n split->lba: %d split->pba: %d split->len: %d ", split->lba, split->pba, split->len);
-			printf("\n");
-			exit(-1);
+		if (!ret && i % 1000 == 0)
+			ret = check_cow_model(&m, model, MODEL_SECTORS);
+		if (!ret && cow_nr_extents(&m) != em.n_extents) {
+			printf("\n cow: %lu extents, extent_map has %d", cow_nr_extents(&m),
+			       em.n_extents);
+			ret = -1;
 		}
-		return 0;
-	}
-
-	printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
-	/* Start from the smallest node that overlaps*/
-	while(1) {
-		prev = lsdm_rb_prev(e);
-		if (!prev)
-			break;
-		if (prev->lba + prev->len <= lba)
-			break;
-		e = prev;
-	}
-	printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
-
-	/* Now we consider the overlapping "e's" in an order of
-	 * increasing LBA
-	 */
-
-	/* 
-	 * Case 2: Overwrites an existing extent partially;
-	 * covers only the right portion of an existing extent (e)
-	 * 	++++++++
-	 * ----------- 
-	 *  e
-	 *
-	 *
-	 * 	++++++++
-	 * ------------- 
-	 *
-	 * (Right end of e1 and + could match!)  
-	 *
-	 */
-	if ((lba > e->lba) && ((lba + len) >= (e->lba + e->len)) && (lba < (e->lba + e->len))) {
-		e->len = lba - e->lba;
-		e = lsdm_rb_next(e);
-		flag = 1;
-		/*  
-		 *  process the next overlapping segments!
-		 *  Fall through to the next case.
-		 */
-	}
-
-	/* 
-	 * Case 3: Overwrite many extents completely
-	 *	++++++++++++++++++++
-	 *	  ----- ------  --------
-	 *
-	 * Could also be exact same: 
-	 * 	+++++
-	 * 	-----
-	 * We need to remove all such e
-	 *
-	 * here we compare left ends and right ends of 
-	 * new and existing node e
-	 */
-	while ((e!=NULL) && (lba <= e->lba) && ((lba + len) >= (e->lba + e->len))) {
-		printf("\n case3 ! e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
-		tmp = lsdm_rb_next(e);
-		lsdm_rb_remove(e);
-		free(e);
-		e = tmp;
-	}
-	if (!e || (e->lba >= (lba + len)))  {
-		/* No overlap with any more e */
-		ret = lsdm_rb_insert(new);
-		if (ret < 0) {
-			printf("\n Corruption in case 3!! ");
-			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
-			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
-			printf("\n");
-			exit(-1);
+		if (i % 10000 == 5000) {
+			struct cow_reader *rd = &r[i / 10000];
+
+			rd->model = model + (i / 10000 + 1) * MODEL_SECTORS;
+			memcpy(rd->model, model, MODEL_SECTORS * sizeof(*model));
+			cow_snapshot(&m, &rd->snap);
+			rd->errors = 0;
+			rd->started = !pthread_create(&rd->thread, NULL, cow_read, rd);
+			if (!rd->started)
+				cow_read(rd);
 		}
-		return 0;
 	}
-	/* else fall down to the next case for the last
-	 * component that overwrites an extent partially
-	 */
-
-	/* 
-	 * Case 4: 
-	 * Partially overwrite an extent
-	 * ++++++++++
-	 * 	-------------- OR
-	 *
-	 * Left end of + and - matches!
-	 * +++++++
-	 * --------------
-	 *
-	 */
-	if ((lba <= e->lba) && (lba + len > e->lba) && (lba + len < e->lba + e->len))  {
-		printf("\n case4 ! e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
-		diff = lba + len - e->lba;
-		lsdm_rb_remove(e);
-		e->lba = e->lba + diff;
-		e->len = e->len - diff;
-		e->pba = e->pba + diff;
-		printf("\n e snipped! e->lba: %d e->pba: %d e->len: %d", e->lba, e->pba, e->len);
-		ret = lsdm_rb_insert(new);
-		if (ret < 0) {
-			printf("\n Corruption in case 4!! ");
-			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
-			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
-			printf("\n");
-			exit(-1);
-		}
-		ret = lsdm_rb_insert(e);
-		if (ret < 0) {
-			printf("\n Corruption in case 4!! ");
-			printf ("\n lba: %d pba: %d len: %d ", lba, pba, len);
-			printf ("\n e->lba: %d e->pba: %d e->len: %d ", e->lba, e->pba, e->len);
-			printf("\n");
-			exit(-1);
+	for (i = 0; i < COW_SNAPS; i++) {
+		if (r[i].started)
+			pthread_join(r[i].thread, NULL);
+		if (r[i].errors) {
+			printf("\n cow: snapshot %d changed under its reader", i);
+			ret = -1;
 		}
-		return(0);
 	}
+	if (!ret)
+		ret = check_cow_model(&m, model, MODEL_SECTORS);
+	printf(" copy-on-write map: %s, %lu extents, %d snapshots\n", ret ? "FAILED" : "ok",
+	       cow_nr_extents(&m), COW_SNAPS);
+	cow_map_destroy(&m);
+	extent_map_destroy(&em);
+	extent_pool_exit(&pool);
+	free(model);
+	_stl_verbose = verbose;
+	return ret;
+}
 
-	/* If you are here then you haven't covered some
-	 * case!
-	 */
-	printf("\n why are you here ? flag: %d", flag);
-	printf("\n %s lba: %d, pba: %d, len:%d ", __func__, lba, pba, len);
-	if (flag)
-		printf("\n %s olde.lba: %d, olde.pba: %d, olde.len:%d ", __func__, olde.lba, olde.pba, olde.len);
-	printf("\n %s e->lba: %d, e->pba: %d, e->len:%d ", __func__, e->lba, e->pba, e->len);
-	printf("\n");
-	exit(-1);
+struct cow_diff_check {
+	const sector_t *old, *new;
+	struct cow_map *copy;
+	sector_t next;		/* records must come in LBA order */
+	long sectors;
+	int errors;
+};
+
+/* Each record must say exactly what the two models say, and is replayed */
+static int cow_diff_record(const struct cow_diff *r, void *arg)
+{
+	struct cow_diff_check *c = arg;
+	sector_t o, n;
+	int i;
 
+	if (r->lba < c->next || r->len == 0)
+		c->errors++;
+	c->next = r->lba + r->len;
+	for (i = 0; i < r->len; i++) {
+		o = r->type == COW_DIFF_ADDED ? -1 : r->old_pba + i;
+		n = r->type == COW_DIFF_REMOVED ? -1 : r->new_pba + i;
+		if (c->old[r->lba + i] != o || c->new[r->lba + i] != n || o == n) {
+			printf("\n cow diff: lba %d reported %d -> %d, models say %d -> %d",
+			       r->lba + i, o, n, c->old[r->lba + i], c->new[r->lba + i]);
+			c->errors++;
+			return 1;
+		}
+	}
+	c->sectors += r->len;
+	if (r->type == COW_DIFF_REMOVED)
+		cow_trim_range(c->copy, r->lba, r->len);
+	else
+		cow_update_range(c->copy, r->lba, r->new_pba, r->len);
 	return 0;
 }
 
-static void print_tree_contents(struct rb_node *node)
+static int cow_diff_none(const struct cow_diff *r, void *arg)
 {
-
-	if (!node)
-		return;
-
-	struct extent *e = rb_entry(node, struct extent, rb);
-
-	printf("\n %d %d %d", e->lba, e->pba, e->len);
-
-	if(node->rb_left)
-		print_tree_contents(node->rb_left);
-	if (node->rb_right)
-		print_tree_contents(node->rb_right);
+	(*(long *)arg)++;
+	return 0;
 }
 
-static void start_printing()
+/*
+ * Diff a snapshot against the map a few hundred writes later: every
+ * changed sector must be reported once, nothing else, and replaying the
+ * records on the old snapshot must give the new map. Two maps with the
+ * same extents but no shared nodes must diff empty too.
+ */
+static int check_cow_diff(void)
 {
-	struct rb_node *node = extent_tbl_root.rb_node;
-	print_tree_contents(node);
-	printf("\n");
+	struct cow_diff_check c;
+	struct cow_map m, old, copy, same;
+	sector_t *model;
+	int verbose = _stl_verbose, ret = 0, i, j, lba, len;
+	unsigned seed = 46;
+	long nr, changed = 0, none = 0;
+
+	model = malloc(2 * MODEL_SECTORS * sizeof(*model));
+	if (!model)
+		return -ENOMEM;
+	_stl_verbose = 0;
+	cow_map_init(&m);
+	cow_map_init(&same);
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+	for (i = 0; i < MODEL_SECTORS / 16; i++) {
+		cow_update_range(&m, i * 16, 100000 + i * 32, 8 + i % 8);
+		cow_update_range(&same, i * 16, 100000 + i * 32, 8 + i % 8);
+		for (j = 0; j < 8 + i % 8; j++)
+			model[i * 16 + j] = 100000 + i * 32 + j;
+	}
+	cow_snapshot(&m, &old);
+	memcpy(model + MODEL_SECTORS, model, MODEL_SECTORS * sizeof(*model));
+
+	for (i = 0; i < 300; i++) {
+		len = 1 + rand_r(&seed) % 40;
+		lba = rand_r(&seed) % (MODEL_SECTORS - len);
+		if (i % 4 == 3) {
+			cow_trim_range(&m, lba, len);
+			for (j = 0; j < len; j++)
+				model[MODEL_SECTORS + lba + j] = -1;
+		} else {
+			/* Some writes put back what was there */
+			sector_t pba = i % 7 ? 500000 + i * 64 : model[lba];
+
+			if (pba < 0)
+				pba = 500000 + i * 64;
+			cow_update_range(&m, lba, pba, len);
+			for (j = 0; j < len; j++)
+				model[MODEL_SECTORS + lba + j] = pba + j;
+		}
+	}
+	for (i = 0; i < MODEL_SECTORS; i++)
+		changed += model[i] != model[MODEL_SECTORS + i];
+
+	memset(&c, 0, sizeof(c));
+	c.old = model;
+	c.new = model + MODEL_SECTORS;
+	c.copy = &copy;
+	cow_snapshot(&old, &copy);
+	nr = cow_diff(&old, &m, cow_diff_record, &c);
+	if (c.errors || c.sectors != changed) {
+		printf("\n cow diff: %ld sectors reported, %ld changed", c.sectors, changed);
+		ret = -1;
+	}
+	if (!ret)
+		ret = check_cow_model(&copy, model + MODEL_SECTORS, MODEL_SECTORS);
+	if (!ret && (cow_diff(&m, &m, cow_diff_none, &none) || cow_diff(&old, &same,
+								  cow_diff_none, &none))) {
+		printf("\n cow diff: identical maps differ");
+		ret = -1;
+	}
+	printf(" snapshot diff: %s, %ld records for %ld changed sectors\n",
+	       ret ? "FAILED" : "ok", nr, changed);
+	cow_map_destroy(&copy);
+	cow_map_destroy(&old);
+	cow_map_destroy(&same);
+	cow_map_destroy(&m);
+	free(model);
+	_stl_verbose = verbose;
+	return ret;
 }
 
-
-
-static void init(void)
+/*
+ * Fold a parent map into a child that overwrote and trimmed parts of it:
+ * the child must end up with the child-wins view of both, as many
+ * extents as replaying both maps through lsdm_update_range() gives, and
+ * the shared segment table must only count what the child still maps.
+ */
+static int check_union(void)
 {
-	int i;
-	unsigned int lba = 0, pba = 0, len=0;
-	for (i = 0; i < NODES; i++) {
-		extent_init(&nodes[i], lba, pba, len);
-		lba = lba + 20;
-		len = len + 20;
-		pba = pba + 20;
+	struct extent_map parent, child, serial;
+	struct seg_tbl st;
+	struct extent *e;
+	sector_t *model;
+	int verbose = _stl_verbose, ret, i, j, lba, len;
+	unsigned seed = 47;
+
+	model = malloc(MODEL_SECTORS * sizeof(*model));
+	if (!model)
+		return -ENOMEM;
+	ret = seg_tbl_init(&st, 8 * MODEL_SECTORS, 8);
+	if (ret < 0) {
+		free(model);
+		return ret;
+	}
+	_stl_verbose = 0;
+	extent_map_init(&parent);
+	extent_map_init(&child);
+	extent_map_init(&serial);
+	parent.sit = child.sit = &st;
+	for (i = 0; i < MODEL_SECTORS; i++)
+		model[i] = -1;
+	for (i = 0; i < 3000; i++) {
+		len = 1 + rand_r(&seed) % 32;
+		lba = rand_r(&seed) % (MODEL_SECTORS - len);
+		lsdm_update_range(&parent, lba, MODEL_SECTORS + i * 32, len);
+		for (j = 0; j < len; j++)
+			model[lba + j] = MODEL_SECTORS + i * 32 + j;
+	}
+	/* The child's writes, some continuing the parent's extents */
+	for (i = 0; i < 2000; i++) {
+		len = 1 + rand_r(&seed) % 32;
+		lba = rand_r(&seed) % (MODEL_SECTORS - len);
+		if (i % 5 == 0 && lba && model[lba - 1] != -1) {
+			e = stl_rb_geq(&parent, lba - 1);
+			if (e && e->lba + e->len == lba && e->pba + e->len < MODEL_SECTORS * 4) {
+				lsdm_update_range(&child, lba, e->pba + e->len, len);
+				for (j = 0; j < len; j++)
+					model[lba + j] = e->pba + e->len + j;
+				continue;
+			}
+		}
+		lsdm_update_range(&child, lba, 4 * MODEL_SECTORS + i * 32, len);
+		for (j = 0; j < len; j++)
+			model[lba + j] = 4 * MODEL_SECTORS + i * 32 + j;
+	}
+	for (e = stl_rb_geq(&parent, 0); e; e = lsdm_rb_next(e))
+		lsdm_update_range(&serial, e->lba, e->pba, e->len);
+	for (e = stl_rb_geq(&child, 0); e; e = lsdm_rb_next(e))
+		lsdm_update_range(&serial, e->lba, e->pba, e->len);
+
+	ret = lsdm_map_union(&child, &parent, 4);
+	if (!ret)
+		ret = check_against_model(&child, model, MODEL_SECTORS);
+	if (!ret && child.n_extents != serial.n_extents) {
+		printf("\n union: %d extents, serial replay gives %d", child.n_extents,
+		       serial.n_extents);
+		ret = -1;
 	}
+	if (!ret && lsdm_tree_check(&child) < 0)
+		ret = -1;
+	if (!ret)
+		ret = check_map_sit(&child, &st);
+	printf(" snapshot union: %s, %d extents\n", ret ? "FAILED" : "ok", child.n_extents);
+	extent_map_destroy(&serial);
+	extent_map_destroy(&child);
+	extent_map_destroy(&parent);
+	seg_tbl_exit(&st);
+	free(model);
+	_stl_verbose = verbose;
+	return ret;
 }
 
-static int is_red(struct rb_node *rb)
+/*
+ * With CONFIG_RB_STATS, counters must add up: every rotation belongs to
+ * one rebalancing case, each kind of overwrite lands in its case, and
+ * no descent is deeper than a red-black tree of that size can be.
+ */
+static int check_stats(void)
 {
-	return !(rb->__rb_parent_color & 1);
+#ifdef CONFIG_RB_STATS
+	struct extent_pool pool;
+	struct extent_map m;
+	struct rb_stats *s = &rb_stats;
+	unsigned long max_depth = 0, n;
+	int verbose = _stl_verbose, ret = 0, i;
+
+	_stl_verbose = 0;
+	extent_map_init(&m);
+	extent_pool_init(&pool);
+	m.pool = &pool;
+	rb_stats_reset();
+	for (i = 0; i < 4096; i++)
+		lsdm_update_range(&m, i * 8, 100000 + i * 16, 6);
+	for (n = 4096 + 1; n; n >>= 1)
+		max_depth += 2;
+	if (s->update_case[0] != 4096 || s->inserts != 4096 ||
+	    s->max_insert_depth > max_depth)
+		ret = -1;
+
+	lsdm_update_range(&m, 8 + 1, 200000, 2);	/* inside one extent */
+	lsdm_update_range(&m, 80 + 4, 200010, 6);	/* tail of one, head of the next */
+	lsdm_update_range(&m, 160, 200020, 6);		/* exactly one */
+	if (s->update_case[1] != 1 || s->update_case[2] != 1 ||
+	    s->update_case[3] != 1 || s->update_case[4] != 1)
+		ret = -1;
+
+	for (i = 0; i < 4096; i += 2)
+		lsdm_trim_range(&m, i * 8 + 200, 6);
+	for (i = 0; i < 1000; i++)
+		stl_rb_geq(&m, i * 31);
+	if (s->lookups < 1000 || s->max_lookup_nodes > max_depth || !s->erase_fixups ||
+	    s->rotations != s->insert_case[1] + s->insert_case[2] + s->erase_case[0] +
+			    s->erase_case[2] + s->erase_case[3])
+		ret = -1;
+	if (ret)
+		rb_stats_dump();
+	printf(" rb stats: %s, %lu rotations, %lu recolors, max depth %lu\n",
+	       ret ? "FAILED" : "ok", s->rotations, s->recolors, s->max_insert_depth);
+	extent_map_destroy(&m);
+	extent_pool_exit(&pool);
+	_stl_verbose = verbose;
+	return ret;
+#else
+	printf(" rb stats: not built in (make STATS=1)\n");
+	return 0;
+#endif
 }
 
-static int black_path_count(struct rb_node *rb)
+//#define NUM 3051
+//
+#define NUM 1964
+
+void overwrite()
 {
-	int count;
-	for (count = 0; rb; rb = rb_parent(rb))
-		count += !is_red(rb);
-	return count;
+	for(int i=0; i<NUM; i++) {
+		//printf("\n %d %d %d ", trio[i][0], trio[i][1], trio[i][2]);
+		lsdm_update_range(&map, replace[i][1], replace[i][0], replace[i][2]);
+	}
+	start_printing();
+	if (check_sit() < 0) {
+		printf("\n Segment accounting is wrong after overwrite!\n");
+		exit(-1);
+	}
 }
 
-static void check_postorder_foreach(int nr_nodes)
+static int cmp_node_lba(const void *key, const struct rb_node *node)
 {
-	struct extent *cur, *n;
-	int count = 0;
-	rbtree_postorder_for_each_entry_safe(cur, n, &extent_tbl_root, rb)
-		count++;
+	int lba = *(const int *)key;
+	int nlba = rb_entry(node, struct extent, rb)->lba;
 
+	return lba < nlba ? -1 : lba > nlba;
 }
 
-static void check_postorder(int nr_nodes)
+/*
+ * The stack cursor must step exactly like rb_next/rb_prev, both from the
+ * ends and from wherever rb_iter_seek() put it, and must agree with
+ * stl_rb_geq() on a real extent map.
+ */
+static int check_iter(void)
 {
-	struct rb_node *rb;
-	int count = 0;
-	for (rb = rb_first_postorder(&extent_tbl_root); rb; rb = rb_next_postorder(rb))
-		count++;
+	struct rb_root root;
+	struct rb_iter it;
+	struct rb_node *a, *b;
+	struct extent_map m;
+	struct extent *e;
+	int loop, key, i, ret = 0, verbose = _stl_verbose;
+
+	srand(32);
+	insert_nodes_shuffled(&root, NODES);
+	for (a = rb_iter_first(&it, &root), b = rb_first(&root); a || b;
+	     a = rb_iter_next(&it), b = rb_next(b))
+		if (a != b)
+			ret = -1;
+	for (a = rb_iter_last(&it, &root), b = rb_last(&root); a || b;
+	     a = rb_iter_prev(&it), b = rb_prev(b))
+		if (a != b)
+			ret = -1;
+	for (loop = 0; loop < 1000 && !ret; loop++) {
+		key = rand() % (NODES * 20 + 40) - 20;
+		i = key <= 0 ? 0 : (key + 19) / 20;
+		a = rb_iter_seek(&it, &root, &key, cmp_node_lba);
+		if (a != (i < NODES ? &nodes[i].rb : NULL)) {
+			ret = -1;
+			break;
+		}
+		if (!a)
+			continue;
+		for (b = a, i = 0; i < 30; i++) {
+			if (loop & 1) {
+				a = rb_iter_next(&it);
+				b = rb_next(b);
+			} else {
+				a = rb_iter_prev(&it);
+				b = rb_prev(b);
+			}
+			if (a != b)
+				ret = -1;
+			if (!a)
+				break;
+		}
+	}
 
+	_stl_verbose = 0;
+	extent_map_init(&m);
+	for (i = 0; i < 2000; i++)
+		lsdm_update_range(&m, trio[i % 1000][0], trio[i % 1000][1] + i, trio[i % 1000][2]);
+	for (key = 0; key < 40000000 && !ret; key += 9973)
+		if (extent_iter_seek(&m, &it, key) != stl_rb_geq(&m, key))
+			ret = -1;
+	for (e = extent_iter_first(&m, &it), i = 0; e; e = extent_iter_next(&it))
+		i++;
+	if (i != m.n_extents)
+		ret = -1;
+	extent_map_destroy(&m);
+	_stl_verbose = verbose;
+
+	printf(" stack cursor: %s\n", ret ? "FAILED" : "ok");
+	return ret;
 }
 
-static void check(int nr_nodes)
+struct lnode {
+	struct rb_lnode ln;
+	int key;
+};
+
+static struct lnode lnodes[NODES];
+
+static void lnode_insert(struct rb_root_linked *root, struct lnode *n)
 {
-	struct rb_node *rb;
-	int count = 0, blacks = 0;
-	uint32_t prev_key = 0;
+	struct rb_node **link = &root->rb_root.rb_node, *parent = NULL;
 
-	for (rb = rb_first(&extent_tbl_root); rb; rb = rb_next(rb)) {
-		struct extent *node = rb_entry(rb, struct extent, rb);
-		if (!count)
-			blacks = black_path_count(rb);
+	while (*link) {
+		parent = *link;
+		if (n->key < rb_entry(parent, struct lnode, ln.rb)->key)
+			link = &parent->rb_left;
 		else
-		prev_key = node->lba;
-		count++;
+			link = &parent->rb_right;
 	}
+	rb_insert_linked(&n->ln, parent, link, root);
+}
 
+/* The list must be the in-order walk of the tree, both ways */
+static int check_threads(struct rb_root_linked *root)
+{
+	struct rb_node *rb = rb_first(&root->rb_root);
+	struct rb_lnode *ln = root->first, *prev = NULL;
 
-	check_postorder(nr_nodes);
-	check_postorder_foreach(nr_nodes);
+	for (; rb && ln; rb = rb_next(rb), prev = ln, ln = ln->next)
+		if (rb != &ln->rb || ln->prev != prev)
+			return -1;
+	if (rb || ln || root->last != prev)
+		return -1;
+	if (root->rb_root.rb_node && check_rb_props(root->rb_root.rb_node) < 0)
+		return -1;
+	return 0;
 }
 
-static void check_augmented(int nr_nodes)
+/* Every update of a threaded tree must keep the list in step */
+static int check_linked(void)
 {
-	struct rb_node *rb;
+	struct rb_root_linked root = RB_ROOT_LINKED, detached;
+	struct rb_lnode *orig;
+	struct lnode spare;
+	int i, j, ret = 0;
 
-	check(nr_nodes);
-	for (rb = rb_first(&extent_tbl_root); rb; rb = rb_next(rb)) {
-		struct extent *node = rb_entry(rb, struct extent, rb);
+	srand(33);
+	for (i = 0; i < NODES; i++) {
+		lnodes[i].key = rand() % (NODES * 4);
+		lnode_insert(&root, &lnodes[i]);
+	}
+	ret |= check_threads(&root);
+
+	for (i = 0; i < NODES; i += 3)
+		rb_erase_linked(&lnodes[i].ln, &root);
+	ret |= check_threads(&root);
+
+	/* Swap the first and the last node for a spare one with the same key */
+	orig = root.first;
+	spare.key = rb_entry(orig, struct lnode, ln)->key;
+	rb_replace_linked(orig, &spare.ln, &root);
+	ret |= check_threads(&root);
+	rb_replace_linked(&spare.ln, orig, &root);
+	orig = root.last;
+	spare.key = rb_entry(orig, struct lnode, ln)->key;
+	rb_replace_linked(orig, &spare.ln, &root);
+	ret |= check_threads(&root);
+	rb_replace_linked(&spare.ln, orig, &root);
+
+	/* Cut a range out and thread it back in with insert_after */
+	for (j = 0; j < 20 && !ret; j++) {
+		struct rb_lnode *first = root.first, *last, *prev, *ln, *next;
+
+		for (i = rand() % 200; i && first->next; i--)
+			first = first->next;
+		for (last = first, i = rand() % 300; i && last->next; i--)
+			last = last->next;
+		prev = first->prev;
+		rb_erase_range_linked(first, last, &root, &detached);
+		ret |= check_threads(&root) | check_threads(&detached);
+		for (ln = detached.first; ln; prev = ln, ln = next) {
+			next = ln->next;
+			rb_insert_linked_after(ln, prev, &root);
+		}
+		ret |= check_threads(&root);
 	}
+	printf(" threaded tree: %s\n", ret ? "FAILED" : "ok");
+	return ret;
 }
 
-//#define NUM 3051
-//
-#define NUM 1964
+static void count_release(struct rb_node *node, void *arg)
+{
+	int *seen = arg;
+	struct extent *t = rb_entry(node, struct extent, rb);
+
+	/* Postorder: both children must already be gone */
+	if ((node->rb_left && !seen[rb_entry(node->rb_left, struct extent, rb) - nodes]) ||
+	    (node->rb_right && !seen[rb_entry(node->rb_right, struct extent, rb) - nodes]))
+		seen[NODES] = -1;
+	seen[t - nodes]++;
+}
 
-void overwrite()
+/* rb_destroy() must hand every node to release() once, children first */
+static int check_destroy(void)
 {
-	for(int i=0; i<NUM; i++) {
-		//printf("\n %d %d %d ", trio[i][0], trio[i][1], trio[i][2]);
-		lsdm_update_range(replace[i][1], replace[i][0], replace[i][2]);
-	}
-	start_printing();
+	struct rb_root root = RB_ROOT;
+	int seen[NODES + 1] = { 0 }, i, ret = 0;
+
+	insert_nodes_shuffled(&root, NODES);
+	rb_destroy(&root, count_release, seen);
+	for (i = 0; i < NODES; i++)
+		if (seen[i] != 1)
+			ret = -1;
+	if (seen[NODES] || root.rb_node)
+		ret = -1;
+	printf(" destroy: %s\n", ret ? "FAILED" : "ok");
+	return ret;
 }
 
 int main(void)
@@ -638,6 +2299,107 @@ int main(void)
 	
 	printf("rbtree testing\n");
 
+	if (check_insert_hint() < 0) {
+		printf("\n rb_insert_after/before built a broken tree!\n");
+		exit(-1);
+	}
+	if (check_erase_range() < 0) {
+		printf("\n rb_erase_range is broken!\n");
+		exit(-1);
+	}
+	if (check_destroy() < 0) {
+		printf("\n rb_destroy missed or repeated nodes!\n");
+		exit(-1);
+	}
+	if (check_iter() < 0) {
+		printf("\n rb_iter steps differ from rb_next/rb_prev!\n");
+		exit(-1);
+	}
+	if (check_linked() < 0) {
+		printf("\n Threaded tree lost track of its list!\n");
+		exit(-1);
+	}
+	if (check_overwrite_range() < 0) {
+		printf("\n Large overwrites corrupted the map!\n");
+		exit(-1);
+	}
+	if (check_update_buf() < 0) {
+		printf("\n Buffered updates got lost or reordered!\n");
+		exit(-1);
+	}
+	if (check_coalesce() < 0) {
+		printf("\n Coalescing changed what the map says!\n");
+		exit(-1);
+	}
+	if (check_pmap() < 0) {
+		printf("\n Persistent map is corrupt!\n");
+		exit(-1);
+	}
+	if (check_checkpoint() < 0) {
+		printf("\n Checkpoint did not load back the same map!\n");
+		exit(-1);
+	}
+	if (check_delta() < 0) {
+		printf("\n Base plus deltas differs from the live map!\n");
+		exit(-1);
+	}
+	if (check_wal() < 0) {
+		printf("\n Checkpoint plus log replay differs from the map!\n");
+		exit(-1);
+	}
+	if (check_wal_interval() < 0) {
+		printf("\n A lone logged update never became durable!\n");
+		exit(-1);
+	}
+	if (check_paged() < 0) {
+		printf("\n Paged map differs from the model!\n");
+		exit(-1);
+	}
+	if (check_shard() < 0) {
+		printf("\n Sharded map differs from the model!\n");
+		exit(-1);
+	}
+	if (check_rangelock() < 0) {
+		printf("\n Range locks let conflicting holders in!\n");
+		exit(-1);
+	}
+	if (check_actor() < 0) {
+		printf("\n Map behind the single writer differs from the model!\n");
+		exit(-1);
+	}
+	if (check_seqmap() < 0) {
+		printf("\n An optimistic lookup saw a torn map!\n");
+		exit(-1);
+	}
+	if (check_cow() < 0) {
+		printf("\n Persistent map or one of its snapshots is wrong!\n");
+		exit(-1);
+	}
+	if (check_cow_diff() < 0) {
+		printf("\n Snapshot diff missed or invented a change!\n");
+		exit(-1);
+	}
+	if (check_union() < 0) {
+		printf("\n Snapshot union lost a mapping!\n");
+		exit(-1);
+	}
+	if (check_stats() < 0) {
+		printf("\n Tree statistics do not add up!\n");
+		exit(-1);
+	}
+	if (check_pba_alloc() < 0) {
+		printf("\n PBA allocator is corrupt!\n");
+		exit(-1);
+	}
+
+	_stl_verbose = 1;
+	extent_map_init(&map);
+	if (seg_tbl_init(&sit, NR_SECTORS, SEG_SHIFT_DEFAULT) < 0) {
+		printf("\n Could not allocate the segment table");
+		exit(-1);
+	}
+	map.sit = &sit;
+
 	for(i=0; i<NUM; i++) {
 		if (replace[i][0] < 0) {
 			printf("\n LBA is indeed < 0");
@@ -656,9 +2418,17 @@ int main(void)
 
 	for(i=0; i<NUM; i++) {
 		//printf("\n %d %d %d ", trio[i][0], trio[i][1], trio[i][2]);
-		lsdm_update_range(new[i][1], new[i][0], new[i][2]);
+		lsdm_update_range(&map, new[i][1], new[i][0], new[i][2]);
 	}
 	start_printing();
+	if (check_sit() < 0) {
+		printf("\n Segment accounting is wrong after insert!\n");
+		exit(-1);
+	}
+	if (check_finger(NUM) < 0) {
+		printf("\n Finger updates and lookups went wrong!\n");
+		exit(-1);
+	}
 	getchar();
 
 	overwrite();
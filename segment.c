@@ -0,0 +1,184 @@
+/*
+ * Segment utilization table and GC victim selection.
+ * See segment.h for the overview.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<errno.h>
+#include"rbtree_augmented.h"
+#include"segment.h"
+
+static inline __u32 seg_compute_min(struct seg_entry *e)
+{
+	__u32 min = e->vblocks;
+	struct seg_entry *child;
+
+	if (e->rb.rb_left) {
+		child = rb_entry(e->rb.rb_left, struct seg_entry, rb);
+		if (child->min_vblocks < min)
+			min = child->min_vblocks;
+	}
+	if (e->rb.rb_right) {
+		child = rb_entry(e->rb.rb_right, struct seg_entry, rb);
+		if (child->min_vblocks < min)
+			min = child->min_vblocks;
+	}
+	return min;
+}
+
+RB_DECLARE_CALLBACKS(static, seg_augment_cb, struct seg_entry, rb,
+		     __u32, min_vblocks, seg_compute_min)
+
+int seg_tbl_init(struct seg_tbl *sit, sector_t nr_sectors, unsigned seg_shift)
+{
+	unsigned i;
+
+	sit->seg_shift = seg_shift;
+	sit->nr_segs = ((unsigned)nr_sectors + (1U << seg_shift) - 1) >> seg_shift;
+	sit->entries = calloc(sit->nr_segs, sizeof(struct seg_entry));
+	if (!sit->entries)
+		return -ENOMEM;
+	for (i = 0; i < sit->nr_segs; i++)
+		RB_CLEAR_NODE(&sit->entries[i].rb);
+	sit->victim_root = RB_ROOT;
+	sit->nr_victims = 0;
+	return 0;
+}
+
+void seg_tbl_exit(struct seg_tbl *sit)
+{
+	free(sit->entries);
+	sit->entries = NULL;
+	sit->nr_segs = 0;
+	sit->victim_root = RB_ROOT;
+	sit->nr_victims = 0;
+}
+
+/* A segment received its first live sectors: make it a GC candidate */
+static void seg_victim_insert(struct seg_tbl *sit, struct seg_entry *new)
+{
+	struct rb_node **link = &sit->victim_root.rb_node, *parent = NULL;
+	struct seg_entry *e;
+
+	new->min_vblocks = new->vblocks;
+	while (*link) {
+		parent = *link;
+		e = rb_entry(parent, struct seg_entry, rb);
+		if (e->min_vblocks > new->vblocks)
+			e->min_vblocks = new->vblocks;
+		if (new < e)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&new->rb, parent, link);
+	rb_insert_augmented(&new->rb, &sit->victim_root, &seg_augment_cb);
+	sit->nr_victims++;
+}
+
+void seg_add_valid(struct seg_tbl *sit, sector_t pba, __u32 len)
+{
+	unsigned segno = seg_nr(sit, pba);
+	__u32 seg_sectors = 1U << sit->seg_shift;
+	__u32 off = (unsigned)pba & (seg_sectors - 1);
+	struct seg_entry *e;
+	__u32 n;
+
+	while (len) {
+		if (segno >= sit->nr_segs) {
+			printf("\n %s pba: %d beyond the last segment (%u)", __func__, pba, sit->nr_segs);
+			return;
+		}
+		n = seg_sectors - off;
+		if (n > len)
+			n = len;
+		e = &sit->entries[segno];
+		e->vblocks += n;
+		if (RB_EMPTY_NODE(&e->rb))
+			seg_victim_insert(sit, e);
+		else
+			seg_augment_cb_propagate(&e->rb, NULL);
+		len -= n;
+		off = 0;
+		segno++;
+	}
+}
+
+void seg_inval(struct seg_tbl *sit, sector_t pba, __u32 len)
+{
+	unsigned segno = seg_nr(sit, pba);
+	__u32 seg_sectors = 1U << sit->seg_shift;
+	__u32 off = (unsigned)pba & (seg_sectors - 1);
+	struct seg_entry *e;
+	__u32 n;
+
+	while (len) {
+		if (segno >= sit->nr_segs) {
+			printf("\n %s pba: %d beyond the last segment (%u)", __func__, pba, sit->nr_segs);
+			return;
+		}
+		n = seg_sectors - off;
+		if (n > len)
+			n = len;
+		e = &sit->entries[segno];
+		if (n > e->vblocks) {
+			printf("\n %s segment %u: invalidating %u of %u valid sectors!",
+			       __func__, segno, n, e->vblocks);
+			e->vblocks = 0;
+		} else
+			e->vblocks -= n;
+		if (!RB_EMPTY_NODE(&e->rb))
+			seg_augment_cb_propagate(&e->rb, NULL);
+		len -= n;
+		off = 0;
+		segno++;
+	}
+}
+
+/*
+ * Return the written segment with the fewest live sectors, or -1 if
+ * nothing has been written since the last clean. Ties go to the lowest
+ * segment number.
+ */
+int seg_pick_victim(struct seg_tbl *sit)
+{
+	struct rb_node *node = sit->victim_root.rb_node;
+	struct seg_entry *e, *left;
+	__u32 min;
+
+	if (!node)
+		return -1;
+
+	min = rb_entry(node, struct seg_entry, rb)->min_vblocks;
+	while (node) {
+		e = rb_entry(node, struct seg_entry, rb);
+		if (node->rb_left) {
+			left = rb_entry(node->rb_left, struct seg_entry, rb);
+			if (left->min_vblocks == min) {
+				node = node->rb_left;
+				continue;
+			}
+		}
+		if (e->vblocks == min)
+			return e - sit->entries;
+		node = node->rb_right;
+	}
+	/* The augmented minimum lied to us */
+	printf("\n %s: victim tree corrupt, min_vblocks: %u", __func__, min);
+	return -1;
+}
+
+/* The GC has cleaned 'segno': it is free and no longer a victim */
+void seg_release(struct seg_tbl *sit, unsigned segno)
+{
+	struct seg_entry *e = &sit->entries[segno];
+
+	if (RB_EMPTY_NODE(&e->rb))
+		return;
+	if (e->vblocks)
+		printf("\n %s segment %u still has %u valid sectors!", __func__, segno, e->vblocks);
+	rb_erase_augmented(&e->rb, &sit->victim_root, &seg_augment_cb);
+	RB_CLEAR_NODE(&e->rb);
+	sit->nr_victims--;
+}
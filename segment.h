@@ -0,0 +1,59 @@
+/*
+ * Segment utilization table.
+ *
+ * The device is carved into segments of (1 << seg_shift) sectors. For
+ * every segment we count the sectors that are still referenced by the
+ * extent map ("vblocks"). The counts are maintained incrementally by
+ * lsdm_update_range() as extents are inserted, trimmed, split and
+ * removed, so the GC never has to scan the map to find out how much
+ * live data a segment holds.
+ *
+ * Every segment that has been written to since it was last cleaned sits
+ * in an rbtree ordered by segment number and augmented with the minimum
+ * vblocks of its subtree. The cheapest GC victim is then found by
+ * following the minimum down from the root in O(log n).
+ */
+
+#ifndef _SEGMENT_H
+#define _SEGMENT_H
+
+#include<linux/types.h>
+#include"rbtree.h"
+#include"extent.h"
+
+#define SEG_SHIFT_DEFAULT	12	/* 4096 sectors: 2MB segments */
+
+struct seg_entry {
+	struct rb_node rb;	/* victim tree, keyed by segment number */
+	__u32 vblocks;		/* sectors of this segment holding live data */
+	__u32 min_vblocks;	/* smallest vblocks in this subtree */
+};
+
+struct seg_tbl {
+	struct seg_entry *entries;
+	unsigned nr_segs;
+	unsigned seg_shift;
+	struct rb_root victim_root;
+	unsigned nr_victims;	/* segments in victim_root */
+};
+
+int seg_tbl_init(struct seg_tbl *sit, sector_t nr_sectors, unsigned seg_shift);
+void seg_tbl_exit(struct seg_tbl *sit);
+
+void seg_add_valid(struct seg_tbl *sit, sector_t pba, __u32 len);
+void seg_inval(struct seg_tbl *sit, sector_t pba, __u32 len);
+
+int seg_pick_victim(struct seg_tbl *sit);
+void seg_release(struct seg_tbl *sit, unsigned segno);
+
+static inline unsigned seg_nr(struct seg_tbl *sit, sector_t pba)
+{
+	return (unsigned)pba >> sit->seg_shift;
+}
+
+static inline __u32 seg_vblocks(struct seg_tbl *sit, unsigned segno)
+{
+	return sit->entries[segno].vblocks;
+}
+
+#endif /* _SEGMENT_H */
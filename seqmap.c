@@ -0,0 +1,144 @@
+/*
+ * Extent map with optimistic, lock-free lookups.
+ * See seqmap.h for the overview.
+ */
+
+#include<stdio.h>
+#include<limits.h>
+#include<sched.h>
+#include"seqmap.h"
+
+#define READ_ONCE(x)	(*(const volatile typeof(x) *)&(x))
+
+void seq_map_init(struct seq_map *sm)
+{
+	extent_map_init(&sm->map);
+	extent_pool_init(&sm->pool);
+	sm->map.pool = &sm->pool;
+	pthread_mutex_init(&sm->lock, NULL);
+	sm->seq = 0;
+	sm->nr_retries = 0;
+}
+
+/* No reader may be left */
+void seq_map_exit(struct seq_map *sm)
+{
+	extent_map_destroy(&sm->map);
+	extent_pool_exit(&sm->pool);
+	pthread_mutex_destroy(&sm->lock);
+}
+
+static inline void write_seq_begin(struct seq_map *sm)
+{
+	__atomic_store_n(&sm->seq, sm->seq + 1, __ATOMIC_RELAXED);
+	/* The odd count is visible before any store to the tree */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void write_seq_end(struct seq_map *sm)
+{
+	__atomic_store_n(&sm->seq, sm->seq + 1, __ATOMIC_RELEASE);
+}
+
+int seq_map_update_range(struct seq_map *sm, sector_t lba, sector_t pba, int len)
+{
+	int ret;
+
+	pthread_mutex_lock(&sm->lock);
+	write_seq_begin(sm);
+	ret = lsdm_update_range(&sm->map, lba, pba, len);
+	write_seq_end(sm);
+	pthread_mutex_unlock(&sm->lock);
+	return ret;
+}
+
+int seq_map_trim_range(struct seq_map *sm, sector_t lba, int len)
+{
+	int ret;
+
+	pthread_mutex_lock(&sm->lock);
+	write_seq_begin(sm);
+	ret = lsdm_trim_range(&sm->map, lba, len);
+	write_seq_end(sm);
+	pthread_mutex_unlock(&sm->lock);
+	return ret;
+}
+
+/*
+ * _stl_rb_geq() with every load done once, copying out what it finds.
+ * Returns 0 if the descent went too deep to be a consistent tree.
+ */
+static int seq_geq(struct seq_map *sm, sector_t lba, sector_t *e_lba,
+		   sector_t *e_pba, __u32 *e_len)
+{
+	struct rb_node *node = READ_ONCE(sm->map.extent_tbl_root.rb_node);
+	struct extent *e;
+	sector_t h_lba = INT_MAX, h_pba = -1, l;
+	__u32 h_len = 0, n;
+	int depth;
+
+	for (depth = 0; node; depth++) {
+		if (depth == SEQ_MAP_MAX_DEPTH)
+			return 0;
+		e = rb_entry(node, struct extent, rb);
+		l = READ_ONCE(e->lba);
+		n = READ_ONCE(e->len);
+		if (lba < l) {
+			if (l < h_lba) {
+				h_lba = l;
+				h_pba = READ_ONCE(e->pba);
+				h_len = n;
+			}
+			node = READ_ONCE(node->rb_left);
+		} else if ((__u32)(lba - l) >= n) {
+			node = READ_ONCE(node->rb_right);
+		} else {
+			h_lba = l;
+			h_pba = READ_ONCE(e->pba);
+			h_len = n;
+			break;
+		}
+	}
+	*e_lba = h_lba;
+	*e_pba = h_pba;
+	*e_len = h_len;
+	return 1;
+}
+
+/*
+ * PBA that 'lba' maps to, or -1 if it is unmapped. If 'len' is given it
+ * is set to the number of sectors from 'lba' on for which the answer
+ * stays contiguous (or unmapped). Never blocks on writers, but retries
+ * as long as they keep changing the map under it.
+ */
+sector_t seq_map_lookup(struct seq_map *sm, sector_t lba, int *len)
+{
+	unsigned long seq;
+	sector_t e_lba, e_pba;
+	__u32 e_len;
+	int ok;
+
+	for (;;) {
+		seq = __atomic_load_n(&sm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			/* Let the writer finish rather than spin against it */
+			sched_yield();
+			continue;
+		}
+		ok = seq_geq(sm, lba, &e_lba, &e_pba, &e_len);
+		/* Everything read above is ordered before the recheck */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (ok && __atomic_load_n(&sm->seq, __ATOMIC_RELAXED) == seq)
+			break;
+		__atomic_fetch_add(&sm->nr_retries, 1, __ATOMIC_RELAXED);
+	}
+
+	if (e_lba <= lba) {
+		if (len)
+			*len = e_lba + e_len - lba;
+		return e_pba + (lba - e_lba);
+	}
+	if (len)
+		*len = e_lba - lba;
+	return -1;
+}
@@ -0,0 +1,41 @@
+/*
+ * Extent map with optimistic, lock-free lookups.
+ *
+ * Writers serialize on a mutex and make the sequence counter odd for
+ * the duration of each update. Readers take no lock at all: they note
+ * the counter, descend the tree with single loads that may observe it
+ * half rewritten, and start over if the counter was odd or has moved by
+ * the time they are done. A read that overlaps no write costs two loads
+ * of the counter on top of the descent.
+ *
+ * A reader may follow a pointer to an extent that is being freed or
+ * reused, so extents come from the map's own pool, which never gives
+ * memory back before seq_map_exit(): any pointer a reader can load
+ * points at a struct extent or is NULL. A torn descent can loop, so it
+ * is cut off after SEQ_MAP_MAX_DEPTH steps and retried.
+ */
+
+#ifndef _SEQMAP_H
+#define _SEQMAP_H
+
+#include<pthread.h>
+#include"extent.h"
+
+#define SEQ_MAP_MAX_DEPTH	128
+
+struct seq_map {
+	struct extent_map map;
+	struct extent_pool pool;
+	pthread_mutex_t lock;		/* writers */
+	unsigned long seq;		/* odd while a write is in progress */
+	unsigned long nr_retries;	/* lookups that had to start over */
+};
+
+void seq_map_init(struct seq_map *sm);
+void seq_map_exit(struct seq_map *sm);
+
+int seq_map_update_range(struct seq_map *sm, sector_t lba, sector_t pba, int len);
+int seq_map_trim_range(struct seq_map *sm, sector_t lba, int len);
+sector_t seq_map_lookup(struct seq_map *sm, sector_t lba, int *len);
+
+#endif /* _SEQMAP_H */
@@ -0,0 +1,174 @@
+/*
+ * Sharded extent map.
+ * See shard.h for the overview.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<limits.h>
+#include<errno.h>
+#include"shard.h"
+
+static inline int shard_of(struct shard_map *sm, sector_t lba)
+{
+	return (lba >> sm->stripe_shift) % sm->nr_shards;
+}
+
+static inline sector_t stripe_end(struct shard_map *sm, sector_t lba)
+{
+	sector_t end = ((lba >> sm->stripe_shift) + 1) << sm->stripe_shift;
+
+	return end > lba ? end : INT_MAX;
+}
+
+int shard_map_init(struct shard_map *sm, int nr_shards, unsigned stripe_shift)
+{
+	int i;
+
+	if (nr_shards < 1 || nr_shards > SHARD_MAX || stripe_shift > 30)
+		return -EINVAL;
+	if (posix_memalign((void **)&sm->shards, 64, nr_shards * sizeof(*sm->shards)))
+		return -ENOMEM;
+	sm->nr_shards = nr_shards;
+	sm->stripe_shift = stripe_shift;
+	for (i = 0; i < nr_shards; i++) {
+		struct shard *s = &sm->shards[i];
+
+		pthread_mutex_init(&s->lock, NULL);
+		extent_map_init(&s->map);
+		extent_pool_init(&s->pool);
+		s->map.pool = &s->pool;
+		s->nr_updates = 0;
+	}
+	return 0;
+}
+
+void shard_map_exit(struct shard_map *sm)
+{
+	int i;
+
+	for (i = 0; i < sm->nr_shards; i++) {
+		extent_map_destroy(&sm->shards[i].map);
+		extent_pool_exit(&sm->shards[i].pool);
+		pthread_mutex_destroy(&sm->shards[i].lock);
+	}
+	free(sm->shards);
+}
+
+/* Bit i set: the range touches shard i */
+static unsigned long long shard_mask(struct shard_map *sm, sector_t lba, int len)
+{
+	sector_t first = lba >> sm->stripe_shift;
+	sector_t last = (lba + len - 1) >> sm->stripe_shift;
+	unsigned long long mask = 0;
+	sector_t s;
+
+	if (last - first + 1 >= sm->nr_shards)
+		return sm->nr_shards == 64 ? ~0ULL : (1ULL << sm->nr_shards) - 1;
+	for (s = first; s <= last; s++)
+		mask |= 1ULL << (s % sm->nr_shards);
+	return mask;
+}
+
+/*
+ * Map [lba, lba + len) to [pba, pba + len) with the semantics of
+ * lsdm_update_range(). Only the shards the range touches are locked.
+ */
+int shard_update_range(struct shard_map *sm, sector_t lba, sector_t pba, int len)
+{
+	unsigned long long mask;
+	struct shard *s;
+	sector_t n;
+	int i, ret = 0;
+
+	if (lba < 0 || len <= 0 || len > INT_MAX - lba)
+		return -EINVAL;
+	mask = shard_mask(sm, lba, len);
+	for (i = 0; i < sm->nr_shards; i++)
+		if (mask & (1ULL << i))
+			pthread_mutex_lock(&sm->shards[i].lock);
+
+	while (len) {
+		s = &sm->shards[shard_of(sm, lba)];
+		n = stripe_end(sm, lba) - lba;
+		if (n > len)
+			n = len;
+		ret = lsdm_update_range(&s->map, lba, pba, n);
+		if (ret < 0)
+			break;
+		s->nr_updates++;
+		lba += n;
+		pba += n;
+		len -= n;
+	}
+
+	for (i = sm->nr_shards - 1; i >= 0; i--)
+		if (mask & (1ULL << i))
+			pthread_mutex_unlock(&sm->shards[i].lock);
+	return ret;
+}
+
+/*
+ * PBA that 'lba' maps to, or -1 if it is unmapped. If 'len' is given it
+ * is set to the number of sectors from 'lba' on for which the answer
+ * stays contiguous (or unmapped), up to the end of the stripe.
+ */
+sector_t shard_lookup(struct shard_map *sm, sector_t lba, int *len)
+{
+	struct shard *s = &sm->shards[shard_of(sm, lba)];
+	struct extent *e;
+	sector_t pba = -1, end = stripe_end(sm, lba);
+
+	pthread_mutex_lock(&s->lock);
+	e = stl_rb_geq(&s->map, lba);
+	if (e && e->lba <= lba) {
+		pba = e->pba + (lba - e->lba);
+		end = e->lba + e->len;
+	} else if (e && e->lba < end) {
+		end = e->lba;
+	}
+	pthread_mutex_unlock(&s->lock);
+	if (len)
+		*len = end - lba;
+	return pba;
+}
+
+/* Not a snapshot: shards are counted one after the other */
+unsigned long shard_nr_extents(struct shard_map *sm)
+{
+	unsigned long nr = 0;
+	int i;
+
+	for (i = 0; i < sm->nr_shards; i++) {
+		pthread_mutex_lock(&sm->shards[i].lock);
+		nr += sm->shards[i].map.n_extents;
+		pthread_mutex_unlock(&sm->shards[i].lock);
+	}
+	return nr;
+}
+
+/* Every shard is a valid map and only holds extents of its own stripes */
+int shard_check(struct shard_map *sm)
+{
+	struct rb_iter it;
+	struct extent *e;
+	int i, ret = 0;
+
+	for (i = 0; i < sm->nr_shards && !ret; i++) {
+		struct shard *s = &sm->shards[i];
+
+		pthread_mutex_lock(&s->lock);
+		if (lsdm_tree_check(&s->map) < 0)
+			ret = -EINVAL;
+		for (e = extent_iter_first(&s->map, &it); e && !ret; e = extent_iter_next(&it)) {
+			if (shard_of(sm, e->lba) != i ||
+			    e->lba + e->len > stripe_end(sm, e->lba)) {
+				printf("\n %s: extent %d+%u is in shard %d", __func__,
+				       e->lba, e->len, i);
+				ret = -EINVAL;
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	return ret;
+}
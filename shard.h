@@ -0,0 +1,47 @@
+/*
+ * Sharded extent map.
+ *
+ * The LBA space is striped over up to SHARD_MAX independent extent maps,
+ * each behind its own lock: stripe s (LBAs [s << stripe_shift,
+ * (s + 1) << stripe_shift)) lives in shard s % nr_shards. Updates from
+ * different cores only contend when they hit the same shard. An update
+ * that spans stripes takes every shard it touches, in ascending order so
+ * that two such updates cannot deadlock, and applies each piece with
+ * lsdm_update_range(); it is atomic with respect to other updates and
+ * lookups. Extents never merge across a stripe boundary.
+ *
+ * There is no segment accounting: the shards would race on a shared
+ * seg_tbl.
+ */
+
+#ifndef _SHARD_H
+#define _SHARD_H
+
+#include<pthread.h>
+#include"extent.h"
+
+#define SHARD_MAX		64
+#define SHARD_STRIPE_DEFAULT	11	/* 2048 sectors: 1MB stripes */
+
+struct shard {
+	pthread_mutex_t lock;
+	struct extent_map map;
+	struct extent_pool pool;
+	unsigned long nr_updates;
+} __attribute__((aligned(64)));
+
+struct shard_map {
+	int nr_shards;
+	unsigned stripe_shift;
+	struct shard *shards;
+};
+
+int shard_map_init(struct shard_map *sm, int nr_shards, unsigned stripe_shift);
+void shard_map_exit(struct shard_map *sm);
+
+int shard_update_range(struct shard_map *sm, sector_t lba, sector_t pba, int len);
+sector_t shard_lookup(struct shard_map *sm, sector_t lba, int *len);
+unsigned long shard_nr_extents(struct shard_map *sm);
+int shard_check(struct shard_map *sm);
+
+#endif /* _SHARD_H */
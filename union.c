@@ -0,0 +1,269 @@
+/*
+ * Union of two extent maps, for deleting a snapshot.
+ * See union.h for the overview.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<errno.h>
+#include<pthread.h>
+#include"union.h"
+#include"segment.h"
+#include"dirty.h"
+
+struct union_rec {
+	sector_t lba;
+	sector_t pba;
+	__u32 len;
+};
+
+/* What one chunk of the LBA space merged into */
+struct union_run {
+	struct union_rec *ext;		/* the union, sorted */
+	unsigned long nr, max;
+	struct union_rec *hidden;	/* parent sectors under child extents */
+	unsigned long nr_hidden, max_hidden;
+};
+
+struct union_worker {
+	pthread_t thread;
+	struct extent_map *child, *parent;
+	struct union_run *runs;
+	sector_t lo;
+	long long span;			/* LBAs from 'lo' covered by the chunks */
+	unsigned long nr_chunks;
+	unsigned long first, step;	/* chunks first, first + step, ... */
+	int started;
+	int ret;
+};
+
+/* Append to a sorted run, growing the last record if this continues it */
+static int union_add(struct union_rec **ext, unsigned long *nr, unsigned long *max,
+		     sector_t lba, sector_t pba, __u32 len)
+{
+	struct union_rec *r;
+
+	if (*nr) {
+		r = &(*ext)[*nr - 1];
+		if (r->lba + r->len == lba && r->pba + r->len == pba) {
+			r->len += len;
+			return 0;
+		}
+	}
+	if (*nr == *max) {
+		r = realloc(*ext, (*max ? *max * 2 : 64) * sizeof(*r));
+		if (!r)
+			return -ENOMEM;
+		*ext = r;
+		*max = *max ? *max * 2 : 64;
+	}
+	r = &(*ext)[(*nr)++];
+	r->lba = lba;
+	r->pba = pba;
+	r->len = len;
+	return 0;
+}
+
+/*
+ * Walk the parent's extents over [a, b) from '*pe' on, clipped to it.
+ * They are kept in the union, or with 'keep' clear recorded as hidden if
+ * the caller wants that. '*pe' is left on the first extent reaching
+ * past 'b'.
+ */
+static int union_parent(struct union_run *run, struct extent **pe,
+			sector_t a, sector_t b, int keep, int want_hidden)
+{
+	struct extent *e;
+	sector_t s, end;
+	int ret = 0;
+
+	while ((e = *pe) && e->lba < b && !ret) {
+		s = e->lba > a ? e->lba : a;
+		end = e->lba + e->len < b ? e->lba + e->len : b;
+		if (s < end && keep)
+			ret = union_add(&run->ext, &run->nr, &run->max, s,
+					e->pba + (s - e->lba), end - s);
+		else if (s < end && want_hidden)
+			ret = union_add(&run->hidden, &run->nr_hidden, &run->max_hidden,
+					s, e->pba + (s - e->lba), end - s);
+		if (e->lba + e->len > b)
+			break;
+		*pe = lsdm_rb_next(e);
+	}
+	return ret;
+}
+
+/* Child wins over [lo, hi): its extents, and the parent's in the gaps */
+static int union_chunk(struct extent_map *child, struct extent_map *parent,
+		       sector_t lo, sector_t hi, struct union_run *run)
+{
+	struct extent *ce = stl_rb_geq(child, lo), *pe = stl_rb_geq(parent, lo);
+	int want_hidden = parent->sit != NULL, ret;
+	sector_t pos = lo, s, end;
+
+	while (pos < hi) {
+		s = ce && ce->lba < hi ? (ce->lba > lo ? ce->lba : lo) : hi;
+		ret = union_parent(run, &pe, pos, s, 1, 0);
+		if (ret < 0 || s == hi)
+			return ret;
+		end = ce->lba + ce->len < hi ? ce->lba + ce->len : hi;
+		ret = union_add(&run->ext, &run->nr, &run->max, s,
+				ce->pba + (s - ce->lba), end - s);
+		if (!ret)
+			ret = union_parent(run, &pe, s, end, 0, want_hidden);
+		if (ret < 0)
+			return ret;
+		pos = end;
+		ce = lsdm_rb_next(ce);
+	}
+	return 0;
+}
+
+static void *union_merge(void *arg)
+{
+	struct union_worker *w = arg;
+	unsigned long c;
+	sector_t lo, hi;
+
+	w->ret = 0;
+	for (c = w->first; c < w->nr_chunks && !w->ret; c += w->step) {
+		lo = w->lo + w->span * c / w->nr_chunks;
+		hi = w->lo + w->span * (c + 1) / w->nr_chunks;
+		w->ret = union_chunk(w->child, w->parent, lo, hi, &w->runs[c]);
+	}
+	return NULL;
+}
+
+static void union_release(struct rb_node *node, void *arg)
+{
+	extent_free(arg, rb_entry(node, struct extent, rb));
+}
+
+/* First and last LBA + 1 mapped by either map */
+static void union_bounds(struct extent_map *child, struct extent_map *parent,
+			 sector_t *lo, sector_t *hi)
+{
+	struct extent_map *maps[2] = { child, parent };
+	struct extent *e;
+	int i;
+
+	*lo = *hi = 0;
+	for (i = 0; i < 2; i++) {
+		if (!maps[i]->n_extents)
+			continue;
+		e = stl_rb_geq(maps[i], 0);
+		if (*lo == *hi || e->lba < *lo)
+			*lo = e->lba;
+		e = rb_entry(rb_last(&maps[i]->extent_tbl_root), struct extent, rb);
+		if (*lo == *hi || e->lba + e->len > *hi)
+			*hi = e->lba + e->len;
+	}
+}
+
+/*
+ * Fold 'parent' into 'child', child wins, using 'nr_threads' threads.
+ * 'parent' is left as it was, apart from its segment table, and is
+ * expected to be destroyed next. On failure 'child' is unchanged.
+ */
+int lsdm_map_union(struct extent_map *child, struct extent_map *parent, int nr_threads)
+{
+	struct union_worker *workers;
+	struct union_run *runs;
+	struct rb_node **nodes = NULL;
+	struct extent *e, *prev = NULL;
+	struct union_rec *r;
+	unsigned long nr_chunks, total = 0, nr = 0, c, i;
+	sector_t lo, hi;
+	int t, ret;
+
+	if (nr_threads < 1)
+		nr_threads = 1;
+	union_bounds(child, parent, &lo, &hi);
+	nr_chunks = nr_threads * UNION_CHUNKS_PER_THREAD;
+	if (hi - lo < nr_chunks)
+		nr_chunks = 1;
+	workers = calloc(nr_threads, sizeof(*workers));
+	runs = calloc(nr_chunks, sizeof(*runs));
+	ret = -ENOMEM;
+	if (!workers || !runs)
+		goto out;
+
+	for (t = 0; t < nr_threads; t++) {
+		workers[t].child = child;
+		workers[t].parent = parent;
+		workers[t].runs = runs;
+		workers[t].lo = lo;
+		workers[t].span = (long long)hi - lo;
+		workers[t].nr_chunks = nr_chunks;
+		workers[t].first = t;
+		workers[t].step = nr_threads;
+		workers[t].started = t &&
+			!pthread_create(&workers[t].thread, NULL, union_merge, &workers[t]);
+	}
+	/* Whatever did not get a thread is merged right here */
+	for (t = 0; t < nr_threads; t++)
+		if (!workers[t].started)
+			union_merge(&workers[t]);
+	ret = 0;
+	for (t = 0; t < nr_threads; t++) {
+		if (workers[t].started)
+			pthread_join(workers[t].thread, NULL);
+		if (workers[t].ret)
+			ret = workers[t].ret;
+	}
+	if (ret)
+		goto out;
+
+	for (c = 0; c < nr_chunks; c++)
+		total += runs[c].nr;
+	ret = -ENOMEM;
+	nodes = malloc(sizeof(*nodes) * (total ? total : 1));
+	if (!nodes)
+		goto out;
+	/* Stitch the runs, merging what a chunk boundary cut in two */
+	for (c = 0; c < nr_chunks; c++) {
+		for (i = 0; i < runs[c].nr; i++) {
+			r = &runs[c].ext[i];
+			if (prev && prev->lba + prev->len == r->lba &&
+			    prev->pba + prev->len == r->pba) {
+				prev->len += r->len;
+				continue;
+			}
+			e = extent_alloc(child);
+			if (!e)
+				goto out;
+			e->lba = r->lba;
+			e->pba = r->pba;
+			e->len = r->len;
+			nodes[nr++] = &e->rb;
+			prev = e;
+		}
+	}
+
+	for (c = 0; parent->sit && c < nr_chunks; c++)
+		for (i = 0; i < runs[c].nr_hidden; i++)
+			seg_inval(parent->sit, runs[c].hidden[i].pba, runs[c].hidden[i].len);
+	/* A superset of what changed, but one pass over the parent */
+	if (child->dirty)
+		for (e = stl_rb_geq(parent, 0); e; e = lsdm_rb_next(e))
+			dirty_mark(child->dirty, e->lba, e->len);
+
+	rb_destroy(&child->extent_tbl_root, union_release, child);
+	rb_build_sorted(nodes, nr, &child->extent_tbl_root);
+	child->n_extents = nr;
+	child->gen++;
+	nr = 0;
+	ret = 0;
+out:
+	/* On failure, give back whatever was allocated */
+	for (i = 0; i < nr; i++)
+		extent_free(child, rb_entry(nodes[i], struct extent, rb));
+	for (c = 0; runs && c < nr_chunks; c++) {
+		free(runs[c].ext);
+		free(runs[c].hidden);
+	}
+	free(nodes);
+	free(runs);
+	free(workers);
+	return ret;
+}
@@ -0,0 +1,27 @@
+/*
+ * Union of two extent maps, for deleting a snapshot.
+ *
+ * The snapshot's map (the parent) is folded into the map of its child:
+ * wherever the child maps an LBA it wins, everywhere else the parent's
+ * mapping is kept. The LBA space is cut into chunks that worker threads
+ * merge on their own, reading both trees, into sorted runs of extents.
+ * The runs are stitched together, extents that a chunk boundary cut are
+ * merged back, and the child's tree is rebuilt from the result with
+ * rb_build_sorted() in O(n).
+ *
+ * Snapshots of one device share its segment table. With one on the
+ * parent, the parent's sectors that the child hides are invalidated
+ * there, since only the snapshot referenced them; what the child keeps
+ * stays valid as it is.
+ */
+
+#ifndef _UNION_H
+#define _UNION_H
+
+#include"extent.h"
+
+#define UNION_CHUNKS_PER_THREAD	4
+
+int lsdm_map_union(struct extent_map *child, struct extent_map *parent, int nr_threads);
+
+#endif /* _UNION_H */
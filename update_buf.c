@@ -0,0 +1,110 @@
+/*
+ * Write-combining buffer in front of an extent map.
+ * See update_buf.h for the overview.
+ */
+
+#include<stdio.h>
+#include<limits.h>
+#include"update_buf.h"
+
+void update_buf_init(struct update_buf *b, struct extent_map *map, int max_extents)
+{
+	b->map = map;
+	extent_map_init(&b->staging);
+	extent_pool_init(&b->pool);
+	b->staging.pool = &b->pool;
+	b->max_extents = max_extents > 0 ? max_extents : UPDATE_BUF_MAX_DEFAULT;
+	b->pending = 0;
+	b->nr_updates = b->nr_applied = b->nr_flushes = 0;
+	b->last_updates = b->last_applied = 0;
+}
+
+/* Pending updates are dropped: flush first to keep them */
+void update_buf_exit(struct update_buf *b)
+{
+	extent_map_destroy(&b->staging);
+	extent_pool_exit(&b->pool);
+}
+
+/*
+ * Stage an update. Staged extents carry no segment accounting: sectors
+ * overwritten before a flush never reach the map, so they were never
+ * counted valid in the first place.
+ */
+int update_buf_add(struct update_buf *b, sector_t lba, sector_t pba, int len)
+{
+	int ret;
+
+	ret = lsdm_update_range(&b->staging, lba, pba, len);
+	if (ret < 0)
+		return ret;
+	b->pending++;
+	b->nr_updates++;
+	if (b->staging.n_extents >= b->max_extents) {
+		ret = update_buf_flush(b);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Apply the staging map to the real one in LBA order and empty it.
+ * Returns the number of extents applied. On error nothing is dropped:
+ * applying an extent twice is harmless, so the flush can be retried.
+ */
+int update_buf_flush(struct update_buf *b)
+{
+	struct extent_finger f;
+	struct rb_iter it;
+	struct extent *e;
+	int ret, n = 0;
+
+	extent_finger_init(&f);
+	for (e = extent_iter_first(&b->staging, &it); e; e = extent_iter_next(&it)) {
+		ret = lsdm_update_range_finger(b->map, &f, e->lba, e->pba, e->len);
+		if (ret < 0)
+			return ret;
+		n++;
+	}
+
+	stl_dbg("\n %s: %lu updates went in as %d extents", __func__, b->pending, n);
+	b->nr_flushes++;
+	b->nr_applied += n;
+	b->last_updates = b->pending;
+	b->last_applied = n;
+	b->pending = 0;
+	extent_map_destroy(&b->staging);
+	return n;
+}
+
+/*
+ * PBA that 'lba' maps to, or -1 if it is unmapped. If 'len' is given it
+ * is set to the number of sectors from 'lba' on for which the answer
+ * stays contiguous (or unmapped), whichever of the two maps it comes from.
+ */
+sector_t update_buf_lookup(struct update_buf *b, sector_t lba, int *len)
+{
+	struct extent *s, *m;
+	sector_t limit, end, pba = -1;
+
+	s = stl_rb_geq(&b->staging, lba);
+	if (s && s->lba <= lba) {
+		if (len)
+			*len = s->lba + s->len - lba;
+		return s->pba + (lba - s->lba);
+	}
+
+	/* The real map only shows through up to the next staged extent */
+	limit = s ? s->lba : INT_MAX;
+	m = stl_rb_geq(b->map, lba);
+	if (m && m->lba <= lba) {
+		end = m->lba + m->len;
+		pba = m->pba + (lba - m->lba);
+	} else {
+		end = m ? m->lba : INT_MAX;
+	}
+	if (len)
+		*len = (end < limit ? end : limit) - lba;
+	return pba;
+}
@@ -0,0 +1,41 @@
+/*
+ * Write-combining buffer in front of an extent map.
+ *
+ * Updates are first applied to a small staging map of their own, where
+ * overwrites of hot LBAs replace each other (last writer wins) and
+ * contiguous writes merge, exactly as they would in the real map. A
+ * flush then walks the staging map in LBA order and applies what is
+ * left to the real map through a finger, so the big tree sees one
+ * sorted batch instead of every single update. Lookups consult the
+ * staging map first and stay correct while updates are pending.
+ */
+
+#ifndef _UPDATE_BUF_H
+#define _UPDATE_BUF_H
+
+#include"extent.h"
+
+#define UPDATE_BUF_MAX_DEFAULT	4096	/* staged extents before a flush */
+
+struct update_buf {
+	struct extent_map *map;		/* the map updates end up in */
+	struct extent_map staging;
+	struct extent_pool pool;	/* staging extents, reset on flush */
+	int max_extents;		/* flush once staging holds this many */
+	unsigned long pending;		/* updates since the last flush */
+
+	unsigned long nr_updates;	/* updates taken in */
+	unsigned long nr_applied;	/* extents applied to 'map' */
+	unsigned long nr_flushes;
+	unsigned long last_updates;	/* the same for the last flush */
+	unsigned long last_applied;
+};
+
+void update_buf_init(struct update_buf *b, struct extent_map *map, int max_extents);
+void update_buf_exit(struct update_buf *b);
+
+int update_buf_add(struct update_buf *b, sector_t lba, sector_t pba, int len);
+int update_buf_flush(struct update_buf *b);
+sector_t update_buf_lookup(struct update_buf *b, sector_t lba, int *len);
+
+#endif /* _UPDATE_BUF_H */
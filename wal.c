@@ -0,0 +1,344 @@
+/*
+ * Write-ahead log of extent map updates.
+ * See wal.h for the overview.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<stddef.h>
+#include<limits.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<time.h>
+#include<unistd.h>
+#include<sys/stat.h>
+#include"wal.h"
+#include"update_buf.h"
+
+static inline unsigned long long wal_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* FNV-1a, enough to catch a torn or half written record */
+static __u32 wal_csum(const struct wal_record *r)
+{
+	const unsigned char *p = (const unsigned char *)r;
+	__u32 h = 2166136261u;
+	int i;
+
+	for (i = 0; i < offsetof(struct wal_record, csum); i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+/* Number of records from 'r' on that continue the sequence from 'seq' */
+static long wal_valid(const struct wal_record *r, long nr, __u64 seq)
+{
+	long i;
+
+	for (i = 0; i < nr; i++, seq++) {
+		if (r[i].seq != seq || r[i].len == 0 || r[i].len > INT_MAX ||
+		    r[i].csum != wal_csum(&r[i]))
+			break;
+	}
+	return i;
+}
+
+/* Read all of 'fd' into a buffer; a file shorter than the header is -EINVAL */
+static int wal_read(int fd, struct wal_header **hdr, long *size)
+{
+	struct stat st;
+	char *file;
+	long done = 0;
+	ssize_t n;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+	if (st.st_size < sizeof(**hdr))
+		return -EINVAL;
+	file = malloc(st.st_size);
+	if (!file)
+		return -ENOMEM;
+	while (done < st.st_size) {
+		n = pread(fd, file + done, st.st_size - done, done);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			free(file);
+			return -EIO;
+		}
+		done += n;
+	}
+	*hdr = (struct wal_header *)file;
+	if ((*hdr)->magic != WAL_MAGIC || (*hdr)->version != WAL_VERSION ||
+	    (*hdr)->record_size != sizeof(struct wal_record)) {
+		free(file);
+		return -EINVAL;
+	}
+	*size = st.st_size;
+	return 0;
+}
+
+static int wal_write(int fd, const void *buf, size_t bytes, off_t off)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (bytes) {
+		n = pwrite(fd, p, bytes, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		off += n;
+		bytes -= n;
+	}
+	return 0;
+}
+
+static int wal_write_header(struct wal *w)
+{
+	struct wal_header hdr;
+	int ret;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = WAL_MAGIC;
+	hdr.version = WAL_VERSION;
+	hdr.record_size = sizeof(struct wal_record);
+	hdr.base_seq = w->seq;
+	if (ftruncate(w->fd, 0) < 0)
+		return -errno;
+	ret = wal_write(w->fd, &hdr, sizeof(hdr), 0);
+	if (ret < 0)
+		return ret;
+	return fdatasync(w->fd) < 0 ? -errno : 0;
+}
+
+static inline off_t wal_offset(__u64 base_seq, __u64 seq)
+{
+	return sizeof(struct wal_header) + (seq - base_seq) * sizeof(struct wal_record);
+}
+
+/*
+ * Open the log at 'path', creating it if needed. An existing log is
+ * cut back to its last valid record and appended to. 'batch' records or
+ * 'interval_us' of waiting, whichever comes first, trigger a commit.
+ */
+int wal_open(struct wal *w, const char *path, int batch, unsigned interval_us)
+{
+	struct wal_header *hdr;
+	struct stat st;
+	long size, nr;
+	int ret;
+
+	memset(w, 0, sizeof(*w));
+	w->batch = batch > 0 ? batch : WAL_BATCH_DEFAULT;
+	w->interval_ns = interval_us * 1000ULL;
+	w->buf = malloc(w->batch * sizeof(*w->buf));
+	if (!w->buf)
+		return -ENOMEM;
+	w->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (w->fd < 0) {
+		ret = -errno;
+		goto fail;
+	}
+	if (fstat(w->fd, &st) < 0) {
+		ret = -errno;
+		goto fail_close;
+	}
+
+	if (st.st_size == 0) {
+		ret = wal_write_header(w);
+		if (ret < 0)
+			goto fail_close;
+		return 0;
+	}
+
+	ret = wal_read(w->fd, &hdr, &size);
+	if (ret < 0) {
+		printf("\n %s: %s is not an update log", __func__, path);
+		goto fail_close;
+	}
+	nr = (size - sizeof(*hdr)) / sizeof(struct wal_record);
+	nr = wal_valid((struct wal_record *)(hdr + 1), nr, hdr->base_seq);
+	w->base_seq = hdr->base_seq;
+	w->seq = w->durable = hdr->base_seq + nr;
+	free(hdr);
+	if (wal_offset(w->base_seq, w->seq) < size) {
+		stl_dbg("\n %s: dropping a torn tail of %ld bytes", __func__,
+			size - (long)wal_offset(w->base_seq, w->seq));
+		if (ftruncate(w->fd, wal_offset(w->base_seq, w->seq)) < 0 ||
+		    fdatasync(w->fd) < 0) {
+			ret = -errno;
+			goto fail_close;
+		}
+	}
+	return 0;
+
+fail_close:
+	close(w->fd);
+fail:
+	free(w->buf);
+	return ret;
+}
+
+/* Commits what is pending */
+void wal_close(struct wal *w)
+{
+	wal_commit(w);
+	close(w->fd);
+	free(w->buf);
+}
+
+/*
+ * Write out the pending records and wait for them to be on disk. On
+ * error the log is cut back to what was durable and the records stay
+ * pending, so the commit can be retried.
+ */
+int wal_commit(struct wal *w)
+{
+	off_t off = wal_offset(w->base_seq, w->durable);
+	int ret;
+
+	if (!w->nr)
+		return 0;
+	ret = wal_write(w->fd, w->buf, w->nr * sizeof(*w->buf), off);
+	if (!ret && fdatasync(w->fd) < 0)
+		ret = -errno;
+	if (ret < 0) {
+		if (ftruncate(w->fd, off) < 0)
+			printf("\n %s: cannot cut the log back: %d", __func__, errno);
+		return ret;
+	}
+	w->durable = w->seq;
+	w->nr = 0;
+	w->nr_commits++;
+	return 0;
+}
+
+/*
+ * Log an update. Returns its sequence number: it may be acknowledged
+ * once wal_durable() holds for it, which may already be the case if
+ * this append completed a group.
+ */
+long long wal_append(struct wal *w, sector_t lba, sector_t pba, int len)
+{
+	struct wal_record *r;
+	long long seq;
+	int ret;
+
+	if (len <= 0)
+		return -EINVAL;
+	if (w->nr == w->batch) {
+		/* An earlier commit failed; retry it before taking more */
+		ret = wal_commit(w);
+		if (ret < 0)
+			return ret;
+	}
+	if (!w->nr && w->interval_ns)
+		w->oldest_ns = wal_now_ns();
+
+	r = &w->buf[w->nr++];
+	r->seq = seq = w->seq++;
+	r->lba = lba;
+	r->pba = pba;
+	r->len = len;
+	r->csum = wal_csum(r);
+	w->nr_records++;
+
+	if (w->nr == w->batch)
+		ret = wal_commit(w);
+	else
+		ret = wal_poll(w);
+	return ret < 0 ? ret : seq;
+}
+
+/*
+ * Commit the pending records if the oldest has waited 'interval_us'.
+ * For callers to run when idle, so that the last updates of a burst do
+ * not wait for the next one.
+ */
+int wal_poll(struct wal *w)
+{
+	if (w->nr && w->interval_ns && wal_now_ns() - w->oldest_ns >= w->interval_ns)
+		return wal_commit(w);
+	return 0;
+}
+
+/*
+ * Empty the log once a durable checkpoint holds everything in it.
+ * Pending records are dropped too: the map they were applied to has been
+ * checkpointed.
+ */
+int wal_reset(struct wal *w)
+{
+	int ret;
+
+	w->nr = 0;
+	w->base_seq = w->durable = w->seq;
+	ret = wal_write_header(w);
+	if (ret < 0)
+		printf("\n %s: cannot reset the log: %d", __func__, ret);
+	return ret;
+}
+
+/* Log an update, then apply it to 'map'. Returns what wal_append() did */
+long long wal_update_range(struct wal *w, struct extent_map *map,
+			   sector_t lba, sector_t pba, int len)
+{
+	long long seq;
+	int ret;
+
+	seq = wal_append(w, lba, pba, len);
+	if (seq < 0)
+		return seq;
+	ret = lsdm_update_range(map, lba, pba, len);
+	return ret < 0 ? ret : seq;
+}
+
+/*
+ * Apply the valid records of the log at 'path' to 'map', which should
+ * hold the checkpoint the log was last reset at. The records go through
+ * an update buffer of 'max_extents', so the map sees sorted batches with
+ * the overwrites inside each already folded. Returns the number of
+ * records replayed.
+ */
+long wal_replay(struct extent_map *map, const char *path, int max_extents)
+{
+	struct update_buf b;
+	struct wal_header *hdr;
+	struct wal_record *r;
+	long size, nr, i;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	ret = wal_read(fd, &hdr, &size);
+	close(fd);
+	if (ret < 0)
+		return ret;
+
+	r = (struct wal_record *)(hdr + 1);
+	nr = (size - sizeof(*hdr)) / sizeof(*r);
+	nr = wal_valid(r, nr, hdr->base_seq);
+	update_buf_init(&b, map, max_extents);
+	for (i = 0; i < nr; i++) {
+		ret = update_buf_add(&b, r[i].lba, r[i].pba, r[i].len);
+		if (ret < 0)
+			goto out;
+	}
+	ret = update_buf_flush(&b);
+	stl_dbg("\n %s: %ld records in %lu flushes", __func__, nr, b.nr_flushes);
+out:
+	update_buf_exit(&b);
+	free(hdr);
+	return ret < 0 ? ret : nr;
+}
@@ -0,0 +1,79 @@
+/*
+ * Write-ahead log of extent map updates.
+ *
+ * Every update is appended to the log as a fixed size record before it
+ * may be acknowledged. Records are buffered and made durable in groups:
+ * one write and one fdatasync() per commit, once 'batch' records are
+ * waiting or the oldest of them has waited 'interval_us'. The age is
+ * checked on every append, and by wal_poll(): with no more updates
+ * coming, the caller has to call that from its idle loop or a timer, or
+ * the tail of a burst stays pending. An update is safe once
+ * wal_durable() says so.
+ *
+ * After a checkpoint the log is reset, so recovery is: load the last
+ * checkpoint, then wal_replay() the log onto it. wal_reset() may only
+ * follow a durable checkpoint: one that checkpoint_write() has returned
+ * from, as it syncs the new checkpoint and renames it over the old one. Replay stops at the
+ * first record that is torn or out of sequence; everything after it was
+ * never acknowledged.
+ *
+ *	header | record | record | ...
+ */
+
+#ifndef _WAL_H
+#define _WAL_H
+
+#include<linux/types.h>
+#include"extent.h"
+
+#define WAL_MAGIC		0x474f4c574d44534cULL	/* "LSDMWLOG" */
+#define WAL_VERSION		1
+#define WAL_BATCH_DEFAULT	64
+
+struct wal_header {
+	__u64 magic;
+	__u32 version;
+	__u32 record_size;
+	__u64 base_seq;		/* sequence number of the first record */
+};
+
+struct wal_record {
+	__u64 seq;
+	sector_t lba;
+	sector_t pba;
+	__u32 len;
+	__u32 csum;		/* over the fields above */
+};
+
+struct wal {
+	int fd;
+	struct wal_record *buf;		/* records not yet written */
+	int nr, batch;
+	unsigned long long interval_ns;	/* 0: commit on batch size only */
+	unsigned long long oldest_ns;	/* when buf[0] was appended */
+	__u64 base_seq;			/* first record in the file */
+	__u64 seq;			/* given to the next record */
+	__u64 durable;			/* records below this are on disk */
+
+	unsigned long nr_records;
+	unsigned long nr_commits;
+};
+
+int wal_open(struct wal *w, const char *path, int batch, unsigned interval_us);
+void wal_close(struct wal *w);
+
+long long wal_append(struct wal *w, sector_t lba, sector_t pba, int len);
+int wal_commit(struct wal *w);
+int wal_poll(struct wal *w);
+int wal_reset(struct wal *w);
+
+long long wal_update_range(struct wal *w, struct extent_map *map,
+			   sector_t lba, sector_t pba, int len);
+long wal_replay(struct extent_map *map, const char *path, int max_extents);
+
+static inline int wal_durable(struct wal *w, long long seq)
+{
+	return seq < (long long)w->durable;
+}
+
+#endif /* _WAL_H */